@@ -0,0 +1,155 @@
+/**
+ * @file call_list_archive.h Compact columnar file format for call fragments.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CALL_LIST_ARCHIVE_H_
+#define CALL_LIST_ARCHIVE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "call_list_store.h"
+
+namespace CallListStore
+{
+
+/// Writes call fragments to an archive file.
+///
+/// The file is made up of blocks of records.  Within a block each field is
+/// stored as a separate column and compressed independently, so that similar
+/// data (e.g. the IMPUs, which mostly repeat) compresses well.  An index of
+/// the blocks is written at the end of the file, so that it can be read either
+/// sequentially or by memory-mapping it.
+///
+/// Writes are buffered, so the memory used is bounded by the block size.
+/// This class is thread-safe.
+class ArchiveWriter
+{
+public:
+  ArchiveWriter();
+  virtual ~ArchiveWriter();
+
+  /// Create the archive file.
+  ///
+  /// @param path           - The file to create.
+  /// @param block_records  - The number of records in each block.
+  /// @return               - Whether the file was created successfully.
+  bool open(const std::string& path, size_t block_records = 4096);
+
+  /// Add records to the archive.  Records added in one call are kept together.
+  ///
+  /// @return               - Whether the records were written successfully.
+  bool write(const std::vector<ArchiveRecord>& records);
+  bool write(const ArchiveRecord& record);
+
+  /// Flush any buffered records, write the block index and close the file.
+  ///
+  /// @return               - Whether the archive was completed successfully.
+  bool close();
+
+  /// The number of records written so far.
+  uint64_t num_records() const { return _num_records; }
+
+private:
+  bool add_record(const ArchiveRecord& record);
+  bool flush_block();
+
+  FILE* _file;
+  size_t _block_records;
+  bool _failed;
+
+  // Column buffers for the block being built.
+  size_t _block_count;
+  std::string _impu_col;
+  std::string _timestamp_col;
+  std::string _id_col;
+  std::string _type_col;
+  std::string _contents_col;
+  std::string _cass_timestamp_col;
+  std::string _ttl_col;
+
+  // IMPUs are run-length encoded.  This tracks the run in progress.
+  std::string _run_impu;
+  uint64_t _run_length;
+
+  // The previous cassandra timestamp (cassandra timestamps are delta encoded).
+  int64_t _prev_cass_timestamp;
+
+  uint64_t _num_records;
+  std::vector<uint64_t> _block_offsets;
+
+  pthread_mutex_t _lock;
+};
+
+/// Reads call fragments from an archive file, in the order they were written.
+class ArchiveReader
+{
+public:
+  /// The number of columns each record is stored in.
+  static const int NUM_COLUMNS = 7;
+
+  ArchiveReader();
+  virtual ~ArchiveReader();
+
+  /// Open an archive file.
+  ///
+  /// @param path           - The file to open.
+  /// @param use_mmap       - Whether to memory-map the file rather than read
+  ///                         it.
+  /// @return               - Whether the file is a valid archive.
+  bool open(const std::string& path, bool use_mmap = false);
+
+  /// Read the next record.
+  ///
+  /// @param record         - (out) The record.
+  /// @return               - True if a record was read, false at the end of
+  ///                         the archive or on error (see error()).
+  bool read(ArchiveRecord& record);
+
+  /// Close the archive.
+  void close();
+
+  /// Whether reading failed because the archive is corrupt.
+  bool error() const { return _failed; }
+
+  /// The total number of records in the archive.
+  uint64_t num_records() const { return _num_records; }
+
+private:
+  bool load_block(size_t index);
+  bool read_bytes(uint64_t offset, size_t length, std::string& buffer, const char*& data);
+
+  FILE* _file;
+  const char* _map;
+  size_t _map_length;
+  bool _failed;
+
+  uint64_t _num_records;
+  std::vector<uint64_t> _block_offsets;
+  uint64_t _index_offset;
+  size_t _next_block;
+
+  // Decompressed columns of the current block, and the position in each.
+  size_t _block_remaining;
+  std::string _columns[NUM_COLUMNS];
+  size_t _positions[NUM_COLUMNS];
+  std::string _run_impu;
+  uint64_t _run_remaining;
+  int64_t _prev_cass_timestamp;
+
+  std::string _read_buffer;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,134 @@
+/**
+ * @file call_list_backend.h Storage backends for the call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CALL_LIST_BACKEND_H_
+#define CALL_LIST_BACKEND_H_
+
+#include <stdint.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cassandra_store.h"
+
+namespace CallListStore
+{
+
+/// A column in a call list row, as read from or written to a backend.
+struct CallColumn
+{
+  std::string name;
+  std::string value;
+
+  /// The timestamp of the cassandra write.
+  int64_t timestamp;
+
+  /// The TTL (in seconds) of the column, or 0 if it has none.
+  int32_t ttl;
+};
+
+/// The columns to write to each row, keyed on row key (IMPU).
+typedef std::map<std::string, std::vector<CallColumn> > RowWrites;
+
+/// Exception thrown by a backend if it can't contact the cluster.
+class BackendConnectionError : public std::runtime_error
+{
+public:
+  BackendConnectionError(const std::string& what) : std::runtime_error(what) {}
+};
+
+/// Interface to the storage used by the call list operations.
+///
+/// Backends report errors from the cluster using the same exceptions as the
+/// thrift client (InvalidRequestException, UnavailableException and
+/// TimedOutException), so that the operations' error handling (including
+/// falling back to a lower consistency level) is the same whichever backend is
+/// in use.  Failures to contact the cluster at all are reported as
+/// BackendConnectionError.
+///
+/// Backends must be thread-safe.
+class Backend
+{
+public:
+  virtual ~Backend() {}
+
+  /// Write columns to one or more rows.
+  ///
+  /// @param rows             - The columns to write to each row.
+  /// @param level            - The consistency level to write at.
+  virtual void write_columns(const RowWrites& rows,
+                             org::apache::cassandra::ConsistencyLevel::type level) = 0;
+
+  /// Delete columns from a row, and optionally write other columns to the
+  /// row in the same batch.
+  ///
+  /// @param key              - The row key.
+  /// @param names            - The names of the columns to delete.
+  /// @param timestamp        - The timestamp to use on the cassandra write.
+  /// @param columns          - Columns to write to the row (may be empty).
+  /// @param level            - The consistency level to delete at.
+  virtual void delete_columns(const std::string& key,
+                              const std::vector<std::string>& names,
+                              int64_t timestamp,
+                              const std::vector<CallColumn>& columns,
+                              org::apache::cassandra::ConsistencyLevel::type level) = 0;
+
+  /// Read a range of columns from a row, in column name order.
+  ///
+  /// @param key              - The row key.
+  /// @param start            - The first column name in the range.
+  /// @param finish           - The last column name in the range.
+  /// @param max_columns      - The maximum number of columns to return.
+  /// @param columns          - (out) The columns.
+  /// @param level            - The consistency level to read at.
+  virtual void get_columns(const std::string& key,
+                           const std::string& start,
+                           const std::string& finish,
+                           int32_t max_columns,
+                           std::vector<CallColumn>& columns,
+                           org::apache::cassandra::ConsistencyLevel::type level) = 0;
+};
+
+/// Backend that uses a thrift client from the CassandraStore connection pool.
+class ThriftBackend : public Backend
+{
+public:
+  /// Constructor.
+  ///
+  /// @param client           - The thrift client to use.
+  /// @param column_family    - The column family that holds the call lists.
+  ThriftBackend(CassandraStore::Client* client,
+                const std::string& column_family);
+  virtual ~ThriftBackend();
+
+  void write_columns(const RowWrites& rows,
+                     org::apache::cassandra::ConsistencyLevel::type level);
+  void delete_columns(const std::string& key,
+                      const std::vector<std::string>& names,
+                      int64_t timestamp,
+                      const std::vector<CallColumn>& columns,
+                      org::apache::cassandra::ConsistencyLevel::type level);
+  void get_columns(const std::string& key,
+                   const std::string& start,
+                   const std::string& finish,
+                   int32_t max_columns,
+                   std::vector<CallColumn>& columns,
+                   org::apache::cassandra::ConsistencyLevel::type level);
+
+private:
+  CassandraStore::Client* _client;
+  const std::string _column_family;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,253 @@
+/**
+ * @file call_list_cache.h Cache of recently read call lists, with snapshots.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CALL_LIST_CACHE_H_
+#define CALL_LIST_CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "call_list_store.h"
+
+namespace CallListStore
+{
+
+/// Least-recently-used cache of call lists that have been read from the
+/// store.
+///
+/// Entries older than the maximum age are stale.  They are still returned,
+/// but are also queued to be revalidated (re-read from the store) on a
+/// background thread.  There is one revalidation thread, so revalidation
+/// never puts more than one extra read at a time on the store.  Entries
+/// older than the maximum staleness are dropped, so the cache never returns
+/// a call list that is older than that, even if revalidation is failing.
+///
+/// The cache can be saved to a snapshot file (e.g. on shutdown) and loaded
+/// from one (e.g. on startup), so that a restarted node doesn't start cold.
+/// Loading happens on a background thread and only indexes the file, which
+/// is memory-mapped; each call list is decoded the first time it is read.
+///
+/// This class is thread-safe.
+class CallListCache
+{
+public:
+  /// Interface for re-reading call lists from the store.
+  class Revalidator
+  {
+  public:
+    virtual ~Revalidator() {}
+
+    /// Read the current call list for an IMPU.
+    ///
+    /// @param impu         - The IMPU to read.
+    /// @param fragments    - (out) The fragments.
+    /// @return             - The result of the read.  If this is NOT_FOUND
+    ///                       the entry is removed from the cache, and if it
+    ///                       is any other error the stale entry is kept.
+    virtual CassandraStore::ResultCode revalidate(const std::string& impu,
+                                                  std::vector<CallFragment>& fragments) = 0;
+  };
+
+  /// The result of a lookup.
+  enum Result
+  {
+    MISS,
+    FRESH,
+    STALE
+  };
+
+  /// Constructor.
+  ///
+  /// @param capacity       - The maximum number of call lists to cache.
+  /// @param max_age_ms     - How long an entry is fresh for.
+  /// @param max_stale_ms   - How old an entry can get before it is dropped
+  ///                         rather than returned stale.  Entries in a
+  ///                         snapshot older than this aren't loaded.  0
+  ///                         means there is no limit.
+  /// @param revalidator    - Used to re-read stale entries.  The cache takes
+  ///                         ownership of this.  This may be NULL, in which
+  ///                         case stale entries are never returned.
+  CallListCache(size_t capacity,
+                uint64_t max_age_ms,
+                uint64_t max_stale_ms,
+                Revalidator* revalidator);
+
+  /// Destructor.  Waits for any snapshot load or revalidation in progress.
+  virtual ~CallListCache();
+
+  /// Start the revalidation thread.  Until this is called (and after stop is
+  /// called) stale entries aren't returned.
+  void start();
+
+  /// Tell the revalidation thread to stop.  Revalidations that are queued
+  /// but haven't started are dropped.
+  void stop();
+
+  /// Wait for the revalidation thread to stop.
+  void wait_stopped();
+
+  /// Look up a call list.
+  ///
+  /// @param impu           - The IMPU to look up.
+  /// @param fragments      - (out) The cached fragments, unless this is a
+  ///                         miss.
+  /// @param now_ms         - The current time (ms since the epoch).
+  /// @return               - Whether the entry is present and fresh.
+  Result get(const std::string& impu,
+             std::vector<CallFragment>& fragments,
+             uint64_t now_ms);
+  Result get(const std::string& impu, std::vector<CallFragment>& fragments);
+
+  /// When a read of a call list from the store started, and the IMPU's
+  /// invalidation generation at the time (see begin_read).
+  struct ReadStamp
+  {
+    uint64_t fetch_ms;
+    uint64_t generation;
+  };
+
+  /// Call before reading a call list from the store that is to be added to
+  /// the cache.
+  ///
+  /// @param impu           - The IMPU being read.
+  /// @return               - The stamp to pass to put.
+  ReadStamp begin_read(const std::string& impu);
+
+  /// Add a call list read from the store to the cache, replacing any existing
+  /// entry, unless the IMPU has been invalidated since the read started.  In
+  /// that case the read may have returned the call list from before the
+  /// change, so the call list is dropped.
+  ///
+  /// @param impu           - The IMPU.
+  /// @param fragments      - The fragments.
+  /// @param stamp          - The stamp from begin_read.
+  /// @return               - Whether the call list was added.
+  bool put(const std::string& impu,
+           const std::vector<CallFragment>& fragments,
+           const ReadStamp& stamp);
+
+  /// Add a call list to the cache, replacing any existing entry.
+  ///
+  /// @param impu           - The IMPU.
+  /// @param fragments      - The fragments.
+  /// @param fetch_ms       - The time the call list was read from the store
+  ///                         (ms since the epoch).
+  void put(const std::string& impu,
+           const std::vector<CallFragment>& fragments,
+           uint64_t fetch_ms);
+
+  /// Remove a call list from the cache (e.g. because it has been changed).
+  /// Reads of the call list that are already in progress aren't added to the
+  /// cache either.
+  void invalidate(const std::string& impu);
+
+  /// The number of call lists in the cache (including those in a loaded
+  /// snapshot that haven't been decoded yet).
+  size_t size();
+
+  /// Start loading a snapshot on a background thread.  Entries already in
+  /// the cache are newer than those in the snapshot, so are kept.
+  ///
+  /// @param path           - The snapshot file.
+  void load_snapshot(const std::string& path);
+
+  /// Wait for a snapshot load to complete.
+  ///
+  /// @return               - Whether the snapshot was loaded successfully.
+  bool wait_for_snapshot();
+
+  /// Save the cache to a snapshot file.  The file is written alongside the
+  /// target and renamed into place, so an existing snapshot is only replaced
+  /// by a complete one.
+  ///
+  /// @param path           - The snapshot file.
+  /// @return               - Whether the snapshot was saved successfully.
+  bool save_snapshot(const std::string& path);
+
+  /// Wait until there are no revalidations queued or in progress.
+  void wait_for_revalidations();
+
+private:
+  CallListCache(const CallListCache&);
+  CallListCache& operator=(const CallListCache&);
+
+  struct Entry
+  {
+    std::string impu;
+    std::vector<CallFragment> fragments;
+    uint64_t fetch_ms;
+  };
+
+  static void* load_thread_entry_point(void* cache);
+  bool load_snapshot_file();
+  void unmap_snapshot();
+  bool decode_snapshot_entry(uint64_t offset, Entry& entry);
+  static void encode_entry(const Entry& entry, std::string& out);
+
+  static void* revalidate_thread_entry_point(void* cache);
+  void revalidate_thread();
+
+  // Methods that are called with the lock held.
+  void add_entry(Entry& entry);
+  bool find_entry(const std::string& impu, Entry*& entry);
+  uint64_t& generation(const std::string& impu);
+
+  static size_t generation_slot(const std::string& impu);
+
+  const size_t _capacity;
+  const uint64_t _max_age_ms;
+  const uint64_t _max_stale_ms;
+  Revalidator* _revalidator;
+
+  // The cached entries, most recently used first.
+  std::list<Entry> _entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+
+  // Invalidation generations, which count the invalidations of the IMPUs
+  // that hash to each.  IMPUs share generations so that these take a fixed
+  // amount of memory, so an invalidation occasionally drops the read of
+  // another IMPU, which is then just read from the store again next time.
+  std::vector<uint64_t> _generations;
+
+  // The generations when the snapshot load started.  The loader skips IMPUs
+  // that have been invalidated since, as the snapshot predates the change.
+  std::vector<uint64_t> _load_generations;
+
+  // The mapped snapshot, and the offsets of the entries in it that haven't
+  // been decoded yet.
+  std::string _snapshot_path;
+  const char* _map;
+  size_t _map_length;
+  std::unordered_map<std::string, uint64_t> _snapshot;
+  bool _loading;
+  bool _load_succeeded;
+  pthread_t _load_thread;
+
+  // IMPUs waiting to be revalidated (or being revalidated).
+  std::deque<std::string> _revalidate_queue;
+  std::set<std::string> _revalidating;
+  bool _running;
+  bool _terminating;
+  pthread_t _revalidate_thread;
+  pthread_cond_t _revalidate_cond;
+
+  pthread_mutex_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -12,11 +12,28 @@
 #ifndef CALL_LIST_STORE_H_
 #define CALL_LIST_STORE_H_
 
+#include <string.h>
+#include <atomic>
+
 #include "cassandra_store.h"
+#include "call_list_backend.h"
+#include "connection_pool_warmer.h"
+#include "heavy_hitters.h"
+#include "op_timeline.h"
+#include "op_trace.h"
+#include "read_memory_budget.h"
+#include "recent_writes_filter.h"
+#include "sharded_executor.h"
+#include "thread_local_stats.h"
+#include "trim_scheduler.h"
 
 namespace CallListStore
 {
 
+class ArchiveWriter;
+class ArchiveReader;
+class CallListCache;
+
 /// Structure representing a call record fragment in the store.
 struct CallFragment
 {
@@ -43,11 +60,311 @@ struct CallFragment
   /// The contents of the fragment in cassandra.  This is transparent to the
   /// store.
   std::string contents;
+
+  /// A short summary of the fragment, such as the fields needed to list the
+  /// call.  This is only stored if the store is configured to keep summaries
+  /// (see Store::configure_call_summaries), and is transparent to the store.
+  std::string summary;
+};
+
+
+/// A call fragment together with the IMPU it belongs to and the cassandra
+/// metadata needed to restore it.
+struct ArchiveRecord
+{
+  std::string impu;
+  CallFragment fragment;
+
+  /// The timestamp of the cassandra write.
+  int64_t cass_timestamp;
+
+  /// The TTL (in seconds) the column was written with, or 0 if it has none.
+  int32_t ttl;
+};
+
+
+/// Identifies the most recent call that a client has already seen, so that
+/// the client can ask for only the fragments that sort after it.
+///
+/// Fragments are ordered by the timestamp of the start of the call, so
+/// fragments written later for a call that started at or before the
+/// watermark (e.g. the END fragment of a call in progress) are not returned
+/// by a delta fetch.  Clients that care about these should set the watermark
+/// to the oldest call that they still consider to be in progress.
+struct CallListWatermark
+{
+  /// Timestamp of the call (in the form YYYYMMDDHHMMSS).
+  std::string timestamp;
+
+  /// ID of the call.
+  std::string id;
+};
+
+
+/// Read-only reference to a string held in a CallFragmentArena.  The string is
+/// not null-terminated.
+struct ArenaString
+{
+  const char* data;
+  size_t length;
+
+  /// Copy the referenced string out of the arena.
+  std::string str() const
+  {
+    return std::string(data, length);
+  }
+
+  bool operator==(const std::string& other) const
+  {
+    return ((length == other.length()) &&
+            (memcmp(data, other.data(), length) == 0));
+  }
+};
+
+
+/// Lightweight view of a call fragment whose strings are held in a
+/// CallFragmentArena.  A view is only valid for as long as the arena that
+/// produced it.
+struct CallFragmentView
+{
+  ArenaString timestamp;
+  ArenaString id;
+  CallFragment::Type type;
+  ArenaString contents;
+
+  /// Copy the fragment out of the arena.
+  ///
+  /// @param fragment   - (out) The fragment to fill in.
+  void to_fragment(CallFragment& fragment) const;
+};
+
+
+/// A list of call fragments whose strings are all stored contiguously in a
+/// single block of memory owned by the arena.  This allows a whole call list
+/// to be decoded with a handful of allocations, and freed in one step when the
+/// arena is destroyed or cleared.
+class CallFragmentArena
+{
+public:
+  CallFragmentArena();
+  ~CallFragmentArena();
+
+  /// Reserve space in the arena.  If the reservation is accurate, all strings
+  /// subsequently added to the arena are stored in one contiguous block.
+  ///
+  /// @param num_fragments  - The number of fragments that will be added.
+  /// @param num_bytes      - The total size of the strings that will be added.
+  void reserve(size_t num_fragments, size_t num_bytes);
+
+  /// Copy a string into the arena.
+  ///
+  /// @param data           - The start of the string to copy.
+  /// @param length         - The length of the string.
+  /// @return               - A reference to the copy held in the arena.
+  ArenaString copy(const char* data, size_t length);
+
+  /// Add a fragment to the list.  The fragment's strings must already have
+  /// been copied into this arena.
+  void push_back(const CallFragmentView& fragment);
+
+  /// Free all the fragments and strings in the arena.
+  void clear();
+
+  /// Swap the contents of this arena with another.
+  void swap(CallFragmentArena& other);
+
+  size_t size() const { return _fragments.size(); }
+  bool empty() const { return _fragments.empty(); }
+  const CallFragmentView& operator[](size_t index) const { return _fragments[index]; }
+
+  typedef std::vector<CallFragmentView>::const_iterator const_iterator;
+  const_iterator begin() const { return _fragments.begin(); }
+  const_iterator end() const { return _fragments.end(); }
+
+private:
+  // The arena is not copyable (the views would point into the wrong arena).
+  CallFragmentArena(const CallFragmentArena&);
+  CallFragmentArena& operator=(const CallFragmentArena&);
+
+  // Blocks of memory holding the strings.  There is normally exactly one of
+  // these, but more are allocated if the reservation turns out to be too
+  // small.
+  std::vector<char*> _blocks;
+  size_t _block_capacity;
+  size_t _block_used;
+
+  std::vector<CallFragmentView> _fragments;
+};
+
+
+/// The cassandra consistency levels used by the call list operations.
+///
+/// Call lists are a history feature, so it is usually acceptable to write and
+/// trim at a low consistency level.  Reads are made at the read level, and are
+/// retried at the fallback level if the cluster can't satisfy the read level
+/// (because too few replicas are available, or they time out).
+struct ConsistencyLevels
+{
+  /// Constructor.  The defaults match those of the underlying CassandraStore
+  /// utility methods.
+  ConsistencyLevels() :
+    write(org::apache::cassandra::ConsistencyLevel::ONE),
+    trim(org::apache::cassandra::ConsistencyLevel::ONE),
+    read(org::apache::cassandra::ConsistencyLevel::LOCAL_QUORUM),
+    read_fallback(org::apache::cassandra::ConsistencyLevel::ONE)
+  {}
+
+  org::apache::cassandra::ConsistencyLevel::type write;
+  org::apache::cassandra::ConsistencyLevel::type trim;
+  org::apache::cassandra::ConsistencyLevel::type read;
+  org::apache::cassandra::ConsistencyLevel::type read_fallback;
+};
+
+
+/// Interface for objects that want to be told about call list operations as
+/// they succeed (e.g. to gather statistics).  Callbacks are made on the thread
+/// that performed the operation, so implementations must be thread-safe.
+class OperationObserver
+{
+public:
+  virtual ~OperationObserver() {}
+
+  /// Called when a fragment has been written.
+  ///
+  /// @param impu         - The IMPU the fragment was written for.
+  /// @param fragment     - The fragment.
+  virtual void on_write(const std::string& impu,
+                        const CallFragment& fragment) = 0;
+
+  /// Called when a write was not sent to cassandra because the same fragment
+  /// was written recently.
+  ///
+  /// @param impu         - The IMPU the fragment was for.
+  /// @param fragment     - The fragment.
+  virtual void on_write_suppressed(const std::string& impu,
+                                   const CallFragment& fragment) = 0;
+
+  /// Called when call fragments have been read.
+  ///
+  /// @param impu         - The IMPU whose fragments were read.
+  /// @param num_fragments - The number of fragments read.
+  /// @param num_bytes    - The number of bytes read (column names and values).
+  virtual void on_read(const std::string& impu,
+                       size_t num_fragments,
+                       size_t num_bytes) = 0;
+
+  /// Called for each fragment read, before on_read is called for the row.
+  ///
+  /// @param num_bytes    - The number of bytes in the fragment's column
+  ///                       (name and value).
+  virtual void on_read_fragment(size_t num_bytes) {}
+
+  /// Called when old call fragments have been deleted.
+  ///
+  /// @param impu         - The IMPU whose fragments were deleted.
+  /// @param num_fragments - The number of fragments deleted.
+  /// @param num_bytes    - The number of bytes of column names deleted.
+  virtual void on_trim(const std::string& impu,
+                       size_t num_fragments,
+                       size_t num_bytes) = 0;
+
+  /// Called when archived fragments have been imported for an IMPU.
+  ///
+  /// @param impu         - The IMPU whose fragments were imported.
+  virtual void on_import(const std::string& impu) {}
+};
+
+
+/// Base class for call list operations that are performed on a Backend.
+///
+/// When run by the CassandraStore these use a thrift client from its
+/// connection pool.  The store can run them on a different backend instead.
+class BackendOperation : public CassandraStore::Operation
+{
+public:
+  BackendOperation(const char* name) :
+    _timeline_enabled(false),
+    _timeline(),
+    _pool_warmer(NULL),
+    _checkout_start_us(0)
+  {
+    _timeline.name = name;
+  }
+
+  virtual ~BackendOperation() {}
+
+  /// Run the operation on a backend.  Exceptions are handled in the same way
+  /// as the CassandraStore handles them, so the result code and error text
+  /// are set if the operation fails.
+  ///
+  /// @param backend          - The backend to use.
+  /// @param trail            - The SAS trail to log to.
+  /// @return                 - Whether the operation succeeded.
+  bool run(Backend* backend, SAS::TrailId trail);
+
+  /// Record the times at which the operation passes each stage of its
+  /// processing.  Until this is called, marking events does nothing.
+  void enable_timeline() { _timeline_enabled = true; }
+  bool timeline_enabled() const { return _timeline_enabled; }
+  OpTimeline& timeline() { return _timeline; }
+
+  /// Mark that an event in the operation's timeline has happened now.
+  void mark(OpTimeline::Event event)
+  {
+    if (_timeline_enabled)
+    {
+      _timeline.mark(event);
+    }
+  }
+
+  /// Describe the operation for an operation trace, once it has run.
+  ///
+  /// @param record           - (out) The record to fill in, apart from its
+  ///                           timing and whether it succeeded.
+  /// @return                 - Whether the operation is traced.
+  virtual bool get_trace_record(OpTraceRecord& record) const { return false; }
+
+  /// The IMPU the operation is on, or NULL if it isn't on a single IMPU.
+  virtual const std::string* get_impu() const { return NULL; }
+
+  /// Report the connection that the operation checks out (when it is run by
+  /// the CassandraStore) to a connection pool warmer.
+  ///
+  /// @param warmer           - The warmer.
+  /// @param wait_start_us    - When the operation started waiting for a
+  ///                           connection (see ConnectionPoolWarmer::now_us).
+  void set_pool_warmer(ConnectionPoolWarmer* warmer, uint64_t wait_start_us)
+  {
+    _pool_warmer = warmer;
+    _checkout_start_us = wait_start_us;
+  }
+
+protected:
+  bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+
+  /// Perform the operation.  Errors are reported by throwing exceptions.
+  virtual bool execute(Backend* backend, SAS::TrailId trail) = 0;
+
+  /// Mark that an event has happened, unless it already has (for example
+  /// the first of several requests being sent).
+  void mark_first(OpTimeline::Event event)
+  {
+    if (_timeline_enabled)
+    {
+      _timeline.mark_first(event);
+    }
+  }
+
+  bool _timeline_enabled;
+  OpTimeline _timeline;
+
+  ConnectionPoolWarmer* _pool_warmer;
+  uint64_t _checkout_start_us;
 };
 
 
 /// Operation that adds a new call record fragment to the store.
-class WriteCallFragment : public CassandraStore::Operation
+class WriteCallFragment : public BackendOperation
 {
 public:
   /// Constructor.
@@ -62,26 +379,116 @@ public:
                     const int32_t ttl);
   virtual ~WriteCallFragment();
 
+  /// Set an observer to tell about the operation when it succeeds.
+  void set_observer(OperationObserver* observer) { _observer = observer; }
+
+  /// Set the consistency level to write at (ONE by default).
+  void set_consistency_level(org::apache::cassandra::ConsistencyLevel::type level)
+  {
+    _consistency_level = level;
+  }
+
+  /// Set a filter of recently written fragments.  If the filter says this
+  /// fragment has been written recently, the write is skipped.  Successful
+  /// writes are added to the filter.
+  void set_recent_writes_filter(RecentWritesFilter* filter)
+  {
+    _recent_writes = filter;
+  }
+
+  /// Update the IMPU's change token in the same batch as the write.
+  ///
+  /// @param token            - The new token (from Store::next_change_token).
+  /// @param ttl              - The TTL (in seconds) for the token.
+  void enable_change_token(int64_t token, int32_t ttl)
+  {
+    _change_token = token;
+    _change_token_ttl = ttl;
+  }
+
+  /// Write the fragment to the next of a fixed number of ring slots, rather
+  /// than to a column of its own (see Store::configure_ring_slots).
+  ///
+  /// @param num_slots        - The number of slots, or 0 to write a column
+  ///                           per fragment.
+  void set_ring_slots(size_t num_slots) { _num_slots = num_slots; }
+
+  /// Set the consistency levels to read the ring slot head at (by default
+  /// LOCAL_QUORUM, falling back to ONE).  These should match the levels
+  /// call lists are read at, so that a write sees the head written by the
+  /// last write that a read would see.
+  void set_head_consistency_levels(org::apache::cassandra::ConsistencyLevel::type level,
+                                   org::apache::cassandra::ConsistencyLevel::type fallback_level)
+  {
+    _head_consistency_level = level;
+    _head_fallback_consistency_level = fallback_level;
+  }
+
+  /// Write the fragment's summary to a column of its own, alongside the
+  /// contents (see Store::configure_call_summaries).
+  void enable_summary() { _summary = true; }
+
+  bool get_trace_record(OpTraceRecord& record) const;
+  const std::string* get_impu() const { return &_impu; }
+
 protected:
-  bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  bool execute(Backend* backend, SAS::TrailId trail);
   void unhandled_exception(CassandraStore::ResultCode status,
                            std::string& description,
                            SAS::TrailId trail);
 
+  void add_ring_slot_columns(Backend* backend,
+                             std::vector<CallColumn>& columns);
+
   const std::string _impu;
   const CallFragment _fragment;
   const int64_t _cass_timestamp;
   const int32_t _ttl;
+
+  OperationObserver* _observer;
+  org::apache::cassandra::ConsistencyLevel::type _consistency_level;
+  RecentWritesFilter* _recent_writes;
+  int64_t _change_token;
+  int32_t _change_token_ttl;
+  size_t _num_slots;
+  org::apache::cassandra::ConsistencyLevel::type _head_consistency_level;
+  org::apache::cassandra::ConsistencyLevel::type _head_fallback_consistency_level;
+  bool _summary;
 };
 
 
 /// Operation that gets call fragments for a particular IMPU.
-class GetCallFragments : public CassandraStore::HAOperation
+class GetCallFragments : public BackendOperation
 {
 public:
   /// Constructor.
   /// @param impu     - The IMPU whose call fragments to retrieve.
-  GetCallFragments(const std::string& impu);
+  /// @param use_arena - Whether to decode the fragments into a
+  ///                   CallFragmentArena rather than a vector of
+  ///                   CallFragments.  The results must then be fetched with
+  ///                   the matching get_result method.
+  GetCallFragments(const std::string& impu, bool use_arena = false);
+
+  /// Constructor for an operation that only gets fragments for calls that sort
+  /// after the supplied watermark.  If there are no such fragments the
+  /// operation succeeds and returns no fragments.
+  ///
+  /// @param impu     - The IMPU whose call fragments to retrieve.
+  /// @param since    - The last call the client has already seen.
+  /// @param use_arena - As above.
+  GetCallFragments(const std::string& impu,
+                   const CallListWatermark& since,
+                   bool use_arena = false);
+
+  /// Constructor for an operation that only gets the fragments of selected
+  /// calls.  The operation fails with NOT_FOUND if none of the calls have any
+  /// fragments.
+  ///
+  /// @param impu     - The IMPU whose call fragments to retrieve.
+  /// @param calls    - The calls (identified by timestamp and ID) to get the
+  ///                   fragments of.
+  GetCallFragments(const std::string& impu,
+                   const std::vector<CallListWatermark>& calls);
 
   /// Virtual destructor.
   virtual ~GetCallFragments();
@@ -92,21 +499,126 @@ public:
   /// @param fragments  - (out) A vector of call fragments.
   void get_result(std::vector<CallFragment>& fragments);
 
+  /// Get the fetched call fragments when the operation was created to use an
+  /// arena.  The ordering is the same as above.  Ownership of the arena's
+  /// memory passes to the caller.
+  ///
+  /// @param fragments  - (out) The arena holding the call fragments.
+  void get_result(CallFragmentArena& fragments);
+
+  /// Set an observer to tell about the operation when it succeeds.
+  void set_observer(OperationObserver* observer) { _observer = observer; }
+
+  /// Set the consistency levels to read at.  The fallback level is used if the
+  /// cluster can't satisfy a read at the first level (by default these are
+  /// LOCAL_QUORUM and ONE).
+  void set_consistency_levels(org::apache::cassandra::ConsistencyLevel::type level,
+                              org::apache::cassandra::ConsistencyLevel::type fallback_level)
+  {
+    _consistency_level = level;
+    _fallback_consistency_level = fallback_level;
+  }
+
+  /// Make the read conditional on the IMPU's change token.  The token is read
+  /// first, on its own.  If it matches the client's token the call list
+  /// hasn't changed, so the operation succeeds without reading or returning
+  /// any fragments.  Otherwise the fragments are read as normal.
+  ///
+  /// @param token    - The change token the client already has (from a
+  ///                   previous read).  An empty token never matches.
+  void set_client_change_token(const std::string& token)
+  {
+    _check_change_token = true;
+    _client_change_token = token;
+  }
+
+  /// Whether the call list was unchanged since the client's token, in which
+  /// case no fragments were read.
+  bool get_not_modified() const { return _not_modified; }
+
+  /// The IMPU's change token, as read before the fragments (so it is never
+  /// newer than them).  This is empty if the IMPU has no token, or the read
+  /// was not conditional.
+  const std::string& get_change_token() const { return _change_token; }
+
+  /// Read the row in the ring slot layout (see Store::configure_ring_slots).
+  void set_ring_slots(bool ring_slots) { _ring_slots = ring_slots; }
+
+  /// Read the fragments' summary columns rather than their contents (see
+  /// Store::configure_call_summaries).  The fragments are returned with
+  /// their summaries set and their contents empty.  This can't be used with
+  /// an arena, or with the ring slot layout.
+  void set_summaries_only() { _summaries_only = true; }
+
+  /// Charge the memory held by the results to a budget, and reject the read
+  /// (with RESOURCE_ERROR) if the budget says to.  The memory is released
+  /// when the operation is deleted, or when the results are moved out of it
+  /// into an arena.
+  void set_memory_budget(ReadMemoryBudget* budget) { _budget = budget; }
+
+  bool get_trace_record(OpTraceRecord& record) const;
+  const std::string* get_impu() const { return &_impu; }
+
 protected:
-  bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  bool execute(Backend* backend, SAS::TrailId trail);
   void unhandled_exception(CassandraStore::ResultCode status,
                            std::string& description,
                            SAS::TrailId trail);
 
+  void ha_get_columns(Backend* backend,
+                      const std::string& start,
+                      const std::string& finish,
+                      int32_t max_columns,
+                      std::vector<CallColumn>& columns);
+  void ha_get_call_columns(Backend* backend,
+                           const std::string& start,
+                           const std::string& finish,
+                           std::vector<CallColumn>& columns,
+                           SAS::TrailId trail);
+  bool change_token_matches(Backend* backend);
+  bool get_columns_since(Backend* backend,
+                         std::vector<CallColumn>& columns,
+                         SAS::TrailId trail);
+  void get_slot_columns(Backend* backend, std::vector<CallColumn>& columns);
+  void get_selected_call_columns(Backend* backend,
+                                 std::vector<CallColumn>& columns,
+                                 SAS::TrailId trail);
+  const std::string& column_prefix() const;
+  void decode_columns(const std::vector<CallColumn>& columns);
+  void decode_columns_to_arena(const std::vector<CallColumn>& columns);
+  void reject_overloaded(uint64_t num_bytes, SAS::TrailId trail);
+
   const std::string _impu;
+  const bool _use_arena;
+  const bool _delta;
+  const CallListWatermark _since;
+  const bool _selected_calls;
+  const std::vector<CallListWatermark> _calls;
 
   std::vector<CallFragment> _fragments;
+  CallFragmentArena _arena;
+
+  OperationObserver* _observer;
+  org::apache::cassandra::ConsistencyLevel::type _consistency_level;
+  org::apache::cassandra::ConsistencyLevel::type _fallback_consistency_level;
+
+  bool _check_change_token;
+  std::string _client_change_token;
+  std::string _change_token;
+  bool _not_modified;
+  bool _ring_slots;
+  bool _summaries_only;
+  size_t _num_bytes;
+
+  // The budget the results are charged to, and the memory charged.
+  ReadMemoryBudget* _budget;
+  uint64_t _budget_bytes;
 };
 
 
 /// Operation that deletes all fragments for an IMPU that occurred before a given
 /// timestamp.
-class DeleteOldCallFragments : public CassandraStore::Operation
+class DeleteOldCallFragments : public BackendOperation
 {
 public:
   /// Constructor
@@ -121,8 +633,33 @@ public:
   /// Virtual destructor.
   virtual ~DeleteOldCallFragments();
 
+  /// Set an observer to tell about the operation when it succeeds.
+  void set_observer(OperationObserver* observer) { _observer = observer; }
+
+  /// Set the consistency level to delete at (ONE by default).
+  void set_consistency_level(org::apache::cassandra::ConsistencyLevel::type level)
+  {
+    _consistency_level = level;
+  }
+
+  /// Update the IMPU's change token in the same batch as the deletes.
+  ///
+  /// @param token            - The new token (from Store::next_change_token).
+  /// @param ttl              - The TTL (in seconds) for the token.
+  void enable_change_token(int64_t token, int32_t ttl)
+  {
+    _change_token = token;
+    _change_token_ttl = ttl;
+  }
+
+  /// Delete the fragments' summary columns as well as their contents.
+  void enable_summaries() { _summaries = true; }
+
+  bool get_trace_record(OpTraceRecord& record) const;
+  const std::string* get_impu() const { return &_impu; }
+
 protected:
-  bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  bool execute(Backend* backend, SAS::TrailId trail);
   void unhandled_exception(CassandraStore::ResultCode status,
                            std::string& description,
                            SAS::TrailId trail);
@@ -130,6 +667,159 @@ protected:
   const std::string _impu;
   const std::vector<CallFragment> _fragments;
   const int64_t _cass_timestamp;
+
+  OperationObserver* _observer;
+  org::apache::cassandra::ConsistencyLevel::type _consistency_level;
+  int64_t _change_token;
+  int32_t _change_token_ttl;
+  bool _summaries;
+};
+
+
+/// Operation that exports the call fragments for every IMPU whose row key
+/// hashes into a range of cassandra tokens to an archive file.
+///
+/// Rows are scanned a page at a time, and long rows are themselves read a page
+/// of columns at a time, so the memory used is bounded by the page sizes
+/// rather than the size of the column family.  Each page is written to the
+/// archive as soon as it has been read.
+class ExportCallFragments : public CassandraStore::Operation
+{
+public:
+  /// Constructor.
+  ///
+  /// @param start_token      - The (exclusive) start of the token range.
+  /// @param end_token        - The (inclusive) end of the token range.
+  /// @param writer           - The archive to write the fragments to.  This
+  ///                           may be shared with other export operations.
+  /// @param rows_per_page    - The number of rows to read at once.
+  /// @param columns_per_page - The number of columns to read from a row at
+  ///                           once.
+  ExportCallFragments(const std::string& start_token,
+                      const std::string& end_token,
+                      ArchiveWriter* writer,
+                      size_t rows_per_page = 100,
+                      size_t columns_per_page = 1000);
+
+  /// Virtual destructor.
+  virtual ~ExportCallFragments();
+
+  /// Set the consistency level to read at (ONE by default).
+  void set_consistency_level(org::apache::cassandra::ConsistencyLevel::type level)
+  {
+    _consistency_level = level;
+  }
+
+  /// The number of rows (IMPUs) and fragments exported.
+  uint64_t get_num_rows() const { return _num_rows; }
+  uint64_t get_num_fragments() const { return _num_fragments; }
+
+protected:
+  bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  void unhandled_exception(CassandraStore::ResultCode status,
+                           std::string& description,
+                           SAS::TrailId trail);
+
+  void export_row(CassandraStore::Client* client,
+                  const std::string& impu,
+                  std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+  void decode_columns(const std::string& impu,
+                      const std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                      size_t first_column);
+  void flush_records();
+
+  const std::string _start_token;
+  const std::string _end_token;
+  ArchiveWriter* _writer;
+  const size_t _rows_per_page;
+  const size_t _columns_per_page;
+
+  org::apache::cassandra::ConsistencyLevel::type _consistency_level;
+  uint64_t _num_rows;
+  uint64_t _num_fragments;
+  std::vector<ArchiveRecord> _records;
+};
+
+
+/// Operation that writes a batch of archived call fragments, for any number of
+/// IMPUs, in a single cassandra batch mutation.  Each fragment is written with
+/// the cassandra timestamp and TTL in its record.  The observer is told about
+/// each IMPU in the batch once it has been written.
+class ImportCallFragments : public BackendOperation
+{
+public:
+  /// Constructor.
+  ///
+  /// @param records          - The fragments to write.  The contents of the
+  ///                           vector are taken by the operation.
+  ImportCallFragments(std::vector<ArchiveRecord>& records);
+
+  /// Virtual destructor.
+  virtual ~ImportCallFragments();
+
+  /// Set the consistency level to write at (ONE by default).
+  void set_consistency_level(org::apache::cassandra::ConsistencyLevel::type level)
+  {
+    _consistency_level = level;
+  }
+
+  /// Set an observer to tell about the operation when it succeeds.
+  void set_observer(OperationObserver* observer) { _observer = observer; }
+
+  /// Update the change token of each IMPU in the batch, in the same batch as
+  /// the fragments.
+  ///
+  /// @param token            - The new token (from Store::next_change_token).
+  /// @param ttl              - The TTL (in seconds) for the token.
+  void enable_change_token(int64_t token, int32_t ttl)
+  {
+    _change_token = token;
+    _change_token_ttl = ttl;
+  }
+
+  /// Write each fragment's summary to a column of its own, alongside the
+  /// contents (see Store::configure_call_summaries).
+  void enable_summaries() { _summaries = true; }
+
+  /// The number of fragments in the batch.
+  size_t get_num_records() const { return _records.size(); }
+
+protected:
+  bool execute(Backend* backend, SAS::TrailId trail);
+  void unhandled_exception(CassandraStore::ResultCode status,
+                           std::string& description,
+                           SAS::TrailId trail);
+
+  std::vector<ArchiveRecord> _records;
+  OperationObserver* _observer;
+  org::apache::cassandra::ConsistencyLevel::type _consistency_level;
+  int64_t _change_token;
+  int32_t _change_token_ttl;
+  bool _summaries;
+};
+
+
+/// The outcome of a bulk import.
+struct ImportSummary
+{
+  ImportSummary() :
+    records_read(0),
+    records_written(0),
+    records_expired(0),
+    records_failed(0)
+  {}
+
+  /// The number of records read from the archive.
+  uint64_t records_read;
+
+  /// The number of fragments written to the store.
+  uint64_t records_written;
+
+  /// The number of fragments skipped because their TTL had already expired.
+  uint64_t records_expired;
+
+  /// The number of fragments in batches that failed to be written.
+  uint64_t records_failed;
 };
 
 
@@ -137,7 +827,10 @@ protected:
 ///
 /// This is a thin layer on top of a CassandraStore that provides some
 /// additional utility methods.
-class Store : public CassandraStore::Store
+///
+/// The store observes the operations it creates, so that it can gather
+/// statistics about them.
+class Store : public CassandraStore::Store, public OperationObserver
 {
 public:
 
@@ -147,6 +840,331 @@ public:
   /// Virtual destructor.
   virtual ~Store();
 
+  /// Enable tracking of the IMPUs responsible for the most call list
+  /// operations and bytes.  This should be called before the store is
+  /// started.
+  ///
+  /// @param capacity         - The number of IMPUs to track.  Any IMPU
+  ///                           responsible for more than 1/capacity of the
+  ///                           operations (or bytes) is guaranteed to be
+  ///                           found.
+  /// @param top_n            - The number of IMPUs to publish as statistics.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be NULL).
+  void configure_hot_impu_tracking(size_t capacity,
+                                   size_t top_n,
+                                   LastValueCache* stats_aggregator);
+
+  /// Get the IMPUs with the most call list operations, most first.  Returns
+  /// nothing if hot IMPU tracking is not enabled.
+  void get_hot_impus_by_ops(size_t n, std::vector<HeavyHitters::Item>& impus);
+
+  /// Get the IMPUs with the most call list bytes read or written, most first.
+  /// Returns nothing if hot IMPU tracking is not enabled.
+  void get_hot_impus_by_bytes(size_t n, std::vector<HeavyHitters::Item>& impus);
+
+  /// Set the consistency levels that operations created by this store use.
+  /// This should be called before the store is started.
+  void configure_consistency_levels(const ConsistencyLevels& levels);
+
+  /// Enable suppression of repeated writes of the same fragment (for example
+  /// caused by SIP retransmissions).  A write is skipped if the same fragment
+  /// (IMPU, column name and contents) was written successfully within the
+  /// window.  This should be called before the store is started.
+  ///
+  /// @param window_ms        - How long to remember writes for.  Writes are
+  ///                           remembered for at least this long, and at most
+  ///                           twice this long.
+  /// @param expected_writes  - The number of writes expected in each window.
+  /// @param false_positive_rate - The acceptable probability of wrongly
+  ///                           suppressing a write that is not a repeat.
+  /// @param stats_aggregator - The LVC to report suppressed writes to (may be
+  ///                           NULL).
+  void configure_write_deduplication(uint64_t window_ms,
+                                     size_t expected_writes,
+                                     double false_positive_rate,
+                                     LastValueCache* stats_aggregator);
+
+  /// Run the call list operations on a backend other than the thrift client
+  /// (for example a CqlBackend).  The store takes ownership of the backend.
+  /// This should be called before the store is started.
+  ///
+  /// Exports always use the thrift client, as they need range scans.
+  void configure_backend(Backend* backend);
+
+  /// Trim call lists in the background, rather than relying on the caller to
+  /// trim them with delete_old_call_fragments_sync.  Each IMPU written to is
+  /// trimmed to the configured number of calls a while after the write, at a
+  /// paced rate that backs off while cassandra latency is high.  Trimming
+  /// runs while the store is started.  This should be called before the
+  /// store is started, and can't be used with ring slots (see
+  /// configure_ring_slots).
+  ///
+  /// @param config           - The trim configuration.
+  /// @param stats_aggregator - The LVC to publish the trim backlog and rate
+  ///                           to (may be NULL).
+  void configure_background_trim(const TrimScheduler::Config& config,
+                                 LastValueCache* stats_aggregator);
+
+  /// The number of IMPUs waiting to be trimmed in the background.
+  size_t get_trim_backlog();
+
+  /// Record the distributions of call list sizes as histograms, and publish
+  /// them as percentile statistics:
+  ///
+  /// - call_list_row_fragments: fragments in each row read
+  /// - call_list_row_bytes: bytes in each row read
+  /// - call_list_read_fragment_bytes: bytes in each fragment read
+  /// - call_list_write_fragment_bytes: bytes in each fragment written
+  ///
+  /// Delta reads only count the part of the row that was read.  This should
+  /// be called before the store is started.
+  ///
+  /// @param stats_aggregator - The LVC to publish the statistics to.
+  void configure_size_stats(LastValueCache* stats_aggregator);
+
+  /// Keep a change token for each IMPU, which is updated whenever fragments
+  /// are written for the IMPU or trimmed, so that clients can make
+  /// conditional reads (see get_call_fragments_if_changed_sync).  This should
+  /// be called before the store is started.
+  ///
+  /// The token is updated in the same batch as the write or trim, but
+  /// fragments that expire don't update it, so a conditional read may
+  /// return "not modified" for a call list that has lost expired fragments.
+  /// Each write or trim through this store gets a new token, which is at
+  /// least the cassandra timestamp of the operation and greater than any
+  /// token this store has written before, so the token changes even if
+  /// operations reuse or go back in timestamp.  Tokens from different
+  /// nodes are only ordered as well as the nodes' clocks are.
+  ///
+  /// @param ttl              - The TTL (in seconds) to write the token with.
+  ///                           This should be at least the TTL of the
+  ///                           fragments.  Tokens can't be written without
+  ///                           a TTL, so if this isn't positive a default
+  ///                           of 30 days is used.
+  void configure_change_tokens(int32_t ttl);
+
+  /// Round the TTL of each written fragment up so that it expires at the end
+  /// of a fixed time window.  Fragments written with the same TTL in the
+  /// same window then expire together, so with time-window compaction whole
+  /// SSTables expire at once rather than being compacted column by column.
+  /// Fragments are kept for at most one window longer than requested.  This
+  /// should be called before the store is started.
+  ///
+  /// The cassandra timestamps of writes are not changed, as they order
+  /// writes and are used as change tokens.
+  ///
+  /// @param window_s         - The window length (in seconds).  0 disables
+  ///                           alignment.
+  /// @param stats_aggregator - The LVC to publish the distribution of
+  ///                           effective TTLs to (may be NULL).
+  void configure_ttl_alignment(int32_t window_s,
+                               LastValueCache* stats_aggregator);
+
+  /// Round a TTL up so that it expires at the end of a window.
+  ///
+  /// @param ttl              - The requested TTL (in seconds).
+  /// @param window_s         - The window length (in seconds).
+  /// @param now_s            - The current time (seconds since the epoch).
+  /// @return                 - The aligned TTL.  TTLs of 0 (no expiry) are
+  ///                           not changed.
+  static int32_t align_ttl(int32_t ttl, int32_t window_s, int64_t now_s);
+
+  /// Store each IMPU's call list in a fixed number of ring slots, rather than
+  /// a column per fragment.  Each write overwrites the oldest slot and
+  /// advances a head column, so rows never grow beyond the number of slots
+  /// and never need trimming (so there is no delete traffic and there are no
+  /// tombstones).  Reads put the slots back into call order.  This should be
+  /// called before the store is started, and all nodes must use the same
+  /// layout.  Ring slots can't be used with background trimming (see
+  /// configure_background_trim); whichever is configured second is ignored.
+  ///
+  /// Each write reads the head first, at the read consistency levels, so
+  /// each write costs an extra round trip to cassandra (a quorum read, so
+  /// typically more than the write itself) and concurrent writes to the same
+  /// IMPU may overwrite each other's fragments.  Fragments written in the
+  /// column-per-fragment layout are still read (and can still be trimmed)
+  /// until they expire.  Exports only include the column-per-fragment
+  /// layout.
+  ///
+  /// @param num_slots        - The number of fragments to keep for each
+  ///                           IMPU (at most 10000), or 0 for a column per
+  ///                           fragment.
+  void configure_ring_slots(size_t num_slots);
+
+  /// Keep each fragment's summary in a column of its own, alongside its
+  /// contents, so that call lists can be listed (with
+  /// get_call_summaries_sync) without reading the contents of every
+  /// fragment.  The contents of selected calls can then be read with
+  /// get_call_contents_sync.  Trims delete the summaries along with the
+  /// contents.  This should be called before the store is started.
+  ///
+  /// Summaries are not kept in the ring slot layout, and are not exported.
+  void configure_call_summaries();
+
+  /// Record the shape of every write, read and trim (but not the IMPUs or
+  /// call fragments) to a trace, so that the mix of operations can be
+  /// replayed (see TraceReplayer).  This can be called while the store is
+  /// running.
+  ///
+  /// @param writer           - The (open) trace to write to, or NULL to stop
+  ///                           tracing.  The caller is responsible for
+  ///                           closing it, after tracing has stopped.
+  void configure_op_trace(OpTraceWriter* writer);
+
+  /// Run asynchronous operations on worker threads sharded by IMPU, rather
+  /// than on the CassandraStore's shared thread pool, so that the operations
+  /// on an IMPU are run in order and usually on the same core (see
+  /// ShardedExecutor).  Operations that aren't on a single IMPU still use the
+  /// shared pool.  This should be called before the store is started, and
+  /// the workers run while the store is started.
+  ///
+  /// @param config           - The configuration of the shards.  If this
+  ///                           doesn't set the number of shards, there is one
+  ///                           for each of the store's worker threads (see
+  ///                           configure_workers).
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  void configure_sharded_workers(const ShardedExecutor::Config& config,
+                                 LastValueCache* stats_aggregator);
+
+  /// Limit the memory held by the results of reads (see ReadMemoryBudget).
+  /// Reads that are rejected because of the budget fail with RESOURCE_ERROR.
+  /// This should be called before the store is started.
+  ///
+  /// @param config           - The configuration of the budget.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  void configure_read_memory_budget(const ReadMemoryBudget::Config& config,
+                                    LastValueCache* stats_aggregator);
+
+  /// Cache call lists read by get_call_fragments_sync (into a vector), so
+  /// that repeated reads of the same IMPU don't go to cassandra.  Cached call
+  /// lists are dropped when this store writes or trims them.  Call lists
+  /// older than the maximum age (which may have been changed by another node)
+  /// are still returned, but are re-read in the background while the store
+  /// is running.  Call lists older than the maximum staleness are dropped.
+  /// This should be called before the store is started.
+  ///
+  /// @param capacity         - The number of call lists to cache.
+  /// @param max_age_ms       - How long a cached call list is fresh for.
+  /// @param max_stale_ms     - How old a cached call list can be returned
+  ///                           while it is re-read.  0 means there is no
+  ///                           limit.
+  void configure_call_list_cache(size_t capacity,
+                                 uint64_t max_age_ms,
+                                 uint64_t max_stale_ms = 3600000);
+
+  /// Start loading a snapshot of the call list cache (saved by an earlier
+  /// process) in the background.  This returns immediately; call lists that
+  /// are read before the snapshot has loaded are read from cassandra.
+  ///
+  /// @param path             - The snapshot file.
+  void load_call_list_snapshot(const std::string& path);
+
+  /// Save a snapshot of the call list cache (e.g. on shutdown).
+  ///
+  /// @param path             - The snapshot file.
+  /// @return                 - Whether the snapshot was saved.  This fails if
+  ///                           the cache is not enabled.
+  bool save_call_list_snapshot(const std::string& path);
+
+  /// Record a timeline of each call list operation (when it was queued,
+  /// dequeued, sent to cassandra and so on), so that the slowest recent
+  /// operations can be dumped.  This should be called before the store is
+  /// started.
+  ///
+  /// @param ops_per_thread   - The number of recent operations to remember
+  ///                           for each thread.
+  void configure_op_timelines(size_t ops_per_thread);
+
+  /// Open connections to cassandra when the store is started, rather than
+  /// when the first requests need them, and check that the call list column
+  /// family exists (see ConnectionPoolWarmer).  start() then waits for the
+  /// first attempt to open the connections.  If they can't be opened, the
+  /// store still starts, but isn't ready until a retry in the background
+  /// succeeds.  This should be called before the store is started.
+  ///
+  /// The connections are counted by a MonitoredConnectionPool.  Unless the
+  /// store's connection pool already is one, this replaces it with one.
+  ///
+  /// @param config           - The warm up configuration.
+  /// @param stats_aggregator - The LVC to publish the connection pool size,
+  ///                           wait time and churn to (may be NULL).
+  void configure_connection_warmup(const ConnectionPoolWarmer::Config& config,
+                                   LastValueCache* stats_aggregator);
+
+  /// Configure the thread pool that runs asynchronous operations.  This is
+  /// CassandraStore::Store::configure_workers, but also remembers the number
+  /// of threads to size the sharded workers with.  This should be called
+  /// before the store is started.
+  ///
+  /// @param exception_handler - Handles exceptions thrown by the threads.
+  /// @param num_threads      - The number of worker threads.
+  /// @param max_queue        - The maximum number of queued operations (0 for
+  ///                           no limit).
+  void configure_workers(ExceptionHandler* exception_handler,
+                         unsigned int num_threads,
+                         unsigned int max_queue = 0);
+
+  /// Start the store, along with its sharded workers and background
+  /// trimming, and warm up its connections if configured to.
+  virtual CassandraStore::ResultCode start();
+
+  /// Stop the store, its sharded workers, its background trimming and any
+  /// connection warm up retries.
+  virtual void stop();
+
+  /// Wait for the store, its sharded workers, its background trimming and
+  /// any connection warm up retries to stop.
+  virtual void wait_stopped();
+
+  /// Whether the store is ready for requests: it has started and (if
+  /// configured to) warmed up its connections.
+  bool is_ready() const
+  {
+    return ((_ready.load()) &&
+            ((_pool_warmer == NULL) || (_pool_warmer->is_warm())));
+  }
+
+  /// The connection pool warmer, or NULL if warm up is not configured.
+  ConnectionPoolWarmer* get_connection_pool_warmer() const { return _pool_warmer; }
+
+  /// The sharded workers, or NULL if they are not configured or the store
+  /// has not been started.
+  ShardedExecutor* get_sharded_executor() const { return _executor; }
+
+  /// Dump the timelines of the slowest recent operations in the Chrome trace
+  /// event format.
+  ///
+  /// @param n                - The maximum number of operations to dump.
+  /// @param json             - (out) The trace.
+  /// @return                 - False if timelines are not being recorded.
+  bool dump_slowest_operations(size_t n, std::string& json);
+
+  /// Run an operation synchronously.  Call list operations are run on the
+  /// configured backend, if there is one.
+  virtual bool do_sync(CassandraStore::Operation* op, SAS::TrailId trail);
+
+  /// Run an operation asynchronously.
+  virtual void do_async(CassandraStore::Operation*& op,
+                        CassandraStore::Transaction*& trx);
+
+  /// The read memory budget, or NULL if there isn't one.
+  ReadMemoryBudget* get_read_memory_budget() const { return _read_budget; }
+
+  /// The number of writes suppressed since the store was created.
+  uint64_t get_writes_suppressed() const { return _writes_suppressed->total(); }
+
+  //
+  // OperationObserver methods.
+  //
+  void on_write(const std::string& impu, const CallFragment& fragment);
+  void on_write_suppressed(const std::string& impu, const CallFragment& fragment);
+  void on_read(const std::string& impu, size_t num_fragments, size_t num_bytes);
+  void on_read_fragment(size_t num_bytes);
+  void on_trim(const std::string& impu, size_t num_fragments, size_t num_bytes);
+  void on_import(const std::string& impu);
+
   //
   // Methods to create new operation objects.
   //
@@ -160,10 +1178,31 @@ public:
                                const int32_t ttl);
   virtual GetCallFragments*
     new_get_call_fragments_op(const std::string& impu);
+  virtual GetCallFragments*
+    new_get_call_fragments_op(const std::string& impu,
+                              bool use_arena);
+  virtual GetCallFragments*
+    new_get_call_fragments_since_op(const std::string& impu,
+                                    const CallListWatermark& since);
+  virtual GetCallFragments*
+    new_get_call_fragments_if_changed_op(const std::string& impu,
+                                         const std::string& change_token,
+                                         bool use_arena = false);
+  virtual GetCallFragments*
+    new_get_call_summaries_op(const std::string& impu);
+  virtual GetCallFragments*
+    new_get_call_contents_op(const std::string& impu,
+                             const std::vector<CallListWatermark>& calls);
   virtual DeleteOldCallFragments*
     new_delete_old_call_fragments_op(const std::string& impu,
                                      const std::vector<CallFragment> fragments,
                                      const int64_t cass_timestamp);
+  virtual ImportCallFragments*
+    new_import_call_fragments_op(std::vector<ArchiveRecord>& records);
+  virtual ExportCallFragments*
+    new_export_call_fragments_op(const std::string& start_token,
+                                 const std::string& end_token,
+                                 ArchiveWriter* writer);
 
   //
   // Utility methods to perform synchronous operations more easily.
@@ -178,11 +1217,173 @@ public:
     get_call_fragments_sync(const std::string& impu,
                             std::vector<CallFragment>& fragments,
                             SAS::TrailId trail);
+  virtual CassandraStore::ResultCode
+    get_call_fragments_sync(const std::string& impu,
+                            CallFragmentArena& fragments,
+                            SAS::TrailId trail);
+
+  /// Get the call fragments for an IMPU from cassandra, bypassing the call
+  /// list cache (for example to refresh it).
+  ///
+  /// @param impu             - The IMPU whose call fragments to retrieve.
+  /// @param fragments        - (out) The fragments.
+  /// @param trail            - The SAS trail to log to.
+  virtual CassandraStore::ResultCode
+    get_call_fragments_uncached_sync(const std::string& impu,
+                                     std::vector<CallFragment>& fragments,
+                                     SAS::TrailId trail);
+  virtual CassandraStore::ResultCode
+    get_call_fragments_since_sync(const std::string& impu,
+                                  const CallListWatermark& since,
+                                  std::vector<CallFragment>& fragments,
+                                  SAS::TrailId trail);
+
+  /// Get the call fragments for an IMPU, unless they haven't changed since
+  /// the client's change token.
+  ///
+  /// @param impu             - The IMPU whose call fragments to retrieve.
+  /// @param change_token     - The token the client already has, or empty.
+  /// @param fragments        - (out) The fragments.  Not set if the call list
+  ///                           hasn't changed.
+  /// @param new_change_token - (out) The token to give the client with the
+  ///                           fragments.
+  /// @param modified         - (out) Whether the call list has changed (and
+  ///                           so was read).
+  /// @param trail            - The SAS trail to log to.
+  virtual CassandraStore::ResultCode
+    get_call_fragments_if_changed_sync(const std::string& impu,
+                                       const std::string& change_token,
+                                       std::vector<CallFragment>& fragments,
+                                       std::string& new_change_token,
+                                       bool& modified,
+                                       SAS::TrailId trail);
+
+  /// Get the summaries of an IMPU's call fragments (see
+  /// configure_call_summaries).
+  ///
+  /// @param impu             - The IMPU whose call fragments to retrieve.
+  /// @param fragments        - (out) The fragments, in the same order as
+  ///                           get_call_fragments_sync, with their summaries
+  ///                           set and their contents empty.
+  /// @param trail            - The SAS trail to log to.
+  virtual CassandraStore::ResultCode
+    get_call_summaries_sync(const std::string& impu,
+                            std::vector<CallFragment>& fragments,
+                            SAS::TrailId trail);
+
+  /// Get the full fragments of selected calls.
+  ///
+  /// @param impu             - The IMPU whose call fragments to retrieve.
+  /// @param calls            - The calls (identified by timestamp and ID).
+  /// @param fragments        - (out) The fragments of the calls, ordered as
+  ///                           for get_call_fragments_sync.
+  /// @param trail            - The SAS trail to log to.
+  /// @return                 - NOT_FOUND if none of the calls were found.
+  virtual CassandraStore::ResultCode
+    get_call_contents_sync(const std::string& impu,
+                           const std::vector<CallListWatermark>& calls,
+                           std::vector<CallFragment>& fragments,
+                           SAS::TrailId trail);
   virtual CassandraStore::ResultCode
     delete_old_call_fragments_sync(const std::string& impu,
                                    const std::vector<CallFragment> fragments,
                                    const int64_t cass_timestamp,
                                    SAS::TrailId trail);
+
+  /// Export the call fragments for every IMPU to an archive.  The token ring
+  /// is split into equal ranges, which are exported in parallel by up to 16
+  /// threads.
+  ///
+  /// @param writer           - The (open) archive to write the fragments to.
+  ///                           The caller is responsible for closing it.
+  /// @param num_ranges       - The number of token ranges to split the ring
+  ///                           into.
+  /// @param trail            - The SAS trail to log to.
+  /// @return                 - OK if every range was exported successfully,
+  ///                           otherwise the error from the first range that
+  ///                           failed.
+  virtual CassandraStore::ResultCode
+    export_call_lists_sync(ArchiveWriter* writer,
+                           size_t num_ranges,
+                           SAS::TrailId trail);
+
+  /// Import call fragments from an archive (for example to restore a site).
+  ///
+  /// Fragments are written in batches, which are sent using the store's
+  /// worker threads (see configure_workers) so that several are in flight at
+  /// once.  Reading from the archive is paused while the maximum number of
+  /// batches are in flight.  If the store has no worker threads, the batches
+  /// are sent one at a time on the calling thread.
+  ///
+  /// Each fragment's TTL is reduced by the time since it was originally
+  /// written, so that it expires when it would have done originally.
+  /// Fragments that have already expired are skipped.
+  ///
+  /// Imported IMPUs are treated as written: their change tokens are updated
+  /// (if configured), they are invalidated in the cache and they are
+  /// scheduled for background trimming.  Archives don't hold fragment
+  /// summaries, so if summaries are configured, imported fragments have
+  /// empty ones.
+  ///
+  /// @param reader           - The (open) archive to read the fragments from.
+  /// @param batch_size       - The maximum number of fragments in each batch.
+  /// @param max_in_flight    - The maximum number of batches in flight.
+  /// @param summary          - (out) The number of fragments imported.
+  /// @param trail            - The SAS trail to log to.
+  /// @return                 - OK if every fragment was imported (or skipped),
+  ///                           otherwise the error from the first batch that
+  ///                           failed.  The import continues after a failed
+  ///                           batch.
+  virtual CassandraStore::ResultCode
+    import_call_lists(ArchiveReader* reader,
+                      size_t batch_size,
+                      size_t max_in_flight,
+                      ImportSummary& summary,
+                      SAS::TrailId trail);
+
+private:
+  // Set the options that every read uses (observer, memory budget,
+  // consistency levels and layout).
+  void apply_read_options(GetCallFragments* op);
+
+  // Get a new change token for an operation.  This is the operation's
+  // timestamp, unless this store has already written a token at least that
+  // large, in which case it is one more than the largest.
+  int64_t next_change_token(int64_t cass_timestamp);
+
+  Backend* _backend;
+  CallListCache* _cache;
+  ShardedExecutor* _executor;
+  ShardedExecutor::Config _executor_config;
+  LastValueCache* _executor_stats;
+  bool _sharded_workers;
+  unsigned int _num_workers;
+  ReadMemoryBudget* _read_budget;
+  ConnectionPoolWarmer* _pool_warmer;
+  std::atomic<bool> _ready;
+  TrimScheduler* _trim_scheduler;
+  HotImpuTracker* _hot_impus;
+  OpTimelineRecorder* _op_timelines;
+  std::atomic<OpTraceWriter*> _op_trace;
+  ConsistencyLevels _consistency_levels;
+
+  bool _change_tokens;
+  int32_t _change_token_ttl;
+  std::atomic<int64_t> _last_change_token;
+
+  int32_t _ttl_window_s;
+  ThreadLocalAccumulator* _write_ttls;
+
+  size_t _ring_slots;
+  bool _call_summaries;
+
+  ThreadLocalHistogram* _row_fragments;
+  ThreadLocalHistogram* _row_bytes;
+  ThreadLocalHistogram* _read_fragment_bytes;
+  ThreadLocalHistogram* _write_fragment_bytes;
+
+  RecentWritesFilter* _recent_writes;
+  ThreadLocalCounter* _writes_suppressed;
 };
 
 } // namespace CallListStore
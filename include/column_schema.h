@@ -0,0 +1,271 @@
+/**
+ * @file column_schema.h Compile-time described column name layouts.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef COLUMN_SCHEMA_H_
+#define COLUMN_SCHEMA_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+namespace CallListStore
+{
+
+/// The length of a string literal, at compile time.
+constexpr size_t literal_length(const char* str)
+{
+  return (*str == '\0') ? 0 : 1 + literal_length(str + 1);
+}
+
+/// The name used in column names for a value of an enumerated field.
+template <typename Enum>
+struct EnumName
+{
+  constexpr EnumName(Enum value, const char* name) :
+    value(value),
+    name(name),
+    length(literal_length(name))
+  {}
+
+  Enum value;
+  const char* name;
+  size_t length;
+};
+
+/// The position of a field in a column name, as found by decoding it.
+struct FieldSpan
+{
+  size_t start;
+  size_t length;
+};
+
+/// Describes the layout of a family of column names, and encodes and decodes
+/// them.  The names are of the form:
+///   <prefix><field 1><sep>...<field NUM_FIELDS><sep><enumerated field>
+/// for example call_<timestamp>_<id>_<type>.  The fields can be any
+/// non-empty strings that don't contain the separator.  The enumerated field
+/// is the name of one of a fixed set of values of Enum.
+///
+/// Schemas are intended to be defined as constexpr objects, which must be
+/// checked with in_enum_order:
+///
+///   constexpr EnumName<Type> TYPE_NAMES[] = {EnumName<Type>(A, "a"), ...};
+///   constexpr ColumnNameCodec<Type, 2> COLUMN("col_", '_', TYPE_NAMES, 2);
+///   static_assert(COLUMN.in_enum_order(), "...");
+///
+/// Encoding sizes each name exactly before building it, and decoding finds
+/// the fields in place, without copying them.
+template <typename Enum, size_t NUM_FIELDS>
+class ColumnNameCodec
+{
+public:
+  /// Constructor.
+  ///
+  /// @param prefix           - The prefix of every name in the family.
+  /// @param separator        - The character between the fields.
+  /// @param names            - The names of the values of the enumerated
+  ///                           field.  These must be in the order of the
+  ///                           enumerators, starting from 0.
+  /// @param num_names        - The number of names.
+  constexpr ColumnNameCodec(const char* prefix,
+                            char separator,
+                            const EnumName<Enum>* names,
+                            size_t num_names) :
+    _prefix(prefix),
+    _prefix_length(literal_length(prefix)),
+    _separator(separator),
+    _names(names),
+    _num_names(num_names)
+  {}
+
+  /// Whether the enumerated names are listed in the order of the
+  /// enumerators, starting from 0, so that they can be looked up by value.
+  constexpr bool in_enum_order(size_t index = 0) const
+  {
+    return (index == _num_names) ||
+           ((static_cast<size_t>(_names[index].value) == index) &&
+            (in_enum_order(index + 1)));
+  }
+
+  const char* prefix() const { return _prefix; }
+  size_t prefix_length() const { return _prefix_length; }
+
+  /// Look up the name of an enumerated value.
+  ///
+  /// @return                 - The entry for the value, or NULL if it isn't
+  ///                           in the schema.
+  const EnumName<Enum>* enum_name(Enum value) const
+  {
+    size_t index = static_cast<size_t>(value);
+    return (index < _num_names) ? &_names[index] : NULL;
+  }
+
+  /// Look up an enumerated value by name.
+  ///
+  /// @return                 - False if the name isn't in the schema.
+  bool enum_value(const char* name, size_t length, Enum& value) const
+  {
+    for (size_t ii = 0; ii < _num_names; ++ii)
+    {
+      if ((_names[ii].length == length) &&
+          (memcmp(_names[ii].name, name, length) == 0))
+      {
+        value = _names[ii].value;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// The length of an encoded name.
+  ///
+  /// @param fields           - The fields.
+  /// @param value            - The enumerated field.
+  /// @param with_prefix      - Whether to include the prefix.
+  /// @return                 - The length, or 0 if the value isn't in the
+  ///                           schema.
+  size_t encoded_length(const std::string* const (&fields)[NUM_FIELDS],
+                        Enum value,
+                        bool with_prefix) const
+  {
+    const EnumName<Enum>* name = enum_name(value);
+
+    if (name == NULL)
+    {
+      return 0;
+    }
+
+    size_t length = (with_prefix ? _prefix_length : 0) + NUM_FIELDS + name->length;
+
+    for (size_t ii = 0; ii < NUM_FIELDS; ++ii)
+    {
+      length += fields[ii]->length();
+    }
+
+    return length;
+  }
+
+  /// Append a name to a string, without reserving space for it.
+  ///
+  /// @return                 - False (and nothing is appended) if the value
+  ///                           isn't in the schema.
+  bool append(const std::string* const (&fields)[NUM_FIELDS],
+              Enum value,
+              bool with_prefix,
+              std::string& out) const
+  {
+    const EnumName<Enum>* name = enum_name(value);
+
+    if (name == NULL)
+    {
+      return false;
+    }
+
+    if (with_prefix)
+    {
+      out.append(_prefix, _prefix_length);
+    }
+
+    for (size_t ii = 0; ii < NUM_FIELDS; ++ii)
+    {
+      out.append(*fields[ii]).push_back(_separator);
+    }
+
+    out.append(name->name, name->length);
+    return true;
+  }
+
+  /// Encode a name.
+  ///
+  /// @param fields           - The fields.
+  /// @param value            - The enumerated field.
+  /// @param with_prefix      - Whether to include the prefix.
+  /// @param out              - (out) The name.
+  /// @return                 - False (and the name is empty) if the value
+  ///                           isn't in the schema.
+  bool encode(const std::string* const (&fields)[NUM_FIELDS],
+              Enum value,
+              bool with_prefix,
+              std::string& out) const
+  {
+    out.clear();
+    out.reserve(encoded_length(fields, value, with_prefix));
+    return append(fields, value, with_prefix, out);
+  }
+
+  /// Decode a name, without copying it.
+  ///
+  /// @param name             - The name.
+  /// @param length           - The length of the name.
+  /// @param with_prefix      - Whether the name starts with the prefix.
+  /// @param fields           - (out) Where the fields are in the name.
+  /// @param value            - (out) The enumerated field.
+  /// @return                 - False if the name isn't in this family, or
+  ///                           has the wrong number of fields, an empty
+  ///                           field, or an unknown enumerated value.
+  bool decode(const char* name,
+              size_t length,
+              bool with_prefix,
+              FieldSpan (&fields)[NUM_FIELDS],
+              Enum& value) const
+  {
+    size_t start = 0;
+
+    if (with_prefix)
+    {
+      if ((length < _prefix_length) ||
+          (memcmp(name, _prefix, _prefix_length) != 0))
+      {
+        return false;
+      }
+
+      start = _prefix_length;
+    }
+
+    for (size_t ii = 0; ii < NUM_FIELDS; ++ii)
+    {
+      const char* sep = (const char*)memchr(name + start, _separator, length - start);
+
+      if ((sep == NULL) || (sep == name + start))
+      {
+        return false;
+      }
+
+      fields[ii].start = start;
+      fields[ii].length = (sep - name) - start;
+      start += fields[ii].length + 1;
+    }
+
+    // The rest of the name is the enumerated field, which can't contain the
+    // separator (enum_value checks this, as no name contains it).
+    return enum_value(name + start, length - start, value);
+  }
+
+  bool decode(const std::string& name,
+              bool with_prefix,
+              FieldSpan (&fields)[NUM_FIELDS],
+              Enum& value) const
+  {
+    return decode(name.data(), name.length(), with_prefix, fields, value);
+  }
+
+private:
+  const char* _prefix;
+  size_t _prefix_length;
+  char _separator;
+  const EnumName<Enum>* _names;
+  size_t _num_names;
+};
+
+} // namespace CallListStore
+
+#endif
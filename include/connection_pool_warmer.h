@@ -0,0 +1,184 @@
+/**
+ * @file connection_pool_warmer.h Opens and monitors the store's cassandra
+ * connections.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CONNECTION_POOL_WARMER_H_
+#define CONNECTION_POOL_WARMER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "cassandra_store.h"
+#include "statistic.h"
+#include "thread_local_stats.h"
+#include "zmq_lvc.h"
+
+namespace CallListStore
+{
+
+/// Opens the store's connections to cassandra when it starts, rather than
+/// when the first requests need them, and monitors the connections that its
+/// connection pool opens.
+///
+/// To warm up, a number of operations are run on the store in parallel.  Each
+/// checks out a connection (so the store resolves a target and connects, and
+/// sets the keyspace, as it would for a request), reads from the call list
+/// column family to check that it exists, and then holds its connection
+/// until every operation has one.  The connection pool therefore ends up
+/// with that many open connections.  If the warm up fails, it is retried in
+/// the background until it succeeds.
+///
+/// The warmer also publishes the number of open connections, how long
+/// operations wait to check out a connection, and the number of connections
+/// opened other than by a warm up (churn, for example after a connection
+/// fails).  The connections are reported by a MonitoredConnectionPool, so
+/// these only cover the thrift connection pool, not a configured Backend.
+///
+/// This class is thread-safe.
+class ConnectionPoolWarmer
+{
+public:
+  /// Configuration.
+  struct Config
+  {
+    Config() :
+      connections(8),
+      timeout_ms(5000),
+      retry_interval_ms(1000)
+    {}
+
+    /// The number of connections to open, in parallel.
+    size_t connections;
+
+    /// How long the operations that open the connections wait for each
+    /// other.  The warm up fails if they don't all have a connection by
+    /// then.
+    uint64_t timeout_ms;
+
+    /// How long to wait after a warm up fails before retrying it.
+    uint64_t retry_interval_ms;
+  };
+
+  /// Constructor.
+  ///
+  /// @param config           - The configuration.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  ConnectionPoolWarmer(const Config& config, LastValueCache* stats_aggregator);
+  virtual ~ConnectionPoolWarmer();
+
+  /// Open the connections.  This blocks until they are open, or the warm up
+  /// has failed.
+  ///
+  /// @param store            - The store to open the connections for.
+  /// @param trail            - The SAS trail to log to.
+  /// @return                 - OK if every connection was opened, and the
+  ///                           column family exists.  Otherwise the error from
+  ///                           the first operation that failed.
+  CassandraStore::ResultCode warm_up(CassandraStore::Store* store,
+                                     SAS::TrailId trail);
+
+  /// Warm up, and if that fails keep retrying in the background until it
+  /// succeeds or the warmer is stopped.
+  ///
+  /// @param store            - The store to open the connections for.
+  void start(CassandraStore::Store* store);
+
+  /// Stop retrying the warm up.
+  void stop();
+
+  /// Wait for a warm up that is being retried to finish after stop.
+  void wait_stopped();
+
+  /// Whether the last warm up succeeded.
+  bool is_warm() const { return _warm.load(); }
+
+  /// Record that an operation has checked out a connection.
+  ///
+  /// @param wait_start_us    - When the operation started waiting for the
+  ///                           connection (from now_us).
+  void on_checkout(uint64_t wait_start_us);
+
+  /// Record that the connection pool has opened a connection.
+  void on_connection_opened();
+
+  /// Record that the connection pool has closed a connection.
+  void on_connection_closed();
+
+  /// The number of open connections.
+  size_t num_connections() const { return _num_connections.load(); }
+
+  /// The number of connections opened other than by a warm up.
+  uint64_t num_churned() const { return _churn->total(); }
+
+  /// The current monotonic time in microseconds.
+  static uint64_t now_us();
+
+private:
+  ConnectionPoolWarmer(const ConnectionPoolWarmer&);
+  ConnectionPoolWarmer& operator=(const ConnectionPoolWarmer&);
+
+  static void* thread_entry_point(void* warmer);
+
+  // Retry the warm up until it succeeds or the warmer is stopped.
+  void retry_loop();
+
+  // Publish the number of connections.
+  void publish_connections(size_t num_connections);
+
+  const Config _config;
+  std::atomic<bool> _warm;
+  std::atomic<bool> _warming;
+  std::atomic<size_t> _num_connections;
+
+  CassandraStore::Store* _store;
+  pthread_t _thread;
+  bool _running;
+  std::atomic<bool> _terminating;
+  pthread_cond_t _cond;
+  pthread_mutex_t _lock;
+
+  Statistic* _connections_stat;
+  ThreadLocalAccumulator* _wait_us;
+  ThreadLocalCounter* _churn;
+};
+
+/// Connection pool that reports the connections it opens and closes to a
+/// ConnectionPoolWarmer.  Connections are counted when they are created
+/// and destroyed, so a connection that is replaced by one that happens to
+/// reuse its client's memory is still counted as churn.
+class MonitoredConnectionPool : public CassandraStore::CassandraConnectionPool
+{
+public:
+  MonitoredConnectionPool() : _warmer(NULL) {}
+  virtual ~MonitoredConnectionPool() {}
+
+  /// Set the warmer to report connections to.
+  ///
+  /// @param warmer           - The warmer, or NULL to stop reporting.
+  void set_warmer(ConnectionPoolWarmer* warmer) { _warmer = warmer; }
+
+protected:
+  virtual CassandraStore::Client* create_connection(AddrInfo target);
+  virtual void destroy_connection(AddrInfo target,
+                                  CassandraStore::Client* conn);
+
+private:
+  MonitoredConnectionPool(const MonitoredConnectionPool&);
+  MonitoredConnectionPool& operator=(const MonitoredConnectionPool&);
+
+  std::atomic<ConnectionPoolWarmer*> _warmer;
+};
+
+} // namespace CallListStore
+
+#endif
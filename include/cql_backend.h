@@ -0,0 +1,444 @@
+/**
+ * @file cql_backend.h Call list store backend using the CQL native protocol.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CQL_BACKEND_H_
+#define CQL_BACKEND_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "call_list_backend.h"
+
+namespace CallListStore
+{
+
+/// Definitions and encoding utilities for version 4 of the CQL native
+/// protocol.
+namespace Cql
+{
+  // Frame header.
+  const uint8_t REQUEST_VERSION = 0x04;
+  const uint8_t RESPONSE_VERSION = 0x84;
+  const size_t HEADER_LENGTH = 9;
+  const uint32_t MAX_BODY_LENGTH = 256 * 1024 * 1024;
+
+  // Opcodes.
+  const uint8_t OP_ERROR = 0x00;
+  const uint8_t OP_STARTUP = 0x01;
+  const uint8_t OP_READY = 0x02;
+  const uint8_t OP_QUERY = 0x07;
+  const uint8_t OP_RESULT = 0x08;
+  const uint8_t OP_PREPARE = 0x09;
+  const uint8_t OP_EXECUTE = 0x0A;
+  const uint8_t OP_BATCH = 0x0D;
+
+  // Result kinds.
+  const int32_t RESULT_VOID = 0x0001;
+  const int32_t RESULT_ROWS = 0x0002;
+  const int32_t RESULT_PREPARED = 0x0004;
+
+  // Error codes.
+  const int32_t ERROR_UNAVAILABLE = 0x1000;
+  const int32_t ERROR_OVERLOADED = 0x1001;
+  const int32_t ERROR_WRITE_TIMEOUT = 0x1100;
+  const int32_t ERROR_READ_TIMEOUT = 0x1200;
+  const int32_t ERROR_INVALID = 0x2200;
+  const int32_t ERROR_UNPREPARED = 0x2500;
+
+  // Query and batch flags.
+  const uint8_t FLAG_VALUES = 0x01;
+  const uint8_t BATCH_UNLOGGED = 0x01;
+  const uint8_t BATCH_KIND_PREPARED = 0x01;
+
+  // Rows metadata flags.
+  const int32_t ROWS_GLOBAL_TABLE_SPEC = 0x0001;
+  const int32_t ROWS_HAS_MORE_PAGES = 0x0002;
+  const int32_t ROWS_NO_METADATA = 0x0004;
+
+  /// Thrown when a message can't be parsed.
+  class ProtocolError : public std::runtime_error
+  {
+  public:
+    ProtocolError(const std::string& what) : std::runtime_error(what) {}
+  };
+
+  /// Convert a consistency level to its CQL value.
+  uint16_t consistency(org::apache::cassandra::ConsistencyLevel::type level);
+
+  /// Calculate the Murmur3Partitioner token of a row key.
+  int64_t murmur3_token(const std::string& key);
+
+  /// Builds the body of a message.  All integers are big-endian.
+  class Writer
+  {
+  public:
+    Writer& u8(uint8_t value);
+    Writer& u16(uint16_t value);
+    Writer& i32(int32_t value);
+    Writer& i64(int64_t value);
+
+    /// [string] - a u16 length followed by the bytes.
+    Writer& string(const std::string& value);
+
+    /// [long string] - an i32 length followed by the bytes.
+    Writer& long_string(const std::string& value);
+
+    /// [bytes] - an i32 length followed by the bytes.  A null value has
+    /// length -1.
+    Writer& bytes(const std::string& value);
+    Writer& null_bytes();
+
+    /// [short bytes] - a u16 length followed by the bytes.
+    Writer& short_bytes(const std::string& value);
+
+    /// [bytes] holding a big-endian bigint or int.
+    Writer& bigint_value(int64_t value);
+    Writer& int_value(int32_t value);
+
+    const std::string& data() const { return _data; }
+
+    /// Build a complete frame from a header and this body.
+    std::string frame(uint8_t version, int16_t stream, uint8_t opcode) const;
+
+  private:
+    std::string _data;
+  };
+
+  /// Parses the body of a message.  Throws ProtocolError if the message is
+  /// too short.
+  class Reader
+  {
+  public:
+    Reader(const std::string& data);
+
+    uint8_t u8();
+    uint16_t u16();
+    int32_t i32();
+    int64_t i64();
+    std::string string();
+    std::string long_string();
+
+    /// Read a [bytes].  Returns false (and an empty string) for a null value.
+    bool bytes(std::string& value);
+    std::string short_bytes();
+
+    /// Skip over an [option] describing a column type.
+    void skip_type();
+
+    /// Read the rows of a RESULT of kind Rows (with the kind already read).
+    /// Null values are returned as empty strings.
+    void rows(std::vector<std::vector<std::string> >& rows);
+
+    bool at_end() const { return _pos == _data.length(); }
+    size_t position() const { return _pos; }
+
+  private:
+    const char* take(size_t length);
+
+    const std::string& _data;
+    size_t _pos;
+  };
+
+  /// Decode a big-endian bigint or int value from a result row.  Returns 0 for
+  /// an empty (null) value.
+  int64_t bigint_value(const std::string& value);
+  int32_t int_value(const std::string& value);
+} // namespace Cql
+
+
+/// A byte stream to a cassandra node.
+class CqlTransport
+{
+public:
+  virtual ~CqlTransport() {}
+
+  /// Connect to the node.
+  virtual bool connect() = 0;
+
+  /// Send some data.  Only one thread sends at a time.
+  virtual bool send(const std::string& data) = 0;
+
+  /// Receive exactly the requested number of bytes, blocking until they
+  /// arrive.  Returns false if the transport fails or is closed.
+  virtual bool recv(char* buffer, size_t length) = 0;
+
+  /// Close the transport.  This unblocks any thread waiting in recv().
+  virtual void close() = 0;
+};
+
+/// TCP transport to a cassandra node.
+class CqlSocketTransport : public CqlTransport
+{
+public:
+  CqlSocketTransport(const std::string& host, int port, int connect_timeout_ms);
+  virtual ~CqlSocketTransport();
+
+  bool connect();
+  bool send(const std::string& data);
+  bool recv(char* buffer, size_t length);
+  void close();
+
+private:
+  const std::string _host;
+  const int _port;
+  const int _connect_timeout_ms;
+  int _fd;
+};
+
+
+/// A connection to a cassandra node using the CQL native protocol.
+///
+/// Requests from many threads are pipelined on the connection: each is sent
+/// on its own stream, and a reader thread matches the responses (which may
+/// arrive in any order) to the waiting requests.
+class CqlConnection
+{
+public:
+  /// Constructor.
+  ///
+  /// @param transport        - The transport to use.  The connection takes
+  ///                           ownership of it.
+  /// @param max_streams      - The maximum number of requests in flight.
+  ///                           Further requests wait for a stream to become
+  ///                           free.
+  CqlConnection(CqlTransport* transport, size_t max_streams);
+  virtual ~CqlConnection();
+
+  /// Connect and perform the STARTUP handshake.
+  bool start();
+
+  /// Close the connection.  Requests in flight fail.
+  void stop();
+
+  /// Whether the connection is usable.
+  bool is_connected();
+
+  /// Send a request.
+  ///
+  /// @param opcode           - The request opcode.
+  /// @param body             - The request body.
+  /// @return                 - The stream the request was sent on, or -1 if
+  ///                           the connection has failed.
+  int send_request(uint8_t opcode, const Cql::Writer& body);
+
+  /// Wait for the response to a request.
+  ///
+  /// @param stream           - The stream the request was sent on.
+  /// @param timeout_ms       - How long to wait.
+  /// @param opcode           - (out) The response opcode.
+  /// @param body             - (out) The response body.
+  /// @return                 - False if the connection failed or the request
+  ///                           timed out.
+  bool wait_response(int stream,
+                     int timeout_ms,
+                     uint8_t& opcode,
+                     std::string& body);
+
+  /// Send a request and wait for its response.
+  bool request(uint8_t opcode,
+               const Cql::Writer& body,
+               int timeout_ms,
+               uint8_t& response_opcode,
+               std::string& response_body);
+
+  /// The largest number of requests that have been in flight at once.
+  size_t peak_in_flight();
+
+private:
+  CqlConnection(const CqlConnection&);
+  CqlConnection& operator=(const CqlConnection&);
+
+  static void* reader_thread_fn(void* connection);
+  void reader_loop();
+  void fail_connection();
+
+  // The state of a stream.  A stream is in use from when a request is sent
+  // on it until its response is collected (or, if the request timed out,
+  // until its response arrives).
+  struct Stream
+  {
+    bool in_use;
+    bool complete;
+    bool abandoned;
+    uint8_t opcode;
+    std::string body;
+    pthread_cond_t cond;
+  };
+
+  void release_stream(int stream);
+
+  CqlTransport* _transport;
+  const size_t _max_streams;
+  Stream* _streams;
+  std::vector<int> _free_streams;
+  size_t _in_flight;
+  size_t _peak_in_flight;
+  bool _connected;
+  bool _reader_running;
+  pthread_t _reader_thread;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_mutex_t _send_lock;
+};
+
+
+/// Backend that talks to the cassandra cluster using the CQL native protocol.
+///
+/// The backend connects to every node in the cluster, and sends each request
+/// to the node that owns the row's token (as the Murmur3Partitioner assigns
+/// them), so the node can act as coordinator without forwarding the request.
+/// Each request uses a prepared statement.  Requests from many threads are
+/// pipelined on the connections.
+class CqlBackend : public Backend
+{
+public:
+  /// Constructor.
+  ///
+  /// @param seed_hosts       - The nodes to contact to discover the cluster.
+  /// @param port             - The CQL port.
+  /// @param keyspace         - The keyspace holding the call lists.
+  /// @param table            - The table holding the call lists.
+  /// @param max_streams      - The maximum requests in flight per node.
+  /// @param timeout_ms       - The timeout for each request.
+  CqlBackend(const std::vector<std::string>& seed_hosts,
+             int port,
+             const std::string& keyspace,
+             const std::string& table,
+             size_t max_streams = 1024,
+             int timeout_ms = 5000);
+  virtual ~CqlBackend();
+
+  /// Connect to the cluster, discover its nodes and their tokens, and prepare
+  /// the statements.  Returns false if no seed node could be contacted.
+  bool start();
+
+  /// Close all connections.
+  void stop();
+
+  void write_columns(const RowWrites& rows,
+                     org::apache::cassandra::ConsistencyLevel::type level);
+  void delete_columns(const std::string& key,
+                      const std::vector<std::string>& names,
+                      int64_t timestamp,
+                      const std::vector<CallColumn>& columns,
+                      org::apache::cassandra::ConsistencyLevel::type level);
+  void get_columns(const std::string& key,
+                   const std::string& start,
+                   const std::string& finish,
+                   int32_t max_columns,
+                   std::vector<CallColumn>& columns,
+                   org::apache::cassandra::ConsistencyLevel::type level);
+
+  /// The node that requests for a row are sent to.
+  std::string host_for_key(const std::string& key);
+
+protected:
+  /// Create a transport to a node.  This is virtual so that UT can use a
+  /// fake cluster.
+  virtual CqlTransport* create_transport(const std::string& host, int port);
+
+private:
+  // The statements the backend uses.
+  enum Statement
+  {
+    INSERT = 0,
+    SELECT,
+    DELETE,
+    NUM_STATEMENTS
+  };
+
+  // A node in the cluster, and its connection.
+  struct Host
+  {
+    std::string address;
+    CqlConnection* connection;
+    std::string prepared_ids[NUM_STATEMENTS];
+    uint64_t retry_after_ms;
+  };
+
+  // A request to a node.  If there is more than one statement they are run
+  // in a batch.
+  struct Request
+  {
+    Request(Host* host) :
+      host(host),
+      statements(),
+      values(),
+      connection(NULL),
+      stream(-1),
+      responded(false),
+      response_opcode(0),
+      response()
+    {}
+
+    // Add a statement, with its bound values, to the request.
+    void add(Statement statement, const std::vector<std::string>& bound)
+    {
+      statements.push_back(statement);
+      values.push_back(bound);
+    }
+
+    Host* host;
+    std::vector<Statement> statements;
+    std::vector<std::vector<std::string> > values;
+
+    CqlConnection* connection;
+    int stream;
+    bool responded;
+    uint8_t response_opcode;
+    std::string response;
+  };
+
+  Host* add_host(const std::string& address);
+  Host* route(const std::string& key);
+  bool host_available(Host* host);
+  bool connect_host(Host* host);
+  bool prepare_statements(CqlConnection* connection,
+                          std::string (&prepared_ids)[NUM_STATEMENTS]);
+  void discover_ring(Host* host);
+  bool query(CqlConnection* connection,
+             const std::string& cql,
+             std::vector<std::vector<std::string> >& rows);
+
+  void run_requests(std::vector<Request>& requests,
+                    org::apache::cassandra::ConsistencyLevel::type level);
+  bool send_request(Request& request,
+                    org::apache::cassandra::ConsistencyLevel::type level);
+  void wait_response(Request& request);
+  void check_response(Request& request,
+                      org::apache::cassandra::ConsistencyLevel::type level);
+  void throw_error(const std::string& body);
+
+  const std::vector<std::string> _seed_hosts;
+  const int _port;
+  const size_t _max_streams;
+  const int _timeout_ms;
+  std::string _statements[NUM_STATEMENTS];
+
+  // The nodes, keyed on address, and the token ring.
+  std::map<std::string, Host*> _hosts;
+  std::map<int64_t, Host*> _ring;
+
+  // Connections that have failed and been replaced.  Other threads may still
+  // be using these, so they are only freed when the backend is stopped.
+  std::vector<CqlConnection*> _failed_connections;
+
+  pthread_mutex_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,171 @@
+/**
+ * @file fnv_hash.h FNV-1a hashing.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef FNV_HASH_H_
+#define FNV_HASH_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+/// 64 bit FNV-1a hashing, shared by everything that needs a fast,
+/// non-cryptographic hash of a key or a message body.
+namespace FnvHash
+{
+
+/// FNV-1a parameters (64 bit).
+const uint64_t OFFSET_BASIS = 0xcbf29ce484222325ULL;
+const uint64_t PRIME = 0x100000001b3ULL;
+
+/// Hash a block of data.  Data can be hashed in pieces by passing the hash
+/// of the earlier pieces as the seed.
+///
+/// @param data             - The data.
+/// @param length           - The length of the data.
+/// @param seed             - The hash to start from.  Pass a different seed
+///                           (for example the hash of a secret) to get hashes
+///                           that can't be computed without it.
+/// @return                 - The hash.
+inline uint64_t hash(const void* data,
+                     size_t length,
+                     uint64_t seed = OFFSET_BASIS)
+{
+  const unsigned char* bytes = (const unsigned char*)data;
+  uint64_t hash = seed;
+
+  for (size_t ii = 0; ii < length; ++ii)
+  {
+    hash ^= bytes[ii];
+    hash *= PRIME;
+  }
+
+  return hash;
+}
+
+/// Hash a string.
+///
+/// @param key              - The string.
+/// @param seed             - The hash to start from (see above).
+/// @return                 - The hash.
+inline uint64_t hash(const std::string& key, uint64_t seed = OFFSET_BASIS)
+{
+  return hash(key.data(), key.length(), seed);
+}
+
+/// Spread the bits of a hash.  FNV alone leaves keys that differ only in
+/// their last few characters close together, so hashes that are used to
+/// place keys (on a ring, or in shards) should be finished with this.  It is
+/// the MurmurHash3 finalizer.
+///
+/// @param hash             - The hash.
+/// @return                 - The mixed hash.
+inline uint64_t mix(uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/// Incremental hash of a large body, which may be passed in any number of
+/// pieces.
+///
+/// This takes eight bytes at a time into four independent FNV-1a lanes (so
+/// the multiplies can overlap), so that hashing a large body costs about the
+/// same as copying it.  The hash only depends on the bytes, not on how they
+/// were split into pieces, but is different from hash() of the same bytes.
+class WideHash
+{
+public:
+  WideHash() :
+    _pending_length(0)
+  {
+    for (size_t lane = 0; lane < NUM_LANES; ++lane)
+    {
+      _lanes[lane] = OFFSET_BASIS + lane;
+    }
+  }
+
+  /// Add the next piece of the body.
+  ///
+  /// @param data           - The piece.
+  /// @param length         - The length of the piece.
+  void update(const void* data, size_t length)
+  {
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    // Complete any block left over from the last piece first.
+    if (_pending_length > 0)
+    {
+      size_t fill = std::min(length, BLOCK_SIZE - _pending_length);
+      memcpy(_pending + _pending_length, bytes, fill);
+      _pending_length += fill;
+      bytes += fill;
+      length -= fill;
+
+      if (_pending_length < BLOCK_SIZE)
+      {
+        return;
+      }
+
+      add_block(_pending);
+      _pending_length = 0;
+    }
+
+    for (; length >= BLOCK_SIZE; bytes += BLOCK_SIZE, length -= BLOCK_SIZE)
+    {
+      add_block(bytes);
+    }
+
+    memcpy(_pending, bytes, length);
+    _pending_length = length;
+  }
+
+  /// The hash of the body so far.
+  uint64_t value() const
+  {
+    uint64_t hash = OFFSET_BASIS;
+
+    for (size_t lane = 0; lane < NUM_LANES; ++lane)
+    {
+      hash ^= _lanes[lane];
+      hash *= PRIME;
+    }
+
+    return FnvHash::hash(_pending, _pending_length, hash);
+  }
+
+private:
+  static const size_t NUM_LANES = 4;
+  static const size_t BLOCK_SIZE = NUM_LANES * sizeof(uint64_t);
+
+  void add_block(const unsigned char* block)
+  {
+    for (size_t lane = 0; lane < NUM_LANES; ++lane)
+    {
+      uint64_t word;
+      memcpy(&word, block + (lane * sizeof(word)), sizeof(word));
+      _lanes[lane] ^= word;
+      _lanes[lane] *= PRIME;
+    }
+  }
+
+  uint64_t _lanes[NUM_LANES];
+  unsigned char _pending[BLOCK_SIZE];
+  size_t _pending_length;
+};
+
+} // namespace FnvHash
+
+#endif
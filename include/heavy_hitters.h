@@ -0,0 +1,141 @@
+/**
+ * @file heavy_hitters.h Bounded-memory tracking of the most frequent keys.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HEAVY_HITTERS_H_
+#define HEAVY_HITTERS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "statistic.h"
+#include "zmq_lvc.h"
+
+/// Space-Saving sketch that tracks the keys with the largest total weight in a
+/// stream, using a fixed number of counters.
+///
+/// Any key whose true weight is more than 1/capacity of the total weight of
+/// the stream is guaranteed to be tracked.  The count reported for a key may
+/// over-estimate its true weight, but by no more than the reported error.
+///
+/// This class is thread-safe.
+class HeavyHitters
+{
+public:
+  /// A key and its estimated weight.
+  struct Item
+  {
+    std::string key;
+
+    /// Estimated total weight of the key.
+    uint64_t count;
+
+    /// Maximum amount by which the count may over-estimate the true weight.
+    uint64_t error;
+  };
+
+  /// Constructor.
+  ///
+  /// @param capacity   - The number of keys to track.
+  HeavyHitters(size_t capacity);
+
+  /// Destructor.
+  virtual ~HeavyHitters();
+
+  /// Add an occurrence of a key to the sketch.
+  ///
+  /// @param key        - The key.
+  /// @param weight     - The weight of this occurrence.
+  void add(const std::string& key, uint64_t weight = 1);
+
+  /// Get the heaviest keys, heaviest first.
+  ///
+  /// @param n          - The maximum number of keys to return.
+  /// @param items      - (out) The heaviest keys.
+  void top(size_t n, std::vector<Item>& items) const;
+
+  /// Forget all the tracked keys.
+  void clear();
+
+private:
+  typedef std::multimap<uint64_t, std::string> CountIndex;
+
+  struct Counter
+  {
+    uint64_t count;
+    uint64_t error;
+
+    // Position of this counter in the index sorted by count.
+    CountIndex::iterator index_it;
+  };
+
+  const size_t _capacity;
+  std::unordered_map<std::string, Counter> _counters;
+  CountIndex _by_count;
+  mutable pthread_mutex_t _lock;
+};
+
+
+/// Tracks the IMPUs responsible for the most call list store operations, and
+/// the most bytes read and written, and periodically publishes the top few to
+/// the stats aggregator.
+class HotImpuTracker
+{
+public:
+  /// Constructor.
+  ///
+  /// @param capacity         - The number of IMPUs each sketch tracks.  The
+  ///                           larger this is, the more accurate the results.
+  /// @param top_n            - The number of IMPUs to publish as statistics.
+  /// @param stats_aggregator - The LVC to publish statistics to.  May be NULL,
+  ///                           in which case the results are only available
+  ///                           by querying the tracker.
+  HotImpuTracker(size_t capacity,
+                 size_t top_n,
+                 LastValueCache* stats_aggregator);
+
+  /// Destructor.
+  virtual ~HotImpuTracker();
+
+  /// Record an operation on an IMPU.
+  ///
+  /// @param impu             - The IMPU the operation was for.
+  /// @param bytes            - The number of bytes read or written.
+  void record(const std::string& impu, uint64_t bytes);
+
+  /// Get the IMPUs with the most operations.
+  void top_by_ops(size_t n, std::vector<HeavyHitters::Item>& impus) const;
+
+  /// Get the IMPUs with the most bytes read or written.
+  void top_by_bytes(size_t n, std::vector<HeavyHitters::Item>& impus) const;
+
+  /// Publish the current top IMPUs to the stats aggregator.
+  void publish();
+
+private:
+  void publish_sketch(const HeavyHitters& sketch, Statistic* statistic);
+
+  HeavyHitters _by_ops;
+  HeavyHitters _by_bytes;
+  const size_t _top_n;
+
+  Statistic* _ops_stat;
+  Statistic* _bytes_stat;
+
+  // Monotonic time (in ms) at which the stats are next due to be published.
+  std::atomic<uint64_t> _next_publish_ms;
+};
+
+#endif
@@ -44,6 +44,9 @@ namespace SASEvent
   const int CALL_LIST_DB_INVALID_RECORD_2 = MEMENTO_BASE + 0x000035;
   const int CALL_LIST_DB_INVALID_RECORD = MEMENTO_BASE + 0x000036;
 
+  const int HTTP_RX_BODY_DIGEST = MEMENTO_BASE + 0x000040;
+  const int HTTP_TX_BODY_DIGEST = MEMENTO_BASE + 0x000041;
+
   const int CALL_LIST_WRITE_STARTED = MEMENTO_BASE + 0x000200;
   const int CALL_LIST_WRITE_OK      = MEMENTO_BASE + 0x000201;
   const int CALL_LIST_WRITE_FAILED  = MEMENTO_BASE + 0x000202;
@@ -53,6 +56,16 @@ namespace SASEvent
   const int CALL_LIST_TRIM_STARTED  = MEMENTO_BASE + 0x000206;
   const int CALL_LIST_TRIM_OK       = MEMENTO_BASE + 0x000207;
   const int CALL_LIST_TRIM_FAILED   = MEMENTO_BASE + 0x000208;
+  const int CALL_LIST_READ_UNCHANGED = MEMENTO_BASE + 0x000209;
+  const int CALL_LIST_WRITE_SUPPRESSED = MEMENTO_BASE + 0x00020A;
+  const int CALL_LIST_EXPORT_STARTED = MEMENTO_BASE + 0x00020B;
+  const int CALL_LIST_EXPORT_OK     = MEMENTO_BASE + 0x00020C;
+  const int CALL_LIST_EXPORT_FAILED = MEMENTO_BASE + 0x00020D;
+  const int CALL_LIST_IMPORT_STARTED = MEMENTO_BASE + 0x00020E;
+  const int CALL_LIST_IMPORT_OK     = MEMENTO_BASE + 0x00020F;
+  const int CALL_LIST_IMPORT_FAILED = MEMENTO_BASE + 0x000210;
+  const int CALL_LIST_READ_NOT_MODIFIED = MEMENTO_BASE + 0x000211;
+  const int CALL_LIST_READ_CACHED   = MEMENTO_BASE + 0x000212;
 
   const int CALL_LIST_BEGIN_FRAGMENT = MEMENTO_BASE + 0x000300;
   const int CALL_LIST_REJECTED_FRAGMENT = MEMENTO_BASE + 0x000301;
@@ -12,13 +12,62 @@
 #ifndef MEMENTOSASLOGGER_H_
 #define MEMENTOSASLOGGER_H_
 
+#include <stdint.h>
+
 #include "sas.h"
 #include "httpstack.h"
 
+// SAS logger that bounds the cost of logging HTTP messages.
+//
+// Bodies up to a configurable size (set separately for received requests and
+// transmitted responses) are logged in full.  Larger bodies are not copied
+// into the HTTP event.  Optionally a separate event records their length and
+// a hash, which is enough to tell whether two messages carried the same body.
+// Hashing costs a pass over the body, so this is off by default.
+//
+// Nothing is built at all for messages that won't be logged, either because
+// there is no trail or because the logger is filtering out the level.
 class MementoSasLogger : public HttpStack::DefaultSasLogger
 {
 public:
-    // Log a transmitted HTTP response, omitting the body.
+    // The largest received request body logged in full by default.
+    static const size_t DEFAULT_MAX_RX_BODY_BYTES = 4096;
+
+    // The largest transmitted response body logged in full by default.
+    // Response bodies (call lists) are large, so by default they are never
+    // logged.
+    static const size_t DEFAULT_MAX_TX_BODY_BYTES = 0;
+
+    MementoSasLogger();
+
+    // Set the largest bodies to log in full.
+    //
+    // @param max_rx_body_bytes limit for received requests.
+    // @param max_tx_body_bytes limit for transmitted responses.
+    void set_max_body_bytes(size_t max_rx_body_bytes, size_t max_tx_body_bytes);
+
+    // Set whether to log a digest (length and hash) of bodies that are too
+    // large to log in full.
+    //
+    // @param enabled whether to log digests.
+    void set_body_digests(bool enabled);
+
+    // Set the lowest level to log.  HTTP events are logged at PROTOCOL level,
+    // so setting this above PROTOCOL turns off HTTP logging.
+    //
+    // @param level the lowest level to log.
+    void set_min_level(SASEvent::HttpLogLevel level);
+
+    // Log a received HTTP request, with a bounded body.
+    //
+    // @param trail SAS trail ID to log on.
+    // @param req request to log.
+    // @instance_id unique instance ID for the event.
+    void sas_log_rx_http_req(SAS::TrailId trail,
+                             HttpStack::Request& req,
+                             uint32_t instance_id = 0);
+
+    // Log a transmitted HTTP response, with a bounded body.
     //
     // @param trail SAS trail ID to log on.
     // @param req request to log.
@@ -28,6 +77,29 @@ public:
                              HttpStack::Request& req,
                              int rc,
                              uint32_t instance_id = 0);
+
+    // Hash of a message body, as logged for bodies that are too large to log
+    // in full.
+    //
+    // @param data the start of the body.
+    // @param length the length of the body.
+    static uint64_t body_hash(const unsigned char* data, size_t length);
+
+private:
+    // Whether events at a level should be logged on a trail.
+    bool should_log(SAS::TrailId trail, SASEvent::HttpLogLevel level) const;
+
+    // Log the length and hash of a body that is too large to log in full.
+    void log_body_digest(SAS::TrailId trail,
+                         int event_id,
+                         evbuffer* body,
+                         size_t length,
+                         uint32_t instance_id);
+
+    size_t _max_rx_body_bytes;
+    size_t _max_tx_body_bytes;
+    bool _body_digests;
+    SASEvent::HttpLogLevel _min_level;
 };
 
 #endif
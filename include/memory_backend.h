@@ -0,0 +1,78 @@
+/**
+ * @file memory_backend.h In-memory storage backend for the call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMORY_BACKEND_H_
+#define MEMORY_BACKEND_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "call_list_backend.h"
+
+namespace CallListStore
+{
+
+/// Backend that holds call lists in memory, for benchmarking the store
+/// without a cassandra cluster (e.g. when replaying a trace).
+///
+/// Like cassandra, a write or delete only takes effect if its timestamp is
+/// at least that of the existing column.  TTLs are ignored, and deleted
+/// columns are removed rather than leaving tombstones.  Each operation can
+/// be delayed to model the latency of a real cluster.
+class MemoryBackend : public Backend
+{
+public:
+  /// Constructor.
+  ///
+  /// @param latency_us       - How long each operation takes.
+  MemoryBackend(uint64_t latency_us = 0);
+  virtual ~MemoryBackend();
+
+  void write_columns(const RowWrites& rows,
+                     org::apache::cassandra::ConsistencyLevel::type level);
+  void delete_columns(const std::string& key,
+                      const std::vector<std::string>& names,
+                      int64_t timestamp,
+                      const std::vector<CallColumn>& columns,
+                      org::apache::cassandra::ConsistencyLevel::type level);
+  void get_columns(const std::string& key,
+                   const std::string& start,
+                   const std::string& finish,
+                   int32_t max_columns,
+                   std::vector<CallColumn>& columns,
+                   org::apache::cassandra::ConsistencyLevel::type level);
+
+  /// The number of rows, and the total number of columns in them.
+  size_t num_rows();
+  size_t num_columns();
+
+private:
+  MemoryBackend(const MemoryBackend&);
+  MemoryBackend& operator=(const MemoryBackend&);
+
+  typedef std::map<std::string, CallColumn> Row;
+
+  // Methods that are called with the lock held.
+  void write_column(Row& row, const CallColumn& column);
+
+  void delay();
+
+  const uint64_t _latency_us;
+  std::map<std::string, Row> _rows;
+  pthread_mutex_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
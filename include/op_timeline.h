@@ -0,0 +1,178 @@
+/**
+ * @file op_timeline.h Per-operation timelines, recorded in per-thread rings.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef OP_TIMELINE_H_
+#define OP_TIMELINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/// The times at which an operation passed each stage of its processing.
+///
+/// This is a fixed-size structure so that it can be copied into a ring buffer
+/// without allocating.
+struct OpTimeline
+{
+  enum Event
+  {
+    // The operation was queued for a worker thread.
+    ENQUEUE = 0,
+
+    // A worker thread (or the calling thread, for a synchronous operation)
+    // started to process the operation.
+    DEQUEUE,
+
+    // The operation was given a connection from the pool.
+    CONNECTION_CHECKOUT,
+
+    // The (first) request was sent to cassandra.
+    SEND,
+
+    // The (last) response was received from cassandra.
+    RECEIVE,
+
+    DECODE_START,
+    DECODE_END,
+
+    // The result was ready to be handed back to the caller.
+    HANDOFF,
+
+    NUM_EVENTS
+  };
+
+  OpTimeline() : name(""), trail(0)
+  {
+    clear();
+  }
+
+  /// Mark that an event has happened now.
+  void mark(Event event);
+
+  /// Mark that an event has happened, unless it has already been marked.
+  void mark_first(Event event);
+
+  /// Forget all the marked events.
+  void clear()
+  {
+    for (int ii = 0; ii < NUM_EVENTS; ++ii)
+    {
+      times_ns[ii] = 0;
+    }
+  }
+
+  /// The time of the first marked event, or 0 if there are none.
+  uint64_t start_ns() const;
+
+  /// The time between the first and last marked events.
+  uint64_t duration_ns() const;
+
+  /// The name of an event.
+  static const char* event_name(Event event);
+
+  /// The name of the operation.  This must be a string literal.
+  const char* name;
+
+  /// The SAS trail the operation was logged to.
+  uint64_t trail;
+
+  /// The monotonic time (in ns) of each event, or 0 if it didn't happen.
+  uint64_t times_ns[NUM_EVENTS];
+};
+
+
+/// Records the timelines of completed operations, so that the slowest can be
+/// dumped on demand.
+///
+/// Each thread records into its own ring buffer of the most recent
+/// timelines, so recording takes no locks and doesn't contend with other
+/// threads.  Each slot in a ring is protected by a sequence number, so a dump
+/// can read the rings while they are being written and skip any slot that
+/// was being overwritten.
+///
+/// This class is thread-safe.
+class OpTimelineRecorder
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ops_per_thread     - The number of operations to remember for
+  ///                             each thread.
+  OpTimelineRecorder(size_t ops_per_thread);
+
+  /// Destructor.  No threads may be recording when the recorder is
+  /// destroyed.
+  virtual ~OpTimelineRecorder();
+
+  /// Record the timeline of a completed operation.
+  void record(const OpTimeline& timeline);
+
+  /// Get the slowest operations that are still in the rings, slowest first.
+  ///
+  /// @param n                  - The maximum number of operations to return.
+  /// @param timelines          - (out) The timelines.
+  void slowest(size_t n, std::vector<OpTimeline>& timelines);
+
+  /// Dump the slowest operations in the Chrome trace event format (as read
+  /// by chrome://tracing and Perfetto).  Each operation is a row, with a
+  /// slice for the whole operation and a slice for each stage of it
+  /// (queued, connection checkout, cassandra, decode, hand-off).
+  ///
+  /// @param n                  - The maximum number of operations to dump.
+  /// @param json               - (out) The JSON trace.
+  void dump_slowest(size_t n, std::string& json);
+
+private:
+  OpTimelineRecorder(const OpTimelineRecorder&);
+  OpTimelineRecorder& operator=(const OpTimelineRecorder&);
+
+  struct Slot
+  {
+    // Odd while the slot is being written.
+    std::atomic<uint64_t> sequence;
+    OpTimeline timeline;
+  };
+
+  struct Ring
+  {
+    Ring(size_t size) : slots(new Slot[size]), size(size), next(0)
+    {
+      for (size_t ii = 0; ii < size; ++ii)
+      {
+        slots[ii].sequence.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    ~Ring() { delete[] slots; }
+
+    Slot* slots;
+    const size_t size;
+
+    // Only written by the owning thread.
+    size_t next;
+  };
+
+  Ring* ring_for_this_thread();
+
+  const size_t _ops_per_thread;
+
+  // Identifies this recorder in each thread's cache of rings.  IDs are never
+  // reused, so a stale cache entry can't match a new recorder.
+  const uint64_t _id;
+
+  // Every thread's ring.  The lock protects the list, not the rings.
+  std::vector<Ring*> _rings;
+  pthread_mutex_t _lock;
+};
+
+#endif
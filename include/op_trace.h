@@ -0,0 +1,159 @@
+/**
+ * @file op_trace.h Compact binary traces of call list store operations.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef OP_TRACE_H_
+#define OP_TRACE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace CallListStore
+{
+
+/// A traced call list store operation.  This records the shape of the
+/// operation (what it was, how big it was and how long it took) but not the
+/// IMPU or the call fragments themselves.
+struct OpTraceRecord
+{
+  // Types of operation.  These are stored in trace files so each element must
+  // have an explicit value.
+  enum Type
+  {
+    WRITE = 0,
+    READ = 1,
+    TRIM = 2
+  };
+
+  static const int NUM_TYPES = TRIM + 1;
+
+  Type type;
+
+  /// Whether the operation succeeded.
+  bool success;
+
+  /// Hash of the IMPU (see hash_impu).  Operations on the same IMPU in a
+  /// trace have the same hash.
+  uint64_t impu_hash;
+
+  /// When the operation started, in microseconds since the trace started.
+  uint64_t start_us;
+
+  /// How long the operation took.
+  uint64_t latency_us;
+
+  /// The number of fragments written, read or deleted, and their size (for
+  /// trims, the size of the column names).
+  uint64_t num_fragments;
+  uint64_t num_bytes;
+
+  /// Hash an IMPU for a trace.  The hash is salted with a random value
+  /// chosen when the process starts, so it is only consistent within a
+  /// process, and the IMPUs in a trace can't be recovered by hashing likely
+  /// IMPUs.  It is not a cryptographic hash, so the trace should still be
+  /// handled with care.
+  static uint64_t hash_impu(const std::string& impu);
+};
+
+/// Writes operation records to a trace file.
+///
+/// Records are buffered and written in the order they are added.  They are
+/// small (typically around 16 bytes) so tracing can be left on under load,
+/// but the number of records can be limited to bound the size of the file.
+/// This class is thread-safe.
+class OpTraceWriter
+{
+public:
+  OpTraceWriter();
+  virtual ~OpTraceWriter();
+
+  /// Create the trace file.  The trace starts now.
+  ///
+  /// @param path           - The file to create.
+  /// @param max_records    - The number of records after which later ones
+  ///                         are dropped, or 0 for no limit.
+  /// @return               - Whether the file was created successfully.
+  bool open(const std::string& path, uint64_t max_records = 0);
+
+  /// Add a record to the trace.
+  ///
+  /// @param record         - The record.  Its start time is relative to the
+  ///                         start of the trace (see now_us).
+  void write(const OpTraceRecord& record);
+
+  /// The current time, in microseconds since the trace started.
+  uint64_t now_us() const;
+
+  /// Flush any buffered records and close the file.
+  ///
+  /// @return               - Whether the whole trace was written
+  ///                         successfully.
+  bool close();
+
+  /// The number of records written and dropped so far.
+  uint64_t num_records() const { return _num_records; }
+  uint64_t num_dropped() const { return _num_dropped; }
+
+private:
+  bool flush();
+
+  FILE* _file;
+  uint64_t _max_records;
+  bool _failed;
+
+  struct timespec _start;
+  std::string _buffer;
+  uint64_t _prev_start_us;
+
+  uint64_t _num_records;
+  uint64_t _num_dropped;
+
+  pthread_mutex_t _lock;
+};
+
+/// Reads operation records from a trace file, in the order they were written.
+class OpTraceReader
+{
+public:
+  OpTraceReader();
+  virtual ~OpTraceReader();
+
+  /// Open a trace file.
+  ///
+  /// @param path           - The file to open.
+  /// @return               - Whether the file is a valid trace.
+  bool open(const std::string& path);
+
+  /// Read the next record.
+  ///
+  /// @param record         - (out) The record.
+  /// @return               - True if a record was read, false at the end of
+  ///                         the trace or on error (see error()).
+  bool read(OpTraceRecord& record);
+
+  /// Close the trace.
+  void close();
+
+  /// Whether reading failed because the trace is corrupt.
+  bool error() const { return _failed; }
+
+private:
+  bool get_varint(uint64_t& value);
+
+  FILE* _file;
+  bool _failed;
+  uint64_t _prev_start_us;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * @file read_memory_budget.h Limits the memory held by call list reads.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef READ_MEMORY_BUDGET_H_
+#define READ_MEMORY_BUDGET_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "statistic.h"
+#include "thread_local_stats.h"
+#include "zmq_lvc.h"
+
+namespace CallListStore
+{
+
+/// Tracks the memory held by the results of call list reads, from when the
+/// columns are read until the operation is deleted (or the results are moved
+/// out of it), against a global budget.
+///
+/// A read's size isn't known until it has read its row, so each read
+/// reserves an estimate of its size before it starts.  While the budget
+/// doesn't have room for the estimate, new reads wait (for a limited time)
+/// for memory to be released, and are rejected if none is.  Once the read
+/// knows its size, the reservation is exchanged for the actual size.  A read
+/// whose results are large, and would take the memory held over the budget,
+/// is rejected at that point, but the row has already been read by then, so
+/// the budget bounds the memory held by results rather than the peak memory
+/// used reading wide rows.  Smaller results are always accepted, as the
+/// memory is already allocated by then.
+///
+/// The memory held is published at most once a second, so the statistic
+/// can lag the budget by that long, except that it is always published when
+/// the memory held drops to zero, so it doesn't stick at its last value when
+/// reads stop.
+///
+/// This class is thread-safe.
+class ReadMemoryBudget
+{
+public:
+  /// Configuration.
+  struct Config
+  {
+    Config() :
+      max_bytes(256 * 1024 * 1024),
+      large_read_bytes(1024 * 1024),
+      max_wait_ms(100),
+      reserved_bytes(16 * 1024)
+    {}
+
+    /// The memory that read results can hold between them.
+    uint64_t max_bytes;
+
+    /// Reads with results at least this size are rejected rather than take
+    /// the memory held over the budget.
+    uint64_t large_read_bytes;
+
+    /// How long a read waits for memory to be released before it is
+    /// rejected.
+    uint64_t max_wait_ms;
+
+    /// The memory reserved for a read before it starts.
+    uint64_t reserved_bytes;
+  };
+
+  /// Constructor.
+  ///
+  /// @param config           - The configuration.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  ReadMemoryBudget(const Config& config, LastValueCache* stats_aggregator);
+  virtual ~ReadMemoryBudget();
+
+  /// Wait until the budget has room for a read, and reserve memory for it so
+  /// that it can start.
+  ///
+  /// @param reserved_bytes   - Set to the memory reserved, which must be
+  ///                           passed to charge, or released.
+  /// @return                 - False (and nothing is reserved) if the read
+  ///                           should be rejected.
+  bool admit(uint64_t& reserved_bytes);
+
+  /// Charge the memory held by a read's results to the budget, in place of
+  /// the memory reserved for it.
+  ///
+  /// @param bytes            - The size of the results.
+  /// @param reserved_bytes   - The memory reserved by admit, which is
+  ///                           released whether or not the results are
+  ///                           charged.
+  /// @return                 - False (and nothing is charged) if the read
+  ///                           should be rejected.
+  bool charge(uint64_t bytes, uint64_t reserved_bytes = 0);
+
+  /// Release memory that was charged to the budget.
+  void release(uint64_t bytes);
+
+  /// The memory currently charged to the budget.
+  uint64_t bytes_held();
+
+  /// The number of reads rejected since the budget was created.
+  uint64_t num_rejected() const { return _rejected->total(); }
+
+  /// The maximum memory that can be held.
+  uint64_t max_bytes() const { return _config.max_bytes; }
+
+private:
+  ReadMemoryBudget(const ReadMemoryBudget&);
+  ReadMemoryBudget& operator=(const ReadMemoryBudget&);
+
+  // Whether the memory held is due to be published.  Must be called with the
+  // lock held.
+  bool publish_due();
+
+  // Publish the memory held.  This is called without the lock held, as it
+  // sends to the LVC.
+  void publish_bytes_held(uint64_t bytes_held);
+
+  const Config _config;
+  uint64_t _bytes_held;
+  uint64_t _next_publish_ms;
+  uint64_t _published_bytes_held;
+
+  Statistic* _bytes_held_stat;
+  ThreadLocalCounter* _rejected;
+
+  pthread_cond_t _cond;
+  pthread_mutex_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
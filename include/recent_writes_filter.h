@@ -0,0 +1,106 @@
+/**
+ * @file recent_writes_filter.h Time-decaying filter of recently written keys.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RECENT_WRITES_FILTER_H_
+#define RECENT_WRITES_FILTER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/// Probabilistic filter that remembers which keys have been written recently.
+///
+/// The filter is a pair of Bloom filters, each covering one window of time.
+/// When the current window ends, the older filter is discarded and a new,
+/// empty one started.  A key is therefore remembered for at least one window
+/// and at most two.
+///
+/// The filter never forgets a key early (no false negatives within the
+/// window), but may claim to have seen a key that it has not (a false
+/// positive) with roughly the configured probability, provided no more than
+/// the expected number of keys are added each window.
+///
+/// This class is thread-safe.
+class RecentWritesFilter
+{
+public:
+  /// Hash of a key, built up from one or more parts.
+  class Key
+  {
+  public:
+    Key();
+
+    /// Add a part to the key.  Parts are delimited, so ("ab", "c") and
+    /// ("a", "bc") are different keys.
+    Key& add(const std::string& part);
+
+  private:
+    uint64_t _hash;
+    friend class RecentWritesFilter;
+  };
+
+  /// Constructor.
+  ///
+  /// @param window_ms          - How long (in ms) to remember keys for.
+  /// @param expected_entries   - The number of keys expected to be added in
+  ///                             each window.
+  /// @param false_positive_rate - The target probability of falsely reporting
+  ///                             that a key has been seen.
+  RecentWritesFilter(uint64_t window_ms,
+                     size_t expected_entries,
+                     double false_positive_rate);
+
+  /// Destructor.
+  virtual ~RecentWritesFilter();
+
+  /// Check whether a key has been added recently.
+  ///
+  /// @param key                - The key to check.
+  /// @param now_ms             - The current monotonic time in ms.
+  /// @return                   - True if the key has (probably) been added
+  ///                             in the last window.
+  bool contains(const Key& key, uint64_t now_ms);
+  bool contains(const Key& key);
+
+  /// Add a key to the filter.
+  ///
+  /// @param key                - The key to add.
+  /// @param now_ms             - The current monotonic time in ms.
+  void add(const Key& key, uint64_t now_ms);
+  void add(const Key& key);
+
+  /// The number of bits in each of the filter's windows.
+  size_t num_bits() const { return _num_bits; }
+
+  /// The number of hash functions used.
+  size_t num_hashes() const { return _num_hashes; }
+
+private:
+  void rotate_if_needed(uint64_t now_ms);
+  bool test_bits(const std::vector<uint64_t>& bits, const Key& key) const;
+  void set_bits(std::vector<uint64_t>& bits, const Key& key);
+
+  const uint64_t _window_ms;
+  size_t _num_bits;
+  size_t _num_hashes;
+
+  // Bit arrays for the current and previous windows.
+  std::vector<uint64_t> _current;
+  std::vector<uint64_t> _previous;
+
+  // Monotonic time (in ms) at which the current window ends.
+  uint64_t _window_end_ms;
+
+  pthread_mutex_t _lock;
+};
+
+#endif
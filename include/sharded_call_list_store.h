@@ -0,0 +1,137 @@
+/**
+ * @file sharded_call_list_store.h Call list store sharded across clusters.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_CALL_LIST_STORE_H_
+#define SHARDED_CALL_LIST_STORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "call_list_store.h"
+
+namespace CallListStore
+{
+
+/// Front end that spreads IMPUs across several call list stores (each
+/// normally connected to its own cassandra cluster).
+///
+/// Each IMPU is mapped to a shard by consistent hashing.  Every shard owns a
+/// number of points (virtual nodes) on a 64-bit hash ring, and an IMPU
+/// belongs to the shard that owns the first point at or after the IMPU's
+/// hash.  Adding a shard only moves the IMPUs that hash to the new shard's
+/// points (about 1/N of them), and they all move to the new shard.
+///
+/// Moving the call lists of IMPUs that change shard is left to the operator
+/// (e.g. by exporting and importing them).
+///
+/// This class is thread-safe.
+class ShardedStore
+{
+public:
+  /// The default number of points each shard owns on the ring.  More points
+  /// spread IMPUs more evenly, at the cost of a larger ring.
+  static const size_t DEFAULT_VNODES_PER_SHARD = 128;
+
+  /// Constructor.
+  ///
+  /// @param vnodes_per_shard - The number of points each shard owns on the
+  ///                           ring.
+  ShardedStore(size_t vnodes_per_shard = DEFAULT_VNODES_PER_SHARD);
+
+  /// Destructor.  Deletes the shards' stores.
+  virtual ~ShardedStore();
+
+  /// Add a shard.  The shard's points on the ring are derived from its name,
+  /// so a shard must keep the same name for IMPUs to keep mapping to it.
+  ///
+  /// @param name             - The shard's name.  This must be unique.
+  /// @param store            - The shard's store.  The sharded store takes
+  ///                           ownership of this.
+  /// @return                 - False if there is already a shard with the
+  ///                           name (in which case the store is not taken).
+  bool add_shard(const std::string& name, Store* store);
+
+  /// The number of shards.
+  size_t num_shards();
+
+  /// Get the store that holds an IMPU's call list (for example to run
+  /// asynchronous operations on it).
+  ///
+  /// @param impu             - The IMPU.
+  /// @return                 - The store, or NULL if there are no shards.
+  Store* get_store(const std::string& impu);
+
+  /// Get the name of the shard that holds an IMPU's call list.
+  ///
+  /// @param impu             - The IMPU.
+  /// @return                 - The name, or empty if there are no shards.
+  std::string get_shard_name(const std::string& impu);
+
+  /// Start every shard's store.
+  ///
+  /// @return                 - OK, or the error from the first store that
+  ///                           failed to start.
+  CassandraStore::ResultCode start();
+
+  /// Stop every shard's store.
+  void stop();
+
+  /// Wait for every shard's store to stop.
+  void wait_stopped();
+
+  //
+  // Synchronous operations, run on the IMPU's shard.  These return
+  // CONNECTION_ERROR if there are no shards.
+  //
+  CassandraStore::ResultCode
+    write_call_fragment_sync(const std::string& impu,
+                             const CallFragment& fragment,
+                             const int64_t cass_timestamp,
+                             const int32_t ttl,
+                             SAS::TrailId trail);
+  CassandraStore::ResultCode
+    get_call_fragments_sync(const std::string& impu,
+                            std::vector<CallFragment>& fragments,
+                            SAS::TrailId trail);
+  CassandraStore::ResultCode
+    delete_old_call_fragments_sync(const std::string& impu,
+                                   const std::vector<CallFragment> fragments,
+                                   const int64_t cass_timestamp,
+                                   SAS::TrailId trail);
+
+  /// The hash used to place IMPUs and virtual nodes on the ring.
+  static uint64_t ring_hash(const std::string& key);
+
+private:
+  ShardedStore(const ShardedStore&);
+  ShardedStore& operator=(const ShardedStore&);
+
+  // Find the shard for an IMPU.  Called with the lock held.
+  size_t find_shard(const std::string& impu) const;
+
+  const size_t _vnodes_per_shard;
+
+  std::vector<std::string> _names;
+  std::vector<Store*> _stores;
+
+  // The points on the ring, sorted, with the index of the shard that owns
+  // each one.
+  std::vector<std::pair<uint64_t, size_t> > _ring;
+
+  pthread_rwlock_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,186 @@
+/**
+ * @file sharded_executor.h Worker threads sharded by key, with work stealing.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_EXECUTOR_H_
+#define SHARDED_EXECUTOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <unordered_set>
+#include <vector>
+
+#include "thread_local_stats.h"
+#include "zmq_lvc.h"
+
+namespace CallListStore
+{
+
+/// Runs tasks on a set of worker threads (shards), choosing the shard by
+/// hashing a key that comes with each task (for the call list store, the
+/// IMPU).  Each shard has its own queue and thread, which can be pinned to a
+/// CPU, so the tasks for a key are always queued in the same place and
+/// usually run on the same core.
+///
+/// Tasks with the same key are run one at a time, in the order they were
+/// submitted.  A shard with nothing to do steals tasks from the front of
+/// busy shards' queues, but only tasks whose key isn't already running or
+/// queued ahead of them, so stealing never reorders the tasks for a key.
+///
+/// This class is thread-safe.
+class ShardedExecutor
+{
+public:
+  /// A unit of work.
+  class Task
+  {
+  public:
+    virtual ~Task() {}
+
+    /// Run the task.  This is called on one of the executor's threads.
+    virtual void run() = 0;
+  };
+
+  /// Configuration.
+  struct Config
+  {
+    Config() :
+      num_shards(0),
+      pin_threads(true),
+      max_scan(64),
+      min_steal_backlog(2),
+      steal_interval_ms(1)
+    {}
+
+    /// The number of shards.  The call list store sets this to its number
+    /// of worker threads if it is 0 (see Store::configure_sharded_workers);
+    /// otherwise 0 means 1.
+    size_t num_shards;
+
+    /// Whether to pin each shard's thread to a CPU (shard N to CPU N, modulo
+    /// the number of CPUs).
+    bool pin_threads;
+
+    /// How far down a queue to look for a task whose key isn't already
+    /// running.
+    size_t max_scan;
+
+    /// A shard is only stolen from if it has at least this many tasks
+    /// queued.  Its own thread is likely to take the first one.
+    size_t min_steal_backlog;
+
+    /// How often an idle shard looks for work to steal.
+    uint64_t steal_interval_ms;
+  };
+
+  /// Constructor.
+  ///
+  /// @param config           - The configuration.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  ShardedExecutor(const Config& config, LastValueCache* stats_aggregator);
+
+  /// Destructor.  Stops the executor if it is running.
+  virtual ~ShardedExecutor();
+
+  /// Start the worker threads.
+  void start();
+
+  /// Stop accepting tasks, and tell the worker threads to stop once they
+  /// have run all the tasks already submitted.
+  void stop();
+
+  /// Wait for the worker threads to stop after stop.
+  void wait_stopped();
+
+  /// Submit a task.
+  ///
+  /// @param key              - The key to shard the task by.
+  /// @param task             - The task.  The executor takes ownership of
+  ///                           this if it is accepted.
+  /// @return                 - Whether the task was accepted (it isn't if
+  ///                           the executor isn't running).
+  bool submit(uint64_t key, Task* task);
+
+  /// The shard that runs the tasks for a key.
+  static size_t shard_for(uint64_t key, size_t num_shards);
+
+  /// The number of shards.
+  size_t num_shards() const { return _shards.size(); }
+
+  /// The number of tasks queued on a shard.
+  size_t queue_length(size_t shard) const { return _shards[shard]->queued.load(); }
+
+  /// The number of tasks that have been stolen by other shards.
+  uint64_t num_steals() const { return _steals->total(); }
+
+private:
+  ShardedExecutor(const ShardedExecutor&);
+  ShardedExecutor& operator=(const ShardedExecutor&);
+
+  struct Entry
+  {
+    uint64_t key;
+    Task* task;
+  };
+
+  struct Shard
+  {
+    Shard();
+    ~Shard();
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // The tasks waiting to run, and the keys of the tasks from this shard
+    // that are running (on this shard's thread or another).
+    std::deque<Entry> queue;
+    std::unordered_set<uint64_t> running;
+    std::atomic<size_t> queued;
+
+    // Incremented whenever a task is queued or finishes, so that the thread
+    // can tell whether anything has changed since it last looked.
+    uint64_t changes;
+
+    pthread_t thread;
+    bool started;
+  };
+
+  // Passed to each thread so that it knows which shard it is.
+  struct ThreadArgs
+  {
+    ShardedExecutor* executor;
+    size_t index;
+  };
+
+  static void* thread_entry_point(void* args);
+  void thread_main(size_t index);
+
+  bool steal(size_t thief, Entry& entry, size_t& victim);
+  void finish(Shard* shard, uint64_t key);
+  void pin_thread(size_t index);
+
+  // Methods that are called with the shard's lock held.
+  bool take(Shard* shard, Entry& entry);
+
+  const Config _config;
+  std::vector<Shard*> _shards;
+  std::vector<ThreadArgs> _thread_args;
+  ThreadLocalCounter* _steals;
+
+  std::atomic<bool> _running;
+  std::atomic<bool> _terminating;
+};
+
+} // namespace CallListStore
+
+#endif
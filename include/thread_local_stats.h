@@ -0,0 +1,245 @@
+/**
+ * @file thread_local_stats.h Statistics accumulated in per-thread slots.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef THREAD_LOCAL_STATS_H_
+#define THREAD_LOCAL_STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "statistic.h"
+#include "zmq_lvc.h"
+
+/// Base class for statistics that are updated from many threads at once.
+///
+/// Each thread updates its own cache-line sized slot, so updates from
+/// different threads don't contend.  The slots are only merged when the
+/// statistic is published to the last value cache, which a background thread
+/// (shared by all the statistics) does at the end of each period, or when
+/// publish() is called.  Updates never read the clock.
+///
+/// There are a fixed number of slots.  If there are more threads than slots
+/// some threads share a slot, which is still correct (the slots are updated
+/// atomically) but may contend.
+///
+/// This class is thread-safe.
+class ThreadLocalStatistic
+{
+public:
+  /// The number of slots in each statistic.
+  static const size_t NUM_SLOTS = 128;
+
+  /// Constructor.
+  ///
+  /// @param statname           - The name of the statistic in the LVC.
+  /// @param stats_aggregator   - The LVC to publish to.  If this is NULL the
+  ///                             statistic is still accumulated, but never
+  ///                             published.
+  /// @param period_ms          - How often to publish.
+  ThreadLocalStatistic(const std::string& statname,
+                       LastValueCache* stats_aggregator,
+                       uint64_t period_ms);
+
+  /// Destructor.
+  virtual ~ThreadLocalStatistic();
+
+  /// Merge the slots and publish the result, starting a new period.
+  void publish();
+
+protected:
+  /// The slot the calling thread should update.
+  static size_t slot_index();
+
+  /// Start publishing the statistic at the end of each period.  Subclasses
+  /// must call this at the end of their constructor (once merge can be
+  /// called).
+  void start_publishing();
+
+  /// Stop publishing the statistic.  Subclasses must call this at the start
+  /// of their destructor (while merge can still be called).
+  void stop_publishing();
+
+  /// Merge the slots (resetting them for the next period) and build the
+  /// values to publish.
+  virtual void merge(std::vector<std::string>& values) = 0;
+
+  /// Allocate an array of NUM_SLOTS slots, aligned to a cache line.  The
+  /// memory is zeroed, and must be freed with free().
+  static void* alloc_slots(size_t slot_size);
+
+private:
+  ThreadLocalStatistic(const ThreadLocalStatistic&);
+  ThreadLocalStatistic& operator=(const ThreadLocalStatistic&);
+
+  friend class ThreadLocalStatsPublisher;
+
+  Statistic* _statistic;
+  const uint64_t _period_ms;
+
+  // When the statistic is next due to be published.  This is only used by
+  // the publisher thread.
+  uint64_t _next_publish_ms;
+};
+
+
+/// Counter statistic.  Publishes the number of increments in each period.
+class ThreadLocalCounter : public ThreadLocalStatistic
+{
+public:
+  ThreadLocalCounter(const std::string& statname,
+                     LastValueCache* stats_aggregator,
+                     uint64_t period_ms = 5000);
+  virtual ~ThreadLocalCounter();
+
+  /// Add to the counter.
+  void increment(uint64_t count = 1)
+  {
+    Slot& slot = _slots[slot_index()];
+    slot.count.fetch_add(count, std::memory_order_relaxed);
+    slot.total.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  /// The total of all increments since the counter was created.
+  uint64_t total() const;
+
+protected:
+  void merge(std::vector<std::string>& values);
+
+private:
+  // Each slot fills a cache line, so that threads don't falsely share them.
+  struct alignas(64) Slot
+  {
+    // The count in this period, and since the counter was created.
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total;
+  };
+
+  Slot* _slots;
+};
+
+
+/// Accumulator statistic.  Publishes the mean, variance, low and high water
+/// marks and number of samples in each period (in the same form as the
+/// StatisticAccumulator).
+class ThreadLocalAccumulator : public ThreadLocalStatistic
+{
+public:
+  ThreadLocalAccumulator(const std::string& statname,
+                         LastValueCache* stats_aggregator,
+                         uint64_t period_ms = 5000);
+  virtual ~ThreadLocalAccumulator();
+
+  /// Add a sample.
+  void accumulate(uint64_t sample)
+  {
+    Slot& slot = _slots[slot_index()];
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    slot.sum.fetch_add(sample, std::memory_order_relaxed);
+    slot.sum_squares.fetch_add(sample * sample, std::memory_order_relaxed);
+
+    // The slot is usually only updated by this thread, so these loops rarely
+    // go round more than once.
+    uint64_t lwm = slot.lwm.load(std::memory_order_relaxed);
+    while ((sample < lwm) &&
+           (!slot.lwm.compare_exchange_weak(lwm, sample, std::memory_order_relaxed)))
+    {
+    }
+
+    uint64_t hwm = slot.hwm.load(std::memory_order_relaxed);
+    while ((sample > hwm) &&
+           (!slot.hwm.compare_exchange_weak(hwm, sample, std::memory_order_relaxed)))
+    {
+    }
+  }
+
+protected:
+  void merge(std::vector<std::string>& values);
+
+private:
+  struct alignas(64) Slot
+  {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> sum_squares;
+    std::atomic<uint64_t> lwm;
+    std::atomic<uint64_t> hwm;
+  };
+
+  Slot* _slots;
+};
+
+
+/// Histogram statistic, for distributions with long tails.  Samples are
+/// counted in log-scaled buckets (four per power of two, so each bucket is
+/// at most 25% wide), and the 50th, 90th, 99th and 99.9th percentiles, the
+/// maximum and the number of samples in each period are published.
+///
+/// A percentile is reported as the upper bound of the bucket it falls in
+/// (capped at the maximum), so it may overstate the true value by up to 25%.
+/// Samples above 2^40 are counted in the top bucket.
+class ThreadLocalHistogram : public ThreadLocalStatistic
+{
+public:
+  ThreadLocalHistogram(const std::string& statname,
+                       LastValueCache* stats_aggregator,
+                       uint64_t period_ms = 5000);
+  virtual ~ThreadLocalHistogram();
+
+  /// Add a sample.
+  void record(uint64_t sample)
+  {
+    Slot& slot = _slots[slot_index()];
+    slot.buckets[bucket_index(sample)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t hwm = slot.hwm.load(std::memory_order_relaxed);
+    while ((sample > hwm) &&
+           (!slot.hwm.compare_exchange_weak(hwm, sample, std::memory_order_relaxed)))
+    {
+    }
+  }
+
+  /// The number of buckets.
+  static const size_t NUM_BUCKETS = 160;
+
+  /// The bucket a sample is counted in.
+  static size_t bucket_index(uint64_t sample)
+  {
+    if (sample < 4)
+    {
+      return sample;
+    }
+
+    // The bucket is given by the position of the top bit and the two bits
+    // below it.
+    size_t top_bit = 63 - __builtin_clzll(sample);
+    size_t index = ((top_bit - 1) * 4) + ((sample >> (top_bit - 2)) & 3);
+    return (index < NUM_BUCKETS) ? index : NUM_BUCKETS - 1;
+  }
+
+  /// The largest sample counted in a bucket.
+  static uint64_t bucket_upper_bound(size_t index);
+
+protected:
+  void merge(std::vector<std::string>& values);
+
+private:
+  struct alignas(64) Slot
+  {
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> hwm;
+  };
+
+  Slot* _slots;
+};
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ * @file trace_replayer.h Replays operation traces against a call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TRACE_REPLAYER_H_
+#define TRACE_REPLAYER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "call_list_store.h"
+#include "op_trace.h"
+
+namespace CallListStore
+{
+
+/// Replays an operation trace (captured with Store::configure_op_trace)
+/// against a store, and measures the throughput and latency.  This is for
+/// benchmarking a store (typically one using a MemoryBackend or a test
+/// cluster) with a real mix of operations and row sizes.
+///
+/// Traces don't hold IMPUs or call fragments, so each traced IMPU is replaced
+/// by a made-up one, and fragments by made-up fragments of the traced size.
+/// Trims delete the oldest fragments that the replay has written to the
+/// IMPU, made up to the traced number with fragments that don't exist.
+///
+/// Operations are spread over a number of threads by IMPU, so the operations
+/// on each IMPU are replayed in the same order every time.  When replaying
+/// at a fixed speed, latencies are measured from when each operation should
+/// have started, so a store that can't keep up shows high latencies rather
+/// than a slower replay.
+class TraceReplayer
+{
+public:
+  /// Configuration.
+  struct Config
+  {
+    Config() :
+      speed(1.0),
+      num_threads(8),
+      ttl(3600)
+    {}
+
+    /// How fast to replay the trace: 1.0 for the rate it was captured at,
+    /// N for N times faster, or 0 for as fast as possible.
+    double speed;
+
+    /// The number of threads to replay operations on.
+    size_t num_threads;
+
+    /// The TTL (in seconds) to write fragments with.
+    int32_t ttl;
+  };
+
+  /// The latency distribution of one type of operation.
+  struct LatencySummary
+  {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    uint64_t max_us;
+  };
+
+  /// The results of a replay.
+  struct Results
+  {
+    uint64_t num_ops;
+    uint64_t num_errors;
+    uint64_t elapsed_us;
+    double ops_per_sec;
+    LatencySummary latency[OpTraceRecord::NUM_TYPES];
+
+    /// A human-readable report of the results.
+    std::string to_string() const;
+  };
+
+  /// Constructor.
+  ///
+  /// @param store            - The store to replay against.
+  /// @param config           - The configuration.
+  TraceReplayer(Store* store, const Config& config);
+  virtual ~TraceReplayer();
+
+  /// Read the whole of a trace, ready to replay it.
+  ///
+  /// @param reader           - The (open) trace.
+  /// @return                 - Whether the trace was read successfully.
+  bool load(OpTraceReader* reader);
+
+  /// Add an operation to replay (as an alternative to loading a trace).
+  void add(const OpTraceRecord& record);
+
+  /// The number of operations to replay.
+  size_t num_records() const { return _records.size(); }
+
+  /// Replay the operations.  This can be called more than once, to replay
+  /// the same operations again.
+  ///
+  /// @param results          - (out) The results of the replay.
+  void run(Results& results);
+
+  /// Summarise a set of latencies.
+  ///
+  /// @param latencies        - The latencies (in microseconds).  These are
+  ///                           sorted by this call.
+  /// @param summary          - (out) The summary.  The error count is not
+  ///                           set.
+  static void summarize(std::vector<uint64_t>& latencies,
+                        LatencySummary& summary);
+
+private:
+  TraceReplayer(const TraceReplayer&);
+  TraceReplayer& operator=(const TraceReplayer&);
+
+  class Worker;
+
+  Store* _store;
+  const Config _config;
+  std::vector<OpTraceRecord> _records;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,206 @@
+/**
+ * @file trim_scheduler.h Paced background trimming of call lists.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TRIM_SCHEDULER_H_
+#define TRIM_SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cassandra_store.h"
+#include "sas.h"
+#include "statistic.h"
+#include "thread_local_stats.h"
+#include "zmq_lvc.h"
+
+namespace CallListStore
+{
+
+struct CallFragment;
+
+/// Trims call lists in the background, so that trimming doesn't add to the
+/// latency of requests.
+///
+/// IMPUs are recorded as they are written to, and each is due to be trimmed
+/// a fixed delay after the first write since it was last trimmed.  Due IMPUs
+/// are trimmed in the order they became due, at a rate limited by a token
+/// bucket.  The rate is scaled down while cassandra latency (as reported by
+/// record_latency) is above a target, so trimming backs off when cassandra is
+/// busy with live traffic.
+///
+/// Trimming an IMPU reads its call list and deletes all but the newest
+/// calls.
+///
+/// This class is thread-safe.
+class TrimScheduler
+{
+public:
+  /// Interface for reading and deleting fragments in the store.
+  class Trimmer
+  {
+  public:
+    virtual ~Trimmer() {}
+
+    /// Read an IMPU's call fragments, oldest first.
+    virtual CassandraStore::ResultCode
+      get_fragments(const std::string& impu,
+                    std::vector<CallFragment>& fragments,
+                    SAS::TrailId trail) = 0;
+
+    /// Delete some of an IMPU's call fragments.
+    virtual CassandraStore::ResultCode
+      delete_fragments(const std::string& impu,
+                       const std::vector<CallFragment>& fragments,
+                       SAS::TrailId trail) = 0;
+  };
+
+  /// Configuration.
+  struct Config
+  {
+    Config() :
+      max_calls(20),
+      delay_ms(60000),
+      trims_per_sec(50.0),
+      burst(10.0),
+      target_latency_us(20000),
+      max_backlog(100000)
+    {}
+
+    /// The number of calls to keep in each call list.
+    size_t max_calls;
+
+    /// How long after an IMPU is written to it is trimmed.  Writes in this
+    /// time share one trim.
+    uint64_t delay_ms;
+
+    /// The maximum rate of trims, and the number that can be made in a burst
+    /// after a quiet period.
+    double trims_per_sec;
+    double burst;
+
+    /// While the average cassandra latency is above this, the trim rate is
+    /// reduced in proportion.
+    uint64_t target_latency_us;
+
+    /// The maximum number of IMPUs waiting to be trimmed.  Writes to other
+    /// IMPUs while the backlog is full don't schedule a trim.
+    size_t max_backlog;
+  };
+
+  /// Constructor.
+  ///
+  /// @param config           - The configuration.
+  /// @param trimmer          - Used to read and delete fragments.  The
+  ///                           scheduler takes ownership of this.
+  /// @param stats_aggregator - The LVC to publish statistics to (may be
+  ///                           NULL).
+  TrimScheduler(const Config& config,
+                Trimmer* trimmer,
+                LastValueCache* stats_aggregator);
+
+  /// Destructor.  Stops the trimming thread if it is running.
+  virtual ~TrimScheduler();
+
+  /// Start trimming on a background thread.
+  void start();
+
+  /// Tell the background thread to stop.  IMPUs waiting to be trimmed stay
+  /// queued, and are trimmed if the scheduler is started again.
+  void stop();
+
+  /// Wait for the background thread to exit after stop.
+  void wait_stopped();
+
+  /// Record that an IMPU has been written to.
+  ///
+  /// @param impu             - The IMPU.
+  /// @param now_ms           - The current monotonic time (ms).
+  void record_write(const std::string& impu, uint64_t now_ms);
+  void record_write(const std::string& impu);
+
+  /// Record the latency of a cassandra operation.
+  ///
+  /// @param latency_us       - The latency in microseconds.
+  void record_latency(uint64_t latency_us);
+
+  /// Trim the next due IMPU, if there is one and the rate limit allows.
+  /// This is normally called by the background thread.
+  ///
+  /// @param now_ms           - The current monotonic time (ms).
+  /// @param wait_ms          - (out) If nothing was trimmed, how long until
+  ///                           something might be (or 0 if nothing is
+  ///                           waiting).
+  /// @return                 - Whether an IMPU was trimmed.
+  bool trim_next(uint64_t now_ms, uint64_t& wait_ms);
+
+  /// The number of IMPUs waiting to be trimmed.
+  size_t backlog();
+
+  /// The current trim rate (per second), after scaling for latency.
+  double current_rate();
+
+  /// Work out which fragments to delete to leave the newest calls.
+  ///
+  /// @param fragments        - The call list, oldest first.
+  /// @param max_calls        - The number of calls to keep.
+  /// @param old_fragments    - (out) The fragments to delete.
+  static void select_old_fragments(const std::vector<CallFragment>& fragments,
+                                   size_t max_calls,
+                                   std::vector<CallFragment>& old_fragments);
+
+private:
+  TrimScheduler(const TrimScheduler&);
+  TrimScheduler& operator=(const TrimScheduler&);
+
+  static void* thread_entry_point(void* scheduler);
+  void thread_main();
+
+  void trim(const std::string& impu);
+  void publish_backlog(uint64_t now_ms);
+
+  // Methods that are called with the lock held.
+  void refill_tokens(uint64_t now_ms);
+
+  const Config _config;
+  Trimmer* _trimmer;
+
+  // The IMPUs waiting to be trimmed, by IMPU and in the order they are due.
+  std::unordered_map<std::string, uint64_t> _due;
+  std::set<std::pair<uint64_t, std::string> > _queue;
+
+  // Token bucket.
+  double _tokens;
+  uint64_t _last_refill_ms;
+
+  // Moving average of cassandra latency.
+  std::atomic<uint64_t> _latency_us;
+
+  Statistic* _backlog_stat;
+  uint64_t _next_publish_ms;
+  ThreadLocalCounter* _trims;
+  ThreadLocalCounter* _writes_not_scheduled;
+
+  bool _running;
+  bool _terminating;
+  pthread_t _thread;
+  pthread_cond_t _cond;
+  pthread_mutex_t _lock;
+};
+
+} // namespace CallListStore
+
+#endif
@@ -0,0 +1,674 @@
+/**
+ * @file call_list_archive.cpp Compact columnar file format for call fragments.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "call_list_archive.h"
+#include "log.h"
+
+// The layout of an archive file is:
+//
+//   Header:  "CLAR" <version:u32>
+//   Blocks:  <block>*
+//   Index:   <block offset:u64>*
+//   Trailer: <index offset:u64> <num blocks:u64> <num records:u64> "CLAE"
+//
+// Each block is:
+//
+//   "CLBK" <num records:u32> <num columns:u32>
+//   (<raw length:u32> <compressed length:u32>) for each column
+//   <zlib compressed column data> for each column
+//
+// All integers are little-endian.  Within a column, strings are stored as a
+// varint length followed by the bytes of the string.  The columns are:
+//
+// -  IMPU: run-length encoded as (<varint run length> <string>) pairs.
+// -  Timestamp, ID and contents: one string per record.
+// -  Type: one byte per record.
+// -  Cassandra timestamp: zig-zag varint delta from the previous record.
+// -  TTL: zig-zag varint.
+
+const static uint32_t FILE_MAGIC = 0x52414c43;    // "CLAR"
+const static uint32_t BLOCK_MAGIC = 0x4b424c43;   // "CLBK"
+const static uint32_t TRAILER_MAGIC = 0x45414c43; // "CLAE"
+const static uint32_t FILE_VERSION = 1;
+
+const static size_t HEADER_SIZE = 8;
+const static size_t TRAILER_SIZE = 28;
+const static size_t BLOCK_HEADER_SIZE = 12;
+
+// The columns in each block.
+enum ArchiveColumn
+{
+  COL_IMPU = 0,
+  COL_TIMESTAMP,
+  COL_ID,
+  COL_TYPE,
+  COL_CONTENTS,
+  COL_CASS_TIMESTAMP,
+  COL_TTL
+};
+
+const static int NUM_COLUMNS = COL_TTL + 1;
+
+namespace CallListStore
+{
+
+//
+// Encoding utility methods.
+//
+
+static void put_u32(std::string& out, uint32_t value)
+{
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static void put_u64(std::string& out, uint64_t value)
+{
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static uint32_t get_u32(const char* data)
+{
+  uint32_t value = 0;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    value |= ((uint32_t)(uint8_t)data[ii]) << (8 * ii);
+  }
+  return value;
+}
+
+static uint64_t get_u64(const char* data)
+{
+  uint64_t value = 0;
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    value |= ((uint64_t)(uint8_t)data[ii]) << (8 * ii);
+  }
+  return value;
+}
+
+static void put_varint(std::string& out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out.push_back((char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back((char)value);
+}
+
+static bool get_varint(const std::string& in, size_t& pos, uint64_t& value)
+{
+  value = 0;
+
+  for (int shift = 0; (shift < 64) && (pos < in.length()); shift += 7)
+  {
+    uint8_t byte = (uint8_t)in[pos++];
+    value |= ((uint64_t)(byte & 0x7f)) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void put_string(std::string& out, const std::string& str)
+{
+  put_varint(out, str.length());
+  out.append(str);
+}
+
+static bool get_string(const std::string& in, size_t& pos, std::string& str)
+{
+  uint64_t length;
+
+  if ((!get_varint(in, pos, length)) || (length > in.length() - pos))
+  {
+    return false;
+  }
+
+  str.assign(in, pos, length);
+  pos += length;
+  return true;
+}
+
+static uint64_t zigzag_encode(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+//
+// ArchiveWriter methods.
+//
+
+ArchiveWriter::ArchiveWriter() :
+  _file(NULL),
+  _block_records(0),
+  _failed(false),
+  _block_count(0),
+  _run_length(0),
+  _prev_cass_timestamp(0),
+  _num_records(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+  if (_file != NULL)
+  {
+    close();
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ArchiveWriter::open(const std::string& path, size_t block_records)
+{
+  _file = fopen(path.c_str(), "wb");
+
+  if (_file == NULL)
+  {
+    TRC_ERROR("Failed to create call list archive %s: %s",
+              path.c_str(), strerror(errno));
+    return false;
+  }
+
+  _block_records = (block_records > 0) ? block_records : 1;
+  _failed = false;
+  _num_records = 0;
+  _block_offsets.clear();
+
+  std::string header;
+  put_u32(header, FILE_MAGIC);
+  put_u32(header, FILE_VERSION);
+
+  if (fwrite(header.data(), 1, header.length(), _file) != header.length())
+  {
+    _failed = true;
+  }
+
+  return !_failed;
+}
+
+bool ArchiveWriter::write(const std::vector<ArchiveRecord>& records)
+{
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<ArchiveRecord>::const_iterator it = records.begin();
+       (it != records.end()) && (!_failed);
+       ++it)
+  {
+    add_record(*it);
+  }
+
+  bool success = !_failed;
+  pthread_mutex_unlock(&_lock);
+
+  return success;
+}
+
+bool ArchiveWriter::write(const ArchiveRecord& record)
+{
+  pthread_mutex_lock(&_lock);
+  bool success = add_record(record);
+  pthread_mutex_unlock(&_lock);
+
+  return success;
+}
+
+bool ArchiveWriter::add_record(const ArchiveRecord& record)
+{
+  if ((_file == NULL) || (_failed))
+  {
+    return false;
+  }
+
+  if ((_run_length > 0) && (record.impu != _run_impu))
+  {
+    put_varint(_impu_col, _run_length);
+    put_string(_impu_col, _run_impu);
+    _run_length = 0;
+  }
+
+  if (_run_length == 0)
+  {
+    _run_impu = record.impu;
+  }
+
+  _run_length++;
+
+  put_string(_timestamp_col, record.fragment.timestamp);
+  put_string(_id_col, record.fragment.id);
+  _type_col.push_back((char)record.fragment.type);
+  put_string(_contents_col, record.fragment.contents);
+  put_varint(_cass_timestamp_col,
+             zigzag_encode(record.cass_timestamp - _prev_cass_timestamp));
+  put_varint(_ttl_col, zigzag_encode(record.ttl));
+  _prev_cass_timestamp = record.cass_timestamp;
+
+  _num_records++;
+  _block_count++;
+
+  if (_block_count >= _block_records)
+  {
+    flush_block();
+  }
+
+  return !_failed;
+}
+
+bool ArchiveWriter::flush_block()
+{
+  if (_block_count == 0)
+  {
+    return !_failed;
+  }
+
+  if (_run_length > 0)
+  {
+    put_varint(_impu_col, _run_length);
+    put_string(_impu_col, _run_impu);
+    _run_length = 0;
+  }
+
+  std::string* columns[NUM_COLUMNS] = { &_impu_col,
+                                        &_timestamp_col,
+                                        &_id_col,
+                                        &_type_col,
+                                        &_contents_col,
+                                        &_cass_timestamp_col,
+                                        &_ttl_col };
+
+  std::string header;
+  put_u32(header, BLOCK_MAGIC);
+  put_u32(header, _block_count);
+  put_u32(header, NUM_COLUMNS);
+
+  std::string payload;
+
+  for (int col = 0; col < NUM_COLUMNS; ++col)
+  {
+    // Compress for speed rather than size - the columns are already laid out
+    // to compress well, and exports should run at disk speed.
+    uLongf compressed_length = compressBound(columns[col]->length());
+    size_t payload_start = payload.length();
+    payload.resize(payload_start + compressed_length);
+
+    int rc = compress2((Bytef*)&payload[payload_start],
+                       &compressed_length,
+                       (const Bytef*)columns[col]->data(),
+                       columns[col]->length(),
+                       Z_BEST_SPEED);
+
+    if (rc != Z_OK)
+    {
+      // LCOV_EXCL_START - only fails if out of memory.
+      TRC_ERROR("Failed to compress call list archive block (%d)", rc);
+      _failed = true;
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    payload.resize(payload_start + compressed_length);
+    put_u32(header, columns[col]->length());
+    put_u32(header, compressed_length);
+    columns[col]->clear();
+  }
+
+  _block_offsets.push_back(ftello(_file));
+
+  if ((fwrite(header.data(), 1, header.length(), _file) != header.length()) ||
+      (fwrite(payload.data(), 1, payload.length(), _file) != payload.length()))
+  {
+    TRC_ERROR("Failed to write call list archive block: %s", strerror(errno));
+    _failed = true;
+  }
+
+  _block_count = 0;
+  _prev_cass_timestamp = 0;
+
+  return !_failed;
+}
+
+bool ArchiveWriter::close()
+{
+  pthread_mutex_lock(&_lock);
+
+  bool success = false;
+
+  if (_file != NULL)
+  {
+    flush_block();
+
+    std::string trailer;
+    uint64_t index_offset = ftello(_file);
+
+    for (std::vector<uint64_t>::const_iterator it = _block_offsets.begin();
+         it != _block_offsets.end();
+         ++it)
+    {
+      put_u64(trailer, *it);
+    }
+
+    put_u64(trailer, index_offset);
+    put_u64(trailer, _block_offsets.size());
+    put_u64(trailer, _num_records);
+    put_u32(trailer, TRAILER_MAGIC);
+
+    if (fwrite(trailer.data(), 1, trailer.length(), _file) != trailer.length())
+    {
+      _failed = true;
+    }
+
+    if (fclose(_file) != 0)
+    {
+      _failed = true;
+    }
+
+    _file = NULL;
+    success = !_failed;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return success;
+}
+
+//
+// ArchiveReader methods.
+//
+
+ArchiveReader::ArchiveReader() :
+  _file(NULL),
+  _map(NULL),
+  _map_length(0),
+  _failed(false),
+  _num_records(0),
+  _index_offset(0),
+  _next_block(0),
+  _block_remaining(0),
+  _run_remaining(0),
+  _prev_cass_timestamp(0)
+{}
+
+ArchiveReader::~ArchiveReader()
+{
+  close();
+}
+
+bool ArchiveReader::open(const std::string& path, bool use_mmap)
+{
+  close();
+  _failed = true;
+
+  _file = fopen(path.c_str(), "rb");
+
+  if (_file == NULL)
+  {
+    TRC_ERROR("Failed to open call list archive %s: %s",
+              path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat file_stat;
+  if ((fstat(fileno(_file), &file_stat) != 0) ||
+      ((size_t)file_stat.st_size < HEADER_SIZE + TRAILER_SIZE))
+  {
+    TRC_ERROR("Call list archive %s is too short", path.c_str());
+    return false;
+  }
+
+  uint64_t file_length = file_stat.st_size;
+
+  if (use_mmap)
+  {
+    void* map = mmap(NULL, file_length, PROT_READ, MAP_PRIVATE, fileno(_file), 0);
+
+    if (map == MAP_FAILED)
+    {
+      TRC_ERROR("Failed to map call list archive %s: %s",
+                path.c_str(), strerror(errno));
+      return false;
+    }
+
+    _map = (const char*)map;
+    _map_length = file_length;
+  }
+
+  std::string buffer;
+  const char* data;
+
+  if ((!read_bytes(0, HEADER_SIZE, buffer, data)) ||
+      (get_u32(data) != FILE_MAGIC) ||
+      (get_u32(data + 4) != FILE_VERSION))
+  {
+    TRC_ERROR("%s is not a call list archive", path.c_str());
+    return false;
+  }
+
+  if ((!read_bytes(file_length - TRAILER_SIZE, TRAILER_SIZE, buffer, data)) ||
+      (get_u32(data + 24) != TRAILER_MAGIC))
+  {
+    TRC_ERROR("Call list archive %s is incomplete", path.c_str());
+    return false;
+  }
+
+  _index_offset = get_u64(data);
+  uint64_t num_blocks = get_u64(data + 8);
+  _num_records = get_u64(data + 16);
+
+  if ((_index_offset > file_length - TRAILER_SIZE) ||
+      (num_blocks != (file_length - TRAILER_SIZE - _index_offset) / 8) ||
+      (!read_bytes(_index_offset, num_blocks * 8, buffer, data)))
+  {
+    TRC_ERROR("Call list archive %s has a corrupt index", path.c_str());
+    return false;
+  }
+
+  for (uint64_t ii = 0; ii < num_blocks; ++ii)
+  {
+    _block_offsets.push_back(get_u64(data + (ii * 8)));
+  }
+
+  _failed = false;
+  return true;
+}
+
+bool ArchiveReader::read_bytes(uint64_t offset,
+                               size_t length,
+                               std::string& buffer,
+                               const char*& data)
+{
+  if (_map != NULL)
+  {
+    if ((offset > _map_length) || (length > _map_length - offset))
+    {
+      return false;
+    }
+
+    data = _map + offset;
+    return true;
+  }
+
+  buffer.resize(length);
+
+  if ((fseeko(_file, offset, SEEK_SET) != 0) ||
+      (fread(&buffer[0], 1, length, _file) != length))
+  {
+    return false;
+  }
+
+  data = buffer.data();
+  return true;
+}
+
+bool ArchiveReader::load_block(size_t index)
+{
+  uint64_t offset = _block_offsets[index];
+  const char* data;
+
+  if ((!read_bytes(offset, BLOCK_HEADER_SIZE, _read_buffer, data)) ||
+      (get_u32(data) != BLOCK_MAGIC) ||
+      (get_u32(data + 8) != NUM_COLUMNS))
+  {
+    return false;
+  }
+
+  _block_remaining = get_u32(data + 4);
+  offset += BLOCK_HEADER_SIZE;
+
+  if (!read_bytes(offset, NUM_COLUMNS * 8, _read_buffer, data))
+  {
+    return false;
+  }
+
+  uint32_t raw_lengths[NUM_COLUMNS];
+  uint32_t compressed_lengths[NUM_COLUMNS];
+
+  for (int col = 0; col < NUM_COLUMNS; ++col)
+  {
+    raw_lengths[col] = get_u32(data + (col * 8));
+    compressed_lengths[col] = get_u32(data + (col * 8) + 4);
+  }
+
+  offset += NUM_COLUMNS * 8;
+
+  for (int col = 0; col < NUM_COLUMNS; ++col)
+  {
+    if ((offset + compressed_lengths[col] > _index_offset) ||
+        (!read_bytes(offset, compressed_lengths[col], _read_buffer, data)))
+    {
+      return false;
+    }
+
+    _columns[col].resize(raw_lengths[col]);
+    uLongf raw_length = raw_lengths[col];
+    int rc = uncompress((Bytef*)&_columns[col][0],
+                        &raw_length,
+                        (const Bytef*)data,
+                        compressed_lengths[col]);
+
+    if ((rc != Z_OK) || (raw_length != raw_lengths[col]))
+    {
+      TRC_ERROR("Failed to decompress call list archive block (%d)", rc);
+      return false;
+    }
+
+    _positions[col] = 0;
+    offset += compressed_lengths[col];
+  }
+
+  _run_remaining = 0;
+  _prev_cass_timestamp = 0;
+  return true;
+}
+
+bool ArchiveReader::read(ArchiveRecord& record)
+{
+  if (_failed)
+  {
+    return false;
+  }
+
+  while (_block_remaining == 0)
+  {
+    if (_next_block >= _block_offsets.size())
+    {
+      return false;
+    }
+
+    if (!load_block(_next_block++))
+    {
+      _failed = true;
+      return false;
+    }
+  }
+
+  if (_run_remaining == 0)
+  {
+    if ((!get_varint(_columns[COL_IMPU], _positions[COL_IMPU], _run_remaining)) ||
+        (!get_string(_columns[COL_IMPU], _positions[COL_IMPU], _run_impu)) ||
+        (_run_remaining == 0))
+    {
+      _failed = true;
+      return false;
+    }
+  }
+
+  uint64_t cass_timestamp_delta;
+  uint64_t ttl;
+
+  if ((!get_string(_columns[COL_TIMESTAMP], _positions[COL_TIMESTAMP], record.fragment.timestamp)) ||
+      (!get_string(_columns[COL_ID], _positions[COL_ID], record.fragment.id)) ||
+      (_positions[COL_TYPE] >= _columns[COL_TYPE].length()) ||
+      ((uint8_t)_columns[COL_TYPE][_positions[COL_TYPE]] > CallFragment::REJECTED) ||
+      (!get_string(_columns[COL_CONTENTS], _positions[COL_CONTENTS], record.fragment.contents)) ||
+      (!get_varint(_columns[COL_CASS_TIMESTAMP], _positions[COL_CASS_TIMESTAMP], cass_timestamp_delta)) ||
+      (!get_varint(_columns[COL_TTL], _positions[COL_TTL], ttl)))
+  {
+    _failed = true;
+    return false;
+  }
+
+  record.impu = _run_impu;
+  record.fragment.type =
+    (CallFragment::Type)(uint8_t)_columns[COL_TYPE][_positions[COL_TYPE]++];
+  _prev_cass_timestamp += zigzag_decode(cass_timestamp_delta);
+  record.cass_timestamp = _prev_cass_timestamp;
+  record.ttl = (int32_t)zigzag_decode(ttl);
+
+  _run_remaining--;
+  _block_remaining--;
+  return true;
+}
+
+void ArchiveReader::close()
+{
+  if (_map != NULL)
+  {
+    munmap((void*)_map, _map_length);
+    _map = NULL;
+    _map_length = 0;
+  }
+
+  if (_file != NULL)
+  {
+    fclose(_file);
+    _file = NULL;
+  }
+
+  _block_offsets.clear();
+  _num_records = 0;
+  _next_block = 0;
+  _block_remaining = 0;
+}
+
+} // namespace CallListStore
@@ -0,0 +1,165 @@
+/**
+ * @file call_list_backend.cpp Thrift storage backend for the call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "call_list_backend.h"
+#include "log.h"
+
+namespace CallListStore
+{
+
+namespace cass = org::apache::cassandra;
+
+// The type of the map of mutations passed to batch_mutate. This is keyed on
+// row key and then on column family.
+typedef std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > > mutmap_t;
+
+// Utility method for building a mutation that writes a single column.
+//
+// @param name            - The name of the column.
+// @param value           - The value of the column.
+// @param timestamp       - The timestamp to use on the cassandra write.
+// @param ttl             - The TTL of the column (or 0 for no TTL).
+static cass::Mutation column_write_mutation(const std::string& name,
+                                            const std::string& value,
+                                            const int64_t timestamp,
+                                            const int32_t ttl)
+{
+  cass::Column column;
+  column.__set_name(name);
+  column.__set_value(value);
+  column.__set_timestamp(timestamp);
+
+  if (ttl > 0)
+  {
+    column.__set_ttl(ttl);
+  }
+
+  cass::ColumnOrSuperColumn cosc;
+  cosc.__set_column(column);
+
+  cass::Mutation mutation;
+  mutation.__set_column_or_supercolumn(cosc);
+  return mutation;
+}
+
+// Utility method for building a mutation that deletes some columns from a row.
+//
+// @param names           - The names of the columns to delete.
+// @param timestamp       - The timestamp to use on the cassandra write.
+static cass::Mutation column_delete_mutation(const std::vector<std::string>& names,
+                                             const int64_t timestamp)
+{
+  cass::SlicePredicate predicate;
+  predicate.__set_column_names(names);
+
+  cass::Deletion deletion;
+  deletion.__set_predicate(predicate);
+  deletion.__set_timestamp(timestamp);
+
+  cass::Mutation mutation;
+  mutation.__set_deletion(deletion);
+  return mutation;
+}
+
+ThriftBackend::ThriftBackend(CassandraStore::Client* client,
+                             const std::string& column_family) :
+  _client(client),
+  _column_family(column_family)
+{}
+
+ThriftBackend::~ThriftBackend()
+{}
+
+void ThriftBackend::write_columns(const RowWrites& rows,
+                                  cass::ConsistencyLevel::type level)
+{
+  mutmap_t mutations;
+
+  for (RowWrites::const_iterator row = rows.begin(); row != rows.end(); ++row)
+  {
+    std::vector<cass::Mutation>& row_mutations = mutations[row->first][_column_family];
+
+    for (std::vector<CallColumn>::const_iterator column = row->second.begin();
+         column != row->second.end();
+         ++column)
+    {
+      row_mutations.push_back(column_write_mutation(column->name,
+                                                    column->value,
+                                                    column->timestamp,
+                                                    column->ttl));
+    }
+  }
+
+  _client->batch_mutate(mutations, level);
+}
+
+void ThriftBackend::delete_columns(const std::string& key,
+                                   const std::vector<std::string>& names,
+                                   int64_t timestamp,
+                                   const std::vector<CallColumn>& columns,
+                                   cass::ConsistencyLevel::type level)
+{
+  // Delete all the columns in a single mutation on the row.
+  mutmap_t mutations;
+  std::vector<cass::Mutation>& row_mutations = mutations[key][_column_family];
+  row_mutations.push_back(column_delete_mutation(names, timestamp));
+
+  for (std::vector<CallColumn>::const_iterator column = columns.begin();
+       column != columns.end();
+       ++column)
+  {
+    row_mutations.push_back(column_write_mutation(column->name,
+                                                  column->value,
+                                                  column->timestamp,
+                                                  column->ttl));
+  }
+
+  _client->batch_mutate(mutations, level);
+}
+
+void ThriftBackend::get_columns(const std::string& key,
+                                const std::string& start,
+                                const std::string& finish,
+                                int32_t max_columns,
+                                std::vector<CallColumn>& columns,
+                                cass::ConsistencyLevel::type level)
+{
+  cass::SliceRange range;
+  range.__set_start(start);
+  range.__set_finish(finish);
+  range.__set_count(max_columns);
+
+  cass::SlicePredicate predicate;
+  predicate.__set_slice_range(range);
+
+  cass::ColumnParent parent;
+  parent.__set_column_family(_column_family);
+
+  std::vector<cass::ColumnOrSuperColumn> results;
+  _client->get_slice(results, key, parent, predicate, level);
+
+  columns.clear();
+  columns.reserve(results.size());
+
+  for (std::vector<cass::ColumnOrSuperColumn>::iterator it = results.begin();
+       it != results.end();
+       ++it)
+  {
+    columns.push_back(CallColumn());
+    CallColumn& column = columns.back();
+    column.name.swap(it->column.name);
+    column.value.swap(it->column.value);
+    column.timestamp = it->column.timestamp;
+    column.ttl = it->column.__isset.ttl ? it->column.ttl : 0;
+  }
+}
+
+} // namespace CallListStore
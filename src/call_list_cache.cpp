@@ -0,0 +1,852 @@
+/**
+ * @file call_list_cache.cpp Cache of recently read call lists, with snapshots.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "call_list_cache.h"
+#include "fnv_hash.h"
+#include "log.h"
+
+// The layout of a snapshot file is:
+//
+//   Header:  "CLSN" <version:u32> <num entries:u64> <index offset:u64>
+//   Entries: <entry>*
+//   Index:   <entry offset:u64>*
+//
+// Each entry is:
+//
+//   <fetch time:u64> <IMPU length:u32> <IMPU> <num fragments:u32>
+//   (<type:u8> <length:u32> <timestamp> <length:u32> <id>
+//    <length:u32> <contents>) for each fragment
+//
+// All integers are little-endian.  The header is written last, so a snapshot
+// that wasn't completed has no valid header.
+
+const static uint32_t SNAPSHOT_MAGIC = 0x4e534c43; // "CLSN"
+const static uint32_t SNAPSHOT_VERSION = 1;
+const static size_t SNAPSHOT_HEADER_SIZE = 24;
+
+// The number of invalidation generations shared between the IMPUs.
+const static size_t NUM_GENERATIONS = 4096;
+
+// The most IMPUs that can be waiting to be revalidated.  Stale entries read
+// while the queue is full are still returned, and are queued when next read.
+const static size_t MAX_QUEUED_REVALIDATIONS = 1000;
+
+// Utility method for getting the current time in ms since the epoch.  Entries
+// are timestamped with the wall clock rather than the monotonic clock, so
+// that their age is still known after they've been loaded from a snapshot by
+// a restarted process.
+static uint64_t realtime_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+namespace CallListStore
+{
+
+//
+// Encoding utility methods.
+//
+
+static void put_u32(std::string& out, uint32_t value)
+{
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static void put_u64(std::string& out, uint64_t value)
+{
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static void put_string(std::string& out, const std::string& str)
+{
+  put_u32(out, str.length());
+  out.append(str);
+}
+
+// Bounds-checked reader of a mapped snapshot.
+class SnapshotReader
+{
+public:
+  SnapshotReader(const char* data, size_t length, size_t pos) :
+    _data(data),
+    _length(length),
+    _pos(pos)
+  {}
+
+  bool u8(uint8_t& value)
+  {
+    if (_pos + 1 > _length)
+    {
+      return false;
+    }
+
+    value = (uint8_t)_data[_pos++];
+    return true;
+  }
+
+  bool u32(uint32_t& value)
+  {
+    if ((_pos > _length) || (_length - _pos < 4))
+    {
+      return false;
+    }
+
+    value = 0;
+    for (int ii = 0; ii < 4; ++ii)
+    {
+      value |= ((uint32_t)(uint8_t)_data[_pos++]) << (8 * ii);
+    }
+    return true;
+  }
+
+  bool u64(uint64_t& value)
+  {
+    if ((_pos > _length) || (_length - _pos < 8))
+    {
+      return false;
+    }
+
+    value = 0;
+    for (int ii = 0; ii < 8; ++ii)
+    {
+      value |= ((uint64_t)(uint8_t)_data[_pos++]) << (8 * ii);
+    }
+    return true;
+  }
+
+  bool string(std::string& str)
+  {
+    uint32_t length;
+
+    if ((!u32(length)) || (length > _length - _pos))
+    {
+      return false;
+    }
+
+    str.assign(_data + _pos, length);
+    _pos += length;
+    return true;
+  }
+
+private:
+  const char* _data;
+  size_t _length;
+  size_t _pos;
+};
+
+CallListCache::CallListCache(size_t capacity,
+                             uint64_t max_age_ms,
+                             uint64_t max_stale_ms,
+                             Revalidator* revalidator) :
+  _capacity(capacity),
+  _max_age_ms(max_age_ms),
+  _max_stale_ms(max_stale_ms),
+  _revalidator(revalidator),
+  _entries(),
+  _index(),
+  _generations(NUM_GENERATIONS, 0),
+  _load_generations(),
+  _snapshot_path(),
+  _map(NULL),
+  _map_length(0),
+  _snapshot(),
+  _loading(false),
+  _load_succeeded(false),
+  _revalidate_queue(),
+  _revalidating(),
+  _running(false),
+  _terminating(false)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_revalidate_cond, NULL);
+}
+
+CallListCache::~CallListCache()
+{
+  wait_for_snapshot();
+
+  stop();
+  wait_stopped();
+
+  unmap_snapshot();
+  delete _revalidator; _revalidator = NULL;
+
+  pthread_cond_destroy(&_revalidate_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void CallListCache::start()
+{
+  if ((_revalidator == NULL) || (_running))
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _terminating = false;
+  pthread_mutex_unlock(&_lock);
+
+  int rc = pthread_create(&_revalidate_thread,
+                          NULL,
+                          revalidate_thread_entry_point,
+                          this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start call list revalidation thread: %d", rc);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  pthread_mutex_lock(&_lock);
+  _running = true;
+  pthread_mutex_unlock(&_lock);
+}
+
+void CallListCache::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_broadcast(&_revalidate_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void CallListCache::wait_stopped()
+{
+  if (_running)
+  {
+    pthread_join(_revalidate_thread, NULL);
+
+    pthread_mutex_lock(&_lock);
+    _running = false;
+    _revalidate_queue.clear();
+    _revalidating.clear();
+    pthread_mutex_unlock(&_lock);
+  }
+}
+
+CallListCache::Result CallListCache::get(const std::string& impu,
+                                         std::vector<CallFragment>& fragments,
+                                         uint64_t now_ms)
+{
+  Result result = MISS;
+
+  pthread_mutex_lock(&_lock);
+
+  Entry* entry;
+
+  if (find_entry(impu, entry))
+  {
+    uint64_t age_ms = (now_ms > entry->fetch_ms) ? now_ms - entry->fetch_ms : 0;
+
+    if (age_ms <= _max_age_ms)
+    {
+      fragments = entry->fragments;
+      result = FRESH;
+    }
+    else if ((_max_stale_ms != 0) && (age_ms > _max_stale_ms))
+    {
+      // Too old to return even while it is revalidated.  find_entry has
+      // moved the entry to the front of the LRU list.
+      TRC_DEBUG("Cached call list for %s is too stale, dropping it",
+                impu.c_str());
+      _index.erase(impu);
+      _entries.pop_front();
+    }
+    else if ((_revalidator != NULL) && (_running) && (!_terminating))
+    {
+      // Return the stale entry, but queue it to be read again, unless it
+      // already is.
+      fragments = entry->fragments;
+      result = STALE;
+
+      if ((_revalidate_queue.size() < MAX_QUEUED_REVALIDATIONS) &&
+          (_revalidating.insert(impu).second))
+      {
+        _revalidate_queue.push_back(impu);
+        pthread_cond_broadcast(&_revalidate_cond);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return result;
+}
+
+CallListCache::Result CallListCache::get(const std::string& impu,
+                                         std::vector<CallFragment>& fragments)
+{
+  return get(impu, fragments, realtime_ms());
+}
+
+void CallListCache::put(const std::string& impu,
+                        const std::vector<CallFragment>& fragments,
+                        uint64_t fetch_ms)
+{
+  Entry entry;
+  entry.impu = impu;
+  entry.fragments = fragments;
+  entry.fetch_ms = fetch_ms;
+
+  pthread_mutex_lock(&_lock);
+  add_entry(entry);
+  pthread_mutex_unlock(&_lock);
+}
+
+CallListCache::ReadStamp CallListCache::begin_read(const std::string& impu)
+{
+  ReadStamp stamp;
+  stamp.fetch_ms = realtime_ms();
+
+  pthread_mutex_lock(&_lock);
+  stamp.generation = generation(impu);
+  pthread_mutex_unlock(&_lock);
+
+  return stamp;
+}
+
+bool CallListCache::put(const std::string& impu,
+                        const std::vector<CallFragment>& fragments,
+                        const ReadStamp& stamp)
+{
+  Entry entry;
+  entry.impu = impu;
+  entry.fragments = fragments;
+  entry.fetch_ms = stamp.fetch_ms;
+
+  pthread_mutex_lock(&_lock);
+  bool unchanged = (generation(impu) == stamp.generation);
+
+  if (unchanged)
+  {
+    add_entry(entry);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!unchanged)
+  {
+    TRC_DEBUG("Call list for %s changed while it was read, not caching it",
+              impu.c_str());
+  }
+
+  return unchanged;
+}
+
+void CallListCache::invalidate(const std::string& impu)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                            _index.find(impu);
+
+  if (it != _index.end())
+  {
+    _entries.erase(it->second);
+    _index.erase(it);
+  }
+
+  _snapshot.erase(impu);
+  generation(impu)++;
+
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t CallListCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _entries.size() + _snapshot.size();
+  pthread_mutex_unlock(&_lock);
+
+  return size;
+}
+
+void CallListCache::add_entry(Entry& entry)
+{
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                      _index.find(entry.impu);
+
+  if (it != _index.end())
+  {
+    _entries.erase(it->second);
+    _index.erase(it);
+  }
+
+  _snapshot.erase(entry.impu);
+
+  _entries.push_front(Entry());
+  _entries.front().impu.swap(entry.impu);
+  _entries.front().fragments.swap(entry.fragments);
+  _entries.front().fetch_ms = entry.fetch_ms;
+  _index[_entries.front().impu] = _entries.begin();
+
+  // Make room by dropping undecoded snapshot entries first (as they are the
+  // oldest), then the least recently used entries.
+  while ((_entries.size() + _snapshot.size() > _capacity) && (!_snapshot.empty()))
+  {
+    _snapshot.erase(_snapshot.begin());
+  }
+
+  while (_entries.size() > _capacity)
+  {
+    _index.erase(_entries.back().impu);
+    _entries.pop_back();
+  }
+}
+
+uint64_t& CallListCache::generation(const std::string& impu)
+{
+  return _generations[generation_slot(impu)];
+}
+
+size_t CallListCache::generation_slot(const std::string& impu)
+{
+  return FnvHash::hash(impu) % NUM_GENERATIONS;
+}
+
+bool CallListCache::find_entry(const std::string& impu, Entry*& entry)
+{
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                            _index.find(impu);
+
+  if (it != _index.end())
+  {
+    // Move the entry to the front of the LRU list.
+    _entries.splice(_entries.begin(), _entries, it->second);
+    entry = &_entries.front();
+    return true;
+  }
+
+  std::unordered_map<std::string, uint64_t>::iterator snapshot_it =
+                                                         _snapshot.find(impu);
+
+  if (snapshot_it == _snapshot.end())
+  {
+    return false;
+  }
+
+  // Decode the entry from the snapshot the first time it is used.
+  Entry decoded;
+  bool success = decode_snapshot_entry(snapshot_it->second, decoded);
+  _snapshot.erase(snapshot_it);
+
+  if (!success)
+  {
+    TRC_WARNING("Corrupt entry for %s in call list snapshot", impu.c_str());
+    return false;
+  }
+
+  add_entry(decoded);
+  entry = &_entries.front();
+  return true;
+}
+
+//
+// Snapshot methods.
+//
+
+void CallListCache::load_snapshot(const std::string& path)
+{
+  wait_for_snapshot();
+
+  pthread_mutex_lock(&_lock);
+  _snapshot.clear();
+  _load_generations = _generations;
+  pthread_mutex_unlock(&_lock);
+  unmap_snapshot();
+
+  _snapshot_path = path;
+  _loading = true;
+
+  int rc = pthread_create(&_load_thread, NULL, load_thread_entry_point, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start call list snapshot load thread: %d", rc);
+    _loading = false;
+    _load_succeeded = false;
+    // LCOV_EXCL_STOP
+  }
+}
+
+bool CallListCache::wait_for_snapshot()
+{
+  if (_loading)
+  {
+    pthread_join(_load_thread, NULL);
+    _loading = false;
+  }
+
+  return _load_succeeded;
+}
+
+void* CallListCache::load_thread_entry_point(void* cache)
+{
+  CallListCache* self = (CallListCache*)cache;
+  self->_load_succeeded = self->load_snapshot_file();
+  return NULL;
+}
+
+bool CallListCache::load_snapshot_file()
+{
+  const std::string& path = _snapshot_path;
+  FILE* file = fopen(path.c_str(), "rb");
+
+  if (file == NULL)
+  {
+    TRC_INFO("No call list snapshot loaded from %s: %s",
+             path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat file_stat;
+  if ((fstat(fileno(file), &file_stat) != 0) ||
+      ((size_t)file_stat.st_size < SNAPSHOT_HEADER_SIZE))
+  {
+    TRC_ERROR("Call list snapshot %s is too short", path.c_str());
+    fclose(file);
+    return false;
+  }
+
+  size_t length = file_stat.st_size;
+  void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  fclose(file);
+
+  if (map == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map call list snapshot %s: %s",
+              path.c_str(), strerror(errno));
+    return false;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _map = (const char*)map;
+  _map_length = length;
+  pthread_mutex_unlock(&_lock);
+
+  SnapshotReader header(_map, _map_length, 0);
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  uint64_t num_entries = 0;
+  uint64_t index_offset = 0;
+
+  if ((!header.u32(magic)) ||
+      (!header.u32(version)) ||
+      (!header.u64(num_entries)) ||
+      (!header.u64(index_offset)) ||
+      (magic != SNAPSHOT_MAGIC) ||
+      (version != SNAPSHOT_VERSION) ||
+      (index_offset > _map_length) ||
+      (num_entries > (_map_length - index_offset) / 8))
+  {
+    TRC_ERROR("%s is not a valid call list snapshot", path.c_str());
+    return false;
+  }
+
+  // Index the entries by IMPU.  This only touches the start of each entry,
+  // so the fragments aren't paged in until they are used.
+  SnapshotReader index(_map, _map_length, index_offset);
+  uint64_t num_loaded = 0;
+  uint64_t now_ms = realtime_ms();
+
+  for (uint64_t ii = 0; ii < num_entries; ++ii)
+  {
+    uint64_t offset;
+
+    if (!index.u64(offset))
+    {
+      // LCOV_EXCL_START - the header check covers the length of the index.
+      TRC_WARNING("Corrupt index in call list snapshot %s", path.c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
+    SnapshotReader reader(_map, _map_length, offset);
+    uint64_t fetch_ms;
+    std::string impu;
+
+    if ((!reader.u64(fetch_ms)) || (!reader.string(impu)))
+    {
+      TRC_WARNING("Corrupt entry in call list snapshot %s", path.c_str());
+      continue;
+    }
+
+    if ((_max_stale_ms != 0) &&
+        (now_ms > fetch_ms) &&
+        (now_ms - fetch_ms > _max_stale_ms))
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&_lock);
+    bool full = (_entries.size() + _snapshot.size() >= _capacity);
+
+    // Entries already in the cache were read since the snapshot was taken,
+    // so are newer, and IMPUs invalidated since the load started have been
+    // changed since the snapshot was taken.
+    if ((!full) &&
+        (_index.find(impu) == _index.end()) &&
+        (generation(impu) == _load_generations[generation_slot(impu)]))
+    {
+      _snapshot[impu] = offset;
+      num_loaded++;
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if (full)
+    {
+      break;
+    }
+  }
+
+  TRC_STATUS("Loaded %llu call lists from snapshot %s",
+             (unsigned long long)num_loaded, path.c_str());
+  return true;
+}
+
+void CallListCache::unmap_snapshot()
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_map != NULL)
+  {
+    munmap((void*)_map, _map_length);
+    _map = NULL;
+    _map_length = 0;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void CallListCache::encode_entry(const Entry& entry, std::string& out)
+{
+  put_u64(out, entry.fetch_ms);
+  put_string(out, entry.impu);
+  put_u32(out, entry.fragments.size());
+
+  for (std::vector<CallFragment>::const_iterator fragment = entry.fragments.begin();
+       fragment != entry.fragments.end();
+       ++fragment)
+  {
+    out.push_back((char)fragment->type);
+    put_string(out, fragment->timestamp);
+    put_string(out, fragment->id);
+    put_string(out, fragment->contents);
+  }
+}
+
+bool CallListCache::decode_snapshot_entry(uint64_t offset, Entry& entry)
+{
+  SnapshotReader reader(_map, _map_length, offset);
+  uint32_t num_fragments;
+
+  if ((!reader.u64(entry.fetch_ms)) ||
+      (!reader.string(entry.impu)) ||
+      (!reader.u32(num_fragments)))
+  {
+    return false;
+  }
+
+  for (uint32_t ii = 0; ii < num_fragments; ++ii)
+  {
+    CallFragment fragment;
+    uint8_t type;
+
+    if ((!reader.u8(type)) ||
+        (type > CallFragment::REJECTED) ||
+        (!reader.string(fragment.timestamp)) ||
+        (!reader.string(fragment.id)) ||
+        (!reader.string(fragment.contents)))
+    {
+      return false;
+    }
+
+    fragment.type = (CallFragment::Type)type;
+    entry.fragments.push_back(fragment);
+  }
+
+  return true;
+}
+
+bool CallListCache::save_snapshot(const std::string& path)
+{
+  // Copy the entries, most recently used first, so that if the snapshot is
+  // loaded into a smaller cache the most useful entries are kept.  Entries
+  // from an earlier snapshot that haven't been used come last.  They are
+  // encoded after the lock is released, so that reads aren't held up for
+  // the whole of a large save.
+  std::vector<Entry> copies;
+
+  pthread_mutex_lock(&_lock);
+
+  copies.reserve(_entries.size() + _snapshot.size());
+  copies.insert(copies.end(), _entries.begin(), _entries.end());
+
+  for (std::unordered_map<std::string, uint64_t>::const_iterator it = _snapshot.begin();
+       it != _snapshot.end();
+       ++it)
+  {
+    copies.push_back(Entry());
+
+    if (!decode_snapshot_entry(it->second, copies.back()))
+    {
+      copies.pop_back();
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  std::string entries;
+  std::vector<uint64_t> offsets;
+
+  for (std::vector<Entry>::const_iterator it = copies.begin();
+       it != copies.end();
+       ++it)
+  {
+    offsets.push_back(SNAPSHOT_HEADER_SIZE + entries.length());
+    encode_entry(*it, entries);
+  }
+
+  copies.clear();
+
+  std::string index;
+  for (size_t ii = 0; ii < offsets.size(); ++ii)
+  {
+    put_u64(index, offsets[ii]);
+  }
+
+  std::string header;
+  put_u32(header, SNAPSHOT_MAGIC);
+  put_u32(header, SNAPSHOT_VERSION);
+  put_u64(header, offsets.size());
+  put_u64(header, SNAPSHOT_HEADER_SIZE + entries.length());
+
+  std::string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+
+  if (file == NULL)
+  {
+    TRC_ERROR("Failed to create call list snapshot %s: %s",
+              tmp_path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Write the header last, so that a partly written snapshot isn't valid.
+  std::string placeholder(SNAPSHOT_HEADER_SIZE, '\0');
+  bool success = ((fwrite(placeholder.data(), 1, placeholder.length(), file) == placeholder.length()) &&
+                  (fwrite(entries.data(), 1, entries.length(), file) == entries.length()) &&
+                  (fwrite(index.data(), 1, index.length(), file) == index.length()) &&
+                  (fflush(file) == 0) &&
+                  (fseek(file, 0, SEEK_SET) == 0) &&
+                  (fwrite(header.data(), 1, header.length(), file) == header.length()));
+
+  if (fclose(file) != 0)
+  {
+    success = false; // LCOV_EXCL_LINE
+  }
+
+  if ((!success) || (rename(tmp_path.c_str(), path.c_str()) != 0))
+  {
+    TRC_ERROR("Failed to write call list snapshot %s: %s",
+              path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  TRC_STATUS("Saved %zu call lists to snapshot %s", offsets.size(), path.c_str());
+  return true;
+}
+
+//
+// Revalidation methods.
+//
+
+void* CallListCache::revalidate_thread_entry_point(void* cache)
+{
+  ((CallListCache*)cache)->revalidate_thread();
+  return NULL;
+}
+
+void CallListCache::revalidate_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminating)
+  {
+    if (_revalidate_queue.empty())
+    {
+      pthread_cond_wait(&_revalidate_cond, &_lock);
+      continue;
+    }
+
+    std::string impu = _revalidate_queue.front();
+    _revalidate_queue.pop_front();
+    pthread_mutex_unlock(&_lock);
+
+    std::vector<CallFragment> fragments;
+    ReadStamp stamp = begin_read(impu);
+    CassandraStore::ResultCode rc = _revalidator->revalidate(impu, fragments);
+
+    if (rc == CassandraStore::OK)
+    {
+      put(impu, fragments, stamp);
+    }
+    else if (rc == CassandraStore::NOT_FOUND)
+    {
+      invalidate(impu);
+    }
+    else
+    {
+      TRC_DEBUG("Failed to revalidate call list for %s (RC = %d)",
+                impu.c_str(), rc);
+    }
+
+    pthread_mutex_lock(&_lock);
+    _revalidating.erase(impu);
+    pthread_cond_broadcast(&_revalidate_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void CallListCache::wait_for_revalidations()
+{
+  pthread_mutex_lock(&_lock);
+
+  while ((!_revalidating.empty()) && (_running) && (!_terminating))
+  {
+    pthread_cond_wait(&_revalidate_cond, &_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+} // namespace CallListStore
@@ -9,7 +9,19 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
 #include "call_list_store.h"
+#include "call_list_archive.h"
+#include "call_list_cache.h"
+#include "column_schema.h"
+#include "fnv_hash.h"
 #include "mementosasevent.h"
 
 // The keyspace that that call list store uses.
@@ -18,16 +30,66 @@ const static std::string KEYSPACE = "memento";
 // The column family (table) that the call list store uses.
 const static std::string COLUMN_FAMILY = "call_lists";
 
-// String representations of the idfferent call fragment types. These are
+// String representations of the different call fragment types. These are
 // encoded into the column names in the `call_lists` column family.
-const static std::string STR_BEGIN = "begin";
-const static std::string STR_END = "end";
-const static std::string STR_REJECTED = "rejected";
+constexpr CallListStore::EnumName<CallListStore::CallFragment::Type> FRAGMENT_TYPE_NAMES[] = {
+  CallListStore::EnumName<CallListStore::CallFragment::Type>(CallListStore::CallFragment::BEGIN, "begin"),
+  CallListStore::EnumName<CallListStore::CallFragment::Type>(CallListStore::CallFragment::END, "end"),
+  CallListStore::EnumName<CallListStore::CallFragment::Type>(CallListStore::CallFragment::REJECTED, "rejected"),
+};
+
+const static size_t NUM_FRAGMENT_TYPES =
+  sizeof(FRAGMENT_TYPE_NAMES) / sizeof(FRAGMENT_TYPE_NAMES[0]);
 
-// All call list fragements begin with this prefix. This is to allow the column
-// family to be easily extended to contain different types of columns in future
-// (e.g. metatdata related to the call list).
-const static std::string CALL_COLUMN_PREFIX = "call_";
+// The layout of the names of the columns that hold call fragments:
+//   call_<timestamp>_<id>_<type>
+//
+// For example:
+//   call_20140722120000_12345_begin
+//
+// All call list fragements begin with the call_ prefix. This is to allow the
+// column family to be easily extended to contain different types of columns in
+// future (e.g. metatdata related to the call list).
+typedef CallListStore::ColumnNameCodec<CallListStore::CallFragment::Type, 2> CallColumnCodec;
+constexpr CallColumnCodec CALL_COLUMN("call_", '_', FRAGMENT_TYPE_NAMES, NUM_FRAGMENT_TYPES);
+static_assert(CALL_COLUMN.in_enum_order(),
+              "Fragment type names must be in the order of the enumerators");
+
+const static std::string CALL_COLUMN_PREFIX = CALL_COLUMN.prefix();
+
+// The end of the range of call list fragment columns. This is the prefix with
+// its last character incremented.
+const static std::string CALL_COLUMN_RANGE_END = "call`";
+
+// The column holding the IMPU's change token.  This sorts outside the range of
+// call columns, so isn't returned by reads of the call fragments.
+const static std::string CHANGE_TOKEN_COLUMN = "change_token";
+
+// The TTL (in seconds) to write change tokens with if none is configured.
+// Tokens must outlive the fragments they track, so this is longer than any
+// fragment TTL memento uses, but means the tokens of idle IMPUs are still
+// eventually removed.
+const static int32_t DEFAULT_CHANGE_TOKEN_TTL = 30 * 24 * 60 * 60;
+
+// Fragment summaries are held in columns named summary_<timestamp>_<id>_<type>
+// (the same as the call columns apart from the prefix).  These sort after all
+// the other columns.
+constexpr CallColumnCodec SUMMARY_COLUMN("summary_", '_', FRAGMENT_TYPE_NAMES, NUM_FRAGMENT_TYPES);
+
+const static std::string SUMMARY_COLUMN_PREFIX = SUMMARY_COLUMN.prefix();
+const static std::string SUMMARY_COLUMN_RANGE_END = "summary`";
+
+// In the ring slot layout, fragments are held in a fixed set of columns
+// slot_0000, slot_0001, ... and the slot_head column counts the fragments
+// written so far (so the next one goes in slot (head % number of slots)).
+// These all sort after the call columns and the change token.
+const static std::string SLOT_COLUMN_PREFIX = "slot_";
+const static std::string SLOT_COLUMN_RANGE_END = "slot`";
+const static std::string SLOT_HEAD_COLUMN = "slot_head";
+
+// The most slots an IMPU can have (so that the slot number fits the
+// zero-padded column names).
+const static size_t MAX_RING_SLOTS = 10000;
 
 namespace CallListStore
 {
@@ -41,25 +103,19 @@ namespace cass = org::apache::cassandra;
 /// @return        - The string representation.
 std::string fragment_type_to_string(CallFragment::Type type)
 {
-  switch(type)
-  {
-    case CallFragment::BEGIN:
-      return STR_BEGIN;
-
-    case CallFragment::END:
-      return STR_END;
+  const EnumName<CallFragment::Type>* name = CALL_COLUMN.enum_name(type);
 
-    case CallFragment::REJECTED:
-      return STR_REJECTED;
-
-    default:
-      // LCOV_EXCL_START - We should never reach this code.  The function must
-      // be passed a value in the enumeration, and we have already handled all
-      // of them.
-      TRC_ERROR("Unexpected call fragment type %d", (int)type);
-      return (std::string("UNKNOWN (") + std::to_string(type) + std::string(")"));
-      // LCOV_EXCL_STOP
+  if (name == NULL)
+  {
+    // LCOV_EXCL_START - We should never reach this code.  The function must
+    // be passed a value in the enumeration, and the schema has names for all
+    // of them.
+    TRC_ERROR("Unexpected call fragment type %d", (int)type);
+    return (std::string("UNKNOWN (") + std::to_string(type) + std::string(")"));
+    // LCOV_EXCL_STOP
   }
+
+  return std::string(name->name, name->length);
 }
 
 // Utility method for converting a call fragment string (as stored in
@@ -70,32 +126,155 @@ std::string fragment_type_to_string(CallFragment::Type type)
 //
 // @return                - True of the string was converted successfully, false
 //                          if the string is not recognized.
+bool fragment_type_from_string(const char* fragment_str,
+                               size_t fragment_str_len,
+                               CallFragment::Type& type)
+{
+  return CALL_COLUMN.enum_value(fragment_str, fragment_str_len, type);
+}
+
 bool fragment_type_from_string(const std::string& fragment_str,
                                CallFragment::Type& type)
 {
-  bool success = true;
+  return fragment_type_from_string(fragment_str.data(),
+                                   fragment_str.length(),
+                                   type);
+}
+
+// Utility method for building the name of the column that holds a call
+// fragment (see CALL_COLUMN).
+//
+// @param fragment        - The fragment.
+// @return                - The column name.
+std::string call_column_name(const CallFragment& fragment)
+{
+  const std::string* fields[] = {&fragment.timestamp, &fragment.id};
+  std::string column_name;
+  CALL_COLUMN.encode(fields, fragment.type, true, column_name);
+  return column_name;
+}
 
-  if (fragment_str == STR_BEGIN)
-  {
-    type = CallFragment::BEGIN;
-  }
-  else if (fragment_str == STR_END)
-  {
-    type = CallFragment::END;
-  }
-  else if (fragment_str == STR_REJECTED)
-  {
-    type = CallFragment::REJECTED;
-  }
-  else
+// Utility method for building the column that holds an IMPU's change token.
+// The token is also the column's timestamp, so a later token always replaces
+// an earlier one.
+//
+// @param token           - The token (from Store::next_change_token).
+// @param ttl             - The TTL for the column.
+// @return                - The column.
+CallColumn change_token_column(int64_t token, int32_t ttl)
+{
+  CallColumn column;
+  column.name = CHANGE_TOKEN_COLUMN;
+  column.value = std::to_string(token);
+  column.timestamp = token;
+  column.ttl = ttl;
+  return column;
+}
+
+// Utility method for building the name of the column that holds a call
+// fragment's summary.  This is the call column name with a different prefix.
+//
+// @param fragment        - The fragment.
+// @return                - The column name.
+std::string summary_column_name(const CallFragment& fragment)
+{
+  const std::string* fields[] = {&fragment.timestamp, &fragment.id};
+  std::string column_name;
+  SUMMARY_COLUMN.encode(fields, fragment.type, true, column_name);
+  return column_name;
+}
+
+// Utility method for building the name of a ring slot column.
+//
+// @param slot            - The slot number.
+// @return                - The column name, e.g. slot_0003.
+std::string slot_column_name(size_t slot)
+{
+  char digits[21];
+  snprintf(digits, sizeof(digits), "%04zu", slot);
+  return SLOT_COLUMN_PREFIX + digits;
+}
+
+// Utility method for building the value of a ring slot column.  Slots don't
+// identify the fragment in their name, so the value is the call column name
+// (without the call_ prefix), a newline, and then the fragment's contents.
+//
+// @param fragment        - The fragment.
+// @return                - The column value.
+std::string slot_column_value(const CallFragment& fragment)
+{
+  const std::string* fields[] = {&fragment.timestamp, &fragment.id};
+  std::string value;
+  value.reserve(CALL_COLUMN.encoded_length(fields, fragment.type, false) +
+                1 + fragment.contents.length());
+  CALL_COLUMN.append(fields, fragment.type, false, value);
+  value.append("\n").append(fragment.contents);
+  return value;
+}
+
+// Comparators for sorting and deduplicating columns by name.
+static bool column_name_less(const CallColumn& a, const CallColumn& b)
+{
+  return a.name < b.name;
+}
+
+static bool column_name_equal(const CallColumn& a, const CallColumn& b)
+{
+  return a.name == b.name;
+}
+
+static bool column_name_before(const CallColumn& column, const std::string& name)
+{
+  return column.name < name;
+}
+
+// Utility method for turning the columns of a row in the ring slot layout
+// into call columns (with the call_ prefix stripped), as if the row used the
+// column-per-fragment layout.  Call columns written before the layout was
+// enabled are kept, so call lists aren't lost when the layout changes.
+//
+// The returned columns are sorted by name (and so by timestamp, id and type)
+// with duplicates removed, because a fragment written twice is in two slots.
+//
+// @param row_columns     - The row's call, change token and slot columns.
+// @param columns         - (out) The call columns.
+void slot_columns_to_call_columns(const std::vector<CallColumn>& row_columns,
+                                  std::vector<CallColumn>& columns)
+{
+  columns.clear();
+  columns.reserve(row_columns.size());
+
+  for (std::vector<CallColumn>::const_iterator column_it = row_columns.begin();
+       column_it != row_columns.end();
+       ++column_it)
   {
-    // LCOV_EXCL_START Should not hit this as the call list store does not
-    // write values with a unrecognized fragment type string.
-    success = false;
-    // LCOV_EXCL_STOP
+    if (column_it->name.compare(0, CALL_COLUMN_PREFIX.length(), CALL_COLUMN_PREFIX) == 0)
+    {
+      columns.push_back(*column_it);
+      columns.back().name.erase(0, CALL_COLUMN_PREFIX.length());
+    }
+    else if ((column_it->name.compare(0, SLOT_COLUMN_PREFIX.length(), SLOT_COLUMN_PREFIX) == 0) &&
+             (column_it->name != SLOT_HEAD_COLUMN))
+    {
+      size_t separator = column_it->value.find('\n');
+
+      if (separator == std::string::npos)
+      {
+        // LCOV_EXCL_START
+        TRC_WARNING("Invalid ring slot (%s)", column_it->name.c_str());
+        continue;
+        // LCOV_EXCL_STOP
+      }
+
+      columns.push_back(*column_it);
+      columns.back().name.assign(column_it->value, 0, separator);
+      columns.back().value.erase(0, separator + 1);
+    }
   }
 
-  return success;
+  std::sort(columns.begin(), columns.end(), column_name_less);
+  columns.erase(std::unique(columns.begin(), columns.end(), column_name_equal),
+                columns.end());
 }
 
 void sas_log_cassandra_failure(const SAS::TrailId trail,
@@ -111,298 +290,2332 @@ void sas_log_cassandra_failure(const SAS::TrailId trail,
 }
 
 //
-// Call list store methods.
+// Call fragment arena methods.
 //
 
-Store::Store() : CassandraStore::Store(KEYSPACE) {}
-
-Store::~Store() {}
-
-//
-// Operation definitions.
-//
+// Smallest block to allocate when an arena runs out of reserved space.
+const static size_t MIN_ARENA_BLOCK_SIZE = 4096;
 
-//
-// Write a new call fragment to cassandra.
-//
+void CallFragmentView::to_fragment(CallFragment& fragment) const
+{
+  fragment.timestamp.assign(timestamp.data, timestamp.length);
+  fragment.id.assign(id.data, id.length);
+  fragment.type = type;
+  fragment.contents.assign(contents.data, contents.length);
+  fragment.summary.clear();
+}
 
-WriteCallFragment::WriteCallFragment(const std::string& impu,
-                                     const CallFragment& fragment,
-                                     const int64_t cass_timestamp,
-                                     const int32_t ttl) :
-  CassandraStore::Operation(),
-  _impu(impu),
-  _fragment(fragment),
-  _cass_timestamp(cass_timestamp),
-  _ttl(ttl)
+CallFragmentArena::CallFragmentArena() :
+  _blocks(),
+  _block_capacity(0),
+  _block_used(0),
+  _fragments()
 {}
 
-WriteCallFragment::~WriteCallFragment()
-{}
+CallFragmentArena::~CallFragmentArena()
+{
+  clear();
+}
 
-bool WriteCallFragment::perform(CassandraStore::Client* client,
-                                SAS::TrailId trail)
+void CallFragmentArena::reserve(size_t num_fragments, size_t num_bytes)
 {
-  // Log the start of the write.
-  TRC_DEBUG("Writing %s call fragment for IMPU '%s'",
-            fragment_type_to_string(_fragment.type).c_str(),
-            _impu.c_str());
+  _fragments.reserve(_fragments.size() + num_fragments);
 
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_WRITE_STARTED, 0);
-    ev.add_static_param(_fragment.type);
-    ev.add_var_param(_impu);
-    ev.add_var_param(_fragment.timestamp);
-    ev.add_var_param(_fragment.contents);
-    SAS::report_event(ev);
+  if (_block_used + num_bytes > _block_capacity)
+  {
+    _blocks.push_back(new char[num_bytes]);
+    _block_capacity = num_bytes;
+    _block_used = 0;
   }
+}
 
-  // The column name is of the form:
-  //   call_<timestamp>_<id>_<type>
-  //
-  // For example:
-  //   call_20140722120000_12345_begin
-  std::string column_name;
-  column_name.append(CALL_COLUMN_PREFIX)
-             .append(_fragment.timestamp).append("_")
-             .append(_fragment.id).append("_")
-             .append(fragment_type_to_string(_fragment.type));
-
-  // Map describing the columns to write.
-  std::map<std::string, std::string> columns;
-  columns[column_name] = _fragment.contents;
-
-  // Write to the supplied impu only.
-  std::vector<std::string> keys;
-  keys.push_back(_impu);
+ArenaString CallFragmentArena::copy(const char* data, size_t length)
+{
+  if (_block_used + length > _block_capacity)
+  {
+    // The reservation was too small.  Start a new block that is big enough
+    // for this string, and at least as big as the previous one so that
+    // repeated overflows are rare.
+    size_t block_size = std::max(length,
+                                 std::max(_block_capacity, MIN_ARENA_BLOCK_SIZE));
+    TRC_DEBUG("Call fragment arena out of space, allocate %zu byte block",
+              block_size);
+    _blocks.push_back(new char[block_size]);
+    _block_capacity = block_size;
+    _block_used = 0;
+  }
 
-  client->put_columns(COLUMN_FAMILY,
-                      keys,
-                      columns,
-                      _cass_timestamp,
-                      _ttl);
+  char* dest = _blocks.back() + _block_used;
+  memcpy(dest, data, length);
+  _block_used += length;
 
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_WRITE_OK, 0);
-    SAS::report_event(ev);
-  }
+  ArenaString str = { dest, length };
+  return str;
+}
 
-  return true;
+void CallFragmentArena::push_back(const CallFragmentView& fragment)
+{
+  _fragments.push_back(fragment);
 }
 
-void WriteCallFragment::unhandled_exception(CassandraStore:: ResultCode status,
-                                            std::string& description,
-                                            SAS::TrailId trail)
+void CallFragmentArena::clear()
 {
-  CassandraStore::Operation::unhandled_exception(status, description, trail);
+  _fragments.clear();
 
-  TRC_WARNING("Failed to write call list fragment for IMPU %s because '%s' (RC = %d)",
-              _impu.c_str(), description.c_str(), status);
-  sas_log_cassandra_failure(trail,
-                            SASEvent::CALL_LIST_WRITE_FAILED,
-                            status,
-                            description);
+  for (std::vector<char*>::iterator block = _blocks.begin();
+       block != _blocks.end();
+       ++block)
+  {
+    delete[] *block;
+  }
+
+  _blocks.clear();
+  _block_capacity = 0;
+  _block_used = 0;
 }
 
-WriteCallFragment*
-Store::new_write_call_fragment_op(const std::string& impu,
-                                  const CallFragment& fragment,
-                                  const int64_t cass_timestamp,
-                                  const int32_t ttl)
+void CallFragmentArena::swap(CallFragmentArena& other)
 {
-  return new WriteCallFragment(impu, fragment, cass_timestamp, ttl);
+  _blocks.swap(other._blocks);
+  std::swap(_block_capacity, other._block_capacity);
+  std::swap(_block_used, other._block_used);
+  _fragments.swap(other._fragments);
 }
 
 //
-// Get all the call fragments for a given IMPU.
+// Backend operation methods.
 //
 
-GetCallFragments::GetCallFragments(const std::string& impu) :
-  CassandraStore::HAOperation(), _impu(impu), _fragments()
-{}
-
-GetCallFragments::~GetCallFragments()
-{}
-
-bool GetCallFragments::perform(CassandraStore::Client* client,
+bool BackendOperation::perform(CassandraStore::Client* client,
                                SAS::TrailId trail)
 {
-  // Log the start of the read
-  TRC_DEBUG("Get call fragments for IMPU: '%s'", _impu.c_str());
+  mark(OpTimeline::CONNECTION_CHECKOUT);
 
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_READ_STARTED, 0);
-    ev.add_var_param(_impu);
-    SAS::report_event(ev);
+  if (_pool_warmer != NULL)
+  {
+    _pool_warmer->on_checkout(_checkout_start_us);
   }
 
-  // Get all the call columns for the IMPU's cassandra row.
-  std::vector<cass::ColumnOrSuperColumn> columns;
-  ha_get_columns_with_prefix(client,
-                             COLUMN_FAMILY,
-                             _impu,
-                             CALL_COLUMN_PREFIX,
-                             columns,
-                             trail);
+  ThriftBackend backend(client, COLUMN_FAMILY);
+  return execute(&backend, trail);
+}
+
+bool BackendOperation::run(Backend* backend, SAS::TrailId trail)
+{
+  // Handle the exceptions that backends can throw in the same way as the
+  // CassandraStore does when running an operation on a thrift client.
+  CassandraStore::ResultCode status = CassandraStore::OK;
+  std::string description;
 
-  for(std::vector<cass::ColumnOrSuperColumn>::const_iterator column_it = columns.begin();
-      column_it != columns.end();
-      ++column_it)
+  try
+  {
+    return execute(backend, trail);
+  }
+  catch (BackendConnectionError& ce)
+  {
+    status = CassandraStore::CONNECTION_ERROR;
+    description = std::string("Exception: ") + ce.what();
+  }
+  catch (cass::InvalidRequestException& ire)
+  {
+    status = CassandraStore::INVALID_REQUEST;
+    description = "Exception: " + ire.why;
+  }
+  catch (CassandraStore::RowNotFoundException& nfe)
+  {
+    status = CassandraStore::NOT_FOUND;
+    description = "Row not found";
+  }
+  catch (cass::UnavailableException& ue)
   {
-    // The columns name is of the form call_<timestamp>_<id>_<type>. The call_
-    // prefix has already been stripped off, so just split the remaining string
-    // on underscores and access the elements.
-    std::vector<std::string> tokens;
-    Utils::split_string(column_it->column.name, '_', tokens);
+    status = CassandraStore::UNKNOWN_ERROR;
+    description = "Exception: Unavailable";
+  }
+  catch (cass::TimedOutException& te)
+  {
+    status = CassandraStore::UNKNOWN_ERROR;
+    description = "Exception: Timed out";
+  }
+  catch (std::exception& e)
+  {
+    status = CassandraStore::UNKNOWN_ERROR;
+    description = std::string("Exception: ") + e.what();
+  }
 
-    if (tokens.size() != 3)
-    {
-      // LCOV_EXCL_START
-      TRC_WARNING("Invalid column name (%s)", column_it->column.name.c_str());
-      continue;
-      // LCOV_EXCL_STOP
-    }
+  unhandled_exception(status, description, trail);
+  return false;
+}
 
-    std::string& timestamp_str = tokens[0];
-    std::string& id_str = tokens[1];
-    std::string& type_str = tokens[2];
-    CallFragment::Type type;
-    bool rc = fragment_type_from_string(type_str, type);
+//
+// Call list store methods.
+//
 
-    if (rc)
-    {
-      // Now form a call fragment and add it to the output of the operation.
-      CallFragment fragment;
-      fragment.timestamp = timestamp_str;
-      fragment.id = id_str;
-      fragment.type = type;
-      fragment.contents = column_it->column.value;
+Store::Store() :
+  CassandraStore::Store(KEYSPACE),
+  _backend(NULL),
+  _cache(NULL),
+  _executor(NULL),
+  _executor_config(),
+  _executor_stats(NULL),
+  _sharded_workers(false),
+  _num_workers(0),
+  _read_budget(NULL),
+  _pool_warmer(NULL),
+  _ready(false),
+  _trim_scheduler(NULL),
+  _hot_impus(NULL),
+  _op_timelines(NULL),
+  _op_trace(NULL),
+  _consistency_levels(),
+  _change_tokens(false),
+  _change_token_ttl(DEFAULT_CHANGE_TOKEN_TTL),
+  _last_change_token(0),
+  _ttl_window_s(0),
+  _write_ttls(NULL),
+  _ring_slots(0),
+  _call_summaries(false),
+  _row_fragments(NULL),
+  _row_bytes(NULL),
+  _read_fragment_bytes(NULL),
+  _write_fragment_bytes(NULL),
+  _recent_writes(NULL),
+  _writes_suppressed(new ThreadLocalCounter("call_list_writes_suppressed", NULL))
+{}
 
-      _fragments.push_back(fragment);
-    }
-  }
+Store::~Store()
+{
+  // Stop the sharded workers and connection warm up, and delete the trim
+  // scheduler and cache, first as they may be running operations using the
+  // store.
+  delete _executor; _executor = NULL;
 
-  TRC_DEBUG("Retrieved %d call fragments from the store", _fragments.size());
+  MonitoredConnectionPool* pool =
+                           dynamic_cast<MonitoredConnectionPool*>(_conn_pool);
 
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_READ_OK, 0);
-    ev.add_static_param(_fragments.size());
-    ev.add_var_param(columns.front().column.name);
-    ev.add_var_param(columns.back().column.name);
-    SAS::report_event(ev);
+  if (pool != NULL)
+  {
+    pool->set_warmer(NULL);
   }
 
-  return true;
+  delete _pool_warmer; _pool_warmer = NULL;
+  delete _trim_scheduler; _trim_scheduler = NULL;
+  delete _cache; _cache = NULL;
+  delete _backend; _backend = NULL;
+  delete _hot_impus; _hot_impus = NULL;
+  delete _read_budget; _read_budget = NULL;
+  delete _op_timelines; _op_timelines = NULL;
+  delete _recent_writes; _recent_writes = NULL;
+  delete _writes_suppressed; _writes_suppressed = NULL;
+  delete _write_ttls; _write_ttls = NULL;
+  delete _row_fragments; _row_fragments = NULL;
+  delete _row_bytes; _row_bytes = NULL;
+  delete _read_fragment_bytes; _read_fragment_bytes = NULL;
+  delete _write_fragment_bytes; _write_fragment_bytes = NULL;
 }
 
-void GetCallFragments::unhandled_exception(CassandraStore::ResultCode status,
-                                           std::string& description,
-                                           SAS::TrailId trail)
+void Store::configure_hot_impu_tracking(size_t capacity,
+                                        size_t top_n,
+                                        LastValueCache* stats_aggregator)
 {
-  CassandraStore::Operation::unhandled_exception(status, description, trail);
-
-  TRC_WARNING("Failed to get call list fragments for IMPU %s because '%s' (RC = %d)",
-              _impu.c_str(), description.c_str(), status);
-  sas_log_cassandra_failure(trail,
-                            SASEvent::CALL_LIST_READ_FAILED,
-                            status,
-                            description);
+  delete _hot_impus;
+  _hot_impus = new HotImpuTracker(capacity, top_n, stats_aggregator);
 }
 
-void GetCallFragments::get_result(std::vector<CallFragment>& fragments)
+void Store::configure_backend(Backend* backend)
 {
-  fragments = _fragments;
+  delete _backend;
+  _backend = backend;
 }
 
-GetCallFragments*
-Store::new_get_call_fragments_op(const std::string& impu)
+void Store::configure_change_tokens(int32_t ttl)
 {
-  return new GetCallFragments(impu);
+  if (ttl <= 0)
+  {
+    TRC_WARNING("Invalid change token TTL (%d), using %d",
+                ttl, DEFAULT_CHANGE_TOKEN_TTL);
+    ttl = DEFAULT_CHANGE_TOKEN_TTL;
+  }
+
+  _change_tokens = true;
+  _change_token_ttl = ttl;
 }
 
-//
-// Delete old call fragments for the givem IMPU.
-//
+int64_t Store::next_change_token(int64_t cass_timestamp)
+{
+  int64_t last = _last_change_token.load();
+  int64_t token;
 
-DeleteOldCallFragments::DeleteOldCallFragments(const std::string& impu,
-                                               const std::vector<CallFragment> fragments,
-                                               const int64_t cass_timestamp) :
-  CassandraStore::Operation(),
-  _impu(impu),
-  _fragments(fragments),
-  _cass_timestamp(cass_timestamp)
-{}
+  do
+  {
+    token = std::max(cass_timestamp, last + 1);
+  }
+  while (!_last_change_token.compare_exchange_weak(last, token));
 
-DeleteOldCallFragments::~DeleteOldCallFragments()
-{}
+  return token;
+}
 
-bool DeleteOldCallFragments::perform(CassandraStore::Client* client,
-                                     SAS::TrailId trail)
+void Store::configure_ring_slots(size_t num_slots)
 {
-  TRC_DEBUG("Deleting %d call fragments for IMPU '%s'",
-            _fragments.size(),
-            _impu.c_str());
-
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_TRIM_STARTED, 0);
-    ev.add_var_param(_impu);
-    ev.add_static_param(_fragments.size());
-    SAS::report_event(ev);
+  if (num_slots > MAX_RING_SLOTS)
+  {
+    TRC_WARNING("Too many call list ring slots (%zu), using %zu",
+                num_slots, MAX_RING_SLOTS);
+    num_slots = MAX_RING_SLOTS;
   }
 
-  // The column name is of the form:
-  //   call_<timestamp>_<id>_<type>
-  //
-  // For example:
-  //   call_20140722120000_12345_begin
-  std::vector<CassandraStore::RowColumns> to_delete;
-  for (std::vector<CallFragment>::const_iterator ii = _fragments.begin();
-       ii != _fragments.end();
-       ii++)
+  // The trimmer deletes fragment columns, which the ring slot layout doesn't
+  // write, so the two can't be used together.
+  if ((num_slots > 0) && (_trim_scheduler != NULL))
   {
-    std::string column_name;
-    column_name.append(CALL_COLUMN_PREFIX)
-               .append(ii->timestamp).append("_")
-               .append(ii->id).append("_")
-               .append(fragment_type_to_string(ii->type));
-    std::map<std::string, std::string> columns;
-    columns[column_name] = "";
-    to_delete.push_back(CassandraStore::RowColumns(COLUMN_FAMILY, _impu, columns));
+    TRC_ERROR("Call list ring slots can't be used with background trimming");
+    return;
   }
 
-  client->delete_columns(to_delete,
-                         _cass_timestamp);
+  _ring_slots = num_slots;
+}
 
-  TRC_DEBUG("Successfully deleted call fragments");
+void Store::configure_call_summaries()
+{
+  _call_summaries = true;
+}
 
-  { // New scope to avoid accidentally operating on the wrong SAS event.
-    SAS::Event ev(trail, SASEvent::CALL_LIST_TRIM_OK, 0);
-    SAS::report_event(ev);
+void Store::configure_op_trace(OpTraceWriter* writer)
+{
+  _op_trace.store(writer);
+}
+
+// Revalidates cached call lists by reading them from the store (bypassing
+// the cache).
+class StoreRevalidator : public CallListCache::Revalidator
+{
+public:
+  StoreRevalidator(Store* store) : _store(store) {}
+
+  CassandraStore::ResultCode revalidate(const std::string& impu,
+                                        std::vector<CallFragment>& fragments)
+  {
+    return _store->get_call_fragments_uncached_sync(impu, fragments, 0);
   }
 
-  return true;
-}
+private:
+  Store* _store;
+};
 
-void DeleteOldCallFragments::unhandled_exception(CassandraStore::ResultCode status,
-                                                 std::string& description,
-                                                 SAS::TrailId trail)
+void Store::configure_call_list_cache(size_t capacity,
+                                      uint64_t max_age_ms,
+                                      uint64_t max_stale_ms)
 {
-  CassandraStore::Operation::unhandled_exception(status, description, trail);
+  delete _cache;
+  _cache = new CallListCache(capacity,
+                             max_age_ms,
+                             max_stale_ms,
+                             new StoreRevalidator(this));
+}
 
-  TRC_WARNING("Failed to delete old call list fragments for IMPU %s because '%s' (RC = %d)",
-              _impu.c_str(), description.c_str(), status);
+void Store::load_call_list_snapshot(const std::string& path)
+{
+  if (_cache != NULL)
+  {
+    _cache->load_snapshot(path);
+  }
+}
+
+bool Store::save_call_list_snapshot(const std::string& path)
+{
+  return ((_cache != NULL) && (_cache->save_snapshot(path)));
+}
+
+// Trims call lists in the background by reading and deleting through the
+// store (bypassing the cache).
+class StoreTrimmer : public TrimScheduler::Trimmer
+{
+public:
+  StoreTrimmer(Store* store) : _store(store) {}
+
+  CassandraStore::ResultCode get_fragments(const std::string& impu,
+                                           std::vector<CallFragment>& fragments,
+                                           SAS::TrailId trail)
+  {
+    return _store->get_call_fragments_uncached_sync(impu, fragments, trail);
+  }
+
+  CassandraStore::ResultCode delete_fragments(const std::string& impu,
+                                              const std::vector<CallFragment>& fragments,
+                                              SAS::TrailId trail)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t cass_timestamp = ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+    return _store->delete_old_call_fragments_sync(impu,
+                                                  fragments,
+                                                  cass_timestamp,
+                                                  trail);
+  }
+
+private:
+  Store* _store;
+};
+
+void Store::configure_background_trim(const TrimScheduler::Config& config,
+                                      LastValueCache* stats_aggregator)
+{
+  if (_ring_slots > 0)
+  {
+    TRC_ERROR("Background trimming can't be used with call list ring slots");
+    return;
+  }
+
+  delete _trim_scheduler;
+  _trim_scheduler = new TrimScheduler(config,
+                                      new StoreTrimmer(this),
+                                      stats_aggregator);
+}
+
+size_t Store::get_trim_backlog()
+{
+  return (_trim_scheduler != NULL) ? _trim_scheduler->backlog() : 0;
+}
+
+void Store::configure_op_timelines(size_t ops_per_thread)
+{
+  delete _op_timelines;
+  _op_timelines = new OpTimelineRecorder(ops_per_thread);
+}
+
+bool Store::dump_slowest_operations(size_t n, std::string& json)
+{
+  if (_op_timelines == NULL)
+  {
+    return false;
+  }
+
+  _op_timelines->dump_slowest(n, json);
+  return true;
+}
+
+bool Store::do_sync(CassandraStore::Operation* op, SAS::TrailId trail)
+{
+  BackendOperation* backend_op = dynamic_cast<BackendOperation*>(op);
+
+  if ((_op_timelines != NULL) && (backend_op != NULL))
+  {
+    // This is called on a worker thread for asynchronous operations, so this
+    // is when the operation is dequeued.
+    backend_op->enable_timeline();
+    backend_op->timeline().trail = trail;
+    backend_op->mark(OpTimeline::DEQUEUE);
+  }
+
+  // Time the operation if the trim scheduler needs to know how busy cassandra
+  // is, or it is being traced.
+  OpTraceWriter* op_trace = _op_trace.load();
+  uint64_t trace_start_us = 0;
+  struct timespec start;
+
+  if ((_trim_scheduler != NULL) || (op_trace != NULL))
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (op_trace != NULL)
+    {
+      trace_start_us = op_trace->now_us();
+    }
+  }
+
+  bool success;
+
+  if ((_backend != NULL) && (backend_op != NULL))
+  {
+    success = backend_op->run(_backend, trail);
+  }
+  else
+  {
+    if ((_pool_warmer != NULL) && (backend_op != NULL))
+    {
+      // The CassandraStore checks out a connection before it performs the
+      // operation, so time how long that takes.
+      backend_op->set_pool_warmer(_pool_warmer, ConnectionPoolWarmer::now_us());
+    }
+
+    success = CassandraStore::Store::do_sync(op, trail);
+  }
+
+  if ((_trim_scheduler != NULL) || (op_trace != NULL))
+  {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t latency_us = ((end.tv_sec - start.tv_sec) * 1000000) +
+                          ((end.tv_nsec - start.tv_nsec) / 1000);
+
+    if (_trim_scheduler != NULL)
+    {
+      _trim_scheduler->record_latency(latency_us);
+    }
+
+    OpTraceRecord record;
+
+    if ((op_trace != NULL) &&
+        (backend_op != NULL) &&
+        (backend_op->get_trace_record(record)))
+    {
+      record.success = success;
+      record.start_us = trace_start_us;
+      record.latency_us = latency_us;
+      op_trace->write(record);
+    }
+  }
+
+  if ((_op_timelines != NULL) &&
+      (backend_op != NULL) &&
+      (backend_op->timeline_enabled()))
+  {
+    backend_op->mark(OpTimeline::HANDOFF);
+    _op_timelines->record(backend_op->timeline());
+  }
+
+  return success;
+}
+
+// Task that runs an asynchronous operation on a sharded worker, and passes
+// the result to its transaction.
+class ShardedOperationTask : public ShardedExecutor::Task
+{
+public:
+  ShardedOperationTask(Store* store,
+                       CassandraStore::Operation* op,
+                       CassandraStore::Transaction* trx) :
+    _store(store),
+    _op(op),
+    _trx(trx)
+  {}
+
+  void run()
+  {
+    if (_store->do_sync(_op, _trx->trail))
+    {
+      _trx->on_success(_op);
+    }
+    else
+    {
+      _trx->on_failure(_op);
+    }
+
+    delete _trx; _trx = NULL;
+    delete _op; _op = NULL;
+  }
+
+private:
+  Store* _store;
+  CassandraStore::Operation* _op;
+  CassandraStore::Transaction* _trx;
+};
+
+void Store::do_async(CassandraStore::Operation*& op,
+                     CassandraStore::Transaction*& trx)
+{
+  BackendOperation* backend_op = dynamic_cast<BackendOperation*>(op);
+
+  if ((_op_timelines != NULL) && (backend_op != NULL))
+  {
+    backend_op->enable_timeline();
+    backend_op->mark(OpTimeline::ENQUEUE);
+  }
+
+  const std::string* impu = (backend_op != NULL) ? backend_op->get_impu() : NULL;
+
+  if ((_executor != NULL) && (impu != NULL))
+  {
+    ShardedExecutor::Task* task = new ShardedOperationTask(this, op, trx);
+
+    if (_executor->submit(FnvHash::hash(*impu), task))
+    {
+      op = NULL;
+      trx = NULL;
+      return;
+    }
+
+    // The workers have stopped, so fall back to the shared pool.  The task
+    // only deletes the operation and transaction when it runs.
+    delete task;
+  }
+
+  CassandraStore::Store::do_async(op, trx);
+}
+
+void Store::configure_read_memory_budget(const ReadMemoryBudget::Config& config,
+                                         LastValueCache* stats_aggregator)
+{
+  delete _read_budget;
+  _read_budget = new ReadMemoryBudget(config, stats_aggregator);
+}
+
+void Store::configure_connection_warmup(const ConnectionPoolWarmer::Config& config,
+                                        LastValueCache* stats_aggregator)
+{
+  MonitoredConnectionPool* pool =
+                           dynamic_cast<MonitoredConnectionPool*>(_conn_pool);
+
+  if (pool == NULL)
+  {
+    // Use a connection pool that can report its connections to the warmer.
+    // The store hasn't been started, so the old pool has no connections.
+    delete _conn_pool;
+    pool = new MonitoredConnectionPool();
+    _conn_pool = pool;
+  }
+
+  ConnectionPoolWarmer* old_warmer = _pool_warmer;
+  _pool_warmer = new ConnectionPoolWarmer(config, stats_aggregator);
+  pool->set_warmer(_pool_warmer);
+
+  delete old_warmer;
+}
+
+CassandraStore::ResultCode Store::start()
+{
+  CassandraStore::ResultCode rc = CassandraStore::Store::start();
+
+  if ((rc == CassandraStore::OK) && (_sharded_workers))
+  {
+    if (_executor == NULL)
+    {
+      // Unless configured otherwise, use as many shards as the shared pool
+      // has worker threads.
+      ShardedExecutor::Config config = _executor_config;
+
+      if (config.num_shards == 0)
+      {
+        config.num_shards = std::max(_num_workers, 1u);
+      }
+
+      _executor = new ShardedExecutor(config, _executor_stats);
+    }
+
+    _executor->start();
+  }
+
+  if ((rc == CassandraStore::OK) && (_trim_scheduler != NULL))
+  {
+    _trim_scheduler->start();
+  }
+
+  if ((rc == CassandraStore::OK) && (_cache != NULL))
+  {
+    _cache->start();
+  }
+
+  // If the warm up fails, the warmer retries it in the background, and the
+  // store isn't ready until it succeeds.
+  if ((rc == CassandraStore::OK) && (_pool_warmer != NULL))
+  {
+    _pool_warmer->start(this);
+  }
+
+  _ready = (rc == CassandraStore::OK);
+  return rc;
+}
+
+void Store::stop()
+{
+  _ready = false;
+
+  if (_trim_scheduler != NULL)
+  {
+    _trim_scheduler->stop();
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->stop();
+  }
+
+  if (_executor != NULL)
+  {
+    _executor->stop();
+  }
+
+  if (_pool_warmer != NULL)
+  {
+    _pool_warmer->stop();
+  }
+
+  CassandraStore::Store::stop();
+}
+
+void Store::wait_stopped()
+{
+  if (_trim_scheduler != NULL)
+  {
+    _trim_scheduler->wait_stopped();
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->wait_stopped();
+  }
+
+  // The sharded workers finish the operations already submitted to them
+  // before they stop.
+  if (_executor != NULL)
+  {
+    _executor->wait_stopped();
+  }
+
+  if (_pool_warmer != NULL)
+  {
+    _pool_warmer->wait_stopped();
+  }
+
+  CassandraStore::Store::wait_stopped();
+}
+
+void Store::configure_workers(ExceptionHandler* exception_handler,
+                              unsigned int num_threads,
+                              unsigned int max_queue)
+{
+  _num_workers = num_threads;
+  CassandraStore::Store::configure_workers(exception_handler,
+                                           num_threads,
+                                           max_queue);
+}
+
+void Store::configure_sharded_workers(const ShardedExecutor::Config& config,
+                                      LastValueCache* stats_aggregator)
+{
+  // The workers are created when the store is started, so that the shards
+  // can be sized from the worker thread configuration.
+  delete _executor; _executor = NULL;
+  _executor_config = config;
+  _executor_stats = stats_aggregator;
+  _sharded_workers = true;
+}
+
+void Store::configure_consistency_levels(const ConsistencyLevels& levels)
+{
+  _consistency_levels = levels;
+}
+
+void Store::configure_write_deduplication(uint64_t window_ms,
+                                          size_t expected_writes,
+                                          double false_positive_rate,
+                                          LastValueCache* stats_aggregator)
+{
+  delete _recent_writes;
+  _recent_writes = new RecentWritesFilter(window_ms,
+                                          expected_writes,
+                                          false_positive_rate);
+
+  delete _writes_suppressed;
+  _writes_suppressed = new ThreadLocalCounter("call_list_writes_suppressed",
+                                              stats_aggregator);
+}
+
+void Store::configure_size_stats(LastValueCache* stats_aggregator)
+{
+  delete _row_fragments;
+  _row_fragments = new ThreadLocalHistogram("call_list_row_fragments",
+                                            stats_aggregator);
+  delete _row_bytes;
+  _row_bytes = new ThreadLocalHistogram("call_list_row_bytes",
+                                        stats_aggregator);
+  delete _read_fragment_bytes;
+  _read_fragment_bytes = new ThreadLocalHistogram("call_list_read_fragment_bytes",
+                                                  stats_aggregator);
+  delete _write_fragment_bytes;
+  _write_fragment_bytes = new ThreadLocalHistogram("call_list_write_fragment_bytes",
+                                                   stats_aggregator);
+}
+
+void Store::configure_ttl_alignment(int32_t window_s,
+                                    LastValueCache* stats_aggregator)
+{
+  _ttl_window_s = window_s;
+
+  delete _write_ttls; _write_ttls = NULL;
+  if (_ttl_window_s > 0)
+  {
+    _write_ttls = new ThreadLocalAccumulator("call_list_write_ttl",
+                                             stats_aggregator);
+  }
+}
+
+int32_t Store::align_ttl(int32_t ttl, int32_t window_s, int64_t now_s)
+{
+  if ((ttl <= 0) || (window_s <= 0))
+  {
+    return ttl;
+  }
+
+  // Round the expiry time up to the next window boundary (leaving it alone
+  // if it is already on one).
+  int64_t expiry_s = now_s + ttl;
+  int64_t aligned_expiry_s = ((expiry_s + window_s - 1) / window_s) * window_s;
+  int64_t aligned_ttl = aligned_expiry_s - now_s;
+
+  // Don't overflow the TTL (cassandra limits TTLs to 20 years anyway).
+  return (aligned_ttl > std::numeric_limits<int32_t>::max()) ? ttl : (int32_t)aligned_ttl;
+}
+
+void Store::get_hot_impus_by_ops(size_t n,
+                                 std::vector<HeavyHitters::Item>& impus)
+{
+  impus.clear();
+
+  if (_hot_impus != NULL)
+  {
+    _hot_impus->top_by_ops(n, impus);
+  }
+}
+
+void Store::get_hot_impus_by_bytes(size_t n,
+                                   std::vector<HeavyHitters::Item>& impus)
+{
+  impus.clear();
+
+  if (_hot_impus != NULL)
+  {
+    _hot_impus->top_by_bytes(n, impus);
+  }
+}
+
+void Store::on_write(const std::string& impu, const CallFragment& fragment)
+{
+  if (_trim_scheduler != NULL)
+  {
+    _trim_scheduler->record_write(impu);
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->invalidate(impu);
+  }
+
+  size_t num_bytes = (fragment.timestamp.length() +
+                      fragment.id.length() +
+                      fragment.contents.length());
+
+  if (_hot_impus != NULL)
+  {
+    _hot_impus->record(impu, num_bytes);
+  }
+
+  if (_write_fragment_bytes != NULL)
+  {
+    _write_fragment_bytes->record(num_bytes);
+  }
+}
+
+void Store::on_write_suppressed(const std::string& impu,
+                                const CallFragment& fragment)
+{
+  _writes_suppressed->increment();
+}
+
+void Store::on_read(const std::string& impu,
+                    size_t num_fragments,
+                    size_t num_bytes)
+{
+  if (_hot_impus != NULL)
+  {
+    _hot_impus->record(impu, num_bytes);
+  }
+
+  // Reads that found nothing new (e.g. because the client's change token was
+  // current) didn't read a row.
+  if ((_row_fragments != NULL) && (num_fragments > 0))
+  {
+    _row_fragments->record(num_fragments);
+    _row_bytes->record(num_bytes);
+  }
+}
+
+void Store::on_read_fragment(size_t num_bytes)
+{
+  if (_read_fragment_bytes != NULL)
+  {
+    _read_fragment_bytes->record(num_bytes);
+  }
+}
+
+void Store::on_import(const std::string& impu)
+{
+  // Imported fragments change the call list as a write does, but aren't
+  // counted as writes.
+  if (_trim_scheduler != NULL)
+  {
+    _trim_scheduler->record_write(impu);
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->invalidate(impu);
+  }
+}
+
+void Store::on_trim(const std::string& impu,
+                    size_t num_fragments,
+                    size_t num_bytes)
+{
+  if (_cache != NULL)
+  {
+    _cache->invalidate(impu);
+  }
+
+  if (_hot_impus != NULL)
+  {
+    _hot_impus->record(impu, num_bytes);
+  }
+}
+
+//
+// Operation definitions.
+//
+
+//
+// Write a new call fragment to cassandra.
+//
+
+WriteCallFragment::WriteCallFragment(const std::string& impu,
+                                     const CallFragment& fragment,
+                                     const int64_t cass_timestamp,
+                                     const int32_t ttl) :
+  BackendOperation("WriteCallFragment"),
+  _impu(impu),
+  _fragment(fragment),
+  _cass_timestamp(cass_timestamp),
+  _ttl(ttl),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::ONE),
+  _recent_writes(NULL),
+  _change_token(0),
+  _change_token_ttl(0),
+  _num_slots(0),
+  _head_consistency_level(cass::ConsistencyLevel::LOCAL_QUORUM),
+  _head_fallback_consistency_level(cass::ConsistencyLevel::ONE),
+  _summary(false)
+{}
+
+WriteCallFragment::~WriteCallFragment()
+{}
+
+bool WriteCallFragment::execute(Backend* backend,
+                                SAS::TrailId trail)
+{
+  // Log the start of the write.
+  TRC_DEBUG("Writing %s call fragment for IMPU '%s'",
+            fragment_type_to_string(_fragment.type).c_str(),
+            _impu.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_WRITE_STARTED, 0);
+    ev.add_static_param(_fragment.type);
+    ev.add_var_param(_impu);
+    ev.add_var_param(_fragment.timestamp);
+    ev.add_var_param(_fragment.contents);
+    SAS::report_event(ev);
+  }
+
+  std::string column_name = call_column_name(_fragment);
+
+  // If this exact fragment has been written recently (e.g. because of a
+  // retransmission) there's no need to write it again.
+  RecentWritesFilter::Key recent_writes_key;
+
+  if (_recent_writes != NULL)
+  {
+    recent_writes_key.add(_impu).add(column_name).add(_fragment.contents);
+
+    if (_recent_writes->contains(recent_writes_key))
+    {
+      TRC_DEBUG("Suppress repeated write of %s for IMPU '%s'",
+                column_name.c_str(), _impu.c_str());
+
+      SAS::Event ev(trail, SASEvent::CALL_LIST_WRITE_SUPPRESSED, 0);
+      ev.add_var_param(column_name);
+      SAS::report_event(ev);
+
+      if (_observer != NULL)
+      {
+        _observer->on_write_suppressed(_impu, _fragment);
+      }
+
+      return true;
+    }
+  }
+
+  // Write to the supplied impu only.
+  RowWrites rows;
+
+  if (_num_slots > 0)
+  {
+    add_ring_slot_columns(backend, rows[_impu]);
+  }
+  else
+  {
+    CallColumn column;
+    column.name = column_name;
+    column.value = _fragment.contents;
+    column.timestamp = _cass_timestamp;
+    column.ttl = _ttl;
+    rows[_impu].push_back(column);
+
+    if (_summary)
+    {
+      column.name = summary_column_name(_fragment);
+      column.value = _fragment.summary;
+      rows[_impu].push_back(column);
+    }
+  }
+
+  if (_change_token != 0)
+  {
+    rows[_impu].push_back(change_token_column(_change_token,
+                                              _change_token_ttl));
+  }
+
+  mark(OpTimeline::SEND);
+  backend->write_columns(rows, _consistency_level);
+  mark(OpTimeline::RECEIVE);
+
+  // Only remember the write once it has succeeded, so that retries of failed
+  // writes aren't suppressed.
+  if (_recent_writes != NULL)
+  {
+    _recent_writes->add(recent_writes_key);
+  }
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_WRITE_OK, 0);
+    SAS::report_event(ev);
+  }
+
+  if (_observer != NULL)
+  {
+    _observer->on_write(_impu, _fragment);
+  }
+
+  return true;
+}
+
+void WriteCallFragment::add_ring_slot_columns(Backend* backend,
+                                              std::vector<CallColumn>& columns)
+{
+  // Read the head to find the slot to overwrite.  If the row has no head
+  // (because it is new, or has expired) start again from the first slot.
+  //
+  // Two concurrent writes to the same IMPU can read the same head, in which
+  // case one overwrites the other's fragment.  Writes to an IMPU are rare
+  // enough (a few per call) for this to be accepted rather than paying for a
+  // lightweight transaction on every write.
+  //
+  // The head is read at the same consistency level as call lists, rather
+  // than the write level, so that (with quorum reads and writes) it sees the
+  // head of the last write.  As for reads, if the cluster can't satisfy that
+  // level, retry at the fallback level.
+  std::vector<CallColumn> head_columns;
+  bool retry = false;
+
+  try
+  {
+    backend->get_columns(_impu,
+                         SLOT_HEAD_COLUMN,
+                         SLOT_HEAD_COLUMN,
+                         1,
+                         head_columns,
+                         _head_consistency_level);
+  }
+  catch (cass::UnavailableException& ue)
+  {
+    if (_head_fallback_consistency_level == _head_consistency_level)
+    {
+      throw;
+    }
+
+    retry = true;
+  }
+  catch (cass::TimedOutException& te)
+  {
+    if (_head_fallback_consistency_level == _head_consistency_level)
+    {
+      throw;
+    }
+
+    retry = true;
+  }
+
+  if (retry)
+  {
+    TRC_DEBUG("Failed to read ring slot head for %s at consistency level %d, retry at %d",
+              _impu.c_str(), _head_consistency_level, _head_fallback_consistency_level);
+    head_columns.clear();
+    backend->get_columns(_impu,
+                         SLOT_HEAD_COLUMN,
+                         SLOT_HEAD_COLUMN,
+                         1,
+                         head_columns,
+                         _head_fallback_consistency_level);
+  }
+
+  uint64_t head = 0;
+
+  if (!head_columns.empty())
+  {
+    head = strtoull(head_columns.front().value.c_str(), NULL, 10);
+  }
+
+  TRC_DEBUG("Write to ring slot %llu of %zu for IMPU '%s'",
+            (unsigned long long)(head % _num_slots), _num_slots, _impu.c_str());
+
+  CallColumn column;
+  column.name = slot_column_name(head % _num_slots);
+  column.value = slot_column_value(_fragment);
+  column.timestamp = _cass_timestamp;
+  column.ttl = _ttl;
+  columns.push_back(column);
+
+  // The head is written with the same TTL as the fragment, so it expires
+  // with the newest slot.
+  column.name = SLOT_HEAD_COLUMN;
+  column.value = std::to_string(head + 1);
+  columns.push_back(column);
+}
+
+bool WriteCallFragment::get_trace_record(OpTraceRecord& record) const
+{
+  record.type = OpTraceRecord::WRITE;
+  record.impu_hash = OpTraceRecord::hash_impu(_impu);
+  record.num_fragments = 1;
+  record.num_bytes = (_fragment.timestamp.length() +
+                      _fragment.id.length() +
+                      _fragment.contents.length());
+  return true;
+}
+
+void WriteCallFragment::unhandled_exception(CassandraStore:: ResultCode status,
+                                            std::string& description,
+                                            SAS::TrailId trail)
+{
+  CassandraStore::Operation::unhandled_exception(status, description, trail);
+
+  TRC_WARNING("Failed to write call list fragment for IMPU %s because '%s' (RC = %d)",
+              _impu.c_str(), description.c_str(), status);
+  sas_log_cassandra_failure(trail,
+                            SASEvent::CALL_LIST_WRITE_FAILED,
+                            status,
+                            description);
+}
+
+WriteCallFragment*
+Store::new_write_call_fragment_op(const std::string& impu,
+                                  const CallFragment& fragment,
+                                  const int64_t cass_timestamp,
+                                  const int32_t ttl)
+{
+  int32_t effective_ttl = ttl;
+
+  if (_ttl_window_s > 0)
+  {
+    effective_ttl = align_ttl(ttl, _ttl_window_s, time(NULL));
+    _write_ttls->accumulate(effective_ttl);
+  }
+
+  WriteCallFragment* op = new WriteCallFragment(impu,
+                                                fragment,
+                                                cass_timestamp,
+                                                effective_ttl);
+  op->set_observer(this);
+  op->set_consistency_level(_consistency_levels.write);
+  op->set_recent_writes_filter(_recent_writes);
+
+  if (_change_tokens)
+  {
+    op->enable_change_token(next_change_token(cass_timestamp),
+                            _change_token_ttl);
+  }
+
+  op->set_ring_slots(_ring_slots);
+  op->set_head_consistency_levels(_consistency_levels.read,
+                                  _consistency_levels.read_fallback);
+
+  if (_call_summaries)
+  {
+    op->enable_summary();
+  }
+
+  return op;
+}
+
+//
+// Get all the call fragments for a given IMPU.
+//
+
+GetCallFragments::GetCallFragments(const std::string& impu,
+                                   bool use_arena) :
+  BackendOperation("GetCallFragments"),
+  _impu(impu),
+  _use_arena(use_arena),
+  _delta(false),
+  _since(),
+  _selected_calls(false),
+  _calls(),
+  _fragments(),
+  _arena(),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::LOCAL_QUORUM),
+  _fallback_consistency_level(cass::ConsistencyLevel::ONE),
+  _check_change_token(false),
+  _client_change_token(),
+  _change_token(),
+  _not_modified(false),
+  _ring_slots(false),
+  _summaries_only(false),
+  _num_bytes(0),
+  _budget(NULL),
+  _budget_bytes(0)
+{}
+
+GetCallFragments::GetCallFragments(const std::string& impu,
+                                   const CallListWatermark& since,
+                                   bool use_arena) :
+  BackendOperation("GetCallFragments"),
+  _impu(impu),
+  _use_arena(use_arena),
+  _delta(true),
+  _since(since),
+  _selected_calls(false),
+  _calls(),
+  _fragments(),
+  _arena(),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::LOCAL_QUORUM),
+  _fallback_consistency_level(cass::ConsistencyLevel::ONE),
+  _check_change_token(false),
+  _client_change_token(),
+  _change_token(),
+  _not_modified(false),
+  _ring_slots(false),
+  _summaries_only(false),
+  _num_bytes(0),
+  _budget(NULL),
+  _budget_bytes(0)
+{}
+
+GetCallFragments::GetCallFragments(const std::string& impu,
+                                   const std::vector<CallListWatermark>& calls) :
+  BackendOperation("GetCallFragments"),
+  _impu(impu),
+  _use_arena(false),
+  _delta(false),
+  _since(),
+  _selected_calls(true),
+  _calls(calls),
+  _fragments(),
+  _arena(),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::LOCAL_QUORUM),
+  _fallback_consistency_level(cass::ConsistencyLevel::ONE),
+  _check_change_token(false),
+  _client_change_token(),
+  _change_token(),
+  _not_modified(false),
+  _ring_slots(false),
+  _summaries_only(false),
+  _num_bytes(0),
+  _budget(NULL),
+  _budget_bytes(0)
+{}
+
+GetCallFragments::~GetCallFragments()
+{
+  if (_budget_bytes > 0)
+  {
+    _budget->release(_budget_bytes);
+  }
+}
+
+bool GetCallFragments::execute(Backend* backend,
+                               SAS::TrailId trail)
+{
+  // Log the start of the read
+  TRC_DEBUG("Get call fragments for IMPU: '%s'", _impu.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_READ_STARTED, 0);
+    ev.add_var_param(_impu);
+    SAS::report_event(ev);
+  }
+
+  // Don't start reading while other reads' results are holding all the
+  // memory in the budget, and reserve memory for this read's results.
+  uint64_t reserved_bytes = 0;
+
+  if (_budget != NULL)
+  {
+    if (!_budget->admit(reserved_bytes))
+    {
+      reject_overloaded(0, trail);
+      return false;
+    }
+
+    _budget_bytes += reserved_bytes;
+  }
+
+  // If the client's token is still current, nothing has changed since its
+  // last read, so there's no need to read the row.
+  if ((_check_change_token) && (change_token_matches(backend)))
+  {
+    TRC_DEBUG("Call list for IMPU '%s' not modified since %s",
+              _impu.c_str(), _client_change_token.c_str());
+
+    SAS::Event ev(trail, SASEvent::CALL_LIST_READ_NOT_MODIFIED, 0);
+    ev.add_var_param(_client_change_token);
+    SAS::report_event(ev);
+
+    _not_modified = true;
+
+    if (_observer != NULL)
+    {
+      _observer->on_read(_impu, 0, 0);
+    }
+
+    return true;
+  }
+
+  std::vector<CallColumn> columns;
+
+  if (_delta)
+  {
+    // Only get the call columns that sort after the client's watermark.  If
+    // there aren't any then nothing has changed and there is nothing to
+    // decode.
+    if (!get_columns_since(backend, columns, trail))
+    {
+      TRC_DEBUG("No call fragments since %s_%s",
+                _since.timestamp.c_str(), _since.id.c_str());
+
+      SAS::Event ev(trail, SASEvent::CALL_LIST_READ_UNCHANGED, 0);
+      ev.add_var_param(_since.timestamp);
+      ev.add_var_param(_since.id);
+      SAS::report_event(ev);
+
+      if (_observer != NULL)
+      {
+        _observer->on_read(_impu, 0, 0);
+      }
+
+      return true;
+    }
+  }
+  else
+  {
+    // Get all the call columns for the IMPU's cassandra row.
+    if (_selected_calls)
+    {
+      get_selected_call_columns(backend, columns, trail);
+    }
+    else if (_ring_slots)
+    {
+      get_slot_columns(backend, columns);
+    }
+    else if (_summaries_only)
+    {
+      ha_get_call_columns(backend,
+                          SUMMARY_COLUMN_PREFIX,
+                          SUMMARY_COLUMN_RANGE_END,
+                          columns,
+                          trail);
+    }
+    else
+    {
+      ha_get_call_columns(backend,
+                          CALL_COLUMN_PREFIX,
+                          CALL_COLUMN_RANGE_END,
+                          columns,
+                          trail);
+    }
+
+    if (columns.empty())
+    {
+      CassandraStore::RowNotFoundException row_not_found_ex(COLUMN_FAMILY, _impu);
+      throw row_not_found_ex;
+    }
+  }
+
+  // The columns and the fragments decoded from them are both held until the
+  // end of the operation, when the columns are freed.
+  uint64_t row_bytes = 0;
+
+  for(std::vector<CallColumn>::const_iterator column_it = columns.begin();
+      column_it != columns.end();
+      ++column_it)
+  {
+    row_bytes += column_it->name.length() + column_it->value.length();
+  }
+
+  if (_budget != NULL)
+  {
+    // Exchange the reservation for the actual size.
+    _budget_bytes -= reserved_bytes;
+
+    if (!_budget->charge(2 * row_bytes, reserved_bytes))
+    {
+      reject_overloaded(row_bytes, trail);
+      return false;
+    }
+
+    _budget_bytes += 2 * row_bytes;
+  }
+
+  mark(OpTimeline::DECODE_START);
+
+  if (_use_arena)
+  {
+    decode_columns_to_arena(columns);
+  }
+  else
+  {
+    decode_columns(columns);
+  }
+
+  mark(OpTimeline::DECODE_END);
+
+  size_t num_fragments = _use_arena ? _arena.size() : _fragments.size();
+  TRC_DEBUG("Retrieved %zu call fragments from the store", num_fragments);
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_READ_OK, 0);
+    ev.add_static_param(num_fragments);
+    ev.add_var_param(columns.front().name);
+    ev.add_var_param(columns.back().name);
+    SAS::report_event(ev);
+  }
+
+  for(std::vector<CallColumn>::const_iterator column_it = columns.begin();
+      column_it != columns.end();
+      ++column_it)
+  {
+    size_t column_bytes = column_it->name.length() + column_it->value.length();
+    _num_bytes += column_bytes;
+
+    if (_observer != NULL)
+    {
+      _observer->on_read_fragment(column_bytes);
+    }
+  }
+
+  if (_observer != NULL)
+  {
+    _observer->on_read(_impu, num_fragments, _num_bytes);
+  }
+
+  if (_budget_bytes > 0)
+  {
+    _budget->release(row_bytes);
+    _budget_bytes -= row_bytes;
+  }
+
+  return true;
+}
+
+void GetCallFragments::reject_overloaded(uint64_t num_bytes, SAS::TrailId trail)
+{
+  TRC_WARNING("Rejecting call list read for IMPU %s as the read memory budget is used up",
+              _impu.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_OVERLOAD, 0);
+    ev.add_static_param(num_bytes);
+    ev.add_static_param(_budget->bytes_held());
+    ev.add_static_param(_budget->max_bytes());
+    ev.add_var_param(_impu);
+    SAS::report_event(ev);
+  }
+
+  std::string description = "Read memory budget exceeded";
+  unhandled_exception(CassandraStore::RESOURCE_ERROR, description, trail);
+}
+
+bool GetCallFragments::get_trace_record(OpTraceRecord& record) const
+{
+  record.type = OpTraceRecord::READ;
+  record.impu_hash = OpTraceRecord::hash_impu(_impu);
+  record.num_fragments = _use_arena ? _arena.size() : _fragments.size();
+  record.num_bytes = _num_bytes;
+  return true;
+}
+
+void GetCallFragments::ha_get_columns(Backend* backend,
+                                      const std::string& start,
+                                      const std::string& finish,
+                                      int32_t max_columns,
+                                      std::vector<CallColumn>& columns)
+{
+  // Read at the configured consistency level.  If the cluster can't satisfy
+  // that (because too few replicas are up, or they are too slow) retry at the
+  // fallback level.  This extends the HAOperation behaviour to allow the
+  // levels to be configured.
+  bool retry = false;
+  mark_first(OpTimeline::SEND);
+
+  try
+  {
+    backend->get_columns(_impu,
+                         start,
+                         finish,
+                         max_columns,
+                         columns,
+                         _consistency_level);
+  }
+  catch (cass::UnavailableException& ue)
+  {
+    if (_fallback_consistency_level == _consistency_level)
+    {
+      throw;
+    }
+
+    retry = true;
+  }
+  catch (cass::TimedOutException& te)
+  {
+    if (_fallback_consistency_level == _consistency_level)
+    {
+      throw;
+    }
+
+    retry = true;
+  }
+
+  if (retry)
+  {
+    TRC_DEBUG("Failed to read call list for %s at consistency level %d, retry at %d",
+              _impu.c_str(), _consistency_level, _fallback_consistency_level);
+    columns.clear();
+    backend->get_columns(_impu,
+                         start,
+                         finish,
+                         max_columns,
+                         columns,
+                         _fallback_consistency_level);
+  }
+
+  mark(OpTimeline::RECEIVE);
+}
+
+void GetCallFragments::ha_get_call_columns(Backend* backend,
+                                           const std::string& start,
+                                           const std::string& finish,
+                                           std::vector<CallColumn>& columns,
+                                           SAS::TrailId trail)
+{
+  ha_get_columns(backend,
+                 start,
+                 finish,
+                 std::numeric_limits<int32_t>::max(),
+                 columns);
+
+  // Strip the prefix from the column names.
+  const std::string& prefix = column_prefix();
+
+  for (std::vector<CallColumn>::iterator column_it = columns.begin();
+       column_it != columns.end();
+       ++column_it)
+  {
+    column_it->name.erase(0, prefix.length());
+  }
+}
+
+bool GetCallFragments::change_token_matches(Backend* backend)
+{
+  // Read just the token column.  This is read before the fragments, so if the
+  // call list changes in between, the client gets the new fragments with the
+  // old token, and just reads them again next time.
+  std::vector<CallColumn> columns;
+  ha_get_columns(backend, CHANGE_TOKEN_COLUMN, CHANGE_TOKEN_COLUMN, 1, columns);
+
+  if (!columns.empty())
+  {
+    _change_token = columns.front().value;
+  }
+
+  // An IMPU without a token (because the token has expired, or was never
+  // written) can't be known to be unchanged.
+  return ((!_change_token.empty()) && (_change_token == _client_change_token));
+}
+
+bool GetCallFragments::get_columns_since(Backend* backend,
+                                         std::vector<CallColumn>& columns,
+                                         SAS::TrailId trail)
+{
+  // All of the columns for the watermark call have names beginning
+  // call_<timestamp>_<id>_, so the first column after them is the one that
+  // starts with that string with its trailing underscore incremented.  Column
+  // names sort lexically, so this slice is exactly the calls that are newer
+  // than the watermark.
+  //
+  // Unlike the full row read, an empty result is not an error - it just means
+  // nothing has changed.
+  std::string since = _since.timestamp + "_" + _since.id + "`";
+
+  if (_ring_slots)
+  {
+    // Slots aren't in call order, so read them all and drop the calls up to
+    // the watermark.  The row is small, so this costs little more.
+    get_slot_columns(backend, columns);
+
+    std::vector<CallColumn>::iterator first_new =
+      std::lower_bound(columns.begin(),
+                       columns.end(),
+                       since,
+                       column_name_before);
+    columns.erase(columns.begin(), first_new);
+  }
+  else
+  {
+    ha_get_call_columns(backend,
+                        column_prefix() + since,
+                        _summaries_only ? SUMMARY_COLUMN_RANGE_END :
+                                          CALL_COLUMN_RANGE_END,
+                        columns,
+                        trail);
+  }
+
+  return !columns.empty();
+}
+
+void GetCallFragments::get_selected_call_columns(Backend* backend,
+                                                 std::vector<CallColumn>& columns,
+                                                 SAS::TrailId trail)
+{
+  if (_ring_slots)
+  {
+    // The slots aren't named by call, so read them all and keep the selected
+    // calls.
+    std::vector<CallColumn> row_columns;
+    get_slot_columns(backend, row_columns);
+
+    for (std::vector<CallColumn>::const_iterator column_it = row_columns.begin();
+         column_it != row_columns.end();
+         ++column_it)
+    {
+      for (std::vector<CallListWatermark>::const_iterator call_it = _calls.begin();
+           call_it != _calls.end();
+           ++call_it)
+      {
+        std::string call_prefix = call_it->timestamp + "_" + call_it->id + "_";
+
+        if (column_it->name.compare(0, call_prefix.length(), call_prefix) == 0)
+        {
+          columns.push_back(*column_it);
+          break;
+        }
+      }
+    }
+
+    return;
+  }
+
+  // Read each call's columns, which are all named
+  // <prefix><timestamp>_<id>_<type>.  The calls may be in any order (and may
+  // be repeated), so sort the columns into call order afterwards.
+  for (std::vector<CallListWatermark>::const_iterator call_it = _calls.begin();
+       call_it != _calls.end();
+       ++call_it)
+  {
+    std::string call = call_it->timestamp + "_" + call_it->id;
+    std::vector<CallColumn> call_columns;
+    ha_get_call_columns(backend,
+                        column_prefix() + call + "_",
+                        column_prefix() + call + "`",
+                        call_columns,
+                        trail);
+    columns.insert(columns.end(), call_columns.begin(), call_columns.end());
+  }
+
+  std::sort(columns.begin(), columns.end(), column_name_less);
+  columns.erase(std::unique(columns.begin(), columns.end(), column_name_equal),
+                columns.end());
+}
+
+const std::string& GetCallFragments::column_prefix() const
+{
+  return _summaries_only ? SUMMARY_COLUMN_PREFIX : CALL_COLUMN_PREFIX;
+}
+
+void GetCallFragments::get_slot_columns(Backend* backend,
+                                        std::vector<CallColumn>& columns)
+{
+  // Read the call columns as well as the slots, so that fragments written
+  // before the ring slot layout was enabled are still returned until they
+  // expire.  The slots are then put back into call order.
+  std::vector<CallColumn> row_columns;
+  ha_get_columns(backend,
+                 CALL_COLUMN_PREFIX,
+                 SLOT_COLUMN_RANGE_END,
+                 std::numeric_limits<int32_t>::max(),
+                 row_columns);
+  slot_columns_to_call_columns(row_columns, columns);
+}
+
+void GetCallFragments::decode_columns(const std::vector<CallColumn>& columns)
+{
+  for(std::vector<CallColumn>::const_iterator column_it = columns.begin();
+      column_it != columns.end();
+      ++column_it)
+  {
+    // The columns name is of the form call_<timestamp>_<id>_<type>, with the
+    // call_ prefix already stripped off.  Split it in place, and build the
+    // fragment directly in the output of the operation.
+    const std::string& name = column_it->name;
+    FieldSpan fields[2];
+    CallFragment::Type type;
+
+    if (!CALL_COLUMN.decode(name, false, fields, type))
+    {
+      // LCOV_EXCL_START
+      TRC_WARNING("Invalid column name (%s)", name.c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
+    _fragments.push_back(CallFragment());
+    CallFragment& fragment = _fragments.back();
+    fragment.timestamp.assign(name, fields[0].start, fields[0].length);
+    fragment.id.assign(name, fields[1].start, fields[1].length);
+    fragment.type = type;
+
+    if (_summaries_only)
+    {
+      fragment.summary = column_it->value;
+    }
+    else
+    {
+      fragment.contents = column_it->value;
+    }
+  }
+}
+
+void GetCallFragments::decode_columns_to_arena(const std::vector<CallColumn>& columns)
+{
+  // Size the arena up front so that all the strings end up in one block.  The
+  // column name holds the timestamp and id (plus the type and separators,
+  // which aren't copied), so this slightly over-estimates the space needed.
+  size_t num_bytes = 0;
+
+  for(std::vector<CallColumn>::const_iterator column_it = columns.begin();
+      column_it != columns.end();
+      ++column_it)
+  {
+    num_bytes += column_it->name.length() + column_it->value.length();
+  }
+
+  _arena.reserve(columns.size(), num_bytes);
+
+  for(std::vector<CallColumn>::const_iterator column_it = columns.begin();
+      column_it != columns.end();
+      ++column_it)
+  {
+    // The columns name is of the form call_<timestamp>_<id>_<type>, with the
+    // call_ prefix already stripped off.  Split it in place rather than
+    // tokenizing it into new strings.
+    const std::string& name = column_it->name;
+    FieldSpan fields[2];
+    CallFragment::Type type;
+
+    if (!CALL_COLUMN.decode(name, false, fields, type))
+    {
+      // LCOV_EXCL_START
+      TRC_WARNING("Invalid column name (%s)", name.c_str());
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
+    const std::string& value = column_it->value;
+
+    CallFragmentView fragment;
+    fragment.timestamp = _arena.copy(name.data() + fields[0].start, fields[0].length);
+    fragment.id = _arena.copy(name.data() + fields[1].start, fields[1].length);
+    fragment.type = type;
+    fragment.contents = _arena.copy(value.data(), value.length());
+
+    _arena.push_back(fragment);
+  }
+}
+
+void GetCallFragments::unhandled_exception(CassandraStore::ResultCode status,
+                                           std::string& description,
+                                           SAS::TrailId trail)
+{
+  CassandraStore::Operation::unhandled_exception(status, description, trail);
+
+  TRC_WARNING("Failed to get call list fragments for IMPU %s because '%s' (RC = %d)",
+              _impu.c_str(), description.c_str(), status);
+  sas_log_cassandra_failure(trail,
+                            SASEvent::CALL_LIST_READ_FAILED,
+                            status,
+                            description);
+}
+
+void GetCallFragments::get_result(std::vector<CallFragment>& fragments)
+{
+  fragments = _fragments;
+}
+
+void GetCallFragments::get_result(CallFragmentArena& fragments)
+{
+  fragments.clear();
+  fragments.swap(_arena);
+
+  // The results belong to the caller now.
+  if (_budget_bytes > 0)
+  {
+    _budget->release(_budget_bytes);
+    _budget_bytes = 0;
+  }
+}
+
+void Store::apply_read_options(GetCallFragments* op)
+{
+  op->set_observer(this);
+  op->set_memory_budget(_read_budget);
+  op->set_consistency_levels(_consistency_levels.read,
+                             _consistency_levels.read_fallback);
+  op->set_ring_slots(_ring_slots > 0);
+}
+
+GetCallFragments*
+Store::new_get_call_fragments_op(const std::string& impu)
+{
+  GetCallFragments* op = new GetCallFragments(impu);
+  apply_read_options(op);
+  return op;
+}
+
+GetCallFragments*
+Store::new_get_call_fragments_op(const std::string& impu,
+                                 bool use_arena)
+{
+  GetCallFragments* op = new GetCallFragments(impu, use_arena);
+  apply_read_options(op);
+  return op;
+}
+
+GetCallFragments*
+Store::new_get_call_fragments_since_op(const std::string& impu,
+                                       const CallListWatermark& since)
+{
+  GetCallFragments* op = new GetCallFragments(impu, since);
+  apply_read_options(op);
+  return op;
+}
+
+GetCallFragments*
+Store::new_get_call_fragments_if_changed_op(const std::string& impu,
+                                            const std::string& change_token,
+                                            bool use_arena)
+{
+  GetCallFragments* op = new GetCallFragments(impu, use_arena);
+  apply_read_options(op);
+  op->set_client_change_token(change_token);
+  return op;
+}
+
+GetCallFragments*
+Store::new_get_call_summaries_op(const std::string& impu)
+{
+  GetCallFragments* op = new GetCallFragments(impu);
+  apply_read_options(op);
+
+  // Summaries are not kept in the ring slot layout.
+  op->set_ring_slots(false);
+  op->set_summaries_only();
+  return op;
+}
+
+GetCallFragments*
+Store::new_get_call_contents_op(const std::string& impu,
+                                const std::vector<CallListWatermark>& calls)
+{
+  GetCallFragments* op = new GetCallFragments(impu, calls);
+  apply_read_options(op);
+  return op;
+}
+
+//
+// Delete old call fragments for the givem IMPU.
+//
+
+DeleteOldCallFragments::DeleteOldCallFragments(const std::string& impu,
+                                               const std::vector<CallFragment> fragments,
+                                               const int64_t cass_timestamp) :
+  BackendOperation("DeleteOldCallFragments"),
+  _impu(impu),
+  _fragments(fragments),
+  _cass_timestamp(cass_timestamp),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::ONE),
+  _change_token(0),
+  _change_token_ttl(0),
+  _summaries(false)
+{}
+
+DeleteOldCallFragments::~DeleteOldCallFragments()
+{}
+
+bool DeleteOldCallFragments::execute(Backend* backend,
+                                     SAS::TrailId trail)
+{
+  TRC_DEBUG("Deleting %zu call fragments for IMPU '%s'",
+            _fragments.size(),
+            _impu.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_TRIM_STARTED, 0);
+    ev.add_var_param(_impu);
+    ev.add_static_param(_fragments.size());
+    SAS::report_event(ev);
+  }
+
+  std::vector<std::string> column_names;
+  size_t num_bytes = 0;
+  for (std::vector<CallFragment>::const_iterator ii = _fragments.begin();
+       ii != _fragments.end();
+       ii++)
+  {
+    std::string column_name = call_column_name(*ii);
+    num_bytes += column_name.length();
+    column_names.push_back(column_name);
+
+    if (_summaries)
+    {
+      column_names.push_back(summary_column_name(*ii));
+    }
+  }
+
+  std::vector<CallColumn> columns;
+
+  if (_change_token != 0)
+  {
+    columns.push_back(change_token_column(_change_token, _change_token_ttl));
+  }
+
+  mark(OpTimeline::SEND);
+  backend->delete_columns(_impu,
+                          column_names,
+                          _cass_timestamp,
+                          columns,
+                          _consistency_level);
+  mark(OpTimeline::RECEIVE);
+
+  TRC_DEBUG("Successfully deleted call fragments");
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_TRIM_OK, 0);
+    SAS::report_event(ev);
+  }
+
+  if (_observer != NULL)
+  {
+    _observer->on_trim(_impu, _fragments.size(), num_bytes);
+  }
+
+  return true;
+}
+
+bool DeleteOldCallFragments::get_trace_record(OpTraceRecord& record) const
+{
+  record.type = OpTraceRecord::TRIM;
+  record.impu_hash = OpTraceRecord::hash_impu(_impu);
+  record.num_fragments = _fragments.size();
+  record.num_bytes = 0;
+
+  for (std::vector<CallFragment>::const_iterator ii = _fragments.begin();
+       ii != _fragments.end();
+       ii++)
+  {
+    record.num_bytes += call_column_name(*ii).length();
+  }
+
+  return true;
+}
+
+void DeleteOldCallFragments::unhandled_exception(CassandraStore::ResultCode status,
+                                                 std::string& description,
+                                                 SAS::TrailId trail)
+{
+  CassandraStore::Operation::unhandled_exception(status, description, trail);
+
+  TRC_WARNING("Failed to delete old call list fragments for IMPU %s because '%s' (RC = %d)",
+              _impu.c_str(), description.c_str(), status);
+  sas_log_cassandra_failure(trail,
+                            SASEvent::CALL_LIST_TRIM_FAILED,
+                            status,
+                            description);
+}
+
+DeleteOldCallFragments*
+Store::new_delete_old_call_fragments_op(const std::string& impu,
+                                        const std::vector<CallFragment> fragments,
+                                        const int64_t cass_timestamp)
+{
+  DeleteOldCallFragments* op = new DeleteOldCallFragments(impu,
+                                                          fragments,
+                                                          cass_timestamp);
+  op->set_observer(this);
+  op->set_consistency_level(_consistency_levels.trim);
+
+  if (_change_tokens)
+  {
+    op->enable_change_token(next_change_token(cass_timestamp),
+                            _change_token_ttl);
+  }
+
+  if (_call_summaries)
+  {
+    op->enable_summaries();
+  }
+
+  return op;
+}
+
+//
+// Import a batch of archived call fragments.
+//
+
+ImportCallFragments::ImportCallFragments(std::vector<ArchiveRecord>& records) :
+  BackendOperation("ImportCallFragments"),
+  _records(),
+  _observer(NULL),
+  _consistency_level(cass::ConsistencyLevel::ONE),
+  _change_token(0),
+  _change_token_ttl(0),
+  _summaries(false)
+{
+  _records.swap(records);
+}
+
+ImportCallFragments::~ImportCallFragments()
+{}
+
+bool ImportCallFragments::execute(Backend* backend,
+                                  SAS::TrailId trail)
+{
+  TRC_DEBUG("Importing %zu call fragments", _records.size());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_IMPORT_STARTED, 0);
+    ev.add_static_param(_records.size());
+    SAS::report_event(ev);
+  }
+
+  // Build a single batch holding all the fragments.  The mutations are
+  // grouped by IMPU, so fragments for the same IMPU are written to its row
+  // together.
+  RowWrites rows;
+
+  for (std::vector<ArchiveRecord>::const_iterator it = _records.begin();
+       it != _records.end();
+       ++it)
+  {
+    CallColumn column;
+    column.name = call_column_name(it->fragment);
+    column.value = it->fragment.contents;
+    column.timestamp = it->cass_timestamp;
+    column.ttl = it->ttl;
+    rows[it->impu].push_back(column);
+
+    if (_summaries)
+    {
+      column.name = summary_column_name(it->fragment);
+      column.value = it->fragment.summary;
+      rows[it->impu].push_back(column);
+    }
+  }
+
+  if (_change_token != 0)
+  {
+    for (RowWrites::iterator it = rows.begin(); it != rows.end(); ++it)
+    {
+      it->second.push_back(change_token_column(_change_token,
+                                               _change_token_ttl));
+    }
+  }
+
+  mark(OpTimeline::SEND);
+  backend->write_columns(rows, _consistency_level);
+  mark(OpTimeline::RECEIVE);
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_IMPORT_OK, 0);
+    ev.add_static_param(rows.size());
+    SAS::report_event(ev);
+  }
+
+  if (_observer != NULL)
+  {
+    for (RowWrites::const_iterator it = rows.begin(); it != rows.end(); ++it)
+    {
+      _observer->on_import(it->first);
+    }
+  }
+
+  return true;
+}
+
+void ImportCallFragments::unhandled_exception(CassandraStore::ResultCode status,
+                                              std::string& description,
+                                              SAS::TrailId trail)
+{
+  CassandraStore::Operation::unhandled_exception(status, description, trail);
+
+  TRC_WARNING("Failed to import %zu call list fragments because '%s' (RC = %d)",
+              _records.size(), description.c_str(), status);
+  sas_log_cassandra_failure(trail,
+                            SASEvent::CALL_LIST_IMPORT_FAILED,
+                            status,
+                            description);
+}
+
+ImportCallFragments*
+Store::new_import_call_fragments_op(std::vector<ArchiveRecord>& records)
+{
+  // Imported IMPUs are reported to the observer with on_import rather than
+  // on_write - a restore shouldn't make every IMPU look hot.
+  ImportCallFragments* op = new ImportCallFragments(records);
+  op->set_observer(this);
+  op->set_consistency_level(_consistency_levels.write);
+
+  if (_change_tokens)
+  {
+    // The records' timestamps are old, so use the current time for the
+    // token, so that it replaces any token the IMPU already has.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t cass_timestamp = ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    op->enable_change_token(next_change_token(cass_timestamp),
+                            _change_token_ttl);
+  }
+
+  if (_call_summaries)
+  {
+    op->enable_summaries();
+  }
+
+  return op;
+}
+
+//
+// Export the call fragments for a range of tokens.
+//
+
+ExportCallFragments::ExportCallFragments(const std::string& start_token,
+                                         const std::string& end_token,
+                                         ArchiveWriter* writer,
+                                         size_t rows_per_page,
+                                         size_t columns_per_page) :
+  CassandraStore::Operation(),
+  _start_token(start_token),
+  _end_token(end_token),
+  _writer(writer),
+  _rows_per_page(std::max(rows_per_page, (size_t)2)),
+  _columns_per_page(std::max(columns_per_page, (size_t)2)),
+  _consistency_level(cass::ConsistencyLevel::ONE),
+  _num_rows(0),
+  _num_fragments(0),
+  _records()
+{}
+
+ExportCallFragments::~ExportCallFragments()
+{}
+
+bool ExportCallFragments::perform(CassandraStore::Client* client,
+                                  SAS::TrailId trail)
+{
+  TRC_DEBUG("Export call fragments for tokens (%s, %s]",
+            _start_token.c_str(), _end_token.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_EXPORT_STARTED, 0);
+    ev.add_var_param(_start_token);
+    ev.add_var_param(_end_token);
+    SAS::report_event(ev);
+  }
+
+  cass::SliceRange slice;
+  slice.__set_start(CALL_COLUMN_PREFIX);
+  slice.__set_finish(CALL_COLUMN_RANGE_END);
+  slice.__set_count(_columns_per_page);
+
+  cass::SlicePredicate predicate;
+  predicate.__set_slice_range(slice);
+
+  cass::ColumnParent parent;
+  parent.__set_column_family(COLUMN_FAMILY);
+
+  // The first page covers the whole token range.  Subsequent pages start at
+  // the last key of the previous page (which cassandra includes again, so it
+  // is skipped).
+  cass::KeyRange range;
+  range.__set_start_token(_start_token);
+  range.__set_end_token(_end_token);
+  range.__set_count(_rows_per_page);
+
+  std::string last_key;
+  bool first_page = true;
+
+  while (true)
+  {
+    std::vector<cass::KeySlice> rows;
+    client->get_range_slices(rows, parent, predicate, range, _consistency_level);
+
+    for (std::vector<cass::KeySlice>::iterator row_it = rows.begin();
+         row_it != rows.end();
+         ++row_it)
+    {
+      // Rows with no call columns are either deleted or hold only other
+      // types of column, so there's nothing to export.
+      if (((!first_page) && (row_it == rows.begin()) && (row_it->key == last_key)) ||
+          (row_it->columns.empty()))
+      {
+        continue;
+      }
+
+      export_row(client, row_it->key, row_it->columns);
+    }
+
+    flush_records();
+
+    if (rows.size() < _rows_per_page)
+    {
+      break;
+    }
+
+    last_key = rows.back().key;
+    first_page = false;
+
+    range = cass::KeyRange();
+    range.__set_start_key(last_key);
+    range.__set_end_token(_end_token);
+    range.__set_count(_rows_per_page);
+  }
+
+  TRC_DEBUG("Exported %llu call fragments from %llu rows",
+            (unsigned long long)_num_fragments,
+            (unsigned long long)_num_rows);
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_EXPORT_OK, 0);
+    ev.add_static_param(_num_rows);
+    ev.add_static_param(_num_fragments);
+    SAS::report_event(ev);
+  }
+
+  return true;
+}
+
+void ExportCallFragments::export_row(CassandraStore::Client* client,
+                                     const std::string& impu,
+                                     std::vector<cass::ColumnOrSuperColumn>& columns)
+{
+  _num_rows++;
+  decode_columns(impu, columns, 0);
+
+  // If the page of columns was full there may be more, so carry on reading
+  // the row from the last column read.  The start of a slice is inclusive, so
+  // that column is returned again and is skipped.
+  while (columns.size() >= _columns_per_page)
+  {
+    cass::SliceRange slice;
+    slice.__set_start(columns.back().column.name);
+    slice.__set_finish(CALL_COLUMN_RANGE_END);
+    slice.__set_count(_columns_per_page);
+
+    cass::SlicePredicate predicate;
+    predicate.__set_slice_range(slice);
+
+    cass::ColumnParent parent;
+    parent.__set_column_family(COLUMN_FAMILY);
+
+    std::vector<cass::ColumnOrSuperColumn> next_columns;
+    client->get_slice(next_columns, impu, parent, predicate, _consistency_level);
+    columns.swap(next_columns);
+
+    decode_columns(impu, columns, 1);
+
+    // Don't let the buffered records for a long row grow without limit.
+    if (_records.size() >= _columns_per_page)
+    {
+      flush_records();
+    }
+  }
+}
+
+void ExportCallFragments::decode_columns(const std::string& impu,
+                                         const std::vector<cass::ColumnOrSuperColumn>& columns,
+                                         size_t first_column)
+{
+  for (size_t ii = first_column; ii < columns.size(); ++ii)
+  {
+    const cass::Column& column = columns[ii].column;
+
+    // The columns name is of the form call_<timestamp>_<id>_<type>.  Check the
+    // prefix, and split the rest in place.
+    FieldSpan fields[2];
+    ArchiveRecord record;
+
+    if (!CALL_COLUMN.decode(column.name, true, fields, record.fragment.type))
+    {
+      TRC_WARNING("Invalid column name (%s) for IMPU %s",
+                  column.name.c_str(), impu.c_str());
+      continue;
+    }
+
+    record.impu = impu;
+    record.fragment.timestamp.assign(column.name, fields[0].start, fields[0].length);
+    record.fragment.id.assign(column.name, fields[1].start, fields[1].length);
+    record.fragment.contents = column.value;
+    record.cass_timestamp = column.timestamp;
+    record.ttl = column.__isset.ttl ? column.ttl : 0;
+
+    _records.push_back(record);
+    _num_fragments++;
+  }
+}
+
+void ExportCallFragments::flush_records()
+{
+  if ((!_records.empty()) && (!_writer->write(_records)))
+  {
+    throw std::runtime_error("Failed to write to call list archive");
+  }
+
+  _records.clear();
+}
+
+void ExportCallFragments::unhandled_exception(CassandraStore::ResultCode status,
+                                              std::string& description,
+                                              SAS::TrailId trail)
+{
+  CassandraStore::Operation::unhandled_exception(status, description, trail);
+
+  TRC_WARNING("Failed to export call lists for tokens (%s, %s] because '%s' (RC = %d)",
+              _start_token.c_str(), _end_token.c_str(), description.c_str(), status);
   sas_log_cassandra_failure(trail,
-                            SASEvent::CALL_LIST_TRIM_FAILED,
+                            SASEvent::CALL_LIST_EXPORT_FAILED,
                             status,
                             description);
 }
 
-DeleteOldCallFragments*
-Store::new_delete_old_call_fragments_op(const std::string& impu,
-                                        const std::vector<CallFragment> fragments,
-                                        const int64_t cass_timestamp)
+ExportCallFragments*
+Store::new_export_call_fragments_op(const std::string& start_token,
+                                    const std::string& end_token,
+                                    ArchiveWriter* writer)
 {
-  return new DeleteOldCallFragments(impu, fragments, cass_timestamp);
+  ExportCallFragments* op = new ExportCallFragments(start_token,
+                                                    end_token,
+                                                    writer);
+  op->set_consistency_level(_consistency_levels.read_fallback);
+  return op;
 }
 
 
@@ -434,6 +2647,51 @@ CassandraStore::ResultCode
 Store::get_call_fragments_sync(const std::string& impu,
                                std::vector<CallFragment>& fragments,
                                SAS::TrailId trail)
+{
+  if (_cache != NULL)
+  {
+    CallListCache::Result cached = _cache->get(impu, fragments);
+
+    if (cached != CallListCache::MISS)
+    {
+      TRC_DEBUG("Got %zu call fragments for IMPU '%s' from the cache",
+                fragments.size(), impu.c_str());
+
+      SAS::Event ev(trail, SASEvent::CALL_LIST_READ_CACHED, 0);
+      ev.add_static_param(fragments.size());
+      ev.add_static_param(cached == CallListCache::STALE);
+      ev.add_var_param(impu);
+      SAS::report_event(ev);
+
+      return CassandraStore::OK;
+    }
+  }
+
+  // Note when the read started, so that the result isn't cached if the call
+  // list is changed while it is being read.
+  CallListCache::ReadStamp stamp = {0, 0};
+
+  if (_cache != NULL)
+  {
+    stamp = _cache->begin_read(impu);
+  }
+
+  CassandraStore::ResultCode result =
+                          get_call_fragments_uncached_sync(impu, fragments, trail);
+
+  if ((result == CassandraStore::OK) && (_cache != NULL))
+  {
+    _cache->put(impu, fragments, stamp);
+  }
+
+  return result;
+}
+
+
+CassandraStore::ResultCode
+Store::get_call_fragments_uncached_sync(const std::string& impu,
+                                        std::vector<CallFragment>& fragments,
+                                        SAS::TrailId trail)
 {
   GetCallFragments* op = new_get_call_fragments_op(impu);
 
@@ -449,6 +2707,111 @@ Store::get_call_fragments_sync(const std::string& impu,
 }
 
 
+CassandraStore::ResultCode
+Store::get_call_fragments_sync(const std::string& impu,
+                               CallFragmentArena& fragments,
+                               SAS::TrailId trail)
+{
+  GetCallFragments* op = new_get_call_fragments_op(impu, true);
+
+  if (do_sync(op, trail))
+  {
+    op->get_result(fragments);
+  }
+
+  CassandraStore::ResultCode result = op->get_result_code();
+
+  delete op; op = NULL;
+  return result;
+}
+
+
+CassandraStore::ResultCode
+Store::get_call_fragments_since_sync(const std::string& impu,
+                                     const CallListWatermark& since,
+                                     std::vector<CallFragment>& fragments,
+                                     SAS::TrailId trail)
+{
+  GetCallFragments* op = new_get_call_fragments_since_op(impu, since);
+
+  if (do_sync(op, trail))
+  {
+    op->get_result(fragments);
+  }
+
+  CassandraStore::ResultCode result = op->get_result_code();
+
+  delete op; op = NULL;
+  return result;
+}
+
+CassandraStore::ResultCode
+Store::get_call_summaries_sync(const std::string& impu,
+                               std::vector<CallFragment>& fragments,
+                               SAS::TrailId trail)
+{
+  GetCallFragments* op = new_get_call_summaries_op(impu);
+
+  if (do_sync(op, trail))
+  {
+    op->get_result(fragments);
+  }
+
+  CassandraStore::ResultCode result = op->get_result_code();
+
+  delete op; op = NULL;
+  return result;
+}
+
+CassandraStore::ResultCode
+Store::get_call_contents_sync(const std::string& impu,
+                              const std::vector<CallListWatermark>& calls,
+                              std::vector<CallFragment>& fragments,
+                              SAS::TrailId trail)
+{
+  GetCallFragments* op = new_get_call_contents_op(impu, calls);
+
+  if (do_sync(op, trail))
+  {
+    op->get_result(fragments);
+  }
+
+  CassandraStore::ResultCode result = op->get_result_code();
+
+  delete op; op = NULL;
+  return result;
+}
+
+CassandraStore::ResultCode
+Store::get_call_fragments_if_changed_sync(const std::string& impu,
+                                          const std::string& change_token,
+                                          std::vector<CallFragment>& fragments,
+                                          std::string& new_change_token,
+                                          bool& modified,
+                                          SAS::TrailId trail)
+{
+  GetCallFragments* op = new_get_call_fragments_if_changed_op(impu,
+                                                              change_token);
+  modified = true;
+
+  if (do_sync(op, trail))
+  {
+    modified = !op->get_not_modified();
+    new_change_token = op->get_change_token();
+
+    if (modified)
+    {
+      op->get_result(fragments);
+    }
+  }
+
+  CassandraStore::ResultCode result = op->get_result_code();
+
+  delete op; op = NULL;
+  return result;
+}
+
+
 CassandraStore::ResultCode
 Store::delete_old_call_fragments_sync(const std::string& impu,
                                       const std::vector<CallFragment> fragments,
@@ -465,4 +2828,323 @@ Store::delete_old_call_fragments_sync(const std::string& impu,
   return result;
 }
 
+
+// The largest batch (in bytes of column names and values) to send in a single
+// batch mutation when importing, whatever the number of fragments.  This keeps
+// batches well within the thrift frame size.
+const static size_t MAX_IMPORT_BATCH_BYTES = 4 * 1024 * 1024;
+
+// Tracks the progress of the batches of an import.
+struct ImportProgress
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t in_flight;
+  uint64_t records_written;
+  uint64_t records_failed;
+  CassandraStore::ResultCode result;
+};
+
+// Transaction for a batch of an import.  This updates the import's progress
+// and wakes up the thread reading the archive.
+class ImportTransaction : public CassandraStore::Transaction
+{
+public:
+  ImportTransaction(ImportProgress* progress, SAS::TrailId trail) :
+    CassandraStore::Transaction(trail),
+    _progress(progress)
+  {}
+
+  void on_success(CassandraStore::Operation* op)
+  {
+    complete(op, true);
+  }
+
+  void on_failure(CassandraStore::Operation* op)
+  {
+    complete(op, false);
+  }
+
+private:
+  void complete(CassandraStore::Operation* op, bool success)
+  {
+    size_t num_records = ((ImportCallFragments*)op)->get_num_records();
+
+    pthread_mutex_lock(&_progress->lock);
+
+    if (success)
+    {
+      _progress->records_written += num_records;
+    }
+    else
+    {
+      _progress->records_failed += num_records;
+
+      if (_progress->result == CassandraStore::OK)
+      {
+        _progress->result = op->get_result_code();
+      }
+    }
+
+    _progress->in_flight--;
+    pthread_cond_signal(&_progress->cond);
+    pthread_mutex_unlock(&_progress->lock);
+  }
+
+  ImportProgress* _progress;
+};
+
+// Send a batch of an import, first waiting until there is room for it.  If
+// the store has no worker threads the batch is sent synchronously.
+static void send_import_batch(Store* store,
+                              std::vector<ArchiveRecord>& batch,
+                              ImportProgress* progress,
+                              size_t max_in_flight,
+                              bool async,
+                              SAS::TrailId trail)
+{
+  pthread_mutex_lock(&progress->lock);
+
+  while (progress->in_flight >= max_in_flight)
+  {
+    pthread_cond_wait(&progress->cond, &progress->lock);
+  }
+
+  progress->in_flight++;
+  pthread_mutex_unlock(&progress->lock);
+
+  CassandraStore::Operation* op = store->new_import_call_fragments_op(batch);
+  CassandraStore::Transaction* trx = new ImportTransaction(progress, trail);
+
+  if (async)
+  {
+    store->do_async(op, trx);
+  }
+  else
+  {
+    if (store->do_sync(op, trail))
+    {
+      trx->on_success(op);
+    }
+    else
+    {
+      trx->on_failure(op);
+    }
+
+    delete trx; trx = NULL;
+    delete op; op = NULL;
+  }
+}
+
+CassandraStore::ResultCode
+Store::import_call_lists(ArchiveReader* reader,
+                         size_t batch_size,
+                         size_t max_in_flight,
+                         ImportSummary& summary,
+                         SAS::TrailId trail)
+{
+  batch_size = std::max(batch_size, (size_t)1);
+  max_in_flight = std::max(max_in_flight, (size_t)1);
+  summary = ImportSummary();
+
+  ImportProgress progress;
+  pthread_mutex_init(&progress.lock, NULL);
+  pthread_cond_init(&progress.cond, NULL);
+  progress.in_flight = 0;
+  progress.records_written = 0;
+  progress.records_failed = 0;
+  progress.result = CassandraStore::OK;
+
+  TRC_STATUS("Importing %llu call fragments (batches of %zu, %zu in flight)",
+             (unsigned long long)reader->num_records(), batch_size, max_in_flight);
+
+  // The store's worker threads run the batches, so without any, send them
+  // synchronously.
+  bool async = (_num_workers > 0);
+
+  // Cassandra timestamps are in microseconds.
+  int64_t now_s = time(NULL);
+  std::vector<ArchiveRecord> batch;
+  size_t batch_bytes = 0;
+  ArchiveRecord record;
+
+  while (reader->read(record))
+  {
+    summary.records_read++;
+
+    if (record.ttl > 0)
+    {
+      int64_t age_s = now_s - (record.cass_timestamp / 1000000);
+
+      if (age_s >= record.ttl)
+      {
+        summary.records_expired++;
+        continue;
+      }
+      else if (age_s > 0)
+      {
+        record.ttl -= age_s;
+      }
+    }
+
+    batch_bytes += record.impu.length() +
+                   record.fragment.timestamp.length() +
+                   record.fragment.id.length() +
+                   record.fragment.contents.length();
+    batch.push_back(record);
+
+    if ((batch.size() >= batch_size) || (batch_bytes >= MAX_IMPORT_BATCH_BYTES))
+    {
+      send_import_batch(this, batch, &progress, max_in_flight, async, trail);
+      batch.clear();
+      batch_bytes = 0;
+    }
+  }
+
+  if (!batch.empty())
+  {
+    send_import_batch(this, batch, &progress, max_in_flight, async, trail);
+  }
+
+  // Wait for the last batches to complete.
+  pthread_mutex_lock(&progress.lock);
+
+  while (progress.in_flight > 0)
+  {
+    pthread_cond_wait(&progress.cond, &progress.lock);
+  }
+
+  pthread_mutex_unlock(&progress.lock);
+
+  summary.records_written = progress.records_written;
+  summary.records_failed = progress.records_failed;
+  CassandraStore::ResultCode result = progress.result;
+
+  if ((reader->error()) && (result == CassandraStore::OK))
+  {
+    TRC_ERROR("Call list archive is corrupt, import incomplete");
+    result = CassandraStore::UNKNOWN_ERROR;
+  }
+
+  pthread_cond_destroy(&progress.cond);
+  pthread_mutex_destroy(&progress.lock);
+
+  TRC_STATUS("Imported %llu call fragments, %llu expired, %llu failed (RC = %d)",
+             (unsigned long long)summary.records_written,
+             (unsigned long long)summary.records_expired,
+             (unsigned long long)summary.records_failed,
+             result);
+  return result;
+}
+
+// The most threads that export token ranges at once.  Further ranges are
+// exported as the threads finish earlier ones.
+const static size_t MAX_EXPORT_THREADS = 16;
+
+// The token ranges of an export, which a bounded number of threads work
+// through.
+struct ExportJob
+{
+  Store* store;
+  SAS::TrailId trail;
+  std::vector<ExportCallFragments*> ops;
+  std::atomic<size_t> next;
+};
+
+static void* export_range_thread(void* arg)
+{
+  ExportJob* job = (ExportJob*)arg;
+  size_t index;
+
+  while ((index = job->next.fetch_add(1)) < job->ops.size())
+  {
+    job->store->do_sync(job->ops[index], job->trail);
+  }
+
+  return NULL;
+}
+
+CassandraStore::ResultCode
+Store::export_call_lists_sync(ArchiveWriter* writer,
+                              size_t num_ranges,
+                              SAS::TrailId trail)
+{
+  // The call_lists column family uses the Murmur3 partitioner, whose tokens
+  // are the signed 64-bit integers.  Split the ring into equal ranges, each
+  // of which runs from the (exclusive) end of the previous one.
+  num_ranges = std::max(num_ranges, (size_t)1);
+  uint64_t range_size = std::numeric_limits<uint64_t>::max() / num_ranges;
+
+  ExportJob job;
+  job.store = this;
+  job.trail = trail;
+  job.ops.reserve(num_ranges);
+  job.next = 0;
+
+  for (size_t ii = 0; ii < num_ranges; ++ii)
+  {
+    // Do the arithmetic unsigned, offset from the minimum token, so that it
+    // can't overflow.
+    uint64_t min_token = (uint64_t)std::numeric_limits<int64_t>::min();
+    int64_t start = (int64_t)(min_token + (ii * range_size));
+    int64_t end = (ii + 1 == num_ranges) ?
+                    std::numeric_limits<int64_t>::max() :
+                    (int64_t)(min_token + ((ii + 1) * range_size));
+
+    job.ops.push_back(new_export_call_fragments_op(std::to_string(start),
+                                                   std::to_string(end),
+                                                   writer));
+  }
+
+  // This thread exports ranges too, so start one fewer thread.
+  size_t num_threads = std::min(num_ranges, MAX_EXPORT_THREADS) - 1;
+  std::vector<pthread_t> threads;
+
+  TRC_STATUS("Exporting call lists in %zu token ranges on %zu threads",
+             num_ranges, num_threads + 1);
+
+  for (size_t ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, export_range_thread, &job) == 0)
+    {
+      threads.push_back(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START - only fails if out of resources.  The other threads
+      // export the ranges this one would have.
+      TRC_WARNING("Failed to create export thread");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  export_range_thread(&job);
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  CassandraStore::ResultCode result = CassandraStore::OK;
+  uint64_t num_fragments = 0;
+
+  for (size_t ii = 0; ii < num_ranges; ++ii)
+  {
+    if ((result == CassandraStore::OK) &&
+        (job.ops[ii]->get_result_code() != CassandraStore::OK))
+    {
+      result = job.ops[ii]->get_result_code();
+    }
+
+    num_fragments += job.ops[ii]->get_num_fragments();
+    delete job.ops[ii]; job.ops[ii] = NULL;
+  }
+
+  TRC_STATUS("Exported %llu call fragments (RC = %d)",
+             (unsigned long long)num_fragments, result);
+  return result;
+}
+
 } // namespace CallListStore
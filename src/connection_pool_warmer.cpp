@@ -0,0 +1,410 @@
+/**
+ * @file connection_pool_warmer.cpp Opens and monitors the store's cassandra
+ * connections.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "connection_pool_warmer.h"
+#include "call_list_store.h"
+#include "log.h"
+
+// The row that warm up operations read.  It doesn't matter whether it exists.
+const static std::string WARMUP_KEY = "memento_connection_warmup";
+
+namespace CallListStore
+{
+
+namespace cass = org::apache::cassandra;
+
+// The state shared by the operations of a warm up.
+struct WarmupRun
+{
+  CassandraStore::Store* store;
+  SAS::TrailId trail;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct timespec deadline;
+
+  // The number of operations, and how many have a connection (or failed).
+  size_t num_ops;
+  size_t num_ready;
+
+  // The result of the first operation that failed, and whether any timed out
+  // waiting for the others.
+  CassandraStore::ResultCode rc;
+  std::string error_text;
+  bool timed_out;
+};
+
+// Operation that checks out a connection, checks that the call list column
+// family exists, and holds the connection until the other operations of the
+// warm up have one too.
+class WarmupOperation : public BackendOperation
+{
+public:
+  WarmupOperation(WarmupRun* run) :
+    BackendOperation("warmup"),
+    _run(run)
+  {}
+
+  virtual ~WarmupOperation() {}
+
+protected:
+  bool execute(Backend* backend, SAS::TrailId trail)
+  {
+    std::vector<CallColumn> columns;
+    backend->get_columns(WARMUP_KEY,
+                         "",
+                         "",
+                         1,
+                         columns,
+                         cass::ConsistencyLevel::ONE);
+
+    pthread_mutex_lock(&_run->lock);
+    _run->num_ready++;
+    pthread_cond_broadcast(&_run->cond);
+
+    while (_run->num_ready < _run->num_ops)
+    {
+      if (pthread_cond_timedwait(&_run->cond,
+                                 &_run->lock,
+                                 &_run->deadline) != 0)
+      {
+        _run->timed_out = true;
+        break;
+      }
+    }
+
+    pthread_mutex_unlock(&_run->lock);
+    return true;
+  }
+
+private:
+  WarmupRun* _run;
+};
+
+// Thread that runs one warm up operation.
+static void* warmup_thread_fn(void* data)
+{
+  WarmupRun* run = (WarmupRun*)data;
+  WarmupOperation op(run);
+
+  if (!run->store->do_sync(&op, run->trail))
+  {
+    pthread_mutex_lock(&run->lock);
+
+    if (run->rc == CassandraStore::OK)
+    {
+      run->rc = op.get_result_code();
+      run->error_text = op.get_error_text();
+    }
+
+    // The operation never got to hold a connection, so stop the others
+    // waiting for it.
+    run->num_ready++;
+    pthread_cond_broadcast(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+  }
+
+  return NULL;
+}
+
+ConnectionPoolWarmer::ConnectionPoolWarmer(const Config& config,
+                                           LastValueCache* stats_aggregator) :
+  _config(config),
+  _warm(false),
+  _warming(false),
+  _num_connections(0),
+  _store(NULL),
+  _running(false),
+  _terminating(false),
+  _connections_stat(NULL),
+  _wait_us(new ThreadLocalAccumulator("call_list_pool_wait_us",
+                                      stats_aggregator)),
+  _churn(new ThreadLocalCounter("call_list_pool_churn", stats_aggregator))
+{
+  if (stats_aggregator != NULL)
+  {
+    _connections_stat = new Statistic("call_list_pool_connections",
+                                      stats_aggregator);
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ConnectionPoolWarmer::~ConnectionPoolWarmer()
+{
+  stop();
+  wait_stopped();
+
+  delete _connections_stat; _connections_stat = NULL;
+  delete _wait_us; _wait_us = NULL;
+  delete _churn; _churn = NULL;
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+uint64_t ConnectionPoolWarmer::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+CassandraStore::ResultCode ConnectionPoolWarmer::warm_up(CassandraStore::Store* store,
+                                                         SAS::TrailId trail)
+{
+  TRC_STATUS("Warming up %zu cassandra connections", _config.connections);
+  uint64_t start_us = now_us();
+
+  _warm = false;
+  _warming = true;
+
+  WarmupRun run;
+  run.store = store;
+  run.trail = trail;
+  run.num_ops = _config.connections;
+  run.num_ready = 0;
+  run.rc = CassandraStore::OK;
+  run.timed_out = false;
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&run.cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&run.lock, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &run.deadline);
+  run.deadline.tv_sec += _config.timeout_ms / 1000;
+  run.deadline.tv_nsec += (_config.timeout_ms % 1000) * 1000000L;
+  if (run.deadline.tv_nsec >= 1000000000L)
+  {
+    run.deadline.tv_sec++;
+    run.deadline.tv_nsec -= 1000000000L;
+  }
+
+  // Run the operations on threads of their own, rather than the store's
+  // workers, so that they all run at once however many workers there are.
+  std::vector<pthread_t> threads;
+
+  for (size_t ii = 0; ii < _config.connections; ++ii)
+  {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, warmup_thread_fn, &run) != 0)
+    {
+      // LCOV_EXCL_START - Only fails if the process is out of resources.
+      TRC_ERROR("Failed to create connection warm up thread");
+      pthread_mutex_lock(&run.lock);
+      run.num_ops--;
+      pthread_cond_broadcast(&run.cond);
+      pthread_mutex_unlock(&run.lock);
+      // LCOV_EXCL_STOP
+    }
+    else
+    {
+      threads.push_back(thread);
+    }
+  }
+
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+  {
+    pthread_join(threads[ii], NULL);
+  }
+
+  pthread_cond_destroy(&run.cond);
+  pthread_mutex_destroy(&run.lock);
+
+  CassandraStore::ResultCode rc = run.rc;
+
+  if (rc != CassandraStore::OK)
+  {
+    TRC_ERROR("Failed to warm up cassandra connections (%d): %s",
+              rc, run.error_text.c_str());
+  }
+  else if ((run.timed_out) || (threads.size() < _config.connections))
+  {
+    TRC_ERROR("Timed out warming up cassandra connections");
+    rc = CassandraStore::UNKNOWN_ERROR;
+  }
+  else
+  {
+    TRC_STATUS("Warmed up %zu cassandra connections in %llu ms",
+               _config.connections,
+               (unsigned long long)((now_us() - start_us) / 1000));
+  }
+
+  _warming = false;
+  _warm = (rc == CassandraStore::OK);
+
+  return rc;
+}
+
+void ConnectionPoolWarmer::start(CassandraStore::Store* store)
+{
+  if (_running)
+  {
+    return;
+  }
+
+  _store = store;
+  _terminating = false;
+
+  if (warm_up(store, 0) == CassandraStore::OK)
+  {
+    return;
+  }
+
+  TRC_STATUS("Retrying cassandra connection warm up every %llu ms",
+             (unsigned long long)_config.retry_interval_ms);
+
+  int rc = pthread_create(&_thread, NULL, thread_entry_point, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START - Only fails if the process is out of resources.
+    TRC_ERROR("Failed to start connection warm up thread: %d", rc);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _running = true;
+}
+
+void ConnectionPoolWarmer::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void ConnectionPoolWarmer::wait_stopped()
+{
+  if (_running)
+  {
+    pthread_join(_thread, NULL);
+    _running = false;
+  }
+}
+
+void* ConnectionPoolWarmer::thread_entry_point(void* warmer)
+{
+  ((ConnectionPoolWarmer*)warmer)->retry_loop();
+  return NULL;
+}
+
+void ConnectionPoolWarmer::retry_loop()
+{
+  while (true)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _config.retry_interval_ms / 1000;
+    deadline.tv_nsec += (_config.retry_interval_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    // Wait until it's time to retry, or the warmer is stopped.
+    pthread_mutex_lock(&_lock);
+
+    if (!_terminating)
+    {
+      pthread_cond_timedwait(&_cond, &_lock, &deadline);
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if ((_terminating) || (warm_up(_store, 0) == CassandraStore::OK))
+    {
+      break;
+    }
+  }
+}
+
+void ConnectionPoolWarmer::on_checkout(uint64_t wait_start_us)
+{
+  _wait_us->accumulate(now_us() - wait_start_us);
+}
+
+void ConnectionPoolWarmer::on_connection_opened()
+{
+  publish_connections(++_num_connections);
+
+  if (!_warming)
+  {
+    _churn->increment();
+  }
+}
+
+void ConnectionPoolWarmer::on_connection_closed()
+{
+  publish_connections(--_num_connections);
+}
+
+void ConnectionPoolWarmer::publish_connections(size_t num_connections)
+{
+  if (_connections_stat != NULL)
+  {
+    std::vector<std::string> values;
+    values.push_back(std::to_string(num_connections));
+    values.push_back(std::to_string(_config.connections));
+    _connections_stat->report_change(values);
+  }
+}
+
+//
+// Monitored connection pool methods.
+//
+
+CassandraStore::Client* MonitoredConnectionPool::create_connection(AddrInfo target)
+{
+  CassandraStore::Client* conn =
+                CassandraStore::CassandraConnectionPool::create_connection(target);
+
+  ConnectionPoolWarmer* warmer = _warmer;
+
+  if (warmer != NULL)
+  {
+    warmer->on_connection_opened();
+  }
+
+  return conn;
+}
+
+void MonitoredConnectionPool::destroy_connection(AddrInfo target,
+                                                 CassandraStore::Client* conn)
+{
+  ConnectionPoolWarmer* warmer = _warmer;
+
+  if (warmer != NULL)
+  {
+    warmer->on_connection_closed();
+  }
+
+  CassandraStore::CassandraConnectionPool::destroy_connection(target, conn);
+}
+
+} // namespace CallListStore
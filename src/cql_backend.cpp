@@ -0,0 +1,1695 @@
+/**
+ * @file cql_backend.cpp Call list store backend using the CQL native protocol.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+
+#include "cql_backend.h"
+#include "log.h"
+
+namespace CallListStore
+{
+
+namespace cass = org::apache::cassandra;
+
+// How long to wait before trying to reconnect to a node that has failed.
+const static uint64_t RECONNECT_INTERVAL_MS = 1000;
+
+// Header flags on responses.
+const static uint8_t FRAME_FLAG_TRACING = 0x02;
+const static uint8_t FRAME_FLAG_WARNING = 0x08;
+
+// Utility method for getting the current monotonic time in milliseconds.
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+//
+// Protocol utilities.
+//
+
+uint16_t Cql::consistency(cass::ConsistencyLevel::type level)
+{
+  switch (level)
+  {
+    case cass::ConsistencyLevel::ANY:
+      return 0x0000;
+
+    case cass::ConsistencyLevel::ONE:
+      return 0x0001;
+
+    case cass::ConsistencyLevel::TWO:
+      return 0x0002;
+
+    case cass::ConsistencyLevel::THREE:
+      return 0x0003;
+
+    case cass::ConsistencyLevel::QUORUM:
+      return 0x0004;
+
+    case cass::ConsistencyLevel::ALL:
+      return 0x0005;
+
+    case cass::ConsistencyLevel::LOCAL_QUORUM:
+      return 0x0006;
+
+    case cass::ConsistencyLevel::EACH_QUORUM:
+      return 0x0007;
+
+    default:
+      // LCOV_EXCL_START - the call list store doesn't use any other levels.
+      TRC_WARNING("Unsupported consistency level %d, using ONE", level);
+      return 0x0001;
+      // LCOV_EXCL_STOP
+  }
+}
+
+static uint64_t rotl64(uint64_t value, int shift)
+{
+  return (value << shift) | (value >> (64 - shift));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// Cassandra's Murmur3Partitioner uses the first half of MurmurHash3_x64_128
+// (with a seed of 0).  It differs from the reference implementation in that
+// the bytes of the tail are sign-extended, which is reproduced here.
+int64_t Cql::murmur3_token(const std::string& key)
+{
+  if (key.empty())
+  {
+    // The empty key has the minimum token.
+    return std::numeric_limits<int64_t>::min();
+  }
+
+  const uint8_t* data = (const uint8_t*)key.data();
+  const size_t length = key.length();
+  const size_t num_blocks = length / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+
+  for (size_t ii = 0; ii < num_blocks; ++ii)
+  {
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    for (int jj = 7; jj >= 0; --jj)
+    {
+      k1 = (k1 << 8) | data[(ii * 16) + jj];
+      k2 = (k2 << 8) | data[(ii * 16) + 8 + jj];
+    }
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = (h1 * 5) + 0x52dce729;
+
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = (h2 * 5) + 0x38495ab5;
+  }
+
+  const uint8_t* tail = data + (num_blocks * 16);
+  size_t tail_length = length & 15;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+
+  for (size_t ii = tail_length; ii > 8; --ii)
+  {
+    k2 ^= (uint64_t)(int64_t)(int8_t)tail[ii - 1] << ((ii - 9) * 8);
+  }
+
+  if (tail_length > 8)
+  {
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+
+  for (size_t ii = std::min(tail_length, (size_t)8); ii > 0; --ii)
+  {
+    k1 ^= (uint64_t)(int64_t)(int8_t)tail[ii - 1] << ((ii - 1) * 8);
+  }
+
+  if (tail_length > 0)
+  {
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+
+  int64_t token = (int64_t)h1;
+
+  // The minimum token is reserved, so is mapped to the maximum.
+  return (token == std::numeric_limits<int64_t>::min()) ?
+           std::numeric_limits<int64_t>::max() : token;
+}
+
+Cql::Writer& Cql::Writer::u8(uint8_t value)
+{
+  _data.push_back((char)value);
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::u16(uint16_t value)
+{
+  _data.push_back((char)(value >> 8));
+  _data.push_back((char)value);
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::i32(int32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    _data.push_back((char)((uint32_t)value >> shift));
+  }
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::i64(int64_t value)
+{
+  for (int shift = 56; shift >= 0; shift -= 8)
+  {
+    _data.push_back((char)((uint64_t)value >> shift));
+  }
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::string(const std::string& value)
+{
+  u16(value.length());
+  _data.append(value);
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::long_string(const std::string& value)
+{
+  i32(value.length());
+  _data.append(value);
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::bytes(const std::string& value)
+{
+  i32(value.length());
+  _data.append(value);
+  return *this;
+}
+
+Cql::Writer& Cql::Writer::null_bytes()
+{
+  return i32(-1);
+}
+
+Cql::Writer& Cql::Writer::short_bytes(const std::string& value)
+{
+  return string(value);
+}
+
+Cql::Writer& Cql::Writer::bigint_value(int64_t value)
+{
+  i32(8);
+  return i64(value);
+}
+
+Cql::Writer& Cql::Writer::int_value(int32_t value)
+{
+  i32(4);
+  return i32(value);
+}
+
+std::string Cql::Writer::frame(uint8_t version,
+                               int16_t stream,
+                               uint8_t opcode) const
+{
+  Writer header;
+  header.u8(version).u8(0).u16((uint16_t)stream).u8(opcode).i32(_data.length());
+  return header.data() + _data;
+}
+
+Cql::Reader::Reader(const std::string& data) :
+  _data(data),
+  _pos(0)
+{}
+
+const char* Cql::Reader::take(size_t length)
+{
+  if (length > _data.length() - _pos)
+  {
+    throw ProtocolError("Truncated CQL message");
+  }
+
+  const char* start = _data.data() + _pos;
+  _pos += length;
+  return start;
+}
+
+uint8_t Cql::Reader::u8()
+{
+  return (uint8_t)*take(1);
+}
+
+uint16_t Cql::Reader::u16()
+{
+  const uint8_t* data = (const uint8_t*)take(2);
+  return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+int32_t Cql::Reader::i32()
+{
+  const uint8_t* data = (const uint8_t*)take(4);
+  uint32_t value = 0;
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    value = (value << 8) | data[ii];
+  }
+  return (int32_t)value;
+}
+
+int64_t Cql::Reader::i64()
+{
+  const uint8_t* data = (const uint8_t*)take(8);
+  uint64_t value = 0;
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    value = (value << 8) | data[ii];
+  }
+  return (int64_t)value;
+}
+
+std::string Cql::Reader::string()
+{
+  uint16_t length = u16();
+  return std::string(take(length), length);
+}
+
+std::string Cql::Reader::long_string()
+{
+  int32_t length = i32();
+  if (length < 0)
+  {
+    throw ProtocolError("Negative string length");
+  }
+  return std::string(take(length), length);
+}
+
+bool Cql::Reader::bytes(std::string& value)
+{
+  int32_t length = i32();
+
+  if (length < 0)
+  {
+    value.clear();
+    return false;
+  }
+
+  value.assign(take(length), length);
+  return true;
+}
+
+std::string Cql::Reader::short_bytes()
+{
+  return string();
+}
+
+void Cql::Reader::skip_type()
+{
+  uint16_t id = u16();
+
+  switch (id)
+  {
+    case 0x0000:
+      // Custom type, identified by class name.
+      string();
+      break;
+
+    case 0x0020:
+    case 0x0022:
+      // List or set.
+      skip_type();
+      break;
+
+    case 0x0021:
+      // Map.
+      skip_type();
+      skip_type();
+      break;
+
+    case 0x0030:
+    {
+      // User defined type.
+      string();
+      string();
+      uint16_t num_fields = u16();
+      for (uint16_t ii = 0; ii < num_fields; ++ii)
+      {
+        string();
+        skip_type();
+      }
+      break;
+    }
+
+    case 0x0031:
+    {
+      // Tuple.
+      uint16_t num_types = u16();
+      for (uint16_t ii = 0; ii < num_types; ++ii)
+      {
+        skip_type();
+      }
+      break;
+    }
+
+    default:
+      // Native type with no parameters.
+      break;
+  }
+}
+
+void Cql::Reader::rows(std::vector<std::vector<std::string> >& rows)
+{
+  int32_t flags = i32();
+  int32_t num_columns = i32();
+
+  if (flags & ROWS_HAS_MORE_PAGES)
+  {
+    std::string paging_state;
+    bytes(paging_state);
+  }
+
+  if (!(flags & ROWS_NO_METADATA))
+  {
+    if (flags & ROWS_GLOBAL_TABLE_SPEC)
+    {
+      string();
+      string();
+    }
+
+    for (int32_t ii = 0; ii < num_columns; ++ii)
+    {
+      if (!(flags & ROWS_GLOBAL_TABLE_SPEC))
+      {
+        string();
+        string();
+      }
+
+      string();
+      skip_type();
+    }
+  }
+
+  int32_t num_rows = i32();
+  if ((num_rows < 0) || (num_columns < 0))
+  {
+    throw ProtocolError("Negative row or column count");
+  }
+
+  rows.clear();
+  rows.resize(num_rows);
+
+  for (int32_t ii = 0; ii < num_rows; ++ii)
+  {
+    rows[ii].resize(num_columns);
+
+    for (int32_t jj = 0; jj < num_columns; ++jj)
+    {
+      bytes(rows[ii][jj]);
+    }
+  }
+}
+
+int64_t Cql::bigint_value(const std::string& value)
+{
+  if (value.empty())
+  {
+    return 0;
+  }
+
+  return Reader(value).i64();
+}
+
+int32_t Cql::int_value(const std::string& value)
+{
+  if (value.empty())
+  {
+    return 0;
+  }
+
+  return Reader(value).i32();
+}
+
+//
+// Socket transport methods.
+//
+
+CqlSocketTransport::CqlSocketTransport(const std::string& host,
+                                       int port,
+                                       int connect_timeout_ms) :
+  _host(host),
+  _port(port),
+  _connect_timeout_ms(connect_timeout_ms),
+  _fd(-1)
+{}
+
+CqlSocketTransport::~CqlSocketTransport()
+{
+  if (_fd >= 0)
+  {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+bool CqlSocketTransport::connect()
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* addrs = NULL;
+  int rc = getaddrinfo(_host.c_str(), std::to_string(_port).c_str(), &hints, &addrs);
+
+  if (rc != 0)
+  {
+    TRC_WARNING("Failed to resolve cassandra node %s: %s",
+                _host.c_str(), gai_strerror(rc));
+    return false;
+  }
+
+  for (struct addrinfo* addr = addrs; (addr != NULL) && (_fd < 0); addr = addr->ai_next)
+  {
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    // Connect without blocking, so that the connection attempt can time out.
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    rc = ::connect(fd, addr->ai_addr, addr->ai_addrlen);
+
+    if ((rc < 0) && (errno == EINPROGRESS))
+    {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+
+      if ((poll(&pfd, 1, _connect_timeout_ms) == 1) &&
+          (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0) &&
+          (error == 0))
+      {
+        rc = 0;
+      }
+    }
+
+    if (rc == 0)
+    {
+      fcntl(fd, F_SETFL, flags);
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      _fd = fd;
+    }
+    else
+    {
+      ::close(fd);
+    }
+  }
+
+  freeaddrinfo(addrs);
+
+  if (_fd < 0)
+  {
+    TRC_WARNING("Failed to connect to cassandra node %s:%d", _host.c_str(), _port);
+  }
+
+  return (_fd >= 0);
+}
+
+bool CqlSocketTransport::send(const std::string& data)
+{
+  size_t sent = 0;
+
+  while (sent < data.length())
+  {
+    ssize_t rc = ::send(_fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      TRC_WARNING("Failed to send to cassandra node %s: %s",
+                  _host.c_str(), strerror(errno));
+      return false;
+    }
+
+    sent += rc;
+  }
+
+  return true;
+}
+
+bool CqlSocketTransport::recv(char* buffer, size_t length)
+{
+  size_t received = 0;
+
+  while (received < length)
+  {
+    ssize_t rc = ::recv(_fd, buffer + received, length - received, 0);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      return false;
+    }
+    else if (rc == 0)
+    {
+      // The connection has been closed.
+      return false;
+    }
+
+    received += rc;
+  }
+
+  return true;
+}
+
+void CqlSocketTransport::close()
+{
+  // Shut the socket down rather than closing it, as another thread may be
+  // blocked receiving on it.  It is closed when the transport is destroyed.
+  if (_fd >= 0)
+  {
+    shutdown(_fd, SHUT_RDWR);
+  }
+}
+
+//
+// Connection methods.
+//
+
+CqlConnection::CqlConnection(CqlTransport* transport, size_t max_streams) :
+  _transport(transport),
+  _max_streams(std::min(std::max(max_streams, (size_t)1), (size_t)32768)),
+  _streams(NULL),
+  _free_streams(),
+  _in_flight(0),
+  _peak_in_flight(0),
+  _connected(false),
+  _reader_running(false)
+{
+  _streams = new Stream[_max_streams];
+
+  // Hand out the low streams first.
+  for (size_t ii = 0; ii < _max_streams; ++ii)
+  {
+    _streams[ii].in_use = false;
+    _streams[ii].complete = false;
+    _streams[ii].abandoned = false;
+    _streams[ii].opcode = 0;
+    pthread_cond_init(&_streams[ii].cond, NULL);
+    _free_streams.push_back(_max_streams - 1 - ii);
+  }
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_mutex_init(&_send_lock, NULL);
+}
+
+CqlConnection::~CqlConnection()
+{
+  stop();
+
+  for (size_t ii = 0; ii < _max_streams; ++ii)
+  {
+    pthread_cond_destroy(&_streams[ii].cond);
+  }
+
+  delete[] _streams; _streams = NULL;
+  delete _transport; _transport = NULL;
+
+  pthread_mutex_destroy(&_send_lock);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool CqlConnection::start()
+{
+  if (!_transport->connect())
+  {
+    return false;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _connected = true;
+  pthread_mutex_unlock(&_lock);
+
+  if (pthread_create(&_reader_thread, NULL, reader_thread_fn, this) != 0)
+  {
+    // LCOV_EXCL_START - only fails if out of resources.
+    TRC_ERROR("Failed to create CQL reader thread");
+    fail_connection();
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  _reader_running = true;
+
+  Cql::Writer startup;
+  startup.u16(1).string("CQL_VERSION").string("3.0.0");
+
+  uint8_t opcode = 0;
+  std::string body;
+
+  if ((!request(Cql::OP_STARTUP, startup, 5000, opcode, body)) ||
+      (opcode != Cql::OP_READY))
+  {
+    TRC_WARNING("CQL handshake failed (opcode %d)", opcode);
+    stop();
+    return false;
+  }
+
+  return true;
+}
+
+void CqlConnection::stop()
+{
+  fail_connection();
+
+  if (_reader_running)
+  {
+    pthread_join(_reader_thread, NULL);
+    _reader_running = false;
+  }
+}
+
+bool CqlConnection::is_connected()
+{
+  pthread_mutex_lock(&_lock);
+  bool connected = _connected;
+  pthread_mutex_unlock(&_lock);
+  return connected;
+}
+
+size_t CqlConnection::peak_in_flight()
+{
+  pthread_mutex_lock(&_lock);
+  size_t peak = _peak_in_flight;
+  pthread_mutex_unlock(&_lock);
+  return peak;
+}
+
+int CqlConnection::send_request(uint8_t opcode, const Cql::Writer& body)
+{
+  pthread_mutex_lock(&_lock);
+
+  // Wait for a free stream.  This limits the number of requests in flight.
+  while ((_connected) && (_free_streams.empty()))
+  {
+    pthread_cond_wait(&_cond, &_lock);
+  }
+
+  if (!_connected)
+  {
+    pthread_mutex_unlock(&_lock);
+    return -1;
+  }
+
+  int stream = _free_streams.back();
+  _free_streams.pop_back();
+  _streams[stream].in_use = true;
+  _streams[stream].complete = false;
+  _streams[stream].abandoned = false;
+  _in_flight++;
+  _peak_in_flight = std::max(_peak_in_flight, _in_flight);
+
+  pthread_mutex_unlock(&_lock);
+
+  std::string frame = body.frame(Cql::REQUEST_VERSION, stream, opcode);
+
+  pthread_mutex_lock(&_send_lock);
+  bool sent = _transport->send(frame);
+  pthread_mutex_unlock(&_send_lock);
+
+  if (!sent)
+  {
+    fail_connection();
+
+    pthread_mutex_lock(&_lock);
+    release_stream(stream);
+    pthread_mutex_unlock(&_lock);
+    return -1;
+  }
+
+  return stream;
+}
+
+bool CqlConnection::wait_response(int stream,
+                                  int timeout_ms,
+                                  uint8_t& opcode,
+                                  std::string& body)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&_lock);
+  Stream& s = _streams[stream];
+
+  while ((!s.complete) && (_connected))
+  {
+    if (pthread_cond_timedwait(&s.cond, &_lock, &deadline) == ETIMEDOUT)
+    {
+      break;
+    }
+  }
+
+  bool success = s.complete;
+
+  if (success)
+  {
+    opcode = s.opcode;
+    body.swap(s.body);
+    release_stream(stream);
+  }
+  else if (_connected)
+  {
+    // The request has timed out.  The stream can't be reused until the
+    // response arrives, so leave it for the reader thread to release.
+    TRC_DEBUG("CQL request on stream %d timed out", stream);
+    s.abandoned = true;
+  }
+  else
+  {
+    release_stream(stream);
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return success;
+}
+
+bool CqlConnection::request(uint8_t opcode,
+                            const Cql::Writer& body,
+                            int timeout_ms,
+                            uint8_t& response_opcode,
+                            std::string& response_body)
+{
+  int stream = send_request(opcode, body);
+
+  return ((stream >= 0) &&
+          (wait_response(stream, timeout_ms, response_opcode, response_body)));
+}
+
+// Must be called with the lock held.
+void CqlConnection::release_stream(int stream)
+{
+  _streams[stream].in_use = false;
+  _streams[stream].complete = false;
+  _streams[stream].abandoned = false;
+  _streams[stream].body.clear();
+  _free_streams.push_back(stream);
+  _in_flight--;
+  pthread_cond_signal(&_cond);
+}
+
+void* CqlConnection::reader_thread_fn(void* connection)
+{
+  ((CqlConnection*)connection)->reader_loop();
+  return NULL;
+}
+
+void CqlConnection::reader_loop()
+{
+  char header[Cql::HEADER_LENGTH];
+
+  while (_transport->recv(header, sizeof(header)))
+  {
+    uint8_t version = (uint8_t)header[0];
+    uint8_t flags = (uint8_t)header[1];
+    int16_t stream = (int16_t)(((uint8_t)header[2] << 8) | (uint8_t)header[3]);
+    uint8_t opcode = (uint8_t)header[4];
+    uint32_t length = 0;
+    for (int ii = 5; ii < 9; ++ii)
+    {
+      length = (length << 8) | (uint8_t)header[ii];
+    }
+
+    if ((version != Cql::RESPONSE_VERSION) || (length > Cql::MAX_BODY_LENGTH))
+    {
+      TRC_ERROR("Invalid CQL frame (version %d, length %d)", version, length);
+      break;
+    }
+
+    std::string body(length, '\0');
+    if ((length > 0) && (!_transport->recv(&body[0], length)))
+    {
+      break;
+    }
+
+    try
+    {
+      // Skip the tracing ID and any warnings, which the backend doesn't use.
+      if (flags & (FRAME_FLAG_TRACING | FRAME_FLAG_WARNING))
+      {
+        Cql::Reader reader(body);
+
+        if (flags & FRAME_FLAG_TRACING)
+        {
+          // The tracing ID is a 16 byte UUID.
+          reader.i64();
+          reader.i64();
+        }
+
+        if (flags & FRAME_FLAG_WARNING)
+        {
+          uint16_t num_warnings = reader.u16();
+          for (uint16_t ii = 0; ii < num_warnings; ++ii)
+          {
+            TRC_DEBUG("CQL warning: %s", reader.string().c_str());
+          }
+        }
+
+        body.erase(0, reader.position());
+      }
+    }
+    catch (Cql::ProtocolError& pe)
+    {
+      TRC_ERROR("Invalid CQL frame: %s", pe.what());
+      break;
+    }
+
+    if ((stream < 0) || ((size_t)stream >= _max_streams))
+    {
+      // Server-initiated event, which the backend doesn't register for.
+      continue;
+    }
+
+    pthread_mutex_lock(&_lock);
+    Stream& s = _streams[stream];
+
+    if (s.in_use)
+    {
+      if (s.abandoned)
+      {
+        release_stream(stream);
+      }
+      else
+      {
+        s.complete = true;
+        s.opcode = opcode;
+        s.body.swap(body);
+        pthread_cond_signal(&s.cond);
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  fail_connection();
+}
+
+void CqlConnection::fail_connection()
+{
+  pthread_mutex_lock(&_lock);
+
+  bool was_connected = _connected;
+  _connected = false;
+
+  // Wake up every thread waiting for a stream or a response.
+  pthread_cond_broadcast(&_cond);
+
+  for (size_t ii = 0; ii < _max_streams; ++ii)
+  {
+    pthread_cond_broadcast(&_streams[ii].cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (was_connected)
+  {
+    TRC_DEBUG("CQL connection closed");
+    _transport->close();
+  }
+}
+
+//
+// Backend methods.
+//
+
+CqlBackend::CqlBackend(const std::vector<std::string>& seed_hosts,
+                       int port,
+                       const std::string& keyspace,
+                       const std::string& table,
+                       size_t max_streams,
+                       int timeout_ms) :
+  _seed_hosts(seed_hosts),
+  _port(port),
+  _max_streams(max_streams),
+  _timeout_ms(timeout_ms),
+  _hosts(),
+  _ring(),
+  _failed_connections()
+{
+  // The call list table was created through thrift, so its CQL columns have
+  // the default names: key (the IMPU), column1 (the column name) and value.
+  std::string table_name = keyspace + "." + table;
+  _statements[INSERT] = "INSERT INTO " + table_name + " (key, column1, value) "
+                        "VALUES (?, ?, ?) USING TIMESTAMP ? AND TTL ?";
+  _statements[SELECT] = "SELECT column1, value, writetime(value), ttl(value) "
+                        "FROM " + table_name + " "
+                        "WHERE key = ? AND column1 >= ? AND column1 <= ? LIMIT ?";
+  _statements[DELETE] = "DELETE FROM " + table_name + " USING TIMESTAMP ? "
+                        "WHERE key = ? AND column1 = ?";
+
+  pthread_mutex_init(&_lock, NULL);
+}
+
+CqlBackend::~CqlBackend()
+{
+  stop();
+  pthread_mutex_destroy(&_lock);
+}
+
+CqlTransport* CqlBackend::create_transport(const std::string& host, int port)
+{
+  return new CqlSocketTransport(host, port, _timeout_ms);
+}
+
+bool CqlBackend::start()
+{
+  pthread_mutex_lock(&_lock);
+
+  bool connected = false;
+
+  for (std::vector<std::string>::const_iterator seed = _seed_hosts.begin();
+       (seed != _seed_hosts.end()) && (!connected);
+       ++seed)
+  {
+    Host* host = add_host(*seed);
+
+    if (connect_host(host))
+    {
+      discover_ring(host);
+      connected = true;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!connected)
+  {
+    TRC_ERROR("Failed to connect to any cassandra node using CQL");
+  }
+
+  return connected;
+}
+
+void CqlBackend::stop()
+{
+  pthread_mutex_lock(&_lock);
+
+  for (std::map<std::string, Host*>::iterator it = _hosts.begin();
+       it != _hosts.end();
+       ++it)
+  {
+    delete it->second->connection;
+    delete it->second;
+  }
+
+  for (std::vector<CqlConnection*>::iterator it = _failed_connections.begin();
+       it != _failed_connections.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  _hosts.clear();
+  _ring.clear();
+  _failed_connections.clear();
+
+  pthread_mutex_unlock(&_lock);
+}
+
+// Must be called with the lock held.
+CqlBackend::Host* CqlBackend::add_host(const std::string& address)
+{
+  std::map<std::string, Host*>::iterator it = _hosts.find(address);
+
+  if (it != _hosts.end())
+  {
+    return it->second;
+  }
+
+  Host* host = new Host();
+  host->address = address;
+  host->connection = NULL;
+  host->retry_after_ms = 0;
+  _hosts[address] = host;
+  return host;
+}
+
+// Must be called with the lock held.
+bool CqlBackend::connect_host(Host* host)
+{
+  if (host->connection != NULL)
+  {
+    // Other threads may still be using the old connection.
+    _failed_connections.push_back(host->connection);
+    host->connection = NULL;
+  }
+
+  CqlConnection* connection =
+    new CqlConnection(create_transport(host->address, _port), _max_streams);
+
+  if ((!connection->start()) ||
+      (!prepare_statements(connection, host->prepared_ids)))
+  {
+    TRC_WARNING("Failed to connect to cassandra node %s", host->address.c_str());
+    delete connection;
+    host->retry_after_ms = monotonic_ms() + RECONNECT_INTERVAL_MS;
+    return false;
+  }
+
+  TRC_STATUS("Connected to cassandra node %s using CQL", host->address.c_str());
+  host->connection = connection;
+  return true;
+}
+
+bool CqlBackend::prepare_statements(CqlConnection* connection,
+                                    std::string (&prepared_ids)[NUM_STATEMENTS])
+{
+  for (int ii = 0; ii < NUM_STATEMENTS; ++ii)
+  {
+    Cql::Writer body;
+    body.long_string(_statements[ii]);
+
+    uint8_t opcode;
+    std::string response;
+
+    if (!connection->request(Cql::OP_PREPARE, body, _timeout_ms, opcode, response))
+    {
+      return false;
+    }
+
+    try
+    {
+      Cql::Reader reader(response);
+
+      if (opcode == Cql::OP_ERROR)
+      {
+        reader.i32();
+        TRC_ERROR("Failed to prepare '%s': %s",
+                  _statements[ii].c_str(), reader.string().c_str());
+        return false;
+      }
+
+      if ((opcode != Cql::OP_RESULT) || (reader.i32() != Cql::RESULT_PREPARED))
+      {
+        TRC_ERROR("Unexpected response to PREPARE (opcode %d)", opcode);
+        return false;
+      }
+
+      prepared_ids[ii] = reader.short_bytes();
+    }
+    catch (Cql::ProtocolError& pe)
+    {
+      TRC_ERROR("Invalid response to PREPARE: %s", pe.what());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool CqlBackend::query(CqlConnection* connection,
+                       const std::string& cql,
+                       std::vector<std::vector<std::string> >& rows)
+{
+  Cql::Writer body;
+  body.long_string(cql).u16(Cql::consistency(cass::ConsistencyLevel::ONE)).u8(0);
+
+  uint8_t opcode;
+  std::string response;
+
+  if ((!connection->request(Cql::OP_QUERY, body, _timeout_ms, opcode, response)) ||
+      (opcode != Cql::OP_RESULT))
+  {
+    return false;
+  }
+
+  try
+  {
+    Cql::Reader reader(response);
+
+    if (reader.i32() != Cql::RESULT_ROWS)
+    {
+      return false;
+    }
+
+    reader.rows(rows);
+  }
+  catch (Cql::ProtocolError& pe)
+  {
+    TRC_ERROR("Invalid response to '%s': %s", cql.c_str(), pe.what());
+    return false;
+  }
+
+  return true;
+}
+
+// Utility method for decoding a set<varchar> of tokens and adding them to the
+// ring.
+static void add_tokens(const std::string& value,
+                       std::vector<int64_t>& tokens)
+{
+  Cql::Reader reader(value);
+  int32_t num_tokens = reader.i32();
+
+  for (int32_t ii = 0; ii < num_tokens; ++ii)
+  {
+    std::string token;
+    reader.bytes(token);
+    tokens.push_back(strtoll(token.c_str(), NULL, 10));
+  }
+}
+
+// Utility method for converting an inet value to an address string.
+static std::string inet_to_string(const std::string& value)
+{
+  char buffer[INET6_ADDRSTRLEN];
+
+  if ((value.length() == 4) &&
+      (inet_ntop(AF_INET, value.data(), buffer, sizeof(buffer)) != NULL))
+  {
+    return buffer;
+  }
+  else if ((value.length() == 16) &&
+           (inet_ntop(AF_INET6, value.data(), buffer, sizeof(buffer)) != NULL))
+  {
+    return buffer;
+  }
+
+  return "";
+}
+
+// Must be called with the lock held.
+void CqlBackend::discover_ring(Host* seed)
+{
+  std::vector<std::vector<std::string> > rows;
+  std::vector<int64_t> tokens;
+
+  try
+  {
+    if ((query(seed->connection, "SELECT tokens FROM system.local", rows)) &&
+        (rows.size() == 1) &&
+        (rows[0].size() == 1))
+    {
+      add_tokens(rows[0][0], tokens);
+
+      for (size_t ii = 0; ii < tokens.size(); ++ii)
+      {
+        _ring[tokens[ii]] = seed;
+      }
+    }
+
+    if (query(seed->connection, "SELECT peer, rpc_address, tokens FROM system.peers", rows))
+    {
+      for (size_t ii = 0; ii < rows.size(); ++ii)
+      {
+        if (rows[ii].size() != 3)
+        {
+          continue;
+        }
+
+        // Use the address the node listens for clients on, unless it listens
+        // on all addresses.
+        std::string address = inet_to_string(rows[ii][1]);
+        if ((address.empty()) || (address == "0.0.0.0") || (address == "::"))
+        {
+          address = inet_to_string(rows[ii][0]);
+        }
+
+        Host* host = add_host(address);
+        tokens.clear();
+        add_tokens(rows[ii][2], tokens);
+
+        for (size_t jj = 0; jj < tokens.size(); ++jj)
+        {
+          _ring[tokens[jj]] = host;
+        }
+
+        if (host->connection == NULL)
+        {
+          connect_host(host);
+        }
+      }
+    }
+  }
+  catch (Cql::ProtocolError& pe)
+  {
+    TRC_ERROR("Invalid token ring: %s", pe.what());
+  }
+
+  TRC_STATUS("Discovered %zu cassandra nodes, %zu tokens", _hosts.size(), _ring.size());
+}
+
+// Must be called with the lock held.
+bool CqlBackend::host_available(Host* host)
+{
+  if ((host->connection != NULL) && (host->connection->is_connected()))
+  {
+    return true;
+  }
+
+  // Try to reconnect, but not too often.
+  if (monotonic_ms() >= host->retry_after_ms)
+  {
+    return connect_host(host);
+  }
+
+  return false;
+}
+
+CqlBackend::Host* CqlBackend::route(const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+
+  Host* host = NULL;
+
+  // Send the request to the node that owns the key's token - that is, the
+  // first node clockwise round the ring from the token.
+  if (!_ring.empty())
+  {
+    std::map<int64_t, Host*>::iterator it = _ring.lower_bound(Cql::murmur3_token(key));
+
+    if (it == _ring.end())
+    {
+      it = _ring.begin();
+    }
+
+    if (host_available(it->second))
+    {
+      host = it->second;
+    }
+  }
+
+  // If that node isn't available, any other node can coordinate the request.
+  for (std::map<std::string, Host*>::iterator it = _hosts.begin();
+       (it != _hosts.end()) && (host == NULL);
+       ++it)
+  {
+    if (host_available(it->second))
+    {
+      host = it->second;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (host == NULL)
+  {
+    throw BackendConnectionError("No cassandra nodes available");
+  }
+
+  return host;
+}
+
+std::string CqlBackend::host_for_key(const std::string& key)
+{
+  return route(key)->address;
+}
+
+bool CqlBackend::send_request(Request& request,
+                              cass::ConsistencyLevel::type level)
+{
+  std::string prepared_ids[NUM_STATEMENTS];
+
+  pthread_mutex_lock(&_lock);
+  request.connection = request.host->connection;
+  for (int ii = 0; ii < NUM_STATEMENTS; ++ii)
+  {
+    prepared_ids[ii] = request.host->prepared_ids[ii];
+  }
+  pthread_mutex_unlock(&_lock);
+
+  request.responded = false;
+
+  if (request.connection == NULL)
+  {
+    return false;
+  }
+
+  // Use a single EXECUTE for one statement, and a batch for more.
+  Cql::Writer body;
+  uint8_t opcode;
+
+  if (request.values.size() == 1)
+  {
+    opcode = Cql::OP_EXECUTE;
+    body.short_bytes(prepared_ids[request.statements[0]])
+        .u16(Cql::consistency(level))
+        .u8(Cql::FLAG_VALUES)
+        .u16(request.values[0].size());
+
+    for (size_t ii = 0; ii < request.values[0].size(); ++ii)
+    {
+      body.bytes(request.values[0][ii]);
+    }
+  }
+  else
+  {
+    opcode = Cql::OP_BATCH;
+    body.u8(Cql::BATCH_UNLOGGED).u16(request.values.size());
+
+    for (size_t ii = 0; ii < request.values.size(); ++ii)
+    {
+      body.u8(Cql::BATCH_KIND_PREPARED)
+          .short_bytes(prepared_ids[request.statements[ii]])
+          .u16(request.values[ii].size());
+
+      for (size_t jj = 0; jj < request.values[ii].size(); ++jj)
+      {
+        body.bytes(request.values[ii][jj]);
+      }
+    }
+
+    body.u16(Cql::consistency(level)).u8(0);
+  }
+
+  request.stream = request.connection->send_request(opcode, body);
+  return (request.stream >= 0);
+}
+
+void CqlBackend::wait_response(Request& request)
+{
+  if (request.stream >= 0)
+  {
+    request.responded = request.connection->wait_response(request.stream,
+                                                          _timeout_ms,
+                                                          request.response_opcode,
+                                                          request.response);
+    request.stream = -1;
+  }
+}
+
+void CqlBackend::run_requests(std::vector<Request>& requests,
+                              cass::ConsistencyLevel::type level)
+{
+  // Send all the requests before waiting for any of them, so that they are
+  // in flight at the same time.
+  for (std::vector<Request>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    send_request(*it, level);
+  }
+
+  for (std::vector<Request>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    wait_response(*it);
+  }
+
+  for (std::vector<Request>::iterator it = requests.begin();
+       it != requests.end();
+       ++it)
+  {
+    check_response(*it, level);
+  }
+}
+
+void CqlBackend::check_response(Request& request,
+                                cass::ConsistencyLevel::type level)
+{
+  for (int attempt = 0; ; ++attempt)
+  {
+    if (!request.responded)
+    {
+      if ((request.connection != NULL) && (request.connection->is_connected()))
+      {
+        throw cass::TimedOutException();
+      }
+
+      throw BackendConnectionError("Connection to " + request.host->address + " failed");
+    }
+
+    if (request.response_opcode != Cql::OP_ERROR)
+    {
+      return;
+    }
+
+    Cql::Reader reader(request.response);
+
+    if ((reader.i32() == Cql::ERROR_UNPREPARED) && (attempt == 0))
+    {
+      // The node has forgotten the prepared statements (for example because
+      // it has restarted).  Prepare them again and retry.
+      TRC_INFO("Statements unprepared on %s, prepare them again",
+               request.host->address.c_str());
+      std::string prepared_ids[NUM_STATEMENTS];
+
+      if (prepare_statements(request.connection, prepared_ids))
+      {
+        pthread_mutex_lock(&_lock);
+        if (request.host->connection == request.connection)
+        {
+          for (int ii = 0; ii < NUM_STATEMENTS; ++ii)
+          {
+            request.host->prepared_ids[ii] = prepared_ids[ii];
+          }
+        }
+        pthread_mutex_unlock(&_lock);
+      }
+
+      send_request(request, level);
+      wait_response(request);
+      continue;
+    }
+
+    throw_error(request.response);
+  }
+}
+
+void CqlBackend::throw_error(const std::string& body)
+{
+  Cql::Reader reader(body);
+  int32_t code = reader.i32();
+  std::string message = reader.string();
+
+  TRC_DEBUG("CQL error %d: %s", code, message.c_str());
+
+  switch (code)
+  {
+    case Cql::ERROR_UNAVAILABLE:
+      throw cass::UnavailableException();
+
+    case Cql::ERROR_OVERLOADED:
+    case Cql::ERROR_WRITE_TIMEOUT:
+    case Cql::ERROR_READ_TIMEOUT:
+      throw cass::TimedOutException();
+
+    default:
+    {
+      cass::InvalidRequestException ire;
+      ire.why = message;
+      throw ire;
+    }
+  }
+}
+
+// Utility methods for encoding bound values.
+static std::string encode_bigint(int64_t value)
+{
+  Cql::Writer writer;
+  writer.i64(value);
+  return writer.data();
+}
+
+static std::string encode_int(int32_t value)
+{
+  Cql::Writer writer;
+  writer.i32(value);
+  return writer.data();
+}
+
+void CqlBackend::write_columns(const RowWrites& rows,
+                               cass::ConsistencyLevel::type level)
+{
+  // Group the rows by the node they belong to, and send a single batch to
+  // each node.
+  std::vector<Request> requests;
+  std::map<Host*, size_t> request_for_host;
+
+  for (RowWrites::const_iterator row = rows.begin(); row != rows.end(); ++row)
+  {
+    Host* host = route(row->first);
+    std::map<Host*, size_t>::iterator it = request_for_host.find(host);
+
+    if (it == request_for_host.end())
+    {
+      it = request_for_host.insert(std::make_pair(host, requests.size())).first;
+      requests.push_back(Request(host));
+    }
+
+    Request& request = requests[it->second];
+
+    for (std::vector<CallColumn>::const_iterator column = row->second.begin();
+         column != row->second.end();
+         ++column)
+    {
+      std::vector<std::string> values;
+      values.push_back(row->first);
+      values.push_back(column->name);
+      values.push_back(column->value);
+      values.push_back(encode_bigint(column->timestamp));
+      values.push_back(encode_int(std::max(column->ttl, 0)));
+      request.add(INSERT, values);
+    }
+  }
+
+  run_requests(requests, level);
+}
+
+void CqlBackend::delete_columns(const std::string& key,
+                                const std::vector<std::string>& names,
+                                int64_t timestamp,
+                                const std::vector<CallColumn>& columns,
+                                cass::ConsistencyLevel::type level)
+{
+  if ((names.empty()) && (columns.empty()))
+  {
+    return;
+  }
+
+  std::vector<Request> requests;
+  requests.push_back(Request(route(key)));
+
+  for (std::vector<std::string>::const_iterator name = names.begin();
+       name != names.end();
+       ++name)
+  {
+    std::vector<std::string> values;
+    values.push_back(encode_bigint(timestamp));
+    values.push_back(key);
+    values.push_back(*name);
+    requests[0].add(DELETE, values);
+  }
+
+  for (std::vector<CallColumn>::const_iterator column = columns.begin();
+       column != columns.end();
+       ++column)
+  {
+    std::vector<std::string> values;
+    values.push_back(key);
+    values.push_back(column->name);
+    values.push_back(column->value);
+    values.push_back(encode_bigint(column->timestamp));
+    values.push_back(encode_int(std::max(column->ttl, 0)));
+    requests[0].add(INSERT, values);
+  }
+
+  run_requests(requests, level);
+}
+
+void CqlBackend::get_columns(const std::string& key,
+                             const std::string& start,
+                             const std::string& finish,
+                             int32_t max_columns,
+                             std::vector<CallColumn>& columns,
+                             cass::ConsistencyLevel::type level)
+{
+  std::vector<Request> requests;
+  requests.push_back(Request(route(key)));
+
+  std::vector<std::string> values;
+  values.push_back(key);
+  values.push_back(start);
+  values.push_back(finish);
+  values.push_back(encode_int(max_columns));
+  requests[0].add(SELECT, values);
+
+  run_requests(requests, level);
+
+  Cql::Reader reader(requests[0].response);
+
+  if (reader.i32() != Cql::RESULT_ROWS)
+  {
+    throw Cql::ProtocolError("Unexpected result for SELECT");
+  }
+
+  std::vector<std::vector<std::string> > rows;
+  reader.rows(rows);
+
+  columns.clear();
+  columns.reserve(rows.size());
+
+  for (size_t ii = 0; ii < rows.size(); ++ii)
+  {
+    if (rows[ii].size() != 4)
+    {
+      throw Cql::ProtocolError("Unexpected columns for SELECT");
+    }
+
+    columns.push_back(CallColumn());
+    CallColumn& column = columns.back();
+    column.name.swap(rows[ii][0]);
+    column.value.swap(rows[ii][1]);
+    column.timestamp = Cql::bigint_value(rows[ii][2]);
+    column.ttl = Cql::int_value(rows[ii][3]);
+  }
+}
+
+} // namespace CallListStore
@@ -0,0 +1,203 @@
+/**
+ * @file heavy_hitters.cpp Bounded-memory tracking of the most frequent keys.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+
+#include "heavy_hitters.h"
+#include "log.h"
+
+// How often the hot IMPUs are published to the stats aggregator.
+const static uint64_t HOT_IMPU_PUBLISH_PERIOD_MS = 5000;
+
+// Utility method for getting the current monotonic time in milliseconds.
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+//
+// HeavyHitters methods.
+//
+
+HeavyHitters::HeavyHitters(size_t capacity) :
+  _capacity(capacity),
+  _counters(),
+  _by_count()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+HeavyHitters::~HeavyHitters()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void HeavyHitters::add(const std::string& key, uint64_t weight)
+{
+  if (_capacity == 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, Counter>::iterator it = _counters.find(key);
+
+  if (it != _counters.end())
+  {
+    // The key is already being tracked, so just bump its count.
+    Counter& counter = it->second;
+    _by_count.erase(counter.index_it);
+    counter.count += weight;
+    counter.index_it = _by_count.insert(std::make_pair(counter.count, key));
+  }
+  else
+  {
+    Counter counter;
+    counter.count = weight;
+    counter.error = 0;
+
+    if (_counters.size() >= _capacity)
+    {
+      // All the counters are in use.  Take over the one with the smallest
+      // count.  The new key may have occurred up to that many times before
+      // without being tracked, so that's the error on its count.
+      CountIndex::iterator min_it = _by_count.begin();
+      counter.count += min_it->first;
+      counter.error = min_it->first;
+      _counters.erase(min_it->second);
+      _by_count.erase(min_it);
+    }
+
+    counter.index_it = _by_count.insert(std::make_pair(counter.count, key));
+    _counters.insert(std::make_pair(key, counter));
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void HeavyHitters::top(size_t n, std::vector<Item>& items) const
+{
+  items.clear();
+
+  pthread_mutex_lock(&_lock);
+
+  for (CountIndex::const_reverse_iterator it = _by_count.rbegin();
+       (it != _by_count.rend()) && (items.size() < n);
+       ++it)
+  {
+    Item item;
+    item.key = it->second;
+    item.count = it->first;
+    item.error = _counters.find(it->second)->second.error;
+    items.push_back(item);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void HeavyHitters::clear()
+{
+  pthread_mutex_lock(&_lock);
+  _counters.clear();
+  _by_count.clear();
+  pthread_mutex_unlock(&_lock);
+}
+
+//
+// HotImpuTracker methods.
+//
+
+HotImpuTracker::HotImpuTracker(size_t capacity,
+                               size_t top_n,
+                               LastValueCache* stats_aggregator) :
+  _by_ops(capacity),
+  _by_bytes(capacity),
+  _top_n(top_n),
+  _ops_stat(NULL),
+  _bytes_stat(NULL),
+  _next_publish_ms(monotonic_ms() + HOT_IMPU_PUBLISH_PERIOD_MS)
+{
+  if (stats_aggregator != NULL)
+  {
+    _ops_stat = new Statistic("call_list_hot_impus_ops", stats_aggregator);
+    _bytes_stat = new Statistic("call_list_hot_impus_bytes", stats_aggregator);
+  }
+}
+
+HotImpuTracker::~HotImpuTracker()
+{
+  delete _ops_stat; _ops_stat = NULL;
+  delete _bytes_stat; _bytes_stat = NULL;
+}
+
+void HotImpuTracker::record(const std::string& impu, uint64_t bytes)
+{
+  _by_ops.add(impu);
+  _by_bytes.add(impu, bytes);
+
+  // Publish if it's time to.  Only one thread wins the exchange, so only one
+  // thread publishes each period.
+  uint64_t now_ms = monotonic_ms();
+  uint64_t next_publish_ms = _next_publish_ms.load();
+
+  if ((now_ms >= next_publish_ms) &&
+      (_next_publish_ms.compare_exchange_strong(next_publish_ms,
+                                                now_ms + HOT_IMPU_PUBLISH_PERIOD_MS)))
+  {
+    publish();
+  }
+}
+
+void HotImpuTracker::top_by_ops(size_t n,
+                                std::vector<HeavyHitters::Item>& impus) const
+{
+  _by_ops.top(n, impus);
+}
+
+void HotImpuTracker::top_by_bytes(size_t n,
+                                  std::vector<HeavyHitters::Item>& impus) const
+{
+  _by_bytes.top(n, impus);
+}
+
+void HotImpuTracker::publish()
+{
+  publish_sketch(_by_ops, _ops_stat);
+  publish_sketch(_by_bytes, _bytes_stat);
+}
+
+void HotImpuTracker::publish_sketch(const HeavyHitters& sketch,
+                                    Statistic* statistic)
+{
+  if (statistic == NULL)
+  {
+    return;
+  }
+
+  // The statistic is a list of IMPU, count pairs, heaviest first.
+  std::vector<HeavyHitters::Item> impus;
+  sketch.top(_top_n, impus);
+
+  std::vector<std::string> values;
+  for (std::vector<HeavyHitters::Item>::const_iterator it = impus.begin();
+       it != impus.end();
+       ++it)
+  {
+    values.push_back(it->key);
+    values.push_back(std::to_string(it->count));
+  }
+
+  TRC_DEBUG("Publishing %zu hot IMPUs", impus.size());
+  statistic->report_change(values);
+}
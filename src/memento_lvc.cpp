@@ -24,6 +24,23 @@ const std::string MementoLVC::KNOWN_STATS[] = {
   "cassandra_read_latency",
   "record_size",
   "record_length",
+  "call_list_hot_impus_ops",
+  "call_list_hot_impus_bytes",
+  "call_list_writes_suppressed",
+  "call_list_write_ttl",
+  "call_list_row_fragments",
+  "call_list_row_bytes",
+  "call_list_read_fragment_bytes",
+  "call_list_write_fragment_bytes",
+  "call_list_trims",
+  "call_list_trims_not_scheduled",
+  "call_list_trim_backlog",
+  "call_list_shard_steals",
+  "call_list_read_bytes_held",
+  "call_list_reads_overloaded",
+  "call_list_pool_connections",
+  "call_list_pool_wait_us",
+  "call_list_pool_churn",
 };
 
 const int MementoLVC::NUM_KNOWN_STATS = sizeof(MementoLVC::KNOWN_STATS) / sizeof(std::string);
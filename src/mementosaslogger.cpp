@@ -9,13 +9,123 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <vector>
+
 #include "mementosaslogger.h"
+#include "mementosasevent.h"
+#include "fnv_hash.h"
+
+const size_t MementoSasLogger::DEFAULT_MAX_RX_BODY_BYTES;
+const size_t MementoSasLogger::DEFAULT_MAX_TX_BODY_BYTES;
+
+MementoSasLogger::MementoSasLogger() :
+  _max_rx_body_bytes(DEFAULT_MAX_RX_BODY_BYTES),
+  _max_tx_body_bytes(DEFAULT_MAX_TX_BODY_BYTES),
+  _body_digests(false),
+  _min_level(SASEvent::HttpLogLevel::NONE)
+{}
+
+void MementoSasLogger::set_max_body_bytes(size_t max_rx_body_bytes,
+                                          size_t max_tx_body_bytes)
+{
+  _max_rx_body_bytes = max_rx_body_bytes;
+  _max_tx_body_bytes = max_tx_body_bytes;
+}
+
+void MementoSasLogger::set_body_digests(bool enabled)
+{
+  _body_digests = enabled;
+}
+
+void MementoSasLogger::set_min_level(SASEvent::HttpLogLevel level)
+{
+  _min_level = level;
+}
+
+bool MementoSasLogger::should_log(SAS::TrailId trail,
+                                  SASEvent::HttpLogLevel level) const
+{
+  // Events on trail 0 are thrown away, so don't spend any time building them.
+  return ((trail != 0) && ((int)level >= (int)_min_level));
+}
+
+void MementoSasLogger::sas_log_rx_http_req(SAS::TrailId trail,
+                                           HttpStack::Request& req,
+                                           uint32_t instance_id)
+{
+  if (!should_log(trail, SASEvent::HttpLogLevel::PROTOCOL))
+  {
+    return;
+  }
+
+  // Check the length on the request's buffer, rather than copying the body
+  // out of it.
+  evbuffer* body = req.req()->buffer_in;
+  size_t length = evbuffer_get_length(body);
+  bool omit_body = (length > _max_rx_body_bytes);
+
+  log_correlator(trail, req, instance_id);
+  log_req_event(trail, req, instance_id, SASEvent::HttpLogLevel::PROTOCOL, omit_body);
+
+  if ((omit_body) && (_body_digests))
+  {
+    log_body_digest(trail, SASEvent::HTTP_RX_BODY_DIGEST, body, length, instance_id);
+  }
+}
 
 void MementoSasLogger::sas_log_tx_http_rsp(SAS::TrailId trail,
                                            HttpStack::Request& req,
                                            int rc,
                                            uint32_t instance_id)
 {
-  log_rsp_event(trail, req, rc, instance_id, SASEvent::HttpLogLevel::PROTOCOL, true);
+  if (!should_log(trail, SASEvent::HttpLogLevel::PROTOCOL))
+  {
+    return;
+  }
+
+  evbuffer* body = req.req()->buffer_out;
+  size_t length = evbuffer_get_length(body);
+  bool omit_body = (length > _max_tx_body_bytes);
+
+  log_rsp_event(trail, req, rc, instance_id, SASEvent::HttpLogLevel::PROTOCOL, omit_body);
+
+  if ((omit_body) && (_body_digests))
+  {
+    log_body_digest(trail, SASEvent::HTTP_TX_BODY_DIGEST, body, length, instance_id);
+  }
 }
 
+void MementoSasLogger::log_body_digest(SAS::TrailId trail,
+                                       int event_id,
+                                       evbuffer* body,
+                                       size_t length,
+                                       uint32_t instance_id)
+{
+  // Hash the body in place, a chunk at a time, rather than pulling it up into
+  // one contiguous (and possibly newly allocated) chunk.
+  int num_chunks = evbuffer_peek(body, -1, NULL, NULL, 0);
+  std::vector<evbuffer_iovec> chunks(std::max(num_chunks, 0));
+  num_chunks = evbuffer_peek(body, -1, NULL, chunks.data(), chunks.size());
+
+  FnvHash::WideHash hasher;
+
+  for (int ii = 0; ii < num_chunks; ++ii)
+  {
+    hasher.update(chunks[ii].iov_base, chunks[ii].iov_len);
+  }
+
+  uint64_t hash = hasher.value();
+
+  SAS::Event event(trail, event_id, instance_id);
+  event.add_static_param(length);
+  event.add_static_param((uint32_t)(hash >> 32));
+  event.add_static_param((uint32_t)hash);
+  SAS::report_event(event);
+}
+
+uint64_t MementoSasLogger::body_hash(const unsigned char* data, size_t length)
+{
+  FnvHash::WideHash hasher;
+  hasher.update(data, length);
+  return hasher.value();
+}
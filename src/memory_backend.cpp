@@ -0,0 +1,173 @@
+/**
+ * @file memory_backend.cpp In-memory storage backend for the call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+
+#include "memory_backend.h"
+
+namespace CallListStore
+{
+
+MemoryBackend::MemoryBackend(uint64_t latency_us) :
+  _latency_us(latency_us),
+  _rows()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+MemoryBackend::~MemoryBackend()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void MemoryBackend::delay()
+{
+  if (_latency_us > 0)
+  {
+    usleep(_latency_us);
+  }
+}
+
+void MemoryBackend::write_column(Row& row, const CallColumn& column)
+{
+  Row::iterator it = row.find(column.name);
+
+  if (it == row.end())
+  {
+    row[column.name] = column;
+  }
+  else if (column.timestamp >= it->second.timestamp)
+  {
+    it->second = column;
+  }
+}
+
+void MemoryBackend::write_columns(const RowWrites& rows,
+                                  org::apache::cassandra::ConsistencyLevel::type level)
+{
+  delay();
+
+  pthread_mutex_lock(&_lock);
+
+  for (RowWrites::const_iterator row_it = rows.begin();
+       row_it != rows.end();
+       ++row_it)
+  {
+    Row& row = _rows[row_it->first];
+
+    for (std::vector<CallColumn>::const_iterator column_it = row_it->second.begin();
+         column_it != row_it->second.end();
+         ++column_it)
+    {
+      write_column(row, *column_it);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void MemoryBackend::delete_columns(const std::string& key,
+                                   const std::vector<std::string>& names,
+                                   int64_t timestamp,
+                                   const std::vector<CallColumn>& columns,
+                                   org::apache::cassandra::ConsistencyLevel::type level)
+{
+  delay();
+
+  pthread_mutex_lock(&_lock);
+
+  Row& row = _rows[key];
+
+  for (std::vector<std::string>::const_iterator name_it = names.begin();
+       name_it != names.end();
+       ++name_it)
+  {
+    Row::iterator it = row.find(*name_it);
+
+    if ((it != row.end()) && (it->second.timestamp <= timestamp))
+    {
+      row.erase(it);
+    }
+  }
+
+  for (std::vector<CallColumn>::const_iterator column_it = columns.begin();
+       column_it != columns.end();
+       ++column_it)
+  {
+    write_column(row, *column_it);
+  }
+
+  if (row.empty())
+  {
+    _rows.erase(key);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void MemoryBackend::get_columns(const std::string& key,
+                                const std::string& start,
+                                const std::string& finish,
+                                int32_t max_columns,
+                                std::vector<CallColumn>& columns,
+                                org::apache::cassandra::ConsistencyLevel::type level)
+{
+  delay();
+
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, Row>::const_iterator row_it = _rows.find(key);
+
+  if (row_it != _rows.end())
+  {
+    int32_t num_columns = 0;
+
+    for (Row::const_iterator it = row_it->second.lower_bound(start);
+         (it != row_it->second.end()) &&
+         (it->first <= finish) &&
+         (num_columns < max_columns);
+         ++it, ++num_columns)
+    {
+      columns.push_back(it->second);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+size_t MemoryBackend::num_rows()
+{
+  pthread_mutex_lock(&_lock);
+  size_t num_rows = _rows.size();
+  pthread_mutex_unlock(&_lock);
+
+  return num_rows;
+}
+
+size_t MemoryBackend::num_columns()
+{
+  size_t num_columns = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::map<std::string, Row>::const_iterator it = _rows.begin();
+       it != _rows.end();
+       ++it)
+  {
+    num_columns += it->second.size();
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return num_columns;
+}
+
+} // namespace CallListStore
@@ -0,0 +1,296 @@
+/**
+ * @file op_timeline.cpp Per-operation timelines, recorded in per-thread rings.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "op_timeline.h"
+
+// Utility method for getting the current monotonic time in nanoseconds.
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+void OpTimeline::mark(Event event)
+{
+  times_ns[event] = monotonic_ns();
+}
+
+void OpTimeline::mark_first(Event event)
+{
+  if (times_ns[event] == 0)
+  {
+    times_ns[event] = monotonic_ns();
+  }
+}
+
+uint64_t OpTimeline::start_ns() const
+{
+  uint64_t start = 0;
+
+  for (int ii = 0; ii < NUM_EVENTS; ++ii)
+  {
+    if ((times_ns[ii] != 0) && ((start == 0) || (times_ns[ii] < start)))
+    {
+      start = times_ns[ii];
+    }
+  }
+
+  return start;
+}
+
+uint64_t OpTimeline::duration_ns() const
+{
+  uint64_t end = 0;
+
+  for (int ii = 0; ii < NUM_EVENTS; ++ii)
+  {
+    end = std::max(end, times_ns[ii]);
+  }
+
+  return end - start_ns();
+}
+
+const char* OpTimeline::event_name(Event event)
+{
+  switch (event)
+  {
+    case ENQUEUE:
+      return "enqueue";
+
+    case DEQUEUE:
+      return "dequeue";
+
+    case CONNECTION_CHECKOUT:
+      return "connection_checkout";
+
+    case SEND:
+      return "send";
+
+    case RECEIVE:
+      return "receive";
+
+    case DECODE_START:
+      return "decode_start";
+
+    case DECODE_END:
+      return "decode_end";
+
+    case HANDOFF:
+      return "handoff";
+
+    default:
+      return "unknown";
+  }
+}
+
+// The next ID to give a recorder.
+static std::atomic<uint64_t> next_recorder_id(1);
+
+OpTimelineRecorder::OpTimelineRecorder(size_t ops_per_thread) :
+  _ops_per_thread(std::max(ops_per_thread, (size_t)1)),
+  _id(next_recorder_id++),
+  _rings()
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+OpTimelineRecorder::~OpTimelineRecorder()
+{
+  for (std::vector<Ring*>::iterator it = _rings.begin(); it != _rings.end(); ++it)
+  {
+    delete *it;
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+OpTimelineRecorder::Ring* OpTimelineRecorder::ring_for_this_thread()
+{
+  // Each thread caches the rings it has been given, keyed on recorder ID, so
+  // only a thread's first operation on a recorder needs to take the lock.
+  static thread_local std::vector<std::pair<uint64_t, Ring*> > rings;
+
+  for (size_t ii = 0; ii < rings.size(); ++ii)
+  {
+    if (rings[ii].first == _id)
+    {
+      return rings[ii].second;
+    }
+  }
+
+  Ring* ring = new Ring(_ops_per_thread);
+
+  pthread_mutex_lock(&_lock);
+  _rings.push_back(ring);
+  pthread_mutex_unlock(&_lock);
+
+  rings.push_back(std::make_pair(_id, ring));
+  return ring;
+}
+
+void OpTimelineRecorder::record(const OpTimeline& timeline)
+{
+  Ring* ring = ring_for_this_thread();
+  Slot& slot = ring->slots[ring->next];
+  ring->next = (ring->next + 1) % ring->size;
+
+  // Make the sequence number odd while the slot is written, so that readers
+  // can tell they may have read a partly written timeline.
+  uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timeline = timeline;
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Orders timelines slowest first.
+static bool slower(const OpTimeline& a, const OpTimeline& b)
+{
+  return a.duration_ns() > b.duration_ns();
+}
+
+void OpTimelineRecorder::slowest(size_t n, std::vector<OpTimeline>& timelines)
+{
+  timelines.clear();
+
+  pthread_mutex_lock(&_lock);
+  std::vector<Ring*> rings = _rings;
+  pthread_mutex_unlock(&_lock);
+
+  for (std::vector<Ring*>::iterator it = rings.begin(); it != rings.end(); ++it)
+  {
+    Ring* ring = *it;
+
+    for (size_t ii = 0; ii < ring->size; ++ii)
+    {
+      Slot& slot = ring->slots[ii];
+      uint64_t before = slot.sequence.load(std::memory_order_acquire);
+
+      if ((before == 0) || (before % 2 == 1))
+      {
+        // Empty, or being written.
+        continue;
+      }
+
+      OpTimeline timeline = slot.timeline;
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (slot.sequence.load(std::memory_order_relaxed) == before)
+      {
+        timelines.push_back(timeline);
+      }
+    }
+  }
+
+  n = std::min(n, timelines.size());
+  std::partial_sort(timelines.begin(), timelines.begin() + n, timelines.end(), slower);
+  timelines.resize(n);
+}
+
+// Utility method for adding a complete ("X") event to a Chrome trace.
+static void add_trace_slice(std::string& json,
+                            const char* name,
+                            uint64_t start_ns,
+                            uint64_t end_ns,
+                            size_t row,
+                            uint64_t trail)
+{
+  char buffer[256];
+  snprintf(buffer,
+           sizeof(buffer),
+           "%s{\"name\":\"%s\",\"cat\":\"call_list\",\"ph\":\"X\","
+           "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu,"
+           "\"args\":{\"trail\":%llu}}",
+           (json.back() == '[') ? "" : ",",
+           name,
+           start_ns / 1000.0,
+           (end_ns - start_ns) / 1000.0,
+           row,
+           (unsigned long long)trail);
+  json.append(buffer);
+}
+
+void OpTimelineRecorder::dump_slowest(size_t n, std::string& json)
+{
+  // The stages of an operation, as the events that start and end them.
+  const static struct
+  {
+    const char* name;
+    OpTimeline::Event start;
+    OpTimeline::Event end;
+  } STAGES[] =
+  {
+    {"queued", OpTimeline::ENQUEUE, OpTimeline::DEQUEUE},
+    {"connection checkout", OpTimeline::DEQUEUE, OpTimeline::CONNECTION_CHECKOUT},
+    {"cassandra", OpTimeline::SEND, OpTimeline::RECEIVE},
+    {"decode", OpTimeline::DECODE_START, OpTimeline::DECODE_END},
+  };
+
+  std::vector<OpTimeline> timelines;
+  slowest(n, timelines);
+
+  json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+  for (size_t ii = 0; ii < timelines.size(); ++ii)
+  {
+    const OpTimeline& timeline = timelines[ii];
+    const uint64_t* times = timeline.times_ns;
+    uint64_t start = timeline.start_ns();
+
+    add_trace_slice(json,
+                    timeline.name,
+                    start,
+                    start + timeline.duration_ns(),
+                    ii,
+                    timeline.trail);
+
+    for (size_t jj = 0; jj < sizeof(STAGES) / sizeof(STAGES[0]); ++jj)
+    {
+      if ((times[STAGES[jj].start] != 0) && (times[STAGES[jj].end] != 0))
+      {
+        add_trace_slice(json,
+                        STAGES[jj].name,
+                        times[STAGES[jj].start],
+                        times[STAGES[jj].end],
+                        ii,
+                        timeline.trail);
+      }
+    }
+
+    // Hand-off runs from the last event before it.
+    if (times[OpTimeline::HANDOFF] != 0)
+    {
+      uint64_t previous = 0;
+
+      for (int jj = 0; jj < OpTimeline::HANDOFF; ++jj)
+      {
+        previous = std::max(previous, times[jj]);
+      }
+
+      if (previous != 0)
+      {
+        add_trace_slice(json,
+                        "hand-off",
+                        previous,
+                        times[OpTimeline::HANDOFF],
+                        ii,
+                        timeline.trail);
+      }
+    }
+  }
+
+  json.append("]}");
+}
@@ -0,0 +1,389 @@
+/**
+ * @file op_trace.cpp Compact binary traces of call list store operations.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <random>
+
+#include "op_trace.h"
+#include "fnv_hash.h"
+#include "log.h"
+
+// The layout of a trace file is:
+//
+//   Header:  "CLOT" <version:u32>
+//   Records: <record>*
+//
+// Each record is:
+//
+//   <flags:u8> <IMPU hash:u64> <start:varint> <latency:varint>
+//   <num fragments:varint> <num bytes:varint>
+//
+// The low bits of the flags are the operation type and the top bit is set if
+// the operation succeeded.  The start time is a zig-zag encoded delta from
+// the previous record (records are written as operations complete, so start
+// times aren't always in order).  All integers are little-endian.
+
+const static uint32_t FILE_MAGIC = 0x544f4c43;    // "CLOT"
+const static uint32_t FILE_VERSION = 1;
+const static size_t HEADER_SIZE = 8;
+
+const static uint8_t FLAG_SUCCESS = 0x80;
+const static uint8_t FLAG_TYPE_MASK = 0x7f;
+
+// Buffered records are written to the file once there are this many bytes.
+const static size_t FLUSH_SIZE = 65536;
+
+namespace CallListStore
+{
+
+//
+// Encoding utility methods.
+//
+
+static void put_u32(std::string& out, uint32_t value)
+{
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static uint32_t get_u32(const unsigned char* data)
+{
+  uint32_t value = 0;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    value |= ((uint32_t)data[ii]) << (8 * ii);
+  }
+
+  return value;
+}
+
+static void put_u64(std::string& out, uint64_t value)
+{
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    out.push_back((char)((value >> (8 * ii)) & 0xff));
+  }
+}
+
+static uint64_t get_u64(const unsigned char* data)
+{
+  uint64_t value = 0;
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    value |= ((uint64_t)data[ii]) << (8 * ii);
+  }
+
+  return value;
+}
+
+static void put_varint(std::string& out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out.push_back((char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+
+  out.push_back((char)value);
+}
+
+static uint64_t zigzag_encode(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Utility method for choosing the salt for IMPU hashes.
+static uint64_t generate_impu_hash_salt()
+{
+  std::random_device random;
+  return ((uint64_t)random() << 32) | random();
+}
+
+uint64_t OpTraceRecord::hash_impu(const std::string& impu)
+{
+  // The salt is chosen once per process, so the same IMPU always has the same
+  // hash within a trace, but the IMPUs in a trace can't be found by hashing
+  // a list of likely IMPUs (e.g. every number in a range) and looking for
+  // matches.
+  static const uint64_t salt = generate_impu_hash_salt();
+  return FnvHash::hash(impu, FnvHash::hash(&salt, sizeof(salt)));
+}
+
+//
+// OpTraceWriter methods.
+//
+
+OpTraceWriter::OpTraceWriter() :
+  _file(NULL),
+  _max_records(0),
+  _failed(false),
+  _buffer(),
+  _prev_start_us(0),
+  _num_records(0),
+  _num_dropped(0)
+{
+  clock_gettime(CLOCK_MONOTONIC, &_start);
+  pthread_mutex_init(&_lock, NULL);
+}
+
+OpTraceWriter::~OpTraceWriter()
+{
+  if (_file != NULL)
+  {
+    close();
+  }
+
+  pthread_mutex_destroy(&_lock);
+}
+
+bool OpTraceWriter::open(const std::string& path, uint64_t max_records)
+{
+  _file = fopen(path.c_str(), "wb");
+
+  if (_file == NULL)
+  {
+    TRC_ERROR("Failed to create trace file %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  _max_records = max_records;
+  _failed = false;
+  _prev_start_us = 0;
+  _num_records = 0;
+  _num_dropped = 0;
+  clock_gettime(CLOCK_MONOTONIC, &_start);
+
+  _buffer.clear();
+  put_u32(_buffer, FILE_MAGIC);
+  put_u32(_buffer, FILE_VERSION);
+
+  TRC_STATUS("Started operation trace %s", path.c_str());
+  return true;
+}
+
+uint64_t OpTraceWriter::now_us() const
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - _start.tv_sec) * 1000000) +
+         ((now.tv_nsec - _start.tv_nsec) / 1000);
+}
+
+void OpTraceWriter::write(const OpTraceRecord& record)
+{
+  pthread_mutex_lock(&_lock);
+
+  if ((_file == NULL) || (_failed))
+  {
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  if ((_max_records != 0) && (_num_records >= _max_records))
+  {
+    _num_dropped++;
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+
+  uint8_t flags = (uint8_t)record.type & FLAG_TYPE_MASK;
+
+  if (record.success)
+  {
+    flags |= FLAG_SUCCESS;
+  }
+
+  _buffer.push_back((char)flags);
+  put_u64(_buffer, record.impu_hash);
+  put_varint(_buffer, zigzag_encode((int64_t)(record.start_us - _prev_start_us)));
+  put_varint(_buffer, record.latency_us);
+  put_varint(_buffer, record.num_fragments);
+  put_varint(_buffer, record.num_bytes);
+  _prev_start_us = record.start_us;
+  _num_records++;
+
+  if (_buffer.length() >= FLUSH_SIZE)
+  {
+    flush();
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+bool OpTraceWriter::flush()
+{
+  if ((!_buffer.empty()) &&
+      (fwrite(_buffer.data(), 1, _buffer.length(), _file) != _buffer.length()))
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to write to trace file: %s", strerror(errno));
+    _failed = true;
+    // LCOV_EXCL_STOP
+  }
+
+  _buffer.clear();
+  return !_failed;
+}
+
+bool OpTraceWriter::close()
+{
+  pthread_mutex_lock(&_lock);
+
+  if (_file == NULL)
+  {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+
+  bool success = flush();
+
+  if (fclose(_file) != 0)
+  {
+    // LCOV_EXCL_START
+    success = false;
+    // LCOV_EXCL_STOP
+  }
+
+  _file = NULL;
+
+  TRC_STATUS("Finished operation trace (%llu records, %llu dropped)",
+             (unsigned long long)_num_records,
+             (unsigned long long)_num_dropped);
+
+  pthread_mutex_unlock(&_lock);
+  return success;
+}
+
+//
+// OpTraceReader methods.
+//
+
+OpTraceReader::OpTraceReader() :
+  _file(NULL),
+  _failed(false),
+  _prev_start_us(0)
+{}
+
+OpTraceReader::~OpTraceReader()
+{
+  close();
+}
+
+bool OpTraceReader::open(const std::string& path)
+{
+  _file = fopen(path.c_str(), "rb");
+  _failed = false;
+  _prev_start_us = 0;
+
+  if (_file == NULL)
+  {
+    TRC_ERROR("Failed to open trace file %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  unsigned char header[HEADER_SIZE];
+
+  if ((fread(header, 1, HEADER_SIZE, _file) != HEADER_SIZE) ||
+      (get_u32(header) != FILE_MAGIC) ||
+      (get_u32(header + 4) != FILE_VERSION))
+  {
+    TRC_ERROR("%s is not a valid trace file", path.c_str());
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+bool OpTraceReader::get_varint(uint64_t& value)
+{
+  value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int c = fgetc(_file);
+
+    if (c == EOF)
+    {
+      return false;
+    }
+
+    value |= ((uint64_t)(c & 0x7f)) << shift;
+
+    if ((c & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool OpTraceReader::read(OpTraceRecord& record)
+{
+  if ((_file == NULL) || (_failed))
+  {
+    return false;
+  }
+
+  int flags = fgetc(_file);
+
+  if (flags == EOF)
+  {
+    // The end of the trace.
+    return false;
+  }
+
+  unsigned char hash[8];
+  uint64_t start_delta;
+
+  if ((fread(hash, 1, sizeof(hash), _file) != sizeof(hash)) ||
+      (!get_varint(start_delta)) ||
+      (!get_varint(record.latency_us)) ||
+      (!get_varint(record.num_fragments)) ||
+      (!get_varint(record.num_bytes)) ||
+      ((flags & FLAG_TYPE_MASK) >= OpTraceRecord::NUM_TYPES))
+  {
+    TRC_ERROR("Trace file is corrupt");
+    _failed = true;
+    return false;
+  }
+
+  record.type = (OpTraceRecord::Type)(flags & FLAG_TYPE_MASK);
+  record.success = ((flags & FLAG_SUCCESS) != 0);
+  record.impu_hash = get_u64(hash);
+  record.start_us = _prev_start_us + zigzag_decode(start_delta);
+  _prev_start_us = record.start_us;
+
+  return true;
+}
+
+void OpTraceReader::close()
+{
+  if (_file != NULL)
+  {
+    fclose(_file);
+    _file = NULL;
+  }
+}
+
+} // namespace CallListStore
@@ -0,0 +1,218 @@
+/**
+ * @file read_memory_budget.cpp Limits the memory held by call list reads.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "read_memory_budget.h"
+#include "log.h"
+
+// How often the memory held is published.
+const static uint64_t PUBLISH_PERIOD_MS = 1000;
+
+namespace CallListStore
+{
+
+ReadMemoryBudget::ReadMemoryBudget(const Config& config,
+                                   LastValueCache* stats_aggregator) :
+  _config(config),
+  _bytes_held(0),
+  _next_publish_ms(0),
+  _published_bytes_held(0),
+  _bytes_held_stat(NULL),
+  _rejected(new ThreadLocalCounter("call_list_reads_overloaded",
+                                   stats_aggregator))
+{
+  if (stats_aggregator != NULL)
+  {
+    _bytes_held_stat = new Statistic("call_list_read_bytes_held",
+                                     stats_aggregator);
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&_lock, NULL);
+}
+
+ReadMemoryBudget::~ReadMemoryBudget()
+{
+  delete _bytes_held_stat; _bytes_held_stat = NULL;
+  delete _rejected; _rejected = NULL;
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool ReadMemoryBudget::admit(uint64_t& reserved_bytes)
+{
+  reserved_bytes = 0;
+  pthread_mutex_lock(&_lock);
+
+  // A read fits if there's room for its reservation, or nothing else is
+  // held (so that a reservation larger than the budget doesn't block reads
+  // for ever).
+  if ((_bytes_held > 0) &&
+      (_bytes_held + _config.reserved_bytes >= _config.max_bytes))
+  {
+    TRC_DEBUG("Read memory budget used up, deferring read");
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _config.max_wait_ms / 1000;
+    deadline.tv_nsec += (_config.max_wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    while ((_bytes_held > 0) &&
+           (_bytes_held + _config.reserved_bytes >= _config.max_bytes))
+    {
+      if (pthread_cond_timedwait(&_cond, &_lock, &deadline) != 0)
+      {
+        // Timed out.
+        break;
+      }
+    }
+  }
+
+  bool admitted = ((_bytes_held == 0) ||
+                   (_bytes_held + _config.reserved_bytes < _config.max_bytes));
+
+  if (admitted)
+  {
+    reserved_bytes = _config.reserved_bytes;
+    _bytes_held += reserved_bytes;
+  }
+
+  bool publish = (admitted) && (publish_due());
+  uint64_t bytes_held = _bytes_held;
+  pthread_mutex_unlock(&_lock);
+
+  if (!admitted)
+  {
+    _rejected->increment();
+  }
+
+  if (publish)
+  {
+    publish_bytes_held(bytes_held);
+  }
+
+  return admitted;
+}
+
+bool ReadMemoryBudget::charge(uint64_t bytes, uint64_t reserved_bytes)
+{
+  pthread_mutex_lock(&_lock);
+
+  _bytes_held -= std::min(reserved_bytes, _bytes_held);
+
+  bool charged = ((bytes < _config.large_read_bytes) ||
+                  (_bytes_held + bytes <= _config.max_bytes));
+
+  if (charged)
+  {
+    _bytes_held += bytes;
+  }
+
+  if (_bytes_held < _config.max_bytes)
+  {
+    pthread_cond_broadcast(&_cond);
+  }
+
+  bool publish = publish_due();
+  uint64_t bytes_held = _bytes_held;
+  pthread_mutex_unlock(&_lock);
+
+  if (!charged)
+  {
+    _rejected->increment();
+  }
+
+  if (publish)
+  {
+    publish_bytes_held(bytes_held);
+  }
+
+  return charged;
+}
+
+void ReadMemoryBudget::release(uint64_t bytes)
+{
+  pthread_mutex_lock(&_lock);
+
+  _bytes_held -= std::min(bytes, _bytes_held);
+
+  if (_bytes_held < _config.max_bytes)
+  {
+    pthread_cond_broadcast(&_cond);
+  }
+
+  bool publish = publish_due();
+  uint64_t bytes_held = _bytes_held;
+  pthread_mutex_unlock(&_lock);
+
+  if (publish)
+  {
+    publish_bytes_held(bytes_held);
+  }
+}
+
+uint64_t ReadMemoryBudget::bytes_held()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t bytes_held = _bytes_held;
+  pthread_mutex_unlock(&_lock);
+  return bytes_held;
+}
+
+bool ReadMemoryBudget::publish_due()
+{
+  if (_bytes_held_stat == NULL)
+  {
+    return false;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now_ms = ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+  // A drop to zero is published straight away, as there may be no more
+  // reads to publish it later.
+  bool dropped_to_zero = ((_bytes_held == 0) && (_published_bytes_held != 0));
+
+  if ((now_ms < _next_publish_ms) && (!dropped_to_zero))
+  {
+    return false;
+  }
+
+  _next_publish_ms = now_ms + PUBLISH_PERIOD_MS;
+  _published_bytes_held = _bytes_held;
+  return true;
+}
+
+void ReadMemoryBudget::publish_bytes_held(uint64_t bytes_held)
+{
+  std::vector<std::string> values;
+  values.push_back(std::to_string(bytes_held));
+  values.push_back(std::to_string(_config.max_bytes));
+  _bytes_held_stat->report_change(values);
+}
+
+} // namespace CallListStore
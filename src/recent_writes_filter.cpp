@@ -0,0 +1,177 @@
+/**
+ * @file recent_writes_filter.cpp Time-decaying filter of recently written keys.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "recent_writes_filter.h"
+#include "log.h"
+
+// FNV-1a parameters.
+const static uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+const static uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+// Utility method for getting the current monotonic time in milliseconds.
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Finalizer from MurmurHash3, used to derive a second, independent-looking
+// hash from the first.
+static uint64_t mix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+RecentWritesFilter::Key::Key() : _hash(FNV_OFFSET_BASIS) {}
+
+RecentWritesFilter::Key& RecentWritesFilter::Key::add(const std::string& part)
+{
+  for (std::string::const_iterator it = part.begin(); it != part.end(); ++it)
+  {
+    _hash ^= (uint8_t)*it;
+    _hash *= FNV_PRIME;
+  }
+
+  // Mix in a delimiter that can't be confused with a character.
+  _hash ^= 0x100;
+  _hash *= FNV_PRIME;
+
+  return *this;
+}
+
+RecentWritesFilter::RecentWritesFilter(uint64_t window_ms,
+                                       size_t expected_entries,
+                                       double false_positive_rate) :
+  _window_ms(window_ms),
+  _num_bits(64),
+  _num_hashes(1),
+  _current(),
+  _previous(),
+  _window_end_ms(0)
+{
+  // A key is checked against both windows, so size each one for half the
+  // target false positive rate.  These are the standard optimal Bloom filter
+  // parameters: m = -n.ln(p) / ln(2)^2 and k = (m/n).ln(2).
+  double n = std::max(expected_entries, (size_t)1);
+  double p = std::min(std::max(false_positive_rate / 2, 1e-9), 0.5);
+  double m = ceil(-n * log(p) / (M_LN2 * M_LN2));
+
+  _num_bits = std::max((size_t)64, (((size_t)m + 63) / 64) * 64);
+  _num_hashes = std::max((size_t)1, (size_t)round((_num_bits / n) * M_LN2));
+
+  TRC_STATUS("Recent writes filter: %zu bits, %zu hashes, window %llu ms",
+             _num_bits, _num_hashes, (unsigned long long)_window_ms);
+
+  _current.resize(_num_bits / 64, 0);
+  _previous.resize(_num_bits / 64, 0);
+
+  pthread_mutex_init(&_lock, NULL);
+}
+
+RecentWritesFilter::~RecentWritesFilter()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+bool RecentWritesFilter::contains(const Key& key, uint64_t now_ms)
+{
+  pthread_mutex_lock(&_lock);
+  rotate_if_needed(now_ms);
+  bool found = test_bits(_current, key) || test_bits(_previous, key);
+  pthread_mutex_unlock(&_lock);
+
+  return found;
+}
+
+bool RecentWritesFilter::contains(const Key& key)
+{
+  return contains(key, monotonic_ms());
+}
+
+void RecentWritesFilter::add(const Key& key, uint64_t now_ms)
+{
+  pthread_mutex_lock(&_lock);
+  rotate_if_needed(now_ms);
+  set_bits(_current, key);
+  pthread_mutex_unlock(&_lock);
+}
+
+void RecentWritesFilter::add(const Key& key)
+{
+  add(key, monotonic_ms());
+}
+
+void RecentWritesFilter::rotate_if_needed(uint64_t now_ms)
+{
+  if (_window_end_ms == 0)
+  {
+    _window_end_ms = now_ms + _window_ms;
+  }
+  else if (now_ms >= _window_end_ms)
+  {
+    if (now_ms >= _window_end_ms + _window_ms)
+    {
+      // More than a whole window has passed since the current window ended,
+      // so both windows are out of date.
+      std::fill(_previous.begin(), _previous.end(), 0);
+      _window_end_ms = now_ms + _window_ms;
+    }
+    else
+    {
+      _previous.swap(_current);
+      _window_end_ms += _window_ms;
+    }
+
+    std::fill(_current.begin(), _current.end(), 0);
+  }
+}
+
+// The bits for a key are chosen by double hashing: bit i is h1 + i.h2.
+bool RecentWritesFilter::test_bits(const std::vector<uint64_t>& bits,
+                                   const Key& key) const
+{
+  uint64_t h1 = key._hash;
+  uint64_t h2 = mix64(key._hash) | 1;
+
+  for (size_t ii = 0; ii < _num_hashes; ++ii)
+  {
+    uint64_t bit = (h1 + ii * h2) % _num_bits;
+
+    if ((bits[bit / 64] & (1ULL << (bit % 64))) == 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void RecentWritesFilter::set_bits(std::vector<uint64_t>& bits, const Key& key)
+{
+  uint64_t h1 = key._hash;
+  uint64_t h2 = mix64(key._hash) | 1;
+
+  for (size_t ii = 0; ii < _num_hashes; ++ii)
+  {
+    uint64_t bit = (h1 + ii * h2) % _num_bits;
+    bits[bit / 64] |= (1ULL << (bit % 64));
+  }
+}
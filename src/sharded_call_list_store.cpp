@@ -0,0 +1,248 @@
+/**
+ * @file sharded_call_list_store.cpp Call list store sharded across clusters.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "sharded_call_list_store.h"
+#include "fnv_hash.h"
+#include "log.h"
+
+namespace CallListStore
+{
+
+const size_t ShardedStore::DEFAULT_VNODES_PER_SHARD;
+
+ShardedStore::ShardedStore(size_t vnodes_per_shard) :
+  _vnodes_per_shard(std::max(vnodes_per_shard, (size_t)1)),
+  _names(),
+  _stores(),
+  _ring()
+{
+  pthread_rwlock_init(&_lock, NULL);
+}
+
+ShardedStore::~ShardedStore()
+{
+  for (std::vector<Store*>::iterator it = _stores.begin();
+       it != _stores.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  _stores.clear();
+  pthread_rwlock_destroy(&_lock);
+}
+
+uint64_t ShardedStore::ring_hash(const std::string& key)
+{
+  // Mix the hash so that keys that differ only in their last few characters
+  // (e.g. "shard1#1" and "shard1#2") are spread around the ring.
+  return FnvHash::mix(FnvHash::hash(key));
+}
+
+bool ShardedStore::add_shard(const std::string& name, Store* store)
+{
+  pthread_rwlock_wrlock(&_lock);
+
+  if (std::find(_names.begin(), _names.end(), name) != _names.end())
+  {
+    pthread_rwlock_unlock(&_lock);
+    TRC_ERROR("Call list shard %s already exists", name.c_str());
+    return false;
+  }
+
+  size_t index = _stores.size();
+  _names.push_back(name);
+  _stores.push_back(store);
+
+  for (size_t ii = 0; ii < _vnodes_per_shard; ++ii)
+  {
+    _ring.push_back(std::make_pair(ring_hash(name + "#" + std::to_string(ii)),
+                                   index));
+  }
+
+  std::sort(_ring.begin(), _ring.end());
+
+  pthread_rwlock_unlock(&_lock);
+
+  TRC_STATUS("Added call list shard %s (%zu shards)", name.c_str(), index + 1);
+  return true;
+}
+
+size_t ShardedStore::num_shards()
+{
+  pthread_rwlock_rdlock(&_lock);
+  size_t num_shards = _stores.size();
+  pthread_rwlock_unlock(&_lock);
+
+  return num_shards;
+}
+
+size_t ShardedStore::find_shard(const std::string& impu) const
+{
+  // The IMPU belongs to the first point at or after its hash, wrapping round
+  // to the first point on the ring.
+  std::vector<std::pair<uint64_t, size_t> >::const_iterator it =
+    std::lower_bound(_ring.begin(),
+                     _ring.end(),
+                     std::make_pair(ring_hash(impu), (size_t)0));
+
+  if (it == _ring.end())
+  {
+    it = _ring.begin();
+  }
+
+  return it->second;
+}
+
+Store* ShardedStore::get_store(const std::string& impu)
+{
+  Store* store = NULL;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  if (!_ring.empty())
+  {
+    store = _stores[find_shard(impu)];
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return store;
+}
+
+std::string ShardedStore::get_shard_name(const std::string& impu)
+{
+  std::string name;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  if (!_ring.empty())
+  {
+    name = _names[find_shard(impu)];
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return name;
+}
+
+CassandraStore::ResultCode ShardedStore::start()
+{
+  CassandraStore::ResultCode result = CassandraStore::OK;
+
+  pthread_rwlock_rdlock(&_lock);
+
+  for (size_t ii = 0; ii < _stores.size(); ++ii)
+  {
+    CassandraStore::ResultCode rc = _stores[ii]->start();
+
+    if (rc != CassandraStore::OK)
+    {
+      TRC_ERROR("Failed to start call list shard %s (RC = %d)",
+                _names[ii].c_str(), rc);
+
+      if (result == CassandraStore::OK)
+      {
+        result = rc;
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&_lock);
+
+  return result;
+}
+
+void ShardedStore::stop()
+{
+  pthread_rwlock_rdlock(&_lock);
+
+  for (size_t ii = 0; ii < _stores.size(); ++ii)
+  {
+    _stores[ii]->stop();
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+void ShardedStore::wait_stopped()
+{
+  pthread_rwlock_rdlock(&_lock);
+
+  for (size_t ii = 0; ii < _stores.size(); ++ii)
+  {
+    _stores[ii]->wait_stopped();
+  }
+
+  pthread_rwlock_unlock(&_lock);
+}
+
+CassandraStore::ResultCode
+ShardedStore::write_call_fragment_sync(const std::string& impu,
+                                       const CallFragment& fragment,
+                                       const int64_t cass_timestamp,
+                                       const int32_t ttl,
+                                       SAS::TrailId trail)
+{
+  Store* store = get_store(impu);
+
+  if (store == NULL)
+  {
+    TRC_ERROR("No call list shards to write to");
+    return CassandraStore::CONNECTION_ERROR;
+  }
+
+  return store->write_call_fragment_sync(impu,
+                                         fragment,
+                                         cass_timestamp,
+                                         ttl,
+                                         trail);
+}
+
+CassandraStore::ResultCode
+ShardedStore::get_call_fragments_sync(const std::string& impu,
+                                      std::vector<CallFragment>& fragments,
+                                      SAS::TrailId trail)
+{
+  Store* store = get_store(impu);
+
+  if (store == NULL)
+  {
+    TRC_ERROR("No call list shards to read from");
+    return CassandraStore::CONNECTION_ERROR;
+  }
+
+  return store->get_call_fragments_sync(impu, fragments, trail);
+}
+
+CassandraStore::ResultCode
+ShardedStore::delete_old_call_fragments_sync(const std::string& impu,
+                                             const std::vector<CallFragment> fragments,
+                                             const int64_t cass_timestamp,
+                                             SAS::TrailId trail)
+{
+  Store* store = get_store(impu);
+
+  if (store == NULL)
+  {
+    TRC_ERROR("No call list shards to delete from");
+    return CassandraStore::CONNECTION_ERROR;
+  }
+
+  return store->delete_old_call_fragments_sync(impu,
+                                               fragments,
+                                               cass_timestamp,
+                                               trail);
+}
+
+} // namespace CallListStore
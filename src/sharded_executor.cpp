@@ -0,0 +1,341 @@
+/**
+ * @file sharded_executor.cpp Worker threads sharded by key, with work stealing.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "sharded_executor.h"
+#include "fnv_hash.h"
+#include "log.h"
+
+namespace CallListStore
+{
+
+ShardedExecutor::Shard::Shard() :
+  queue(),
+  running(),
+  queued(0),
+  changes(0),
+  started(false)
+{
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&lock, NULL);
+}
+
+ShardedExecutor::Shard::~Shard()
+{
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+ShardedExecutor::ShardedExecutor(const Config& config,
+                                 LastValueCache* stats_aggregator) :
+  _config(config),
+  _shards(),
+  _thread_args(),
+  _steals(new ThreadLocalCounter("call_list_shard_steals", stats_aggregator)),
+  _running(false),
+  _terminating(false)
+{
+  size_t num_shards = std::max(_config.num_shards, (size_t)1);
+
+  for (size_t ii = 0; ii < num_shards; ++ii)
+  {
+    _shards.push_back(new Shard());
+    ThreadArgs args = {this, ii};
+    _thread_args.push_back(args);
+  }
+}
+
+ShardedExecutor::~ShardedExecutor()
+{
+  stop();
+  wait_stopped();
+
+  for (std::vector<Shard*>::iterator it = _shards.begin();
+       it != _shards.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  delete _steals; _steals = NULL;
+}
+
+void ShardedExecutor::start()
+{
+  if (_running)
+  {
+    return;
+  }
+
+  TRC_STATUS("Starting %zu call list worker shards", _shards.size());
+  _terminating = false;
+
+  for (size_t ii = 0; ii < _shards.size(); ++ii)
+  {
+    int rc = pthread_create(&_shards[ii]->thread,
+                            NULL,
+                            thread_entry_point,
+                            &_thread_args[ii]);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start call list worker shard %zu: %d", ii, rc);
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
+    _shards[ii]->started = true;
+  }
+
+  _running = true;
+}
+
+void ShardedExecutor::stop()
+{
+  if (!_running)
+  {
+    return;
+  }
+
+  _terminating = true;
+
+  for (std::vector<Shard*>::iterator it = _shards.begin();
+       it != _shards.end();
+       ++it)
+  {
+    pthread_mutex_lock(&(*it)->lock);
+    pthread_cond_broadcast(&(*it)->cond);
+    pthread_mutex_unlock(&(*it)->lock);
+  }
+}
+
+void ShardedExecutor::wait_stopped()
+{
+  if (!_running)
+  {
+    return;
+  }
+
+  for (std::vector<Shard*>::iterator it = _shards.begin();
+       it != _shards.end();
+       ++it)
+  {
+    if ((*it)->started)
+    {
+      pthread_join((*it)->thread, NULL);
+      (*it)->started = false;
+    }
+  }
+
+  _running = false;
+}
+
+bool ShardedExecutor::submit(uint64_t key, Task* task)
+{
+  if (!_running)
+  {
+    return false;
+  }
+
+  Shard* shard = _shards[shard_for(key, _shards.size())];
+  bool accepted = false;
+
+  pthread_mutex_lock(&shard->lock);
+
+  // Check for termination with the lock held.  The shard's thread checks
+  // whether to exit with the lock held too, so it can't exit leaving this
+  // task behind.
+  if ((!_terminating) && (shard->started))
+  {
+    Entry entry = {key, task};
+    shard->queue.push_back(entry);
+    shard->queued++;
+    shard->changes++;
+    pthread_cond_signal(&shard->cond);
+    accepted = true;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return accepted;
+}
+
+size_t ShardedExecutor::shard_for(uint64_t key, size_t num_shards)
+{
+  // Mix the key, in case its low bits aren't well distributed.
+  return FnvHash::mix(key) % num_shards;
+}
+
+void* ShardedExecutor::thread_entry_point(void* args)
+{
+  ThreadArgs* thread_args = (ThreadArgs*)args;
+  thread_args->executor->thread_main(thread_args->index);
+  return NULL;
+}
+
+void ShardedExecutor::thread_main(size_t index)
+{
+  Shard* shard = _shards[index];
+
+  if (_config.pin_threads)
+  {
+    pin_thread(index);
+  }
+
+  while (true)
+  {
+    Entry entry;
+    size_t owner = index;
+
+    pthread_mutex_lock(&shard->lock);
+    bool found = take(shard, entry);
+    bool exit = (!found) && (_terminating) && (shard->queue.empty());
+    uint64_t changes = shard->changes;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (exit)
+    {
+      break;
+    }
+
+    if ((!found) && (!steal(index, entry, owner)))
+    {
+      // There's nothing to do.  Wait until a task is queued on this shard
+      // or one of its running tasks finishes, or it's time to look for work
+      // to steal again.
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += _config.steal_interval_ms * 1000000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+
+      pthread_mutex_lock(&shard->lock);
+
+      if ((shard->changes == changes) && (!_terminating))
+      {
+        pthread_cond_timedwait(&shard->cond, &shard->lock, &deadline);
+      }
+
+      pthread_mutex_unlock(&shard->lock);
+      continue;
+    }
+
+    entry.task->run();
+    delete entry.task;
+    finish(_shards[owner], entry.key);
+  }
+}
+
+bool ShardedExecutor::steal(size_t thief, Entry& entry, size_t& victim)
+{
+  for (size_t offset = 1; offset < _shards.size(); ++offset)
+  {
+    size_t index = (thief + offset) % _shards.size();
+    Shard* shard = _shards[index];
+
+    // Check the queue length without the lock first, so that idle shards
+    // don't contend for the locks of shards that have no work to spare.
+    if (shard->queued.load() < std::max(_config.min_steal_backlog, (size_t)1))
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    bool found = take(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (found)
+    {
+      TRC_DEBUG("Call list worker shard %zu stole a task from shard %zu",
+                thief, index);
+      _steals->increment();
+      victim = index;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ShardedExecutor::finish(Shard* shard, uint64_t key)
+{
+  pthread_mutex_lock(&shard->lock);
+  shard->running.erase(key);
+  shard->changes++;
+
+  // A task for the same key may have been waiting for this one.
+  if (!shard->queue.empty())
+  {
+    pthread_cond_signal(&shard->cond);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+bool ShardedExecutor::take(Shard* shard, Entry& entry)
+{
+  // Take the first task whose key isn't running.  There can't be an earlier
+  // task with the same key, as it would have been taken instead, so this
+  // keeps the tasks for each key in order.
+  size_t scanned = 0;
+
+  for (std::deque<Entry>::iterator it = shard->queue.begin();
+       (it != shard->queue.end()) && (scanned < _config.max_scan);
+       ++it, ++scanned)
+  {
+    if (shard->running.find(it->key) == shard->running.end())
+    {
+      entry = *it;
+      shard->queue.erase(it);
+      shard->queued--;
+      shard->running.insert(entry.key);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ShardedExecutor::pin_thread(size_t index)
+{
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_cpus <= 0)
+  {
+    // LCOV_EXCL_START
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % num_cpus, &cpus);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  if (rc != 0)
+  {
+    // Not fatal: the shard still works, it just isn't pinned.
+    TRC_WARNING("Failed to pin call list worker shard %zu to CPU %zu: %d",
+                index, index % (size_t)num_cpus, rc);
+  }
+}
+
+} // namespace CallListStore
@@ -0,0 +1,398 @@
+/**
+ * @file thread_local_stats.cpp Statistics accumulated in per-thread slots.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <set>
+
+#include "thread_local_stats.h"
+#include "log.h"
+
+const size_t ThreadLocalStatistic::NUM_SLOTS;
+const size_t ThreadLocalHistogram::NUM_BUCKETS;
+
+// The size of a cache line.
+const static size_t CACHE_LINE_SIZE = 64;
+
+// How often the publisher thread checks whether statistics are due to be
+// published.
+const static uint64_t PUBLISH_TICK_MS = 100;
+
+// Utility method for getting the current monotonic time in milliseconds.  The
+// coarse clock is plenty accurate enough to decide when to publish.
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// The next slot to give a thread.
+static std::atomic<size_t> next_slot(0);
+
+// Publishes thread-local statistics at the end of their periods, from a
+// thread of its own, so that updating a statistic never needs to read the
+// clock.  There is one publisher for the process, which is never deleted (as
+// statistics may be deleted during static destruction).
+class ThreadLocalStatsPublisher
+{
+public:
+  static ThreadLocalStatsPublisher* instance()
+  {
+    static ThreadLocalStatsPublisher* publisher = new ThreadLocalStatsPublisher();
+    return publisher;
+  }
+
+  void add(ThreadLocalStatistic* statistic)
+  {
+    pthread_mutex_lock(&_lock);
+    statistic->_next_publish_ms = monotonic_ms() + statistic->_period_ms;
+    _statistics.insert(statistic);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // The statistic is never being published when this returns, as statistics
+  // are published with the lock held.
+  void remove(ThreadLocalStatistic* statistic)
+  {
+    pthread_mutex_lock(&_lock);
+    _statistics.erase(statistic);
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  ThreadLocalStatsPublisher() : _statistics()
+  {
+    pthread_mutex_init(&_lock, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, publisher_thread_fn, this) == 0)
+    {
+      pthread_detach(thread);
+    }
+    else
+    {
+      // LCOV_EXCL_START - only fails if out of resources.
+      TRC_ERROR("Failed to create thread-local statistics publisher thread");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  static void* publisher_thread_fn(void* publisher)
+  {
+    ((ThreadLocalStatsPublisher*)publisher)->run();
+    return NULL;
+  }
+
+  void run()
+  {
+    while (true)
+    {
+      usleep(PUBLISH_TICK_MS * 1000);
+      uint64_t now_ms = monotonic_ms();
+
+      pthread_mutex_lock(&_lock);
+
+      for (std::set<ThreadLocalStatistic*>::iterator it = _statistics.begin();
+           it != _statistics.end();
+           ++it)
+      {
+        ThreadLocalStatistic* statistic = *it;
+
+        if (now_ms >= statistic->_next_publish_ms)
+        {
+          statistic->_next_publish_ms = now_ms + statistic->_period_ms;
+          statistic->publish();
+        }
+      }
+
+      pthread_mutex_unlock(&_lock);
+    }
+  }
+
+  std::set<ThreadLocalStatistic*> _statistics;
+  pthread_mutex_t _lock;
+};
+
+ThreadLocalStatistic::ThreadLocalStatistic(const std::string& statname,
+                                           LastValueCache* stats_aggregator,
+                                           uint64_t period_ms) :
+  _statistic(NULL),
+  _period_ms(period_ms),
+  _next_publish_ms(0)
+{
+  if (stats_aggregator != NULL)
+  {
+    _statistic = new Statistic(statname, stats_aggregator);
+  }
+}
+
+ThreadLocalStatistic::~ThreadLocalStatistic()
+{
+  delete _statistic; _statistic = NULL;
+}
+
+void ThreadLocalStatistic::start_publishing()
+{
+  // Statistics that have nowhere to publish to are only merged on demand.
+  if (_statistic != NULL)
+  {
+    ThreadLocalStatsPublisher::instance()->add(this);
+  }
+}
+
+void ThreadLocalStatistic::stop_publishing()
+{
+  if (_statistic != NULL)
+  {
+    ThreadLocalStatsPublisher::instance()->remove(this);
+  }
+}
+
+size_t ThreadLocalStatistic::slot_index()
+{
+  // Threads are given slots in turn, the first time they update any
+  // statistic.  The same slot is used for every statistic.
+  static thread_local size_t slot = next_slot++ % NUM_SLOTS;
+  return slot;
+}
+
+void* ThreadLocalStatistic::alloc_slots(size_t slot_size)
+{
+  void* slots = NULL;
+
+  if (posix_memalign(&slots, CACHE_LINE_SIZE, slot_size * NUM_SLOTS) != 0)
+  {
+    // LCOV_EXCL_START - only fails if out of memory.
+    throw std::bad_alloc();
+    // LCOV_EXCL_STOP
+  }
+
+  memset(slots, 0, slot_size * NUM_SLOTS);
+  return slots;
+}
+
+void ThreadLocalStatistic::publish()
+{
+  std::vector<std::string> values;
+  merge(values);
+
+  if (_statistic != NULL)
+  {
+    _statistic->report_change(values);
+  }
+}
+
+//
+// Counter methods.
+//
+
+ThreadLocalCounter::ThreadLocalCounter(const std::string& statname,
+                                       LastValueCache* stats_aggregator,
+                                       uint64_t period_ms) :
+  ThreadLocalStatistic(statname, stats_aggregator, period_ms),
+  _slots((Slot*)alloc_slots(sizeof(Slot)))
+{
+  start_publishing();
+}
+
+ThreadLocalCounter::~ThreadLocalCounter()
+{
+  stop_publishing();
+  free(_slots); _slots = NULL;
+}
+
+uint64_t ThreadLocalCounter::total() const
+{
+  uint64_t total = 0;
+
+  for (size_t ii = 0; ii < NUM_SLOTS; ++ii)
+  {
+    total += _slots[ii].total.load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+void ThreadLocalCounter::merge(std::vector<std::string>& values)
+{
+  uint64_t count = 0;
+
+  for (size_t ii = 0; ii < NUM_SLOTS; ++ii)
+  {
+    count += _slots[ii].count.exchange(0, std::memory_order_relaxed);
+  }
+
+  values.push_back(std::to_string(count));
+}
+
+//
+// Accumulator methods.
+//
+
+ThreadLocalAccumulator::ThreadLocalAccumulator(const std::string& statname,
+                                               LastValueCache* stats_aggregator,
+                                               uint64_t period_ms) :
+  ThreadLocalStatistic(statname, stats_aggregator, period_ms),
+  _slots((Slot*)alloc_slots(sizeof(Slot)))
+{
+  for (size_t ii = 0; ii < NUM_SLOTS; ++ii)
+  {
+    _slots[ii].lwm.store(std::numeric_limits<uint64_t>::max());
+  }
+
+  start_publishing();
+}
+
+ThreadLocalAccumulator::~ThreadLocalAccumulator()
+{
+  stop_publishing();
+  free(_slots); _slots = NULL;
+}
+
+void ThreadLocalAccumulator::merge(std::vector<std::string>& values)
+{
+  // Each slot's fields are reset separately, so a sample added while this
+  // runs may be split across periods.  That doesn't matter for statistics.
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t sum_squares = 0;
+  uint64_t lwm = std::numeric_limits<uint64_t>::max();
+  uint64_t hwm = 0;
+
+  for (size_t ii = 0; ii < NUM_SLOTS; ++ii)
+  {
+    Slot& slot = _slots[ii];
+    count += slot.count.exchange(0, std::memory_order_relaxed);
+    sum += slot.sum.exchange(0, std::memory_order_relaxed);
+    sum_squares += slot.sum_squares.exchange(0, std::memory_order_relaxed);
+    lwm = std::min(lwm, slot.lwm.exchange(std::numeric_limits<uint64_t>::max(),
+                                          std::memory_order_relaxed));
+    hwm = std::max(hwm, slot.hwm.exchange(0, std::memory_order_relaxed));
+  }
+
+  uint64_t mean = 0;
+  uint64_t variance = 0;
+
+  if (count > 0)
+  {
+    mean = sum / count;
+    double mean_squares = (double)sum_squares / count;
+    double exact_mean = (double)sum / count;
+    variance = (uint64_t)std::max(mean_squares - (exact_mean * exact_mean), 0.0);
+  }
+  else
+  {
+    lwm = 0;
+  }
+
+  values.push_back(std::to_string(mean));
+  values.push_back(std::to_string(variance));
+  values.push_back(std::to_string(lwm));
+  values.push_back(std::to_string(hwm));
+  values.push_back(std::to_string(count));
+}
+
+//
+// Histogram methods.
+//
+
+ThreadLocalHistogram::ThreadLocalHistogram(const std::string& statname,
+                                           LastValueCache* stats_aggregator,
+                                           uint64_t period_ms) :
+  ThreadLocalStatistic(statname, stats_aggregator, period_ms),
+  _slots((Slot*)alloc_slots(sizeof(Slot)))
+{
+  start_publishing();
+}
+
+ThreadLocalHistogram::~ThreadLocalHistogram()
+{
+  stop_publishing();
+  free(_slots); _slots = NULL;
+}
+
+uint64_t ThreadLocalHistogram::bucket_upper_bound(size_t index)
+{
+  if (index < 4)
+  {
+    return index;
+  }
+  else if (index == NUM_BUCKETS - 1)
+  {
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+  // The inverse of bucket_index: the next bucket starts at
+  // (4 + sub-bucket) << (top bit - 2).
+  size_t next = index + 1;
+  size_t top_bit = (next / 4) + 1;
+  return ((uint64_t)(4 + (next % 4)) << (top_bit - 2)) - 1;
+}
+
+void ThreadLocalHistogram::merge(std::vector<std::string>& values)
+{
+  // The percentiles to publish, in tenths of a percent.
+  const static uint64_t PERCENTILES[] = {500, 900, 990, 999};
+  const static size_t NUM_PERCENTILES = sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+
+  uint64_t buckets[NUM_BUCKETS] = {0};
+  uint64_t count = 0;
+  uint64_t hwm = 0;
+
+  for (size_t ii = 0; ii < NUM_SLOTS; ++ii)
+  {
+    Slot& slot = _slots[ii];
+
+    for (size_t jj = 0; jj < NUM_BUCKETS; ++jj)
+    {
+      uint64_t bucket = slot.buckets[jj].exchange(0, std::memory_order_relaxed);
+      buckets[jj] += bucket;
+      count += bucket;
+    }
+
+    hwm = std::max(hwm, slot.hwm.exchange(0, std::memory_order_relaxed));
+  }
+
+  // Walk up the buckets, reporting each percentile when the cumulative count
+  // reaches it.
+  uint64_t cumulative = 0;
+  size_t bucket = 0;
+
+  for (size_t ii = 0; ii < NUM_PERCENTILES; ++ii)
+  {
+    // The rank of the sample at this percentile (rounded up, and at least 1).
+    uint64_t rank = std::max(((count * PERCENTILES[ii]) + 999) / 1000, (uint64_t)1);
+    uint64_t value = 0;
+
+    if (count > 0)
+    {
+      while ((cumulative + buckets[bucket] < rank) && (bucket < NUM_BUCKETS - 1))
+      {
+        cumulative += buckets[bucket];
+        bucket++;
+      }
+
+      value = std::min(bucket_upper_bound(bucket), hwm);
+    }
+
+    values.push_back(std::to_string(value));
+  }
+
+  values.push_back(std::to_string(hwm));
+  values.push_back(std::to_string(count));
+}
@@ -0,0 +1,405 @@
+/**
+ * @file trace_replayer.cpp Replays operation traces against a call list store.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+
+#include "trace_replayer.h"
+#include "log.h"
+
+// The names of the operation types, for reports.
+const static char* TYPE_NAMES[] = {"write", "read", "trim"};
+
+// Utility method for getting the current monotonic time in microseconds.
+static uint64_t monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+namespace CallListStore
+{
+
+// Comparator for putting records into the order their operations started.
+static bool start_before(const OpTraceRecord& a, const OpTraceRecord& b)
+{
+  return a.start_us < b.start_us;
+}
+
+/// Replays the operations on a subset of the IMPUs on its own thread.
+class TraceReplayer::Worker
+{
+public:
+  Worker(Store* store, const Config& config) :
+    _store(store),
+    _config(config),
+    _records(),
+    _fragments(),
+    _next_sequence(0),
+    _start_us(0),
+    _trace_start_us(0)
+  {
+    for (int ii = 0; ii < OpTraceRecord::NUM_TYPES; ++ii)
+    {
+      _errors[ii] = 0;
+    }
+  }
+
+  void add(const OpTraceRecord& record) { _records.push_back(record); }
+
+  bool start(uint64_t start_us, uint64_t trace_start_us)
+  {
+    _start_us = start_us;
+    _trace_start_us = trace_start_us;
+    return (pthread_create(&_thread, NULL, thread_entry_point, this) == 0);
+  }
+
+  void join() { pthread_join(_thread, NULL); }
+
+  std::vector<uint64_t> _latencies[OpTraceRecord::NUM_TYPES];
+  uint64_t _errors[OpTraceRecord::NUM_TYPES];
+
+private:
+  static void* thread_entry_point(void* worker)
+  {
+    ((Worker*)worker)->thread_main();
+    return NULL;
+  }
+
+  void thread_main()
+  {
+    for (std::vector<OpTraceRecord>::const_iterator it = _records.begin();
+         it != _records.end();
+         ++it)
+    {
+      // Wait until the operation is due, and measure its latency from then.
+      // At maximum speed, operations are due as soon as the previous one
+      // finishes.
+      uint64_t due_us = monotonic_us();
+
+      if (_config.speed > 0)
+      {
+        due_us = _start_us + (uint64_t)((it->start_us - _trace_start_us) /
+                                        _config.speed);
+        uint64_t now_us = monotonic_us();
+
+        if (due_us > now_us)
+        {
+          usleep(due_us - now_us);
+        }
+      }
+
+      CassandraStore::ResultCode rc = replay(*it);
+      uint64_t end_us = monotonic_us();
+      _latencies[it->type].push_back((end_us > due_us) ? (end_us - due_us) : 0);
+
+      // A read of a call list that doesn't exist (because the replay didn't
+      // include the writes to it) isn't an error.
+      if ((rc != CassandraStore::OK) && (rc != CassandraStore::NOT_FOUND))
+      {
+        _errors[it->type]++;
+      }
+    }
+  }
+
+  // Make up a new fragment of about the given size (including its timestamp
+  // and id) for an IMPU.  Each IMPU belongs to one worker, so fragments are
+  // made up in the same order on every replay.
+  void make_fragment(uint64_t impu_hash, uint64_t num_bytes, CallFragment& fragment)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%014llu", (unsigned long long)_next_sequence++);
+    fragment.timestamp = buf;
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)impu_hash);
+    fragment.id = buf;
+    fragment.type = CallFragment::BEGIN;
+
+    size_t name_bytes = fragment.timestamp.length() + fragment.id.length();
+    fragment.contents.assign((num_bytes > name_bytes) ? (num_bytes - name_bytes) : 0, 'x');
+  }
+
+  CassandraStore::ResultCode replay(const OpTraceRecord& record)
+  {
+    char impu[64];
+    snprintf(impu, sizeof(impu), "sip:%016llx@replay.invalid",
+             (unsigned long long)record.impu_hash);
+
+    // Use the real time for cassandra timestamps, so that they increase.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t cass_timestamp = ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+
+    switch (record.type)
+    {
+    case OpTraceRecord::WRITE:
+    {
+      CallFragment fragment;
+      make_fragment(record.impu_hash, record.num_bytes, fragment);
+      std::deque<CallFragment>& written = _fragments[record.impu_hash];
+      written.push_back(fragment);
+      written.back().contents.clear();
+
+      return _store->write_call_fragment_sync(impu,
+                                              fragment,
+                                              cass_timestamp,
+                                              _config.ttl,
+                                              0);
+    }
+
+    case OpTraceRecord::READ:
+    {
+      std::vector<CallFragment> fragments;
+      return _store->get_call_fragments_sync(impu, fragments, 0);
+    }
+
+    case OpTraceRecord::TRIM:
+    {
+      std::deque<CallFragment>& written = _fragments[record.impu_hash];
+      std::vector<CallFragment> fragments;
+
+      while ((fragments.size() < record.num_fragments) && (!written.empty()))
+      {
+        fragments.push_back(written.front());
+        written.pop_front();
+      }
+
+      while (fragments.size() < record.num_fragments)
+      {
+        CallFragment fragment;
+        make_fragment(record.impu_hash, 0, fragment);
+        fragments.push_back(fragment);
+      }
+
+      return _store->delete_old_call_fragments_sync(impu,
+                                                    fragments,
+                                                    cass_timestamp,
+                                                    0);
+    }
+
+    default:
+      // LCOV_EXCL_START
+      return CassandraStore::INVALID_REQUEST;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  Store* _store;
+  const Config& _config;
+  std::vector<OpTraceRecord> _records;
+
+  // The fragments written to each IMPU (without their contents), oldest
+  // first.
+  std::map<uint64_t, std::deque<CallFragment> > _fragments;
+  uint64_t _next_sequence;
+
+  uint64_t _start_us;
+  uint64_t _trace_start_us;
+  pthread_t _thread;
+};
+
+TraceReplayer::TraceReplayer(Store* store, const Config& config) :
+  _store(store),
+  _config(config),
+  _records()
+{}
+
+TraceReplayer::~TraceReplayer()
+{}
+
+bool TraceReplayer::load(OpTraceReader* reader)
+{
+  OpTraceRecord record;
+
+  while (reader->read(record))
+  {
+    _records.push_back(record);
+  }
+
+  return !reader->error();
+}
+
+void TraceReplayer::add(const OpTraceRecord& record)
+{
+  _records.push_back(record);
+}
+
+void TraceReplayer::summarize(std::vector<uint64_t>& latencies,
+                              LatencySummary& summary)
+{
+  summary.count = latencies.size();
+  summary.p50_us = 0;
+  summary.p90_us = 0;
+  summary.p99_us = 0;
+  summary.p999_us = 0;
+  summary.max_us = 0;
+
+  if (latencies.empty())
+  {
+    return;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  // Each percentile is the smallest latency that at least that fraction of
+  // the operations were within.
+  size_t count = latencies.size();
+  summary.p50_us = latencies[((count * 500) + 999) / 1000 - 1];
+  summary.p90_us = latencies[((count * 900) + 999) / 1000 - 1];
+  summary.p99_us = latencies[((count * 990) + 999) / 1000 - 1];
+  summary.p999_us = latencies[((count * 999) + 999) / 1000 - 1];
+  summary.max_us = latencies.back();
+}
+
+void TraceReplayer::run(Results& results)
+{
+  // Operations are replayed relative to the first one in the trace.  Records
+  // are written as operations complete, so this isn't necessarily the first
+  // record.
+  uint64_t trace_start_us = 0;
+
+  if (!_records.empty())
+  {
+    trace_start_us = _records.front().start_us;
+
+    for (std::vector<OpTraceRecord>::const_iterator it = _records.begin();
+         it != _records.end();
+         ++it)
+    {
+      trace_start_us = std::min(trace_start_us, it->start_us);
+    }
+  }
+
+  // Share the operations out between the workers by IMPU, and put each
+  // worker's operations into the order they started in.
+  std::vector<Worker*> workers;
+  size_t num_threads = std::max(_config.num_threads, (size_t)1);
+
+  for (size_t ii = 0; ii < num_threads; ++ii)
+  {
+    workers.push_back(new Worker(_store, _config));
+  }
+
+  std::vector<OpTraceRecord> records(_records);
+  std::stable_sort(records.begin(), records.end(), start_before);
+
+  for (std::vector<OpTraceRecord>::const_iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    workers[it->impu_hash % num_threads]->add(*it);
+  }
+
+  TRC_STATUS("Replaying %zu operations on %zu threads at speed %f",
+             records.size(), num_threads, _config.speed);
+
+  uint64_t start_us = monotonic_us();
+  std::vector<Worker*> started;
+
+  for (std::vector<Worker*>::iterator it = workers.begin();
+       it != workers.end();
+       ++it)
+  {
+    if ((*it)->start(start_us, trace_start_us))
+    {
+      started.push_back(*it);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start replay thread");
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  for (std::vector<Worker*>::iterator it = started.begin();
+       it != started.end();
+       ++it)
+  {
+    (*it)->join();
+  }
+
+  results.elapsed_us = monotonic_us() - start_us;
+  results.num_ops = 0;
+  results.num_errors = 0;
+
+  for (int type = 0; type < OpTraceRecord::NUM_TYPES; ++type)
+  {
+    std::vector<uint64_t> latencies;
+    uint64_t errors = 0;
+
+    for (std::vector<Worker*>::iterator it = workers.begin();
+         it != workers.end();
+         ++it)
+    {
+      latencies.insert(latencies.end(),
+                       (*it)->_latencies[type].begin(),
+                       (*it)->_latencies[type].end());
+      errors += (*it)->_errors[type];
+    }
+
+    summarize(latencies, results.latency[type]);
+    results.latency[type].errors = errors;
+    results.num_ops += results.latency[type].count;
+    results.num_errors += errors;
+  }
+
+  results.ops_per_sec = (results.elapsed_us > 0) ?
+                          ((results.num_ops * 1000000.0) / results.elapsed_us) :
+                          0.0;
+
+  for (std::vector<Worker*>::iterator it = workers.begin();
+       it != workers.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  TRC_STATUS("Replay finished: %s", results.to_string().c_str());
+}
+
+std::string TraceReplayer::Results::to_string() const
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "%llu ops (%llu errors) in %llu ms, %.1f ops/s\n",
+           (unsigned long long)num_ops,
+           (unsigned long long)num_errors,
+           (unsigned long long)(elapsed_us / 1000),
+           ops_per_sec);
+  std::string report = buf;
+
+  for (int type = 0; type < OpTraceRecord::NUM_TYPES; ++type)
+  {
+    const LatencySummary& summary = latency[type];
+    snprintf(buf, sizeof(buf),
+             "%s: %llu ops (%llu errors), latency (us) p50 %llu p90 %llu "
+             "p99 %llu p99.9 %llu max %llu\n",
+             TYPE_NAMES[type],
+             (unsigned long long)summary.count,
+             (unsigned long long)summary.errors,
+             (unsigned long long)summary.p50_us,
+             (unsigned long long)summary.p90_us,
+             (unsigned long long)summary.p99_us,
+             (unsigned long long)summary.p999_us,
+             (unsigned long long)summary.max_us);
+    report.append(buf);
+  }
+
+  return report;
+}
+
+} // namespace CallListStore
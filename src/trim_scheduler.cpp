@@ -0,0 +1,408 @@
+/**
+ * @file trim_scheduler.cpp Paced background trimming of call lists.
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <algorithm>
+
+#include "trim_scheduler.h"
+#include "call_list_store.h"
+#include "mementosasevent.h"
+#include "log.h"
+
+// The trim rate is never scaled below this fraction of the configured rate,
+// so that the backlog still drains (slowly) while cassandra is slow.
+const static double MIN_RATE_FACTOR = 0.05;
+
+// Weight given to each new latency sample in the moving average, as a
+// fraction 1/LATENCY_SMOOTHING.
+const static uint64_t LATENCY_SMOOTHING = 16;
+
+// How often the backlog statistic is published.
+const static uint64_t BACKLOG_STAT_PERIOD_MS = 5000;
+
+// How long the thread waits when there is nothing to do (it is woken by
+// writes, but also publishes the backlog statistic).
+const static uint64_t IDLE_WAIT_MS = BACKLOG_STAT_PERIOD_MS;
+
+// Utility method for getting the current monotonic time in milliseconds.
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+namespace CallListStore
+{
+
+TrimScheduler::TrimScheduler(const Config& config,
+                             Trimmer* trimmer,
+                             LastValueCache* stats_aggregator) :
+  _config(config),
+  _trimmer(trimmer),
+  _due(),
+  _queue(),
+  _tokens(config.burst),
+  _last_refill_ms(0),
+  _latency_us(0),
+  _backlog_stat(NULL),
+  _next_publish_ms(0),
+  _trims(new ThreadLocalCounter("call_list_trims", stats_aggregator)),
+  _writes_not_scheduled(new ThreadLocalCounter("call_list_trims_not_scheduled",
+                                               stats_aggregator)),
+  _running(false),
+  _terminating(false)
+{
+  if (stats_aggregator != NULL)
+  {
+    _backlog_stat = new Statistic("call_list_trim_backlog", stats_aggregator);
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  pthread_mutex_init(&_lock, NULL);
+}
+
+TrimScheduler::~TrimScheduler()
+{
+  stop();
+  wait_stopped();
+
+  delete _trimmer; _trimmer = NULL;
+  delete _backlog_stat; _backlog_stat = NULL;
+  delete _trims; _trims = NULL;
+  delete _writes_not_scheduled; _writes_not_scheduled = NULL;
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void TrimScheduler::start()
+{
+  if (_running)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _terminating = false;
+  pthread_mutex_unlock(&_lock);
+
+  int rc = pthread_create(&_thread, NULL, thread_entry_point, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start call list trim thread: %d", rc);
+    return;
+    // LCOV_EXCL_STOP
+  }
+
+  _running = true;
+}
+
+void TrimScheduler::stop()
+{
+  pthread_mutex_lock(&_lock);
+  _terminating = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+void TrimScheduler::wait_stopped()
+{
+  if (_running)
+  {
+    pthread_join(_thread, NULL);
+    _running = false;
+  }
+}
+
+void TrimScheduler::record_write(const std::string& impu, uint64_t now_ms)
+{
+  bool scheduled = true;
+
+  pthread_mutex_lock(&_lock);
+
+  // An IMPU that is already waiting keeps its place, so later writes are
+  // covered by the same trim.
+  if (_due.find(impu) == _due.end())
+  {
+    if (_due.size() < _config.max_backlog)
+    {
+      uint64_t due_ms = now_ms + _config.delay_ms;
+      _due[impu] = due_ms;
+      _queue.insert(std::make_pair(due_ms, impu));
+
+      if (_queue.begin()->second == impu)
+      {
+        pthread_cond_signal(&_cond);
+      }
+    }
+    else
+    {
+      scheduled = false;
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!scheduled)
+  {
+    TRC_DEBUG("Trim backlog full, not scheduling trim of %s", impu.c_str());
+    _writes_not_scheduled->increment();
+  }
+}
+
+void TrimScheduler::record_write(const std::string& impu)
+{
+  record_write(impu, monotonic_ms());
+}
+
+void TrimScheduler::record_latency(uint64_t latency_us)
+{
+  // The average is updated without a lock, so concurrent updates may lose a
+  // sample, which doesn't matter for a moving average.
+  uint64_t average = _latency_us.load(std::memory_order_relaxed);
+  average = average - (average / LATENCY_SMOOTHING) + (latency_us / LATENCY_SMOOTHING);
+  _latency_us.store(average, std::memory_order_relaxed);
+}
+
+double TrimScheduler::current_rate()
+{
+  uint64_t latency_us = _latency_us.load(std::memory_order_relaxed);
+  double factor = 1.0;
+
+  if (latency_us > _config.target_latency_us)
+  {
+    factor = std::max((double)_config.target_latency_us / latency_us,
+                      MIN_RATE_FACTOR);
+  }
+
+  return _config.trims_per_sec * factor;
+}
+
+size_t TrimScheduler::backlog()
+{
+  pthread_mutex_lock(&_lock);
+  size_t backlog = _due.size();
+  pthread_mutex_unlock(&_lock);
+
+  return backlog;
+}
+
+void TrimScheduler::refill_tokens(uint64_t now_ms)
+{
+  if (now_ms > _last_refill_ms)
+  {
+    _tokens = std::min(_tokens + (current_rate() * (now_ms - _last_refill_ms) / 1000.0),
+                       _config.burst);
+    _last_refill_ms = now_ms;
+  }
+}
+
+bool TrimScheduler::trim_next(uint64_t now_ms, uint64_t& wait_ms)
+{
+  std::string impu;
+  wait_ms = 0;
+
+  pthread_mutex_lock(&_lock);
+
+  if (_queue.empty())
+  {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+
+  uint64_t due_ms = _queue.begin()->first;
+
+  if (due_ms > now_ms)
+  {
+    wait_ms = due_ms - now_ms;
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+
+  refill_tokens(now_ms);
+
+  if (_tokens < 1.0)
+  {
+    wait_ms = (uint64_t)(((1.0 - _tokens) * 1000.0) / current_rate()) + 1;
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+
+  _tokens -= 1.0;
+  impu = _queue.begin()->second;
+  _queue.erase(_queue.begin());
+  _due.erase(impu);
+
+  pthread_mutex_unlock(&_lock);
+
+  trim(impu);
+  return true;
+}
+
+void TrimScheduler::select_old_fragments(const std::vector<CallFragment>& fragments,
+                                         size_t max_calls,
+                                         std::vector<CallFragment>& old_fragments)
+{
+  // The fragments of a call share a timestamp and ID, and are adjacent.
+  // Count calls back from the newest, and delete everything before the
+  // oldest one to keep.
+  size_t num_calls = 0;
+  size_t keep_from = fragments.size();
+
+  while (keep_from > 0)
+  {
+    const CallFragment& fragment = fragments[keep_from - 1];
+
+    if ((keep_from == fragments.size()) ||
+        (fragment.timestamp != fragments[keep_from].timestamp) ||
+        (fragment.id != fragments[keep_from].id))
+    {
+      if (num_calls == max_calls)
+      {
+        break;
+      }
+
+      num_calls++;
+    }
+
+    keep_from--;
+  }
+
+  old_fragments.assign(fragments.begin(), fragments.begin() + keep_from);
+}
+
+void TrimScheduler::trim(const std::string& impu)
+{
+  SAS::TrailId trail = SAS::new_trail(0);
+  std::vector<CallFragment> fragments;
+  CassandraStore::ResultCode rc = _trimmer->get_fragments(impu, fragments, trail);
+
+  if (rc != CassandraStore::OK)
+  {
+    // NOT_FOUND means the call list has expired, so there is nothing to do.
+    // On other errors, the IMPU will be trimmed after its next write.
+    if (rc != CassandraStore::NOT_FOUND)
+    {
+      TRC_DEBUG("Failed to read call list for %s to trim it (RC = %d)",
+                impu.c_str(), rc);
+    }
+
+    return;
+  }
+
+  std::vector<CallFragment> old_fragments;
+  select_old_fragments(fragments, _config.max_calls, old_fragments);
+
+  if (old_fragments.empty())
+  {
+    return;
+  }
+
+  TRC_DEBUG("Trimming %zu of %zu call fragments for %s",
+            old_fragments.size(), fragments.size(), impu.c_str());
+
+  { // New scope to avoid accidentally operating on the wrong SAS event.
+    SAS::Event ev(trail, SASEvent::CALL_LIST_TRIM_NEEDED, 0);
+    ev.add_var_param(impu);
+    ev.add_static_param(fragments.size());
+    ev.add_static_param(old_fragments.size());
+    SAS::report_event(ev);
+  }
+
+  if (_trimmer->delete_fragments(impu, old_fragments, trail) == CassandraStore::OK)
+  {
+    _trims->increment();
+  }
+}
+
+void TrimScheduler::publish_backlog(uint64_t now_ms)
+{
+  if ((_backlog_stat == NULL) || (now_ms < _next_publish_ms))
+  {
+    return;
+  }
+
+  _next_publish_ms = now_ms + BACKLOG_STAT_PERIOD_MS;
+
+  // Publish the number of IMPUs waiting, and how overdue the oldest is.
+  pthread_mutex_lock(&_lock);
+  uint64_t backlog = _due.size();
+  uint64_t overdue_ms = 0;
+
+  if ((!_queue.empty()) && (_queue.begin()->first < now_ms))
+  {
+    overdue_ms = now_ms - _queue.begin()->first;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  std::vector<std::string> values;
+  values.push_back(std::to_string(backlog));
+  values.push_back(std::to_string(overdue_ms));
+  _backlog_stat->report_change(values);
+}
+
+void* TrimScheduler::thread_entry_point(void* scheduler)
+{
+  ((TrimScheduler*)scheduler)->thread_main();
+  return NULL;
+}
+
+void TrimScheduler::thread_main()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (!_terminating)
+  {
+    pthread_mutex_unlock(&_lock);
+
+    uint64_t now_ms = monotonic_ms();
+    uint64_t wait_ms;
+    publish_backlog(now_ms);
+    bool trimmed = trim_next(now_ms, wait_ms);
+
+    pthread_mutex_lock(&_lock);
+
+    if ((!trimmed) && (!_terminating))
+    {
+      // Wait until the next IMPU is due or there is a token for it (or until
+      // a write makes an IMPU due sooner).
+      if ((wait_ms == 0) || (wait_ms > IDLE_WAIT_MS))
+      {
+        wait_ms = IDLE_WAIT_MS;
+      }
+
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += wait_ms / 1000;
+      deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+
+      pthread_cond_timedwait(&_cond, &_lock, &deadline);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+} // namespace CallListStore
@@ -0,0 +1,235 @@
+/**
+ * @file call_list_archive_test.cpp Call list archive unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "call_list_archive.h"
+
+using namespace CallListStore;
+
+class CallListArchiveTest : public ::testing::Test
+{
+public:
+  CallListArchiveTest() :
+    _path("/tmp/call_list_archive_test_" + std::to_string(getpid()))
+  {}
+
+  virtual ~CallListArchiveTest()
+  {
+    unlink(_path.c_str());
+  }
+
+  // Build a set of records.  Consecutive records share IMPUs, and the
+  // cassandra timestamps go up and down, to exercise the encodings.
+  void make_records(size_t num_records, std::vector<ArchiveRecord>& records)
+  {
+    for (size_t ii = 0; ii < num_records; ++ii)
+    {
+      ArchiveRecord record;
+      record.impu = "sip:" + std::to_string(ii / 4) + "@example.com";
+      record.fragment.timestamp = "2014010113" + std::to_string(1000 + ii);
+      record.fragment.id = std::to_string(ii * 7919);
+      record.fragment.type = (CallFragment::Type)(ii % 3);
+      record.fragment.contents = std::string(ii % 50, 'x') + "<record>";
+      record.cass_timestamp = 1400000000000000LL + ((ii % 2 == 0) ? ii : -(int64_t)ii);
+      record.ttl = (ii % 5 == 0) ? 0 : 3600 * ii;
+      records.push_back(record);
+    }
+  }
+
+  void expect_records(ArchiveReader& reader,
+                      const std::vector<ArchiveRecord>& expected)
+  {
+    ArchiveRecord record;
+
+    for (size_t ii = 0; ii < expected.size(); ++ii)
+    {
+      ASSERT_TRUE(reader.read(record)) << "Record " << ii;
+      EXPECT_EQ(expected[ii].impu, record.impu);
+      EXPECT_EQ(expected[ii].fragment.timestamp, record.fragment.timestamp);
+      EXPECT_EQ(expected[ii].fragment.id, record.fragment.id);
+      EXPECT_EQ(expected[ii].fragment.type, record.fragment.type);
+      EXPECT_EQ(expected[ii].fragment.contents, record.fragment.contents);
+      EXPECT_EQ(expected[ii].cass_timestamp, record.cass_timestamp);
+      EXPECT_EQ(expected[ii].ttl, record.ttl);
+    }
+
+    EXPECT_FALSE(reader.read(record));
+    EXPECT_FALSE(reader.error());
+  }
+
+  std::string _path;
+};
+
+// Records written across several blocks are read back in order.
+TEST_F(CallListArchiveTest, RoundTrip)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(100, records);
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path, 16));
+  EXPECT_TRUE(writer.write(std::vector<ArchiveRecord>(records.begin(), records.begin() + 50)));
+
+  for (size_t ii = 50; ii < records.size(); ++ii)
+  {
+    EXPECT_TRUE(writer.write(records[ii]));
+  }
+
+  EXPECT_TRUE(writer.close());
+  EXPECT_EQ(writer.num_records(), 100u);
+
+  ArchiveReader reader;
+  ASSERT_TRUE(reader.open(_path));
+  EXPECT_EQ(reader.num_records(), 100u);
+  expect_records(reader, records);
+}
+
+// Reading a memory-mapped archive gives the same results.
+TEST_F(CallListArchiveTest, RoundTripMmap)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(100, records);
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path, 7));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  ArchiveReader reader;
+  ASSERT_TRUE(reader.open(_path, true));
+  EXPECT_EQ(reader.num_records(), 100u);
+  expect_records(reader, records);
+}
+
+// An archive with no records is valid.
+TEST_F(CallListArchiveTest, Empty)
+{
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  EXPECT_TRUE(writer.close());
+
+  ArchiveReader reader;
+  ASSERT_TRUE(reader.open(_path));
+  EXPECT_EQ(reader.num_records(), 0u);
+  expect_records(reader, std::vector<ArchiveRecord>());
+}
+
+// Repetitive records (as call lists are) compress well.
+TEST_F(CallListArchiveTest, Compression)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(1000, records);
+
+  size_t raw_bytes = 0;
+  for (std::vector<ArchiveRecord>::const_iterator it = records.begin();
+       it != records.end();
+       ++it)
+  {
+    raw_bytes += it->impu.length() +
+                 it->fragment.timestamp.length() +
+                 it->fragment.id.length() +
+                 it->fragment.contents.length() + 13;
+  }
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  FILE* file = fopen(_path.c_str(), "rb");
+  ASSERT_TRUE(file != NULL);
+  fseek(file, 0, SEEK_END);
+  size_t file_bytes = ftell(file);
+  fclose(file);
+
+  EXPECT_LT(file_bytes * 4, raw_bytes);
+}
+
+// A file that wasn't closed properly (so has no index) is rejected.
+TEST_F(CallListArchiveTest, Truncated)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(10, records);
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path, 4));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  ASSERT_EQ(truncate(_path.c_str(), 60), 0);
+
+  ArchiveReader reader;
+  EXPECT_FALSE(reader.open(_path));
+  EXPECT_FALSE(reader.open(_path, true));
+}
+
+// A corrupt block is detected rather than returning garbage.
+TEST_F(CallListArchiveTest, CorruptBlock)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(10, records);
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  // Overwrite the start of the compressed data of the first block (after the
+  // file header, block header and column lengths).
+  FILE* file = fopen(_path.c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  fseek(file, 8 + 12 + (7 * 8), SEEK_SET);
+  fwrite("garbage", 1, 7, file);
+  fclose(file);
+
+  ArchiveReader reader;
+  ASSERT_TRUE(reader.open(_path));
+
+  ArchiveRecord record;
+  EXPECT_FALSE(reader.read(record));
+  EXPECT_TRUE(reader.error());
+}
+
+// A record with an unknown fragment type (for example from a corrupt or
+// foreign archive) is rejected.
+TEST_F(CallListArchiveTest, CorruptType)
+{
+  std::vector<ArchiveRecord> records;
+  make_records(3, records);
+  records[1].fragment.type = (CallFragment::Type)7;
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  ArchiveReader reader;
+  ASSERT_TRUE(reader.open(_path));
+
+  ArchiveRecord record;
+  EXPECT_TRUE(reader.read(record));
+  EXPECT_FALSE(reader.read(record));
+  EXPECT_TRUE(reader.error());
+}
+
+TEST_F(CallListArchiveTest, MissingFile)
+{
+  ArchiveReader reader;
+  EXPECT_FALSE(reader.open(_path));
+
+  ArchiveWriter writer;
+  EXPECT_FALSE(writer.open("/nonexistent/archive"));
+  EXPECT_FALSE(writer.write(ArchiveRecord()));
+}
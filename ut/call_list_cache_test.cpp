@@ -0,0 +1,376 @@
+/**
+ * @file call_list_cache_test.cpp Call list cache unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "call_list_cache.h"
+
+using namespace CallListStore;
+
+// Revalidator that returns a fixed result.
+class FakeRevalidator : public CallListCache::Revalidator
+{
+public:
+  FakeRevalidator(int* count) : rc(CassandraStore::OK), fragments(), _count(count) {}
+
+  CassandraStore::ResultCode revalidate(const std::string& impu,
+                                        std::vector<CallFragment>& out)
+  {
+    (*_count)++;
+    out = fragments;
+    return rc;
+  }
+
+  CassandraStore::ResultCode rc;
+  std::vector<CallFragment> fragments;
+
+private:
+  int* _count;
+};
+
+static std::vector<CallFragment> make_fragments(const std::string& id, size_t num)
+{
+  std::vector<CallFragment> fragments;
+
+  for (size_t ii = 0; ii < num; ++ii)
+  {
+    CallFragment fragment;
+    fragment.timestamp = "20140101130100";
+    fragment.id = id;
+    fragment.type = (ii % 2 == 0) ? CallFragment::BEGIN : CallFragment::END;
+    fragment.contents = "<" + id + "/>";
+    fragments.push_back(fragment);
+  }
+
+  return fragments;
+}
+
+class CallListCacheTest : public ::testing::Test
+{
+public:
+  CallListCacheTest() :
+    _revalidations(0)
+  {
+    char path[] = "/tmp/call_list_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    _path = path;
+  }
+
+  virtual ~CallListCacheTest()
+  {
+    unlink(_path.c_str());
+  }
+
+  std::string _path;
+  int _revalidations;
+};
+
+// The least recently used call list is evicted when the cache is full.
+TEST_F(CallListCacheTest, LruEviction)
+{
+  CallListCache cache(2, 10000, 0, NULL);
+  std::vector<CallFragment> fragments;
+
+  cache.put("kermit", make_fragments("1", 1), 1000);
+  cache.put("gonzo", make_fragments("2", 2), 1000);
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::FRESH);
+
+  cache.put("piggy", make_fragments("3", 3), 1000);
+  EXPECT_EQ(cache.size(), 2u);
+  EXPECT_EQ(cache.get("gonzo", fragments, 1000), CallListCache::MISS);
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::FRESH);
+  EXPECT_EQ(fragments.size(), 1u);
+
+  cache.invalidate("kermit");
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::MISS);
+}
+
+// Stale call lists are returned, and replaced by a background read.
+TEST_F(CallListCacheTest, Revalidation)
+{
+  FakeRevalidator* revalidator = new FakeRevalidator(&_revalidations);
+  revalidator->fragments = make_fragments("new", 3);
+  CallListCache cache(10, 10000, 0, revalidator);
+  std::vector<CallFragment> fragments;
+
+  // Stale call lists aren't returned until the cache is started.
+  cache.put("kermit", make_fragments("old", 1), 1000);
+  EXPECT_EQ(cache.get("kermit", fragments, 11001), CallListCache::MISS);
+  cache.start();
+
+  EXPECT_EQ(cache.get("kermit", fragments, 11000), CallListCache::FRESH);
+  EXPECT_EQ(cache.get("kermit", fragments, 11001), CallListCache::STALE);
+  EXPECT_EQ(fragments[0].id, "old");
+
+  cache.wait_for_revalidations();
+  EXPECT_EQ(_revalidations, 1);
+  EXPECT_EQ(cache.get("kermit", fragments), CallListCache::FRESH);
+  ASSERT_EQ(fragments.size(), 3u);
+  EXPECT_EQ(fragments[0].id, "new");
+
+  // A call list that no longer exists is dropped.
+  revalidator->rc = CassandraStore::NOT_FOUND;
+  cache.put("gonzo", make_fragments("old", 1), 1000);
+  EXPECT_EQ(cache.get("gonzo", fragments, 20000), CallListCache::STALE);
+  cache.wait_for_revalidations();
+  EXPECT_EQ(cache.get("gonzo", fragments), CallListCache::MISS);
+
+  // Other errors leave the stale call list in the cache.
+  revalidator->rc = CassandraStore::CONNECTION_ERROR;
+  cache.put("gonzo", make_fragments("old", 1), 1000);
+  EXPECT_EQ(cache.get("gonzo", fragments, 20000), CallListCache::STALE);
+  cache.wait_for_revalidations();
+  EXPECT_EQ(cache.get("gonzo", fragments, 20000), CallListCache::STALE);
+
+  // Once the cache is stopped, stale call lists aren't returned again.
+  cache.stop();
+  cache.wait_stopped();
+  EXPECT_EQ(cache.get("gonzo", fragments, 20000), CallListCache::MISS);
+}
+
+// Call lists older than the maximum staleness are dropped rather than
+// returned stale.
+TEST_F(CallListCacheTest, MaxStaleness)
+{
+  FakeRevalidator* revalidator = new FakeRevalidator(&_revalidations);
+  revalidator->rc = CassandraStore::CONNECTION_ERROR;
+  CallListCache cache(10, 10000, 20000, revalidator);
+  cache.start();
+  std::vector<CallFragment> fragments;
+
+  cache.put("kermit", make_fragments("old", 1), 1000);
+  EXPECT_EQ(cache.get("kermit", fragments, 21000), CallListCache::STALE);
+  cache.wait_for_revalidations();
+  EXPECT_EQ(cache.get("kermit", fragments, 21001), CallListCache::MISS);
+  EXPECT_EQ(cache.size(), 0u);
+}
+
+// A read that was in progress when the call list was invalidated (for
+// example by a write) may have read the old call list, so isn't cached.
+TEST_F(CallListCacheTest, InvalidatedDuringRead)
+{
+  CallListCache cache(10, 10000, 0, NULL);
+  std::vector<CallFragment> fragments;
+
+  CallListCache::ReadStamp stamp = cache.begin_read("kermit");
+  cache.invalidate("kermit");
+  EXPECT_FALSE(cache.put("kermit", make_fragments("old", 1), stamp));
+  EXPECT_EQ(cache.get("kermit", fragments), CallListCache::MISS);
+
+  // Reads of other IMPUs, and reads started after the invalidation, are
+  // cached as normal.
+  CallListCache::ReadStamp other_stamp = cache.begin_read("gonzo");
+  stamp = cache.begin_read("kermit");
+  cache.invalidate("piggy");
+  EXPECT_TRUE(cache.put("gonzo", make_fragments("2", 1), other_stamp));
+  EXPECT_TRUE(cache.put("kermit", make_fragments("new", 1), stamp));
+  EXPECT_EQ(cache.get("kermit", fragments), CallListCache::FRESH);
+  EXPECT_EQ(fragments[0].id, "new");
+
+  // The entry's age is from when the read started.
+  EXPECT_EQ(cache.get("kermit", fragments, stamp.fetch_ms + 10000),
+            CallListCache::FRESH);
+  EXPECT_EQ(cache.get("kermit", fragments, stamp.fetch_ms + 10001),
+            CallListCache::MISS);
+}
+
+// Revalidator that invalidates the call list while it is being read, as a
+// write would.
+class InvalidatingRevalidator : public CallListCache::Revalidator
+{
+public:
+  InvalidatingRevalidator() : cache(NULL) {}
+
+  CassandraStore::ResultCode revalidate(const std::string& impu,
+                                        std::vector<CallFragment>& out)
+  {
+    cache->invalidate(impu);
+    out = make_fragments("old", 1);
+    return CassandraStore::OK;
+  }
+
+  CallListCache* cache;
+};
+
+// A revalidation that overlaps an invalidation doesn't cache its result.
+TEST_F(CallListCacheTest, InvalidatedDuringRevalidation)
+{
+  InvalidatingRevalidator* revalidator = new InvalidatingRevalidator();
+  CallListCache cache(10, 10000, 0, revalidator);
+  revalidator->cache = &cache;
+  cache.start();
+  std::vector<CallFragment> fragments;
+
+  cache.put("kermit", make_fragments("stale", 1), 1000);
+  EXPECT_EQ(cache.get("kermit", fragments, 20000), CallListCache::STALE);
+  cache.wait_for_revalidations();
+  EXPECT_EQ(cache.get("kermit", fragments), CallListCache::MISS);
+}
+
+// Without a revalidator stale call lists aren't returned.
+TEST_F(CallListCacheTest, NoRevalidator)
+{
+  CallListCache cache(10, 10000, 0, NULL);
+  std::vector<CallFragment> fragments;
+
+  cache.put("kermit", make_fragments("1", 1), 1000);
+  EXPECT_EQ(cache.get("kermit", fragments, 20000), CallListCache::MISS);
+}
+
+TEST_F(CallListCacheTest, Snapshot)
+{
+  {
+    CallListCache cache(10, 10000, 0, NULL);
+    cache.put("kermit", make_fragments("1", 3), 1000);
+    cache.put("gonzo", make_fragments("2", 1), 2000);
+    EXPECT_TRUE(cache.save_snapshot(_path));
+  }
+
+  // The snapshot is loaded in the background.  Call lists already in the
+  // cache are newer, so aren't replaced.
+  CallListCache cache(10, 10000, 0, NULL);
+  cache.put("gonzo", make_fragments("3", 2), 3000);
+  cache.load_snapshot(_path);
+  EXPECT_TRUE(cache.wait_for_snapshot());
+  EXPECT_EQ(cache.size(), 2u);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::FRESH);
+  ASSERT_EQ(fragments.size(), 3u);
+  EXPECT_EQ(fragments[0].timestamp, "20140101130100");
+  EXPECT_EQ(fragments[0].id, "1");
+  EXPECT_EQ(fragments[1].type, CallFragment::END);
+  EXPECT_EQ(fragments[2].contents, "<1/>");
+
+  // The fetch time is kept, so the call list becomes stale as before.
+  EXPECT_EQ(cache.get("kermit", fragments, 20000), CallListCache::MISS);
+
+  EXPECT_EQ(cache.get("gonzo", fragments, 3000), CallListCache::FRESH);
+  EXPECT_EQ(fragments[0].id, "3");
+}
+
+// A call list that is invalidated while a snapshot is loading isn't loaded,
+// as the snapshot predates the change.
+TEST_F(CallListCacheTest, InvalidatedDuringSnapshotLoad)
+{
+  {
+    CallListCache cache(1000, 10000, 0, NULL);
+    cache.put("kermit", make_fragments("old", 1), 1000);
+
+    // Make the snapshot big enough that the load is usually still running
+    // when kermit is invalidated.  kermit is least recently used, so is
+    // loaded last.
+    for (int ii = 0; ii < 999; ++ii)
+    {
+      cache.put("gonzo" + std::to_string(ii), make_fragments("1", 1), 1000);
+    }
+
+    EXPECT_TRUE(cache.save_snapshot(_path));
+  }
+
+  CallListCache cache(1000, 10000, 0, NULL);
+  cache.load_snapshot(_path);
+  cache.invalidate("kermit");
+  EXPECT_TRUE(cache.wait_for_snapshot());
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::MISS);
+  EXPECT_EQ(cache.get("gonzo0", fragments, 1000), CallListCache::FRESH);
+}
+
+// Call lists in a snapshot that are older than the maximum staleness aren't
+// loaded.
+TEST_F(CallListCacheTest, SnapshotMaxStaleness)
+{
+  {
+    CallListCache cache(10, 10000, 0, NULL);
+    cache.put("kermit", make_fragments("1", 1), 1000);
+    cache.put("gonzo", make_fragments("2", 1), cache.begin_read("gonzo"));
+    EXPECT_TRUE(cache.save_snapshot(_path));
+  }
+
+  CallListCache cache(10, 10000, 3600000, NULL);
+  cache.load_snapshot(_path);
+  EXPECT_TRUE(cache.wait_for_snapshot());
+  EXPECT_EQ(cache.size(), 1u);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(cache.get("gonzo", fragments), CallListCache::FRESH);
+}
+
+// Call lists from a snapshot that haven't been read yet are kept when the
+// cache is saved again.
+TEST_F(CallListCacheTest, SnapshotResave)
+{
+  {
+    CallListCache cache(10, 10000, 0, NULL);
+    cache.put("kermit", make_fragments("1", 3), 1000);
+    cache.put("gonzo", make_fragments("2", 1), 2000);
+    EXPECT_TRUE(cache.save_snapshot(_path));
+  }
+
+  {
+    CallListCache cache(10, 10000, 0, NULL);
+    cache.load_snapshot(_path);
+    EXPECT_TRUE(cache.wait_for_snapshot());
+    cache.put("piggy", make_fragments("3", 1), 3000);
+    EXPECT_TRUE(cache.save_snapshot(_path));
+  }
+
+  CallListCache cache(2, 10000, 0, NULL);
+  cache.load_snapshot(_path);
+  EXPECT_TRUE(cache.wait_for_snapshot());
+
+  // The most recently used call list is loaded first, and the cache fills up
+  // before the last one.
+  EXPECT_EQ(cache.size(), 2u);
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(cache.get("piggy", fragments, 3000), CallListCache::FRESH);
+}
+
+TEST_F(CallListCacheTest, SnapshotErrors)
+{
+  CallListCache cache(10, 10000, 0, NULL);
+
+  // Missing and empty files.
+  cache.load_snapshot("/tmp/no_such_call_list_snapshot");
+  EXPECT_FALSE(cache.wait_for_snapshot());
+  cache.load_snapshot(_path);
+  EXPECT_FALSE(cache.wait_for_snapshot());
+
+  // A snapshot whose entries have been truncated can still be loaded, but
+  // the truncated call list is dropped when it is read.
+  {
+    CallListCache saved(10, 10000, 0, NULL);
+    saved.put("kermit", make_fragments("1", 3), 1000);
+    EXPECT_TRUE(saved.save_snapshot(_path));
+  }
+
+  FILE* file = fopen(_path.c_str(), "r+b");
+  fseek(file, 24 + 8 + 4 + 6 + 4 + 1, SEEK_SET);
+  fputc(0xff, file);
+  fclose(file);
+
+  cache.load_snapshot(_path);
+  EXPECT_TRUE(cache.wait_for_snapshot());
+  EXPECT_EQ(cache.size(), 1u);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(cache.get("kermit", fragments, 1000), CallListCache::MISS);
+  EXPECT_EQ(cache.size(), 0u);
+
+  // A snapshot that can't be written.
+  EXPECT_FALSE(cache.save_snapshot("/no_such_directory/snapshot"));
+}
@@ -0,0 +1,258 @@
+/**
+ * @file call_list_store_alloc_test.cpp Call list store allocation budget tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdlib.h>
+#include <new>
+
+#include <atomic>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "call_list_store.h"
+#include "call_list_store_fixture.h"
+
+//
+// Allocation counting.
+//
+// The global allocator is replaced for the whole UT binary, but only counts
+// allocations while a test has explicitly started an AllocationCounter, and
+// then only those made on the counter's thread.  Otherwise allocations just
+// check one flag, and don't touch the thread-local counts at all, so other
+// tests are unaffected.
+//
+
+static std::atomic<int> alloc_counters_running(0);
+static thread_local bool alloc_counting = false;
+static thread_local uint64_t alloc_count = 0;
+static thread_local uint64_t alloc_bytes = 0;
+
+static void* counted_alloc(size_t size)
+{
+  if ((alloc_counters_running.load(std::memory_order_relaxed) > 0) &&
+      (alloc_counting))
+  {
+    alloc_count++;
+    alloc_bytes += size;
+  }
+
+  void* ptr = malloc((size > 0) ? size : 1);
+
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void* operator new(size_t size) { return counted_alloc(size); }
+void* operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t size) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t size) noexcept { free(ptr); }
+
+// Counts the allocations made on this thread between start and stop.
+class AllocationCounter
+{
+public:
+  AllocationCounter() : _count(0), _bytes(0) {}
+
+  void start()
+  {
+    alloc_count = 0;
+    alloc_bytes = 0;
+    alloc_counting = true;
+    alloc_counters_running++;
+  }
+
+  void stop()
+  {
+    alloc_counters_running--;
+    alloc_counting = false;
+    _count = alloc_count;
+    _bytes = alloc_bytes;
+  }
+
+  uint64_t count() const { return _count; }
+  uint64_t bytes() const { return _bytes; }
+
+private:
+  uint64_t _count;
+  uint64_t _bytes;
+};
+
+//
+// Budgets.
+//
+// Each operation may make a fixed number of allocations, plus a number for
+// each fragment it handles.  The fixed numbers include the allocations made
+// by the mock client and the CassandraStore framework, so are generous; the
+// per-fragment numbers are what catch regressions in the store itself.
+//
+// The per-fragment budgets are the costs when they were set, plus a little
+// for rounding.  If a change reduces the cost, lower the budget to keep the
+// improvement.
+//
+
+const uint64_t WRITE_FIXED_BUDGET = 40;
+
+const uint64_t READ_FIXED_BUDGET = 60;
+const double READ_PER_FRAGMENT_BUDGET = 4.5;
+const double ARENA_READ_PER_FRAGMENT_BUDGET = 2.5;
+
+const uint64_t TRIM_FIXED_BUDGET = 60;
+const double TRIM_PER_FRAGMENT_BUDGET = 5.5;
+
+// The fragment counts to measure at.  The per-fragment cost is the slope
+// between them, so fixed costs (and amortized vector growth) don't count.
+const size_t SMALL_ROW = 10;
+const size_t LARGE_ROW = 200;
+
+const SAS::TrailId FAKE_TRAIL = 0x123456;
+
+// Adds measurement of allocations to the usual store fixture.
+class CallListStoreAllocFixture : public CallListStoreFixture
+{
+public:
+  static CallListStore::CallFragment make_fragment(size_t index)
+  {
+    char timestamp[16];
+    snprintf(timestamp, sizeof(timestamp), "2014010113%04zu", index);
+
+    CallListStore::CallFragment fragment;
+    fragment.timestamp = timestamp;
+    fragment.id = "0123456789ABCDEF";
+    fragment.type = CallListStore::CallFragment::BEGIN;
+    fragment.contents = std::string(200, 'x');
+    return fragment;
+  }
+
+  // Build a slice holding a row of fragments, as returned by cassandra.
+  static void make_row_slice(size_t num_fragments, slice_t& slice)
+  {
+    std::map<std::string, std::string> columns;
+
+    for (size_t ii = 0; ii < num_fragments; ++ii)
+    {
+      CallListStore::CallFragment fragment = make_fragment(ii);
+      columns["call_" + fragment.timestamp + "_" + fragment.id + "_begin"] =
+        fragment.contents;
+    }
+
+    make_slice(slice, columns);
+  }
+
+  // Run an operation, counting its allocations.
+  void run_counted(CassandraStore::Operation* op, AllocationCounter& counter)
+  {
+    counter.start();
+    bool success = _store.do_sync(op, FAKE_TRAIL);
+    counter.stop();
+    EXPECT_TRUE(success);
+    delete op;
+  }
+
+  uint64_t measure_read(size_t num_fragments, bool use_arena)
+  {
+    slice_t slice;
+    make_row_slice(num_fragments, slice);
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+      .WillOnce(SetArgReferee<0>(slice));
+
+    AllocationCounter counter;
+    run_counted(_store.new_get_call_fragments_op("kermit", use_arena), counter);
+    report(std::string(use_arena ? "arena_read_" : "read_") +
+             std::to_string(num_fragments),
+           counter);
+    return counter.count();
+  }
+
+  uint64_t measure_trim(size_t num_fragments)
+  {
+    std::vector<CallListStore::CallFragment> fragments;
+
+    for (size_t ii = 0; ii < num_fragments; ++ii)
+    {
+      fragments.push_back(make_fragment(ii));
+    }
+
+    EXPECT_CALL(_client, batch_mutate(_, _));
+
+    AllocationCounter counter;
+    run_counted(_store.new_delete_old_call_fragments_op("kermit", fragments, 1000),
+                counter);
+    report("trim_" + std::to_string(num_fragments), counter);
+    return counter.count();
+  }
+
+  // Report a measurement as test properties, which appear in the XML or JSON
+  // output (--gtest_output) for tracking over time.
+  void report(const std::string& name, const AllocationCounter& counter)
+  {
+    RecordProperty(name + "_allocs", std::to_string(counter.count()));
+    RecordProperty(name + "_bytes", std::to_string(counter.bytes()));
+  }
+
+  void report_per_fragment(const std::string& name, double per_fragment)
+  {
+    char value[32];
+    snprintf(value, sizeof(value), "%.2f", per_fragment);
+    RecordProperty(name + "_allocs_per_fragment", value);
+  }
+
+};
+
+TEST_F(CallListStoreAllocFixture, WriteBudget)
+{
+  EXPECT_CALL(_client, batch_mutate(_, _));
+
+  AllocationCounter counter;
+  run_counted(_store.new_write_call_fragment_op("kermit", make_fragment(0), 1000, 3600),
+              counter);
+  report("write", counter);
+
+  EXPECT_LE(counter.count(), WRITE_FIXED_BUDGET);
+}
+
+TEST_F(CallListStoreAllocFixture, ReadBudget)
+{
+  uint64_t small = measure_read(SMALL_ROW, false);
+  uint64_t large = measure_read(LARGE_ROW, false);
+  double per_fragment = (double)(large - small) / (LARGE_ROW - SMALL_ROW);
+  report_per_fragment("read", per_fragment);
+
+  EXPECT_LE(per_fragment, READ_PER_FRAGMENT_BUDGET);
+  EXPECT_LE(small, READ_FIXED_BUDGET + (uint64_t)(READ_PER_FRAGMENT_BUDGET * SMALL_ROW));
+}
+
+TEST_F(CallListStoreAllocFixture, ArenaReadBudget)
+{
+  uint64_t small = measure_read(SMALL_ROW, true);
+  uint64_t large = measure_read(LARGE_ROW, true);
+  double per_fragment = (double)(large - small) / (LARGE_ROW - SMALL_ROW);
+  report_per_fragment("arena_read", per_fragment);
+
+  EXPECT_LE(per_fragment, ARENA_READ_PER_FRAGMENT_BUDGET);
+  EXPECT_LE(small, READ_FIXED_BUDGET + (uint64_t)(ARENA_READ_PER_FRAGMENT_BUDGET * SMALL_ROW));
+}
+
+TEST_F(CallListStoreAllocFixture, TrimBudget)
+{
+  uint64_t small = measure_trim(SMALL_ROW);
+  uint64_t large = measure_trim(LARGE_ROW);
+  double per_fragment = (double)(large - small) / (LARGE_ROW - SMALL_ROW);
+  report_per_fragment("trim", per_fragment);
+
+  EXPECT_LE(per_fragment, TRIM_PER_FRAGMENT_BUDGET);
+  EXPECT_LE(small, TRIM_FIXED_BUDGET + (uint64_t)(TRIM_PER_FRAGMENT_BUDGET * SMALL_ROW));
+}
@@ -0,0 +1,102 @@
+/**
+ * @file call_list_store_fixture.h Shared fixtures for call list store tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CALL_LIST_STORE_FIXTURE_H_
+#define CALL_LIST_STORE_FIXTURE_H_
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "mock_cassandra_store.h"
+#include "cass_test_utils.h"
+#include "mock_cassandra_connection_pool.h"
+#include "mock_a_record_resolver.h"
+#include "fake_base_addr_iterator.h"
+
+#include "call_list_store.h"
+
+using namespace CassTestUtils;
+
+// The class under test.
+//
+// We don't test the Store class directly as we need to replace its
+// connection pool, e.g. with a MockCassandraConnectionPool that returns
+// MockCassandraClients.  However all other methods are the real ones from
+// Store.
+class TestCallListStore : public CallListStore::Store
+{
+public:
+  // Replace the connection pool.  This passes ownership of the pool to the
+  // store.
+  void set_conn_pool(CassandraStore::CassandraConnectionPool* pool)
+  {
+    delete _conn_pool;
+    _conn_pool = pool;
+  }
+};
+
+// Fixture for tests of a started store whose operations all use one mock
+// client.
+class CallListStoreFixture : public ::testing::Test
+{
+public:
+  CallListStoreFixture()
+  {
+    _iter = new FakeBaseAddrIterator(create_target("10.0.0.1"));
+
+    // This passes ownership of the pool to the _store
+    MockCassandraConnectionPool* pool = new MockCassandraConnectionPool();
+    _store.set_conn_pool(pool);
+
+    _store.configure_connection("localhost", 1234, NULL, &_resolver);
+
+    // Just return a fake iterator every time
+    EXPECT_CALL(_resolver, resolve_iter(_,_,_)).WillRepeatedly(Return(_iter));
+
+    // The pool should just repeatedly return _client
+    EXPECT_CALL(*pool, get_client()).Times(testing::AnyNumber()).WillRepeatedly(Return(&_client));
+
+    // Not interested in the resolver success calls
+    EXPECT_CALL(_resolver, success(_)).Times(testing::AnyNumber());
+
+    // We expect connect(), is_connected() and set_keyspace() to be called in
+    // every test. By default, just mock them out so that we don't get warnings.
+    EXPECT_CALL(_client, set_keyspace(_)).Times(testing::AnyNumber());
+    EXPECT_CALL(_client, connect()).Times(testing::AnyNumber());
+    EXPECT_CALL(_client, is_connected()).Times(testing::AnyNumber()).WillRepeatedly(Return(false));
+
+    CassandraStore::ResultCode rc = _store.start();
+    EXPECT_EQ(rc, CassandraStore::OK);
+  }
+
+  virtual ~CallListStoreFixture()
+  {
+    _store.stop();
+    _store.wait_stopped();
+    delete _iter; _iter = NULL;
+  }
+
+  static AddrInfo create_target(std::string address)
+  {
+    AddrInfo ai;
+    Utils::parse_ip_target(address, ai.address);
+    ai.port = 1;
+    ai.transport = IPPROTO_TCP;
+    return ai;
+  }
+
+  TestCallListStore _store;
+  MockCassandraClient _client;
+  MockCassandraResolver _resolver;
+  FakeBaseAddrIterator* _iter;
+};
+
+#endif
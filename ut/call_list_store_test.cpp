@@ -12,91 +12,60 @@
 #ifndef CALL_LIST_STORE_TEST_CPP_
 #define CALL_LIST_STORE_TEST_CPP_
 
+#include <unistd.h>
+
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
-#include "mock_cassandra_store.h"
-#include "cass_test_utils.h"
 #include "mock_sas.h"
-#include "mock_cassandra_connection_pool.h"
-#include "mock_a_record_resolver.h"
-#include "fake_base_addr_iterator.h"
 
 #include "call_list_store.h"
+#include "call_list_archive.h"
 #include "mementosasevent.h"
+#include "call_list_store_fixture.h"
+
+using ::testing::SaveArg;
 
-using namespace CassTestUtils;
+// The type of the map of mutations passed to batch_mutate.
+typedef std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > > mutmap_t;
 
 const SAS::TrailId FAKE_TRAIL = 0x123456;
 
-// The class under test.
-//
-// We don't test the Cache class directly as we need to use a
-// MockCassandraConnectionPool that we can use to return MockCassandraClients.
-// However all other methods are the real ones from Cache.
-class TestCallListStore : public CallListStore::Store
+// Matches a slice predicate that requests a particular range of columns.
+MATCHER_P2(ColumnsInRange, start, finish, "")
 {
-public:
-  void set_conn_pool(CassandraStore::CassandraConnectionPool* pool)
-  {
-    delete _conn_pool;
-    _conn_pool = pool;
-  }
-};
+  return (arg.__isset.slice_range &&
+          (arg.slice_range.start == start) &&
+          (arg.slice_range.finish == finish));
+}
 
-class CallListStoreFixture : public ::testing::Test
+// Matches a key range that starts and ends at particular tokens.
+MATCHER_P2(TokenRange, start_token, end_token, "")
 {
-public:
-  CallListStoreFixture()
-  {
-    _iter = new FakeBaseAddrIterator(create_target("10.0.0.1"));
-
-    // This passes ownership of the pool to the _store
-    MockCassandraConnectionPool* pool = new MockCassandraConnectionPool();
-    _store.set_conn_pool(pool);
-
-    _store.configure_connection("localhost", 1234, NULL, &_resolver);
-
-    // Just return a fake iterator every time
-    EXPECT_CALL(_resolver, resolve_iter(_,_,_)).WillRepeatedly(Return(_iter));
-
-    // The pool should just repeatedly return _client
-    EXPECT_CALL(*pool, get_client()).Times(testing::AnyNumber()).WillRepeatedly(Return(&_client));
-
-    // Not interested in the resolver success calls
-    EXPECT_CALL(_resolver, success(_)).Times(testing::AnyNumber());
-
-    // We expect connect(), is_connected() and set_keyspace() to be called in
-    // every test. By default, just mock them out so that we don't get warnings.
-    EXPECT_CALL(_client, set_keyspace(_)).Times(testing::AnyNumber());
-    EXPECT_CALL(_client, connect()).Times(testing::AnyNumber());
-    EXPECT_CALL(_client, is_connected()).Times(testing::AnyNumber()).WillRepeatedly(Return(false));
-
-    CassandraStore::ResultCode rc = _store.start();
-    EXPECT_EQ(rc, CassandraStore::OK);
-  }
-
-  virtual ~CallListStoreFixture()
-  {
-    _store.stop();
-    _store.wait_stopped();
-    delete _iter; _iter = NULL;
-  }
+  return (arg.__isset.start_token &&
+          arg.__isset.end_token &&
+          (arg.start_token == start_token) &&
+          (arg.end_token == end_token));
+}
 
-  AddrInfo create_target(std::string address)
-  {
-    AddrInfo ai;
-    Utils::parse_ip_target(address, ai.address);
-    ai.port = 1;
-    ai.transport = IPPROTO_TCP;
-    return ai;
-  }
+// Matches a key range that starts at a particular key and ends at a token.
+MATCHER_P2(KeyToTokenRange, start_key, end_token, "")
+{
+  return (arg.__isset.start_key &&
+          arg.__isset.end_token &&
+          (arg.start_key == start_key) &&
+          (arg.end_token == end_token));
+}
 
-  TestCallListStore _store;
-  MockCassandraClient _client;
-  MockCassandraResolver _resolver;
-  FakeBaseAddrIterator* _iter;
-};
+// Build a row as returned by get_range_slices.
+cass::KeySlice make_row(const std::string& key,
+                        const std::map<std::string, std::string>& columns)
+{
+  cass::KeySlice row;
+  row.key = key;
+  make_slice(row.columns, columns);
+  return row;
+}
 
 //
 // TESTS
@@ -221,6 +190,145 @@ TEST_F(CallListStoreFixture, GetFragmentsMainline)
 }
 
 
+TEST_F(CallListStoreFixture, GetFragmentsArena)
+{
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<begin-record>";
+  columns["call_20140101130100_0000000000000000_end"] = "<end-record>";
+  columns["call_20140101130100_0000000000000001_rejected"] = "<rejected-record>";
+
+  slice_t slice;
+  make_slice(slice, columns);
+
+  CallListStore::CallFragmentArena fetched_fragments;
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("call_lists"),
+                                 ColumnsWithPrefix("call_"),
+                                 _))
+   .WillOnce(SetArgReferee<0>(slice));
+
+  CassandraStore::ResultCode rc =
+    _store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  ASSERT_EQ(fetched_fragments.size(), 3u);
+
+  EXPECT_TRUE(fetched_fragments[0].timestamp == "20140101130100");
+  EXPECT_TRUE(fetched_fragments[0].id == "0000000000000000");
+  EXPECT_EQ(fetched_fragments[0].type, CallListStore::CallFragment::BEGIN);
+  EXPECT_TRUE(fetched_fragments[0].contents == "<begin-record>");
+
+  EXPECT_TRUE(fetched_fragments[1].timestamp == "20140101130100");
+  EXPECT_TRUE(fetched_fragments[1].id == "0000000000000000");
+  EXPECT_EQ(fetched_fragments[1].type, CallListStore::CallFragment::END);
+  EXPECT_TRUE(fetched_fragments[1].contents == "<end-record>");
+
+  // Check the fragments can be copied out of the arena.
+  CallListStore::CallFragment fragment;
+  fetched_fragments[2].to_fragment(fragment);
+  EXPECT_EQ(fragment.timestamp, "20140101130100");
+  EXPECT_EQ(fragment.id, "0000000000000001");
+  EXPECT_EQ(fragment.type, CallListStore::CallFragment::REJECTED);
+  EXPECT_EQ(fragment.contents, "<rejected-record>");
+
+  // All the strings should be packed into one block, in order.
+  EXPECT_EQ(fetched_fragments[0].timestamp.data + fetched_fragments[0].timestamp.length,
+            fetched_fragments[0].id.data);
+  EXPECT_EQ(fetched_fragments[0].contents.data + fetched_fragments[0].contents.length,
+            fetched_fragments[1].timestamp.data);
+}
+
+
+// Check that the arena still works if more is stored in it than was reserved.
+TEST(CallFragmentArenaTest, Overflow)
+{
+  CallListStore::CallFragmentArena arena;
+  arena.reserve(1, 4);
+
+  std::string big(10000, 'x');
+  CallListStore::CallFragmentView view;
+  view.timestamp = arena.copy("2014", 4);
+  view.id = arena.copy("1", 1);
+  view.type = CallListStore::CallFragment::END;
+  view.contents = arena.copy(big.data(), big.length());
+  arena.push_back(view);
+
+  ASSERT_EQ(arena.size(), 1u);
+  EXPECT_TRUE(arena[0].timestamp == "2014");
+  EXPECT_TRUE(arena[0].id == "1");
+  EXPECT_TRUE(arena[0].contents == big);
+
+  arena.clear();
+  EXPECT_TRUE(arena.empty());
+}
+
+
+TEST_F(CallListStoreFixture, GetFragmentsSinceWatermark)
+{
+  // Cassandra returns the columns with their prefixes intact.
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130200_0000000000000002_begin"] = "<begin-record>";
+  columns["call_20140101130200_0000000000000002_end"] = "<end-record>";
+
+  slice_t slice;
+  make_slice(slice, columns);
+
+  CallListStore::CallListWatermark since;
+  since.timestamp = "20140101130100";
+  since.id = "0000000000000001";
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+
+  // The store should only ask for the columns after the watermark call.
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 ColumnPathForTable("call_lists"),
+                                 ColumnsInRange("call_20140101130100_0000000000000001`",
+                                                "call`"),
+                                 _))
+   .WillOnce(SetArgReferee<0>(slice));
+
+  CassandraStore::ResultCode rc =
+    _store.get_call_fragments_since_sync("kermit", since, fetched_fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+
+  ASSERT_EQ(fetched_fragments.size(), 2u);
+  EXPECT_EQ(fetched_fragments[0].timestamp, "20140101130200");
+  EXPECT_EQ(fetched_fragments[0].id, "0000000000000002");
+  EXPECT_EQ(fetched_fragments[0].type, CallListStore::CallFragment::BEGIN);
+  EXPECT_EQ(fetched_fragments[1].type, CallListStore::CallFragment::END);
+  EXPECT_EQ(fetched_fragments[1].contents, "<end-record>");
+}
+
+
+// Check that a delta fetch with nothing new succeeds without returning any
+// fragments, and doesn't do any more reads.
+TEST_F(CallListStoreFixture, GetFragmentsSinceUnchanged)
+{
+  mock_sas_collect_messages(true);
+
+  CallListStore::CallListWatermark since;
+  since.timestamp = "20140101130100";
+  since.id = "0000000000000001";
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+   .WillOnce(SetArgReferee<0>(empty_slice));
+
+  CassandraStore::ResultCode rc =
+    _store.get_call_fragments_since_sync("kermit", since, fetched_fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  EXPECT_TRUE(fetched_fragments.empty());
+
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_READ_UNCHANGED);
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_READ_FAILED);
+
+  mock_sas_collect_messages(false);
+}
+
+
 TEST_F(CallListStoreFixture, GetFragmentsError)
 {
   std::vector<CallListStore::CallFragment> fetched_fragments;
@@ -306,6 +414,1075 @@ TEST_F(CallListStoreFixture, DeleteOldFragmentsError)
 }
 
 
+// Check that writes and trims update the change token, and that conditional
+// reads only read the whole row if the token has changed.
+TEST_F(CallListStoreFixture, ChangeTokens)
+{
+  mock_sas_collect_messages(true);
+  _store.configure_change_tokens(3600);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130100";
+  frag.id = "0000000000000000";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  // The token is written in the same batch as the fragment.
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<xml>";
+  columns["change_token"] = "1000";
+
+  EXPECT_CALL(_client, batch_mutate(
+                         MutationMap("call_lists", "kermit", columns, 1000, 3600),
+                         _));
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  // ... and with the deletes of a trim.
+  mutmap_t mutations;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&mutations));
+  std::vector<CallListStore::CallFragment> fragments(1, frag);
+  EXPECT_EQ(_store.delete_old_call_fragments_sync("kermit", fragments, 2000, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  std::vector<cass::Mutation>& row = mutations["kermit"]["call_lists"];
+  ASSERT_EQ(row.size(), 2u);
+  EXPECT_TRUE(row[0].__isset.deletion);
+  EXPECT_EQ(row[1].column_or_supercolumn.column.name, "change_token");
+  EXPECT_EQ(row[1].column_or_supercolumn.column.value, "2000");
+  EXPECT_EQ(row[1].column_or_supercolumn.column.timestamp, 2000);
+  EXPECT_EQ(row[1].column_or_supercolumn.column.ttl, 3600);
+
+  // A trim that reuses an older timestamp still changes the token, and the
+  // new token replaces the old one.
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&mutations));
+  EXPECT_EQ(_store.delete_old_call_fragments_sync("kermit", fragments, 1500, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  std::vector<cass::Mutation>& retrim_row = mutations["kermit"]["call_lists"];
+  ASSERT_EQ(retrim_row.size(), 2u);
+  EXPECT_EQ(retrim_row[0].deletion.timestamp, 1500);
+  EXPECT_EQ(retrim_row[1].column_or_supercolumn.column.value, "2001");
+  EXPECT_EQ(retrim_row[1].column_or_supercolumn.column.timestamp, 2001);
+
+  // A read with the current token only reads the token column.
+  std::map<std::string, std::string> token_columns;
+  token_columns["change_token"] = "2001";
+  slice_t token_slice;
+  make_slice(token_slice, token_columns);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("change_token", "change_token"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(token_slice));
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  std::string token;
+  bool modified;
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit",
+                                                      "2001",
+                                                      fetched_fragments,
+                                                      token,
+                                                      modified,
+                                                      FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_FALSE(modified);
+  EXPECT_EQ(token, "2001");
+  EXPECT_TRUE(fetched_fragments.empty());
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_READ_NOT_MODIFIED);
+  mock_sas_discard_messages();
+
+  // A read with an old token reads the row as well, and returns the token.
+  std::map<std::string, std::string> call_columns;
+  call_columns["call_20140101130100_0000000000000000_end"] = "<end-record>";
+  slice_t call_slice;
+  make_slice(call_slice, call_columns);
+
+  {
+    testing::InSequence seq;
+    EXPECT_CALL(_client, get_slice(_,
+                                   "kermit",
+                                   _,
+                                   ColumnsInRange("change_token", "change_token"),
+                                   _))
+      .WillOnce(SetArgReferee<0>(token_slice));
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, ColumnsWithPrefix("call_"), _))
+      .WillOnce(SetArgReferee<0>(call_slice));
+  }
+
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit",
+                                                      "2000",
+                                                      fetched_fragments,
+                                                      token,
+                                                      modified,
+                                                      FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_TRUE(modified);
+  EXPECT_EQ(token, "2001");
+  ASSERT_EQ(fetched_fragments.size(), 1u);
+  EXPECT_EQ(fetched_fragments[0].contents, "<end-record>");
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_READ_NOT_MODIFIED);
+
+  // An IMPU without a token is always read, even if the client's token is
+  // empty too.
+  fetched_fragments.clear();
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("change_token", "change_token"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, ColumnsWithPrefix("call_"), _))
+    .WillOnce(SetArgReferee<0>(call_slice));
+
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit",
+                                                      "",
+                                                      fetched_fragments,
+                                                      token,
+                                                      modified,
+                                                      FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_TRUE(modified);
+  EXPECT_EQ(token, "");
+  EXPECT_EQ(fetched_fragments.size(), 1u);
+
+  mock_sas_collect_messages(false);
+}
+
+
+// Check that the operations use the configured consistency levels.
+TEST_F(CallListStoreFixture, ConfiguredConsistencyLevels)
+{
+  CallListStore::ConsistencyLevels levels;
+  levels.write = cass::ConsistencyLevel::LOCAL_ONE;
+  levels.trim = cass::ConsistencyLevel::ANY;
+  levels.read = cass::ConsistencyLevel::LOCAL_QUORUM;
+  levels.read_fallback = cass::ConsistencyLevel::LOCAL_ONE;
+  _store.configure_consistency_levels(levels);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130100";
+  frag.id = "0000000000000000";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  std::vector<CallListStore::CallFragment> fragments;
+  fragments.push_back(frag);
+
+  EXPECT_CALL(_client, batch_mutate(_, cass::ConsistencyLevel::LOCAL_ONE));
+  CassandraStore::ResultCode rc =
+    _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+
+  EXPECT_CALL(_client, batch_mutate(_, cass::ConsistencyLevel::ANY));
+  rc = _store.delete_old_call_fragments_sync("kermit", fragments, 1000, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+
+  // If the read can't be satisfied at LOCAL_QUORUM, the store falls back to
+  // LOCAL_ONE.
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<xml>";
+  slice_t slice;
+  make_slice(slice, columns);
+
+  cass::UnavailableException ue;
+  {
+    testing::InSequence s;
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, cass::ConsistencyLevel::LOCAL_QUORUM))
+      .WillOnce(Throw(ue));
+    EXPECT_CALL(_client, get_slice(_, "kermit", _, _, cass::ConsistencyLevel::LOCAL_ONE))
+      .WillOnce(SetArgReferee<0>(slice));
+  }
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  rc = _store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  EXPECT_EQ(fetched_fragments.size(), 1u);
+}
+
+
+// Check that repeated writes of the same fragment are suppressed, but that
+// writes of different fragments, and retries of failed writes, aren't.
+TEST_F(CallListStoreFixture, WriteDeduplication)
+{
+  mock_sas_collect_messages(true);
+  _store.configure_write_deduplication(10000, 1000, 0.0001, NULL);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  // A failed write isn't remembered, so it is retried.
+  cass::InvalidRequestException ire;
+  EXPECT_CALL(_client, batch_mutate(_, _))
+    .WillOnce(Throw(ire))
+    .WillOnce(Return());
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::INVALID_REQUEST);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_store.get_writes_suppressed(), 0u);
+
+  mock_sas_discard_messages();
+
+  // Writing the same fragment again succeeds without touching cassandra.
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_store.get_writes_suppressed(), 1u);
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_WRITE_SUPPRESSED);
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_WRITE_OK);
+
+  // A different fragment type, or the same fragment for another IMPU, is
+  // still written.
+  frag.type = CallListStore::CallFragment::END;
+  EXPECT_CALL(_client, batch_mutate(_, _)).Times(2);
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  _store.write_call_fragment_sync("gonzo", frag, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_store.get_writes_suppressed(), 1u);
+
+  mock_sas_collect_messages(false);
+}
+
+
+// Observer that records the sizes it is told about.
+class RecordingObserver : public CallListStore::OperationObserver
+{
+public:
+  void on_write(const std::string& impu, const CallListStore::CallFragment& fragment) {}
+  void on_write_suppressed(const std::string& impu, const CallListStore::CallFragment& fragment) {}
+  void on_read(const std::string& impu, size_t num_fragments, size_t num_bytes)
+  {
+    row_fragments.push_back(num_fragments);
+    row_bytes.push_back(num_bytes);
+  }
+  void on_read_fragment(size_t num_bytes) { fragment_bytes.push_back(num_bytes); }
+  void on_trim(const std::string& impu, size_t num_fragments, size_t num_bytes) {}
+
+  std::vector<size_t> row_fragments;
+  std::vector<size_t> row_bytes;
+  std::vector<size_t> fragment_bytes;
+};
+
+
+// Check that reads report the size of each fragment and of the row, and that
+// the store records them when size statistics are enabled.
+TEST_F(CallListStoreFixture, SizeStats)
+{
+  _store.configure_size_stats(NULL);
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = std::string(100, 'x');
+  columns["call_20140101130100_0000000000000000_end"] = std::string(1000, 'x');
+  slice_t slice;
+  make_slice(slice, columns);
+
+  RecordingObserver observer;
+  CallListStore::GetCallFragments* op = _store.new_get_call_fragments_op("kermit");
+  op->set_observer(&observer);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  EXPECT_TRUE(_store.do_sync(op, FAKE_TRAIL));
+  delete op; op = NULL;
+
+  // The sizes include the column names (without the "call_" prefix).
+  EXPECT_EQ(observer.fragment_bytes, std::vector<size_t>({137, 1035}));
+  EXPECT_EQ(observer.row_fragments, std::vector<size_t>({2}));
+  EXPECT_EQ(observer.row_bytes, std::vector<size_t>({1172}));
+
+  // Reads and writes through the store update the histograms.
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fetched_fragments[0], 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+}
+
+
+// Check that the store feeds its operations into the hot IMPU tracker.
+TEST_F(CallListStoreFixture, HotImpuTracking)
+{
+  _store.configure_hot_impu_tracking(10, 5, NULL);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  EXPECT_CALL(_client, batch_mutate(_, _)).Times(2);
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = std::string(1000, 'x');
+  slice_t slice;
+  make_slice(slice, columns);
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+
+  EXPECT_CALL(_client, get_slice(_, "gonzo", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  _store.get_call_fragments_sync("gonzo", fetched_fragments, FAKE_TRAIL);
+
+  std::vector<HeavyHitters::Item> impus;
+  _store.get_hot_impus_by_ops(1, impus);
+  ASSERT_EQ(impus.size(), 1u);
+  EXPECT_EQ(impus[0].key, "kermit");
+  EXPECT_EQ(impus[0].count, 2u);
+
+  _store.get_hot_impus_by_bytes(1, impus);
+  ASSERT_EQ(impus.size(), 1u);
+  EXPECT_EQ(impus[0].key, "gonzo");
+}
+
+
+TEST_F(CallListStoreFixture, AlignTtl)
+{
+  // Expiry is rounded up to the end of the window.
+  EXPECT_EQ(CallListStore::Store::align_ttl(3600, 600, 1000), 3800);
+  EXPECT_EQ(CallListStore::Store::align_ttl(3600, 600, 1199), 3601);
+  EXPECT_EQ(CallListStore::Store::align_ttl(3600, 600, 1200), 3600);
+
+  // Fragments written in the same window expire together.
+  EXPECT_EQ(1000 + CallListStore::Store::align_ttl(3600, 600, 1000),
+            1100 + CallListStore::Store::align_ttl(3600, 600, 1100));
+
+  // No expiry, or no alignment.
+  EXPECT_EQ(CallListStore::Store::align_ttl(0, 600, 1000), 0);
+  EXPECT_EQ(CallListStore::Store::align_ttl(3600, 0, 1000), 3600);
+}
+
+
+// Check that writes use the aligned TTL when alignment is configured.
+TEST_F(CallListStoreFixture, WriteWithAlignedTtl)
+{
+  _store.configure_ttl_alignment(600, NULL);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  mutmap_t mutations;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&mutations));
+  int64_t now_s = time(NULL);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  std::vector<cass::Mutation>& row = mutations["kermit"]["call_lists"];
+  ASSERT_EQ(row.size(), 1u);
+  int32_t ttl = row[0].column_or_supercolumn.column.ttl;
+  EXPECT_GE(ttl, 3600);
+  EXPECT_LT(ttl, 3600 + 600);
+  EXPECT_LE((now_s + ttl) % 600, 1);
+}
+
+
+// Check that writes schedule background trims.
+// In the ring slot layout each write overwrites the slot after the head, and
+// reads put the slots back into call order.
+TEST_F(CallListStoreFixture, RingSlots)
+{
+  _store.configure_ring_slots(2);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130100";
+  frag.id = "0000000000000001";
+  frag.type = CallListStore::CallFragment::END;
+  frag.contents = "<end-record>";
+
+  // A new row starts at the first slot.  The head is read at the read
+  // consistency level, not the write level.
+  std::map<std::string, std::string> columns;
+  columns["slot_0000"] = "20140101130100_0000000000000001_end\n<end-record>";
+  columns["slot_head"] = "1";
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("slot_head", "slot_head"),
+                                 cass::ConsistencyLevel::LOCAL_QUORUM))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, batch_mutate(
+                         MutationMap("call_lists", "kermit", columns, 1000, 3600),
+                         _));
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  // Later writes wrap round the slots.
+  std::map<std::string, std::string> head_columns;
+  head_columns["slot_head"] = "5";
+  slice_t head_slice;
+  make_slice(head_slice, head_columns);
+
+  columns.clear();
+  columns["slot_0001"] = "20140101130100_0000000000000001_end\n<end-record>";
+  columns["slot_head"] = "6";
+
+  // If too few replicas are up for a quorum read of the head, it is read at
+  // the fallback level.
+  cass::UnavailableException ue;
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("slot_head", "slot_head"),
+                                 cass::ConsistencyLevel::LOCAL_QUORUM))
+    .WillOnce(Throw(ue));
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("slot_head", "slot_head"),
+                                 cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(head_slice));
+  EXPECT_CALL(_client, batch_mutate(
+                         MutationMap("call_lists", "kermit", columns, 2000, 3600),
+                         _));
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 2000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  // Reads return the slots in call order, without duplicates, along with
+  // any fragments written before the layout was enabled.
+  columns.clear();
+  columns["call_20140101130000_0000000000000000_begin"] = "<old-record>";
+  columns["change_token"] = "2000";
+  columns["slot_0000"] = "20140101130200_0000000000000002_begin\n<begin-record>";
+  columns["slot_0001"] = "20140101130100_0000000000000001_end\n<end-record>";
+  columns["slot_0002"] = "20140101130200_0000000000000002_begin\n<begin-record>";
+  columns["slot_head"] = "6";
+  slice_t slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("call_", "slot`"),
+                                 _))
+    .Times(2)
+    .WillRepeatedly(SetArgReferee<0>(slice));
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  ASSERT_EQ(fetched_fragments.size(), 3u);
+  EXPECT_EQ(fetched_fragments[0].contents, "<old-record>");
+  EXPECT_EQ(fetched_fragments[1].id, "0000000000000001");
+  EXPECT_EQ(fetched_fragments[1].type, CallListStore::CallFragment::END);
+  EXPECT_EQ(fetched_fragments[1].contents, "<end-record>");
+  EXPECT_EQ(fetched_fragments[2].timestamp, "20140101130200");
+  EXPECT_EQ(fetched_fragments[2].contents, "<begin-record>");
+
+  // Delta reads only return the calls after the watermark.
+  CallListStore::CallListWatermark since;
+  since.timestamp = "20140101130100";
+  since.id = "0000000000000001";
+
+  EXPECT_EQ(_store.get_call_fragments_since_sync("kermit", since, fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+  ASSERT_EQ(fetched_fragments.size(), 1u);
+  EXPECT_EQ(fetched_fragments[0].id, "0000000000000002");
+}
+
+// Summaries are written alongside the contents, and can be read without
+// them.  The contents of selected calls can then be read on their own.
+TEST_F(CallListStoreFixture, CallSummaries)
+{
+  _store.configure_call_summaries();
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130100";
+  frag.id = "0000000000000001";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<begin-record>";
+  frag.summary = "<summary>";
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000001_begin"] = "<begin-record>";
+  columns["summary_20140101130100_0000000000000001_begin"] = "<summary>";
+
+  EXPECT_CALL(_client, batch_mutate(
+                         MutationMap("call_lists", "kermit", columns, 1000, 3600),
+                         _));
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  // Listing reads only the summary columns.
+  columns.clear();
+  columns["summary_20140101130100_0000000000000001_begin"] = "<summary>";
+  columns["summary_20140101130200_0000000000000002_begin"] = "<summary2>";
+  slice_t summary_slice;
+  make_slice(summary_slice, columns);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("summary_", "summary`"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(summary_slice));
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  EXPECT_EQ(_store.get_call_summaries_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  ASSERT_EQ(fetched_fragments.size(), 2u);
+  EXPECT_EQ(fetched_fragments[0].id, "0000000000000001");
+  EXPECT_EQ(fetched_fragments[0].type, CallListStore::CallFragment::BEGIN);
+  EXPECT_EQ(fetched_fragments[0].summary, "<summary>");
+  EXPECT_EQ(fetched_fragments[0].contents, "");
+  EXPECT_EQ(fetched_fragments[1].summary, "<summary2>");
+
+  // Each selected call is read on its own, and the fragments come back in
+  // call order whatever the order of the calls.
+  std::map<std::string, std::string> call1_columns;
+  call1_columns["call_20140101130100_0000000000000001_begin"] = "<begin-record>";
+  call1_columns["call_20140101130100_0000000000000001_end"] = "<end-record>";
+  slice_t call1_slice;
+  make_slice(call1_slice, call1_columns);
+
+  std::map<std::string, std::string> call2_columns;
+  call2_columns["call_20140101130200_0000000000000002_begin"] = "<begin-record2>";
+  slice_t call2_slice;
+  make_slice(call2_slice, call2_columns);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("call_20140101130100_0000000000000001_",
+                                                "call_20140101130100_0000000000000001`"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(call1_slice));
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("call_20140101130200_0000000000000002_",
+                                                "call_20140101130200_0000000000000002`"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(call2_slice));
+
+  std::vector<CallListStore::CallListWatermark> calls(2);
+  calls[0].timestamp = "20140101130200";
+  calls[0].id = "0000000000000002";
+  calls[1].timestamp = "20140101130100";
+  calls[1].id = "0000000000000001";
+
+  EXPECT_EQ(_store.get_call_contents_sync("kermit", calls, fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  ASSERT_EQ(fetched_fragments.size(), 3u);
+  EXPECT_EQ(fetched_fragments[0].contents, "<begin-record>");
+  EXPECT_EQ(fetched_fragments[1].contents, "<end-record>");
+  EXPECT_EQ(fetched_fragments[2].contents, "<begin-record2>");
+
+  // Calls that don't exist aren't found.
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _))
+    .WillOnce(SetArgReferee<0>(empty_slice));
+  calls.resize(1);
+  EXPECT_EQ(_store.get_call_contents_sync("kermit", calls, fetched_fragments, FAKE_TRAIL),
+            CassandraStore::NOT_FOUND);
+
+  // Trims delete the summaries too.
+  mutmap_t mutations;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&mutations));
+  std::vector<CallListStore::CallFragment> fragments(1, frag);
+  EXPECT_EQ(_store.delete_old_call_fragments_sync("kermit", fragments, 2000, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  std::vector<cass::Mutation>& row = mutations["kermit"]["call_lists"];
+  ASSERT_EQ(row.size(), 1u);
+  EXPECT_EQ(row[0].deletion.predicate.column_names,
+            std::vector<std::string>({"call_20140101130100_0000000000000001_begin",
+                                      "summary_20140101130100_0000000000000001_begin"}));
+}
+
+TEST_F(CallListStoreFixture, BackgroundTrim)
+{
+  CallListStore::TrimScheduler::Config config;
+  config.delay_ms = 3600000;
+  _store.configure_background_trim(config, NULL);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  EXPECT_CALL(_client, batch_mutate(_, _)).Times(3);
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  _store.write_call_fragment_sync("gonzo", frag, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_store.get_trim_backlog(), 2u);
+}
+
+
+// Background trimming is ignored if ring slots are configured, as the
+// trimmer would delete fragment columns that ring slot writes never write.
+TEST_F(CallListStoreFixture, RingSlotsExcludeBackgroundTrim)
+{
+  CallListStore::TrimScheduler::Config config;
+  config.delay_ms = 3600000;
+  _store.configure_ring_slots(2);
+  _store.configure_background_trim(config, NULL);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(empty_slice));
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_store.get_trim_backlog(), 0u);
+}
+
+// Ring slots are ignored if background trimming is configured, so writes
+// still use a column per fragment.
+TEST_F(CallListStoreFixture, BackgroundTrimExcludesRingSlots)
+{
+  CallListStore::TrimScheduler::Config config;
+  config.delay_ms = 3600000;
+  _store.configure_background_trim(config, NULL);
+  _store.configure_ring_slots(2);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130101_0123456789ABCDEF_begin"] = "<xml>";
+  EXPECT_CALL(_client, batch_mutate(MutationMap("call_lists", "kermit", columns, 1000, 3600), _));
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_store.get_trim_backlog(), 1u);
+}
+
+// Check that call lists are served from the cache until they are written,
+// and that the cache can be saved to a snapshot.
+TEST_F(CallListStoreFixture, CachedReads)
+{
+  std::string path = "/tmp/call_list_snapshot_test_" + std::to_string(getpid());
+  _store.configure_call_list_cache(10, 60000);
+  mock_sas_collect_messages(true);
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<xml>";
+  slice_t slice;
+  make_slice(slice, columns);
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_READ_CACHED);
+
+  fetched_fragments.clear();
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+  ASSERT_EQ(fetched_fragments.size(), 1u);
+  EXPECT_EQ(fetched_fragments[0].contents, "<xml>");
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_READ_CACHED);
+
+  EXPECT_TRUE(_store.save_call_list_snapshot(path));
+
+  // Writing a fragment drops the cached call list.
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::END;
+  frag.contents = "<xml>";
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  _store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL);
+
+  mock_sas_collect_messages(false);
+  unlink(path.c_str());
+}
+
+
+TEST_F(CallListStoreFixture, ExportMainline)
+{
+  std::string path = "/tmp/call_list_export_test_" + std::to_string(getpid());
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000001_begin"] = "<begin-record>";
+  columns["call_20140101130100_0000000000000001_end"] = "<end-record>";
+
+  std::map<std::string, std::string> bad_columns;
+  bad_columns["call_20140101130100_bad"] = "<record>";
+
+  std::vector<cass::KeySlice> rows;
+  rows.push_back(make_row("kermit", columns));
+  rows.push_back(make_row("gonzo", std::map<std::string, std::string>()));
+  rows.push_back(make_row("fozzie", bad_columns));
+
+  // A single range covers the whole ring.
+  EXPECT_CALL(_client, get_range_slices(_,
+                                        ColumnPathForTable("call_lists"),
+                                        ColumnsInRange("call_", "call`"),
+                                        TokenRange("-9223372036854775808",
+                                                   "9223372036854775807"),
+                                        _))
+    .WillOnce(SetArgReferee<0>(rows));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  CassandraStore::ResultCode rc = _store.export_call_lists_sync(&writer, 1, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  EXPECT_TRUE(writer.close());
+
+  CallListStore::ArchiveReader reader;
+  ASSERT_TRUE(reader.open(path));
+  EXPECT_EQ(reader.num_records(), 2u);
+
+  CallListStore::ArchiveRecord record;
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ(record.impu, "kermit");
+  EXPECT_EQ(record.fragment.timestamp, "20140101130100");
+  EXPECT_EQ(record.fragment.id, "0000000000000001");
+  EXPECT_EQ(record.fragment.type, CallListStore::CallFragment::BEGIN);
+  EXPECT_EQ(record.fragment.contents, "<begin-record>");
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ(record.fragment.type, CallListStore::CallFragment::END);
+  EXPECT_FALSE(reader.read(record));
+
+  unlink(path.c_str());
+}
+
+TEST_F(CallListStoreFixture, ExportPaging)
+{
+  std::string path = "/tmp/call_list_export_test_" + std::to_string(getpid());
+
+  std::map<std::string, std::string> columns1;
+  columns1["call_20140101130100_0000000000000001_begin"] = "<record1>";
+  columns1["call_20140101130100_0000000000000001_end"] = "<record2>";
+  std::map<std::string, std::string> columns2;
+  columns2["call_20140101130100_0000000000000001_end"] = "<record2>";
+  columns2["call_20140101130200_0000000000000002_begin"] = "<record3>";
+  std::map<std::string, std::string> columns3;
+  columns3["call_20140101130200_0000000000000002_begin"] = "<record3>";
+  std::map<std::string, std::string> other_columns;
+  other_columns["call_20140101130300_0000000000000003_rejected"] = "<record4>";
+
+  // The first page of rows is full, so the export asks for another page
+  // starting at the last row.  That page is also full, so the export asks for
+  // a third, which just contains the last row again.
+  std::vector<cass::KeySlice> page1;
+  page1.push_back(make_row("kermit", columns1));
+  page1.push_back(make_row("gonzo", other_columns));
+  std::vector<cass::KeySlice> page2;
+  page2.push_back(make_row("gonzo", other_columns));
+  page2.push_back(make_row("fozzie", other_columns));
+  std::vector<cass::KeySlice> page3;
+  page3.push_back(make_row("fozzie", other_columns));
+
+  EXPECT_CALL(_client, get_range_slices(_, _, _, TokenRange("0", "100"), _))
+    .WillOnce(SetArgReferee<0>(page1));
+  EXPECT_CALL(_client, get_range_slices(_, _, _, KeyToTokenRange("gonzo", "100"), _))
+    .WillOnce(SetArgReferee<0>(page2));
+  EXPECT_CALL(_client, get_range_slices(_, _, _, KeyToTokenRange("fozzie", "100"), _))
+    .WillOnce(SetArgReferee<0>(page3));
+
+  // The first row fills its page of columns, so the rest of it is read a page
+  // at a time, starting from the last column read.
+  slice_t slice2;
+  make_slice(slice2, columns2);
+  slice_t slice3;
+  make_slice(slice3, columns3);
+
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("call_20140101130100_0000000000000001_end", "call`"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice2));
+  EXPECT_CALL(_client, get_slice(_,
+                                 "kermit",
+                                 _,
+                                 ColumnsInRange("call_20140101130200_0000000000000002_begin", "call`"),
+                                 _))
+    .WillOnce(SetArgReferee<0>(slice3));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+
+  CallListStore::ExportCallFragments op("0", "100", &writer, 2, 2);
+  EXPECT_TRUE(_store.do_sync(&op, FAKE_TRAIL));
+  EXPECT_EQ(op.get_num_rows(), 3u);
+  EXPECT_EQ(op.get_num_fragments(), 5u);
+  EXPECT_TRUE(writer.close());
+
+  CallListStore::ArchiveReader reader;
+  ASSERT_TRUE(reader.open(path, true));
+
+  const char* expected[][2] = { { "kermit", "<record1>" },
+                                { "kermit", "<record2>" },
+                                { "kermit", "<record3>" },
+                                { "gonzo", "<record4>" },
+                                { "fozzie", "<record4>" } };
+  CallListStore::ArchiveRecord record;
+
+  for (size_t ii = 0; ii < 5; ++ii)
+  {
+    ASSERT_TRUE(reader.read(record));
+    EXPECT_EQ(record.impu, expected[ii][0]);
+    EXPECT_EQ(record.fragment.contents, expected[ii][1]);
+  }
+
+  EXPECT_FALSE(reader.read(record));
+
+  unlink(path.c_str());
+}
+
+TEST_F(CallListStoreFixture, ExportError)
+{
+  std::string path = "/tmp/call_list_export_test_" + std::to_string(getpid());
+
+  std::vector<cass::KeySlice> rows;
+
+  // Split the ring in two.  One half succeeds and the other fails.
+  EXPECT_CALL(_client, get_range_slices(_, _, _, TokenRange("-9223372036854775808",
+                                                            "-1"), _))
+    .WillOnce(SetArgReferee<0>(rows));
+  EXPECT_CALL(_client, get_range_slices(_, _, _, TokenRange("-1",
+                                                            "9223372036854775807"), _))
+    .WillOnce(Throw(cass::TimedOutException()));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  CassandraStore::ResultCode rc = _store.export_call_lists_sync(&writer, 2, FAKE_TRAIL);
+  EXPECT_NE(rc, CassandraStore::OK);
+  writer.close();
+
+  unlink(path.c_str());
+}
+
+
+// Build an archive record for the import tests.
+CallListStore::ArchiveRecord make_record(const std::string& impu,
+                                         CallListStore::CallFragment::Type type,
+                                         int64_t age_s,
+                                         int32_t ttl)
+{
+  CallListStore::ArchiveRecord record;
+  record.impu = impu;
+  record.fragment.timestamp = "20140101130100";
+  record.fragment.id = "0000000000000001";
+  record.fragment.type = type;
+  record.fragment.contents = "<" + impu + ">";
+  record.cass_timestamp = ((int64_t)time(NULL) - age_s) * 1000000;
+  record.ttl = ttl;
+  return record;
+}
+
+TEST_F(CallListStoreFixture, ImportMainline)
+{
+  std::string path = "/tmp/call_list_import_test_" + std::to_string(getpid());
+
+  std::vector<CallListStore::ArchiveRecord> records;
+  records.push_back(make_record("kermit", CallListStore::CallFragment::BEGIN, 0, 3600));
+  records.push_back(make_record("kermit", CallListStore::CallFragment::END, 0, 0));
+  records.push_back(make_record("gonzo", CallListStore::CallFragment::BEGIN, 7200, 3600));
+  records.push_back(make_record("gonzo", CallListStore::CallFragment::END, 600, 3600));
+  records.push_back(make_record("fozzie", CallListStore::CallFragment::REJECTED, 0, 0));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  // The expired fragment is skipped, and the rest are sent in batches of two.
+  mutmap_t batch1;
+  mutmap_t batch2;
+  {
+    InSequence s;
+    EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&batch1));
+    EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&batch2));
+  }
+
+  CallListStore::ArchiveReader reader;
+  ASSERT_TRUE(reader.open(path));
+
+  CallListStore::ImportSummary summary;
+  CassandraStore::ResultCode rc = _store.import_call_lists(&reader, 2, 2, summary, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  EXPECT_EQ(summary.records_read, 5u);
+  EXPECT_EQ(summary.records_written, 4u);
+  EXPECT_EQ(summary.records_expired, 1u);
+  EXPECT_EQ(summary.records_failed, 0u);
+
+  // Both of kermit's fragments are in the first batch, using the same column
+  // names as a normal write.
+  ASSERT_EQ(batch1.size(), 1u);
+  std::vector<cass::Mutation>& kermit = batch1["kermit"]["call_lists"];
+  ASSERT_EQ(kermit.size(), 2u);
+  EXPECT_EQ(kermit[0].column_or_supercolumn.column.name,
+            "call_20140101130100_0000000000000001_begin");
+  EXPECT_EQ(kermit[0].column_or_supercolumn.column.value, "<kermit>");
+  EXPECT_EQ(kermit[0].column_or_supercolumn.column.timestamp, records[0].cass_timestamp);
+  EXPECT_EQ(kermit[0].column_or_supercolumn.column.ttl, 3600);
+  EXPECT_EQ(kermit[1].column_or_supercolumn.column.name,
+            "call_20140101130100_0000000000000001_end");
+  EXPECT_FALSE(kermit[1].column_or_supercolumn.column.__isset.ttl);
+
+  // Gonzo's remaining fragment has its TTL reduced by its age.
+  ASSERT_EQ(batch2.size(), 2u);
+  std::vector<cass::Mutation>& gonzo = batch2["gonzo"]["call_lists"];
+  ASSERT_EQ(gonzo.size(), 1u);
+  EXPECT_EQ(gonzo[0].column_or_supercolumn.column.name,
+            "call_20140101130100_0000000000000001_end");
+  EXPECT_GE(gonzo[0].column_or_supercolumn.column.ttl, 2990);
+  EXPECT_LE(gonzo[0].column_or_supercolumn.column.ttl, 3000);
+  EXPECT_EQ(batch2["fozzie"]["call_lists"].size(), 1u);
+
+  unlink(path.c_str());
+}
+
+TEST_F(CallListStoreFixture, ImportError)
+{
+  std::string path = "/tmp/call_list_import_test_" + std::to_string(getpid());
+
+  std::vector<CallListStore::ArchiveRecord> records;
+  records.push_back(make_record("kermit", CallListStore::CallFragment::BEGIN, 0, 0));
+  records.push_back(make_record("gonzo", CallListStore::CallFragment::BEGIN, 0, 0));
+  records.push_back(make_record("fozzie", CallListStore::CallFragment::BEGIN, 0, 0));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  // The first batch fails, but the import carries on with the second.
+  cass::InvalidRequestException ire;
+  {
+    InSequence s;
+    EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(Throw(ire));
+    EXPECT_CALL(_client, batch_mutate(_, _));
+  }
+
+  CallListStore::ArchiveReader reader;
+  ASSERT_TRUE(reader.open(path));
+
+  CallListStore::ImportSummary summary;
+  CassandraStore::ResultCode rc = _store.import_call_lists(&reader, 2, 1, summary, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::INVALID_REQUEST);
+  EXPECT_EQ(summary.records_read, 3u);
+  EXPECT_EQ(summary.records_written, 1u);
+  EXPECT_EQ(summary.records_failed, 2u);
+
+  unlink(path.c_str());
+}
+
+// Imported IMPUs are treated as written: their change tokens and summaries
+// are written with the fragments, and their cached call lists are dropped.
+TEST_F(CallListStoreFixture, ImportUpdatesImpus)
+{
+  std::string path = "/tmp/call_list_import_test_" + std::to_string(getpid());
+  _store.configure_change_tokens(3600);
+  _store.configure_call_summaries();
+  _store.configure_call_list_cache(10, 60000);
+
+  // Cache kermit's call list.
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<xml>";
+  slice_t slice;
+  make_slice(slice, columns);
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  std::vector<CallListStore::ArchiveRecord> records;
+  records.push_back(make_record("kermit", CallListStore::CallFragment::BEGIN, 600, 3600));
+
+  CallListStore::ArchiveWriter writer;
+  ASSERT_TRUE(writer.open(path));
+  EXPECT_TRUE(writer.write(records));
+  EXPECT_TRUE(writer.close());
+
+  mutmap_t batch;
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(SaveArg<0>(&batch));
+
+  CallListStore::ArchiveReader reader;
+  ASSERT_TRUE(reader.open(path));
+
+  CallListStore::ImportSummary summary;
+  EXPECT_EQ(_store.import_call_lists(&reader, 10, 1, summary, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(summary.records_written, 1u);
+
+  // The change token uses the current time, not the record's.
+  std::vector<cass::Mutation>& kermit = batch["kermit"]["call_lists"];
+  ASSERT_EQ(kermit.size(), 3u);
+  EXPECT_EQ(kermit[0].column_or_supercolumn.column.name,
+            "call_20140101130100_0000000000000001_begin");
+  EXPECT_EQ(kermit[1].column_or_supercolumn.column.name,
+            "summary_20140101130100_0000000000000001_begin");
+  EXPECT_EQ(kermit[2].column_or_supercolumn.column.name, "change_token");
+  EXPECT_GT(kermit[2].column_or_supercolumn.column.timestamp,
+            records[0].cass_timestamp);
+
+  // The cached call list was dropped.
+  EXPECT_CALL(_client, get_slice(_, "kermit", _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL),
+            CassandraStore::OK);
+
+  unlink(path.c_str());
+}
+
+
+// Each operation's timeline is recorded, and the slowest can be dumped.
+TEST_F(CallListStoreFixture, OpTimelines)
+{
+  std::string json;
+  EXPECT_FALSE(_store.dump_slowest_operations(10, json));
+
+  _store.configure_op_timelines(16);
+
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130100_0000000000000000_begin"] = "<begin-record>";
+  slice_t slice;
+  make_slice(slice, columns);
+
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  _store.write_call_fragment_sync("kermit", frag, 1000, 3600, FAKE_TRAIL);
+
+  std::vector<CallListStore::CallFragment> fetched_fragments;
+  EXPECT_CALL(_client, get_slice(_, _, _, _, _)).WillOnce(SetArgReferee<0>(slice));
+  _store.get_call_fragments_sync("kermit", fetched_fragments, FAKE_TRAIL);
+
+  EXPECT_TRUE(_store.dump_slowest_operations(10, json));
+  EXPECT_NE(json.find("\"name\":\"WriteCallFragment\""), std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"GetCallFragments\""), std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"connection checkout\""), std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"cassandra\""), std::string::npos);
+  EXPECT_NE(json.find("\"name\":\"decode\""), std::string::npos);
+  EXPECT_NE(json.find("\"trail\":" + std::to_string(FAKE_TRAIL)), std::string::npos);
+
+  // Synchronous operations aren't queued.
+  EXPECT_EQ(json.find("\"name\":\"queued\""), std::string::npos);
+
+  // Only the slowest operation is dumped if that's all that's asked for.
+  EXPECT_TRUE(_store.dump_slowest_operations(1, json));
+  EXPECT_TRUE((json.find("WriteCallFragment") == std::string::npos) ||
+              (json.find("GetCallFragments") == std::string::npos));
+}
+
 TEST_F(CallListStoreFixture, SasLogging)
 {
   mock_sas_collect_messages(true);
@@ -0,0 +1,298 @@
+/**
+ * @file column_schema_test.cpp Column name schema unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "gtest/gtest.h"
+
+#include "column_schema.h"
+#include "call_list_store.h"
+#include "utils.h"
+
+using namespace CallListStore;
+
+// The same layout as the call list store's call columns.
+constexpr EnumName<CallFragment::Type> TYPE_NAMES[] = {
+  EnumName<CallFragment::Type>(CallFragment::BEGIN, "begin"),
+  EnumName<CallFragment::Type>(CallFragment::END, "end"),
+  EnumName<CallFragment::Type>(CallFragment::REJECTED, "rejected"),
+};
+
+constexpr ColumnNameCodec<CallFragment::Type, 2> CALL_COLUMN("call_", '_', TYPE_NAMES, 3);
+static_assert(CALL_COLUMN.in_enum_order(), "Names must be in enum order");
+
+// A different layout, with one field and a different separator.
+enum Colour { RED, GREEN };
+
+constexpr EnumName<Colour> COLOUR_NAMES[] = {
+  EnumName<Colour>(RED, "red"),
+  EnumName<Colour>(GREEN, "green"),
+};
+
+constexpr ColumnNameCodec<Colour, 1> COLOUR_COLUMN("colour:", ':', COLOUR_NAMES, 2);
+static_assert(COLOUR_COLUMN.in_enum_order(), "Names must be in enum order");
+
+// Names out of order are caught at compile time.
+constexpr EnumName<Colour> UNORDERED_NAMES[] = {
+  EnumName<Colour>(GREEN, "green"),
+  EnumName<Colour>(RED, "red"),
+};
+
+constexpr ColumnNameCodec<Colour, 1> UNORDERED_COLUMN("colour:", ':', UNORDERED_NAMES, 2);
+static_assert(!UNORDERED_COLUMN.in_enum_order(), "Names must not be in enum order");
+
+TEST(ColumnSchemaTest, Encode)
+{
+  std::string timestamp = "20140722120000";
+  std::string id = "12345";
+  const std::string* fields[] = {&timestamp, &id};
+  std::string name;
+
+  EXPECT_TRUE(CALL_COLUMN.encode(fields, CallFragment::BEGIN, true, name));
+  EXPECT_EQ(name, "call_20140722120000_12345_begin");
+  EXPECT_EQ(CALL_COLUMN.encoded_length(fields, CallFragment::BEGIN, true), name.length());
+
+  EXPECT_TRUE(CALL_COLUMN.encode(fields, CallFragment::REJECTED, false, name));
+  EXPECT_EQ(name, "20140722120000_12345_rejected");
+  EXPECT_EQ(CALL_COLUMN.encoded_length(fields, CallFragment::REJECTED, false), name.length());
+
+  EXPECT_FALSE(CALL_COLUMN.encode(fields, (CallFragment::Type)7, true, name));
+  EXPECT_EQ(name, "");
+  EXPECT_EQ(CALL_COLUMN.encoded_length(fields, (CallFragment::Type)7, true), 0u);
+
+  std::string shade = "dark";
+  const std::string* colour_fields[] = {&shade};
+  EXPECT_TRUE(COLOUR_COLUMN.encode(colour_fields, GREEN, true, name));
+  EXPECT_EQ(name, "colour:dark:green");
+}
+
+TEST(ColumnSchemaTest, Decode)
+{
+  FieldSpan fields[2];
+  CallFragment::Type type;
+  std::string name = "call_20140722120000_12345_end";
+
+  ASSERT_TRUE(CALL_COLUMN.decode(name, true, fields, type));
+  EXPECT_EQ(name.substr(fields[0].start, fields[0].length), "20140722120000");
+  EXPECT_EQ(name.substr(fields[1].start, fields[1].length), "12345");
+  EXPECT_EQ(type, CallFragment::END);
+
+  ASSERT_TRUE(CALL_COLUMN.decode(name.substr(5), false, fields, type));
+  EXPECT_EQ(fields[0].start, 0u);
+  EXPECT_EQ(fields[1].start, 15u);
+
+  // Names that aren't in the family or are malformed.
+  const char* bad_names[] = {"summary_20140722120000_12345_end",
+                             "call",
+                             "call_20140722120000_12345",
+                             "call_20140722120000__end",
+                             "call__12345_end",
+                             "call_20140722120000_12345_",
+                             "call_20140722120000_12345_middle",
+                             "call_20140722120000_12345_end_extra"};
+
+  for (size_t ii = 0; ii < sizeof(bad_names) / sizeof(bad_names[0]); ++ii)
+  {
+    EXPECT_FALSE(CALL_COLUMN.decode(std::string(bad_names[ii]), true, fields, type))
+      << bad_names[ii];
+  }
+
+  FieldSpan colour_fields[1];
+  Colour colour;
+  ASSERT_TRUE(COLOUR_COLUMN.decode(std::string("colour:light:red"), true, colour_fields, colour));
+  EXPECT_EQ(colour_fields[0].length, 5u);
+  EXPECT_EQ(colour, RED);
+}
+
+//
+// Benchmark against the hand-written encoding and decoding that the call list
+// store used before it had a schema.
+//
+
+const static int BENCHMARK_ITERATIONS = 20000;
+const static int BENCHMARK_RUNS = 5;
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static std::string hand_written_type_to_string(CallFragment::Type type)
+{
+  switch (type)
+  {
+    case CallFragment::BEGIN:
+      return "begin";
+
+    case CallFragment::END:
+      return "end";
+
+    default:
+      return "rejected";
+  }
+}
+
+static std::string hand_written_encode(const CallFragment& fragment)
+{
+  std::string column_name;
+  column_name.append("call_")
+             .append(fragment.timestamp).append("_")
+             .append(fragment.id).append("_")
+             .append(hand_written_type_to_string(fragment.type));
+  return column_name;
+}
+
+static bool hand_written_decode(const std::string& name, CallFragment& fragment)
+{
+  std::vector<std::string> tokens;
+  Utils::split_string(name, '_', tokens);
+
+  if (tokens.size() != 3)
+  {
+    return false;
+  }
+
+  fragment.timestamp = tokens[0];
+  fragment.id = tokens[1];
+
+  if (tokens[2] == "begin")
+  {
+    fragment.type = CallFragment::BEGIN;
+  }
+  else if (tokens[2] == "end")
+  {
+    fragment.type = CallFragment::END;
+  }
+  else if (tokens[2] == "rejected")
+  {
+    fragment.type = CallFragment::REJECTED;
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+static std::string schema_encode(const CallFragment& fragment)
+{
+  const std::string* fields[] = {&fragment.timestamp, &fragment.id};
+  std::string column_name;
+  CALL_COLUMN.encode(fields, fragment.type, true, column_name);
+  return column_name;
+}
+
+static bool schema_decode(const std::string& name, CallFragment& fragment)
+{
+  FieldSpan fields[2];
+
+  if (!CALL_COLUMN.decode(name, false, fields, fragment.type))
+  {
+    return false;
+  }
+
+  fragment.timestamp.assign(name, fields[0].start, fields[0].length);
+  fragment.id.assign(name, fields[1].start, fields[1].length);
+  return true;
+}
+
+// Time encoding a fragment's column name, taking the best of several runs.
+static uint64_t time_encode(std::string (*encode)(const CallFragment&),
+                            const CallFragment& fragment,
+                            size_t& total_length)
+{
+  uint64_t best_ns = UINT64_MAX;
+
+  for (int run = 0; run < BENCHMARK_RUNS; ++run)
+  {
+    uint64_t start_ns = monotonic_ns();
+
+    for (int ii = 0; ii < BENCHMARK_ITERATIONS; ++ii)
+    {
+      total_length += encode(fragment).length();
+    }
+
+    best_ns = std::min(best_ns, monotonic_ns() - start_ns);
+  }
+
+  return best_ns;
+}
+
+// Time decoding a column name into a fragment, taking the best of several
+// runs.
+static uint64_t time_decode(bool (*decode)(const std::string&, CallFragment&),
+                            const std::string& name,
+                            size_t& total_length)
+{
+  uint64_t best_ns = UINT64_MAX;
+
+  for (int run = 0; run < BENCHMARK_RUNS; ++run)
+  {
+    uint64_t start_ns = monotonic_ns();
+
+    for (int ii = 0; ii < BENCHMARK_ITERATIONS; ++ii)
+    {
+      CallFragment fragment;
+      decode(name, fragment);
+      total_length += fragment.id.length();
+    }
+
+    best_ns = std::min(best_ns, monotonic_ns() - start_ns);
+  }
+
+  return best_ns;
+}
+
+// Time the schema's codec against the hand-written code.  The timings are
+// recorded as test properties (see --gtest_output) rather than checked, as
+// the test may run on a busy machine.
+TEST(ColumnSchemaTest, Benchmark)
+{
+  CallFragment fragment;
+  fragment.timestamp = "20140722120000";
+  fragment.id = "0123456789ABCDEF0123456789ABCDEF";
+  fragment.type = CallFragment::REJECTED;
+  std::string name = hand_written_encode(fragment).substr(5);
+
+  // Check that the two give the same results before timing them.
+  CallFragment hand_written_fragment;
+  CallFragment schema_fragment;
+  ASSERT_EQ(hand_written_encode(fragment), schema_encode(fragment));
+  ASSERT_TRUE(hand_written_decode(name, hand_written_fragment));
+  ASSERT_TRUE(schema_decode(name, schema_fragment));
+  ASSERT_EQ(hand_written_fragment.timestamp, schema_fragment.timestamp);
+  ASSERT_EQ(hand_written_fragment.id, schema_fragment.id);
+  ASSERT_EQ(hand_written_fragment.type, schema_fragment.type);
+
+  // Accumulate the results so that the work can't be optimized away.
+  size_t total_length = 0;
+  uint64_t hand_written_encode_ns = time_encode(hand_written_encode, fragment, total_length);
+  uint64_t schema_encode_ns = time_encode(schema_encode, fragment, total_length);
+  uint64_t hand_written_decode_ns = time_decode(hand_written_decode, name, total_length);
+  uint64_t schema_decode_ns = time_decode(schema_decode, name, total_length);
+  EXPECT_GT(total_length, 0u);
+
+  char value[32];
+  snprintf(value, sizeof(value), "%.1f", (double)hand_written_encode_ns / BENCHMARK_ITERATIONS);
+  RecordProperty("hand_written_encode_ns", value);
+  snprintf(value, sizeof(value), "%.1f", (double)schema_encode_ns / BENCHMARK_ITERATIONS);
+  RecordProperty("schema_encode_ns", value);
+  snprintf(value, sizeof(value), "%.1f", (double)hand_written_decode_ns / BENCHMARK_ITERATIONS);
+  RecordProperty("hand_written_decode_ns", value);
+  snprintf(value, sizeof(value), "%.1f", (double)schema_decode_ns / BENCHMARK_ITERATIONS);
+  RecordProperty("schema_decode_ns", value);
+}
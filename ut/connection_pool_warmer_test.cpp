@@ -0,0 +1,297 @@
+/**
+ * @file connection_pool_warmer_test.cpp Connection pool warmer unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "connection_pool_warmer.h"
+#include "call_list_store.h"
+#include "memory_backend.h"
+#include "call_list_store_fixture.h"
+
+using namespace CallListStore;
+using ::testing::Invoke;
+
+const static size_t NUM_CLIENTS = 5;
+
+// Connection pool that hands out each of a set of clients in turn, as if it
+// opened a new connection for each checkout.  Opening and closing a client's
+// connection go through the MonitoredConnectionPool, so that they are
+// reported.
+class FakeConnectionPool : public MonitoredConnectionPool
+{
+public:
+  FakeConnectionPool(MockCassandraClient* clients, size_t num_clients) :
+    _clients(clients),
+    _open(num_clients, false),
+    _next(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  virtual ~FakeConnectionPool()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  CassandraStore::Client* get_client()
+  {
+    pthread_mutex_lock(&_lock);
+    size_t index = _next++ % _open.size();
+
+    if (!_open[index])
+    {
+      create_connection(AddrInfo());
+      _open[index] = true;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    return &_clients[index];
+  }
+
+  // Close a client's connection, so that the next checkout of the client
+  // opens a new one.
+  void close(size_t index)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_open[index])
+    {
+      destroy_connection(AddrInfo(), &_clients[index]);
+      _open[index] = false;
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  MockCassandraClient* _clients;
+  std::vector<bool> _open;
+  size_t _next;
+  pthread_mutex_t _lock;
+};
+
+// A read that takes longer than the warm up allows.
+static void slow_get_slice(std::vector<cass::ColumnOrSuperColumn>& columns,
+                           const std::string& key,
+                           const cass::ColumnParent& parent,
+                           const cass::SlicePredicate& predicate,
+                           const cass::ConsistencyLevel::type level)
+{
+  usleep(100000);
+}
+
+class ConnectionPoolWarmerTest : public ::testing::Test
+{
+public:
+  ConnectionPoolWarmerTest()
+  {
+    // This passes ownership of the pool to the store.
+    _pool = new FakeConnectionPool(_clients, NUM_CLIENTS);
+    _store.set_conn_pool(_pool);
+  }
+
+  virtual ~ConnectionPoolWarmerTest()
+  {
+    _store.stop();
+    _store.wait_stopped();
+  }
+
+  ConnectionPoolWarmer::Config make_config(size_t connections)
+  {
+    ConnectionPoolWarmer::Config config;
+    config.connections = connections;
+    config.timeout_ms = 50;
+    config.retry_interval_ms = 10;
+    return config;
+  }
+
+  // Wait (for up to 5s) until the store is ready.
+  bool wait_for_ready()
+  {
+    for (int ii = 0; (ii < 5000) && (!_store.is_ready()); ++ii)
+    {
+      usleep(1000);
+    }
+
+    return _store.is_ready();
+  }
+
+  TestCallListStore _store;
+  FakeConnectionPool* _pool;
+  MockCassandraClient _clients[NUM_CLIENTS];
+};
+
+// Starting the store opens the connections in parallel, and reads from the
+// call list column family on each.
+TEST_F(ConnectionPoolWarmerTest, WarmUp)
+{
+  _store.configure_connection_warmup(make_config(4), NULL);
+
+  for (size_t ii = 0; ii < 4; ++ii)
+  {
+    EXPECT_CALL(_clients[ii], get_slice(_,
+                                        "memento_connection_warmup",
+                                        ColumnPathForTable("call_lists"),
+                                        _,
+                                        cass::ConsistencyLevel::ONE));
+  }
+
+  EXPECT_FALSE(_store.is_ready());
+  EXPECT_EQ(_store.start(), CassandraStore::OK);
+  EXPECT_TRUE(_store.is_ready());
+
+  ConnectionPoolWarmer* warmer = _store.get_connection_pool_warmer();
+  EXPECT_TRUE(warmer->is_warm());
+  EXPECT_EQ(warmer->num_connections(), 4u);
+  EXPECT_EQ(warmer->num_churned(), 0u);
+
+  _store.stop();
+  EXPECT_FALSE(_store.is_ready());
+}
+
+// The warmer counts the connections that the pool opens, and those opened
+// other than by a warm up as churn.
+TEST(ConnectionPoolWarmerMonitorTest, Connections)
+{
+  ConnectionPoolWarmer::Config config;
+  ConnectionPoolWarmer warmer(config, NULL);
+
+  warmer.on_connection_opened();
+  warmer.on_connection_opened();
+  EXPECT_EQ(warmer.num_connections(), 2u);
+  EXPECT_EQ(warmer.num_churned(), 2u);
+
+  warmer.on_connection_closed();
+  EXPECT_EQ(warmer.num_connections(), 1u);
+  EXPECT_EQ(warmer.num_churned(), 2u);
+
+  warmer.on_connection_opened();
+  EXPECT_EQ(warmer.num_connections(), 2u);
+  EXPECT_EQ(warmer.num_churned(), 3u);
+}
+
+// The store reports the connections its operations use, so a connection
+// opened after the warm up is churn.
+TEST_F(ConnectionPoolWarmerTest, Churn)
+{
+  _store.configure_connection_warmup(make_config(2), NULL);
+
+  EXPECT_CALL(_clients[0], get_slice(_, _, _, _, _));
+  EXPECT_CALL(_clients[1], get_slice(_, _, _, _, _));
+  ASSERT_EQ(_store.start(), CassandraStore::OK);
+
+  // The next operation gets a new connection from the pool.
+  EXPECT_CALL(_clients[2], batch_mutate(_, _));
+
+  CallFragment fragment;
+  fragment.timestamp = "20140101130100";
+  fragment.id = "0000000000000001";
+  fragment.type = CallFragment::BEGIN;
+  fragment.contents = "<xml>";
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, 0),
+            CassandraStore::OK);
+
+  ConnectionPoolWarmer* warmer = _store.get_connection_pool_warmer();
+  EXPECT_EQ(warmer->num_connections(), 3u);
+  EXPECT_EQ(warmer->num_churned(), 1u);
+
+  // A connection that is replaced is churn, even though the new connection
+  // uses the same client.
+  _pool->close(0);
+  EXPECT_EQ(warmer->num_connections(), 2u);
+
+  EXPECT_CALL(_clients[3], batch_mutate(_, _));
+  EXPECT_CALL(_clients[4], batch_mutate(_, _));
+  EXPECT_CALL(_clients[0], batch_mutate(_, _));
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, 0),
+              CassandraStore::OK);
+  }
+
+  EXPECT_EQ(warmer->num_connections(), 5u);
+  EXPECT_EQ(warmer->num_churned(), 4u);
+}
+
+// If the column family doesn't exist, the store starts but isn't ready, and
+// retries the warm up until it succeeds.
+TEST_F(ConnectionPoolWarmerTest, MissingColumnFamily)
+{
+  _store.configure_connection_warmup(make_config(2), NULL);
+
+  cass::InvalidRequestException ire;
+  ire.why = "unconfigured columnfamily call_lists";
+  EXPECT_CALL(_clients[0], get_slice(_, _, _, _, _)).WillOnce(Throw(ire));
+  EXPECT_CALL(_clients[1], get_slice(_, _, _, _, _)).WillOnce(Throw(ire));
+  EXPECT_CALL(_clients[2], get_slice(_, _, _, _, _));
+  EXPECT_CALL(_clients[3], get_slice(_, _, _, _, _));
+
+  EXPECT_EQ(_store.start(), CassandraStore::OK);
+  EXPECT_TRUE(wait_for_ready());
+  EXPECT_TRUE(_store.get_connection_pool_warmer()->is_warm());
+}
+
+// If the connections aren't all open in time, the store starts but isn't
+// ready, and retries the warm up until it succeeds.
+TEST_F(ConnectionPoolWarmerTest, TimedOut)
+{
+  _store.configure_connection_warmup(make_config(2), NULL);
+
+  EXPECT_CALL(_clients[0], get_slice(_, _, _, _, _));
+  EXPECT_CALL(_clients[1], get_slice(_, _, _, _, _))
+    .WillOnce(Invoke(slow_get_slice));
+  EXPECT_CALL(_clients[2], get_slice(_, _, _, _, _));
+  EXPECT_CALL(_clients[3], get_slice(_, _, _, _, _));
+
+  EXPECT_EQ(_store.start(), CassandraStore::OK);
+  EXPECT_FALSE(_store.is_ready());
+  EXPECT_TRUE(wait_for_ready());
+}
+
+// Stopping the store stops the warm up retries.
+TEST_F(ConnectionPoolWarmerTest, RetriesStopped)
+{
+  _store.configure_connection_warmup(make_config(2), NULL);
+
+  cass::InvalidRequestException ire;
+  ire.why = "unconfigured columnfamily call_lists";
+
+  for (size_t ii = 0; ii < NUM_CLIENTS; ++ii)
+  {
+    EXPECT_CALL(_clients[ii], get_slice(_, _, _, _, _))
+      .WillRepeatedly(Throw(ire));
+  }
+
+  EXPECT_EQ(_store.start(), CassandraStore::OK);
+  EXPECT_FALSE(_store.is_ready());
+  usleep(50000);
+  EXPECT_FALSE(_store.is_ready());
+
+  _store.stop();
+  _store.wait_stopped();
+  EXPECT_FALSE(_store.is_ready());
+  EXPECT_FALSE(_store.get_connection_pool_warmer()->is_warm());
+}
+
+// With a configured backend, the warm up runs on the backend.
+TEST_F(ConnectionPoolWarmerTest, Backend)
+{
+  _store.configure_backend(new MemoryBackend());
+  _store.configure_connection_warmup(make_config(4), NULL);
+
+  EXPECT_EQ(_store.start(), CassandraStore::OK);
+  EXPECT_TRUE(_store.is_ready());
+}
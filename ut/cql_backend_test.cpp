@@ -0,0 +1,818 @@
+/**
+ * @file cql_backend_test.cpp CQL call list backend unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+
+#include "mock_sas.h"
+
+#include "call_list_store.h"
+#include "cql_backend.h"
+
+using namespace CallListStore;
+namespace cass = org::apache::cassandra;
+
+const SAS::TrailId FAKE_TRAIL = 0x123456;
+
+// An in-memory cassandra cluster that understands the subset of the CQL
+// native protocol that the backend uses.  All nodes share the same data.
+class FakeCqlCluster
+{
+public:
+  struct Cell
+  {
+    std::string value;
+    int64_t timestamp;
+    int32_t ttl;
+  };
+
+  struct Node
+  {
+    std::vector<int64_t> tokens;
+    bool up;
+    int generation;
+    int requests;
+    uint16_t last_consistency;
+    std::vector<int32_t> errors;
+    size_t hold;
+    std::vector<std::string> held;
+  };
+
+  FakeCqlCluster() { pthread_mutex_init(&_lock, NULL); }
+  ~FakeCqlCluster() { pthread_mutex_destroy(&_lock); }
+
+  void add_node(const std::string& address, const std::vector<int64_t>& tokens)
+  {
+    Node& node = _nodes[address];
+    node.tokens = tokens;
+    node.up = true;
+    node.generation = 0;
+    node.requests = 0;
+    node.last_consistency = 0;
+    node.hold = 0;
+  }
+
+  void set_up(const std::string& address, bool up)
+  {
+    pthread_mutex_lock(&_lock);
+    _nodes[address].up = up;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  bool is_up(const std::string& address)
+  {
+    pthread_mutex_lock(&_lock);
+    bool up = (_nodes.count(address) != 0) && (_nodes[address].up);
+    pthread_mutex_unlock(&_lock);
+    return up;
+  }
+
+  // Fail the next statement on a node with an error.
+  void fail_next(const std::string& address, int32_t code)
+  {
+    pthread_mutex_lock(&_lock);
+    _nodes[address].errors.push_back(code);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Make a node forget its prepared statements (as if it had restarted).
+  void forget_prepared(const std::string& address)
+  {
+    pthread_mutex_lock(&_lock);
+    _nodes[address].generation++;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // Hold the responses to the next n statements on a node, then send them
+  // all in reverse order.
+  void hold_responses(const std::string& address, size_t n)
+  {
+    pthread_mutex_lock(&_lock);
+    _nodes[address].hold = n;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  int requests(const std::string& address)
+  {
+    pthread_mutex_lock(&_lock);
+    int requests = _nodes[address].requests;
+    pthread_mutex_unlock(&_lock);
+    return requests;
+  }
+
+  uint16_t last_consistency(const std::string& address)
+  {
+    pthread_mutex_lock(&_lock);
+    uint16_t consistency = _nodes[address].last_consistency;
+    pthread_mutex_unlock(&_lock);
+    return consistency;
+  }
+
+  size_t num_cells(const std::string& key)
+  {
+    pthread_mutex_lock(&_lock);
+    size_t num_cells = _data[key].size();
+    pthread_mutex_unlock(&_lock);
+    return num_cells;
+  }
+
+  // Handle a request frame sent to a node, adding any response frames to
+  // send back.
+  void handle(const std::string& address,
+              const std::string& frame,
+              std::vector<std::string>& responses)
+  {
+    Cql::Reader header(frame);
+    header.u8();
+    header.u8();
+    int16_t stream = (int16_t)header.u16();
+    uint8_t opcode = header.u8();
+    header.i32();
+    std::string body = frame.substr(Cql::HEADER_LENGTH);
+    Cql::Reader reader(body);
+    Cql::Writer response;
+    uint8_t response_opcode = Cql::OP_RESULT;
+
+    pthread_mutex_lock(&_lock);
+    Node& node = _nodes[address];
+    bool statement = ((opcode == Cql::OP_EXECUTE) || (opcode == Cql::OP_BATCH));
+
+    if (opcode == Cql::OP_STARTUP)
+    {
+      response_opcode = Cql::OP_READY;
+    }
+    else if (opcode == Cql::OP_PREPARE)
+    {
+      std::string cql = reader.long_string();
+      response.i32(Cql::RESULT_PREPARED)
+              .short_bytes(prepared_id(address, node, cql.substr(0, 6)));
+    }
+    else if (opcode == Cql::OP_QUERY)
+    {
+      system_query(address, reader.long_string(), response);
+    }
+    else if ((statement) && (!node.errors.empty()))
+    {
+      node.requests++;
+      response_opcode = Cql::OP_ERROR;
+      response.i32(node.errors.front()).string("Injected error");
+      node.errors.erase(node.errors.begin());
+    }
+    else if (opcode == Cql::OP_EXECUTE)
+    {
+      node.requests++;
+      std::string id = reader.short_bytes();
+      node.last_consistency = reader.u16();
+      reader.u8();
+      std::vector<std::string> values(reader.u16());
+      for (size_t ii = 0; ii < values.size(); ++ii)
+      {
+        reader.bytes(values[ii]);
+      }
+
+      if (!execute(address, node, id, values, response))
+      {
+        response_opcode = Cql::OP_ERROR;
+      }
+    }
+    else if (opcode == Cql::OP_BATCH)
+    {
+      node.requests++;
+      reader.u8();
+      uint16_t num_statements = reader.u16();
+      response.i32(Cql::RESULT_VOID);
+
+      for (uint16_t ii = 0; ii < num_statements; ++ii)
+      {
+        reader.u8();
+        std::string id = reader.short_bytes();
+        std::vector<std::string> values(reader.u16());
+        for (size_t jj = 0; jj < values.size(); ++jj)
+        {
+          reader.bytes(values[jj]);
+        }
+
+        Cql::Writer ignored;
+        if (!execute(address, node, id, values, ignored))
+        {
+          response = ignored;
+          response_opcode = Cql::OP_ERROR;
+          break;
+        }
+      }
+
+      node.last_consistency = reader.u16();
+    }
+
+    std::string response_frame =
+      response.frame(Cql::RESPONSE_VERSION, stream, response_opcode);
+
+    if ((statement) && (node.hold > 0))
+    {
+      node.held.push_back(response_frame);
+
+      if (node.held.size() == node.hold)
+      {
+        responses.insert(responses.end(), node.held.rbegin(), node.held.rend());
+        node.held.clear();
+        node.hold = 0;
+      }
+    }
+    else
+    {
+      responses.push_back(response_frame);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  std::string prepared_id(const std::string& address,
+                          const Node& node,
+                          const std::string& kind)
+  {
+    return address + "/" + std::to_string(node.generation) + "/" + kind;
+  }
+
+  static std::string inet(const std::string& address)
+  {
+    struct in_addr addr;
+    inet_pton(AF_INET, address.c_str(), &addr);
+    return std::string((const char*)&addr, sizeof(addr));
+  }
+
+  static std::string tokens(const std::vector<int64_t>& tokens)
+  {
+    Cql::Writer writer;
+    writer.i32(tokens.size());
+    for (size_t ii = 0; ii < tokens.size(); ++ii)
+    {
+      writer.bytes(std::to_string(tokens[ii]));
+    }
+    return writer.data();
+  }
+
+  static void rows_header(Cql::Writer& response,
+                          const std::vector<std::pair<std::string, uint16_t> >& columns,
+                          int32_t num_rows)
+  {
+    response.i32(Cql::RESULT_ROWS)
+            .i32(Cql::ROWS_GLOBAL_TABLE_SPEC)
+            .i32(columns.size())
+            .string("ks")
+            .string("table");
+
+    for (size_t ii = 0; ii < columns.size(); ++ii)
+    {
+      response.string(columns[ii].first).u16(columns[ii].second);
+      if (columns[ii].second == 0x0022)
+      {
+        // set<varchar>
+        response.u16(0x000D);
+      }
+    }
+
+    response.i32(num_rows);
+  }
+
+  void system_query(const std::string& address,
+                    const std::string& cql,
+                    Cql::Writer& response)
+  {
+    std::vector<std::pair<std::string, uint16_t> > columns;
+
+    if (cql == "SELECT tokens FROM system.local")
+    {
+      columns.push_back(std::make_pair("tokens", 0x0022));
+      rows_header(response, columns, 1);
+      response.bytes(tokens(_nodes[address].tokens));
+    }
+    else
+    {
+      columns.push_back(std::make_pair("peer", 0x0010));
+      columns.push_back(std::make_pair("rpc_address", 0x0010));
+      columns.push_back(std::make_pair("tokens", 0x0022));
+      rows_header(response, columns, _nodes.size() - 1);
+
+      for (std::map<std::string, Node>::iterator it = _nodes.begin();
+           it != _nodes.end();
+           ++it)
+      {
+        if (it->first != address)
+        {
+          response.bytes(inet(it->first))
+                  .bytes(inet("0.0.0.0"))
+                  .bytes(tokens(it->second.tokens));
+        }
+      }
+    }
+  }
+
+  bool execute(const std::string& address,
+               Node& node,
+               const std::string& id,
+               std::vector<std::string>& values,
+               Cql::Writer& response)
+  {
+    std::string kind = id.substr(id.rfind('/') + 1);
+
+    if (id != prepared_id(address, node, kind))
+    {
+      response.i32(Cql::ERROR_UNPREPARED).string("Unprepared").short_bytes(id);
+      return false;
+    }
+
+    if (kind == "INSERT")
+    {
+      Cell& cell = _data[values[0]][values[1]];
+      cell.value = values[2];
+      cell.timestamp = Cql::bigint_value(values[3]);
+      cell.ttl = Cql::int_value(values[4]);
+      response.i32(Cql::RESULT_VOID);
+    }
+    else if (kind == "DELETE")
+    {
+      _data[values[1]].erase(values[2]);
+      response.i32(Cql::RESULT_VOID);
+    }
+    else
+    {
+      std::map<std::string, Cell>& row = _data[values[0]];
+      std::map<std::string, Cell>::iterator start = row.lower_bound(values[1]);
+      std::map<std::string, Cell>::iterator end = row.upper_bound(values[2]);
+      int32_t num_rows = std::min((int32_t)std::distance(start, end),
+                                  Cql::int_value(values[3]));
+
+      std::vector<std::pair<std::string, uint16_t> > columns;
+      columns.push_back(std::make_pair("column1", 0x000D));
+      columns.push_back(std::make_pair("value", 0x0003));
+      columns.push_back(std::make_pair("writetime(value)", 0x0002));
+      columns.push_back(std::make_pair("ttl(value)", 0x0009));
+      rows_header(response, columns, num_rows);
+
+      for (int32_t ii = 0; ii < num_rows; ++ii, ++start)
+      {
+        response.bytes(start->first)
+                .bytes(start->second.value)
+                .bigint_value(start->second.timestamp);
+
+        if (start->second.ttl > 0)
+        {
+          response.int_value(start->second.ttl);
+        }
+        else
+        {
+          response.null_bytes();
+        }
+      }
+    }
+
+    return true;
+  }
+
+  std::map<std::string, Node> _nodes;
+  std::map<std::string, std::map<std::string, Cell> > _data;
+  pthread_mutex_t _lock;
+};
+
+// Transport that sends requests to a FakeCqlCluster.
+class FakeCqlTransport : public CqlTransport
+{
+public:
+  FakeCqlTransport(FakeCqlCluster* cluster, const std::string& address) :
+    _cluster(cluster),
+    _address(address),
+    _closed(false)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+
+  virtual ~FakeCqlTransport()
+  {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  bool connect()
+  {
+    return _cluster->is_up(_address);
+  }
+
+  bool send(const std::string& data)
+  {
+    if (!_cluster->is_up(_address))
+    {
+      close();
+      return false;
+    }
+
+    std::vector<std::string> responses;
+    _cluster->handle(_address, data, responses);
+
+    pthread_mutex_lock(&_lock);
+    for (size_t ii = 0; ii < responses.size(); ++ii)
+    {
+      _buffer.append(responses[ii]);
+    }
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+    return true;
+  }
+
+  bool recv(char* buffer, size_t length)
+  {
+    pthread_mutex_lock(&_lock);
+
+    while ((!_closed) && (_buffer.length() < length))
+    {
+      pthread_cond_wait(&_cond, &_lock);
+    }
+
+    bool success = (_buffer.length() >= length);
+
+    if (success)
+    {
+      memcpy(buffer, _buffer.data(), length);
+      _buffer.erase(0, length);
+    }
+
+    pthread_mutex_unlock(&_lock);
+    return success;
+  }
+
+  void close()
+  {
+    pthread_mutex_lock(&_lock);
+    _closed = true;
+    _buffer.clear();
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  FakeCqlCluster* _cluster;
+  const std::string _address;
+  std::string _buffer;
+  bool _closed;
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+};
+
+// The class under test, using the fake cluster.
+class TestCqlBackend : public CqlBackend
+{
+public:
+  TestCqlBackend(FakeCqlCluster* cluster, const std::string& seed) :
+    CqlBackend(std::vector<std::string>(1, seed), 9042, "memento", "call_lists", 64, 1000),
+    _cluster(cluster)
+  {}
+
+protected:
+  CqlTransport* create_transport(const std::string& host, int port)
+  {
+    return new FakeCqlTransport(_cluster, host);
+  }
+
+private:
+  FakeCqlCluster* _cluster;
+};
+
+class CqlBackendTest : public ::testing::Test
+{
+public:
+  CqlBackendTest()
+  {
+    // Node 1 owns the negative tokens, and node 2 the positive ones.
+    _cluster.add_node("10.0.0.1", std::vector<int64_t>(1, 0));
+    _cluster.add_node("10.0.0.2", std::vector<int64_t>(1, std::numeric_limits<int64_t>::max()));
+
+    _backend = new TestCqlBackend(&_cluster, "10.0.0.1");
+    EXPECT_TRUE(_backend->start());
+
+    // This passes ownership of the backend to the store.
+    _store.configure_backend(_backend);
+  }
+
+  CallFragment make_fragment(const std::string& id, CallFragment::Type type)
+  {
+    CallFragment fragment;
+    fragment.timestamp = "20140101130100";
+    fragment.id = id;
+    fragment.type = type;
+    fragment.contents = "<" + id + ">";
+    return fragment;
+  }
+
+  FakeCqlCluster _cluster;
+  TestCqlBackend* _backend;
+  CallListStore::Store _store;
+};
+
+//
+// TESTS
+//
+
+// The token calculation matches cassandra's Murmur3Partitioner.
+TEST(CqlProtocolTest, Murmur3Token)
+{
+  EXPECT_EQ(Cql::murmur3_token(""), std::numeric_limits<int64_t>::min());
+  EXPECT_EQ(Cql::murmur3_token("a"), -8839064797231613815LL);
+  EXPECT_EQ(Cql::murmur3_token("kermit"), 6334864459865305585LL);
+  EXPECT_EQ(Cql::murmur3_token("sip:6505550001@example.com"), 6128722021943681305LL);
+  EXPECT_EQ(Cql::murmur3_token("0123456789abcdef0"), -1502884478548852619LL);
+}
+
+// A truncated message is rejected.
+TEST(CqlProtocolTest, Truncated)
+{
+  Cql::Writer writer;
+  writer.u16(10).u8(1);
+  Cql::Reader reader(writer.data());
+  EXPECT_THROW(reader.string(), Cql::ProtocolError);
+}
+
+// Fragments can be written, read and deleted through the store.
+TEST_F(CqlBackendTest, Mainline)
+{
+  CassandraStore::ResultCode rc;
+  std::vector<CallFragment> fragments;
+
+  rc = _store.write_call_fragment_sync("kermit", make_fragment("1", CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  rc = _store.write_call_fragment_sync("kermit", make_fragment("1", CallFragment::END), 1001, 3600, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  rc = _store.write_call_fragment_sync("kermit", make_fragment("2", CallFragment::REJECTED), 1002, 0, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+
+  rc = _store.get_call_fragments_sync("kermit", fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  ASSERT_EQ(fragments.size(), 3u);
+  EXPECT_EQ(fragments[0].id, "1");
+  EXPECT_EQ(fragments[0].type, CallFragment::BEGIN);
+  EXPECT_EQ(fragments[0].contents, "<1>");
+  EXPECT_EQ(fragments[1].type, CallFragment::END);
+  EXPECT_EQ(fragments[2].id, "2");
+  EXPECT_EQ(fragments[2].type, CallFragment::REJECTED);
+
+  // Reads use the configured consistency level (LOCAL_QUORUM).
+  EXPECT_EQ(_cluster.last_consistency("10.0.0.2"), 0x0006);
+
+  std::vector<CallFragment> to_delete(fragments.begin(), fragments.begin() + 2);
+  rc = _store.delete_old_call_fragments_sync("kermit", to_delete, 1003, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+
+  rc = _store.get_call_fragments_sync("kermit", fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  ASSERT_EQ(fragments.size(), 1u);
+  EXPECT_EQ(fragments[0].id, "2");
+
+  // A row with no fragments is reported as not found.
+  rc = _store.get_call_fragments_sync("gonzo", fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::NOT_FOUND);
+}
+
+// Requests are sent to the node that owns the row's token.
+TEST_F(CqlBackendTest, TokenRouting)
+{
+  // "a" has a negative token and "kermit" a positive one.
+  EXPECT_EQ(_backend->host_for_key("a"), "10.0.0.1");
+  EXPECT_EQ(_backend->host_for_key("kermit"), "10.0.0.2");
+
+  _store.write_call_fragment_sync("a", make_fragment("1", CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_cluster.requests("10.0.0.1"), 1);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), 0);
+
+  _store.write_call_fragment_sync("kermit", make_fragment("1", CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_cluster.requests("10.0.0.1"), 1);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), 1);
+}
+
+// Columns for several rows are batched, with one batch per node.
+TEST_F(CqlBackendTest, BatchWrites)
+{
+  RowWrites rows;
+  CallColumn column = {"call_1", "value", 1000, 3600};
+  rows["a"].push_back(column);
+  column.name = "call_2";
+  rows["a"].push_back(column);
+  rows["kermit"].push_back(column);
+
+  _backend->write_columns(rows, cass::ConsistencyLevel::ONE);
+  EXPECT_EQ(_cluster.requests("10.0.0.1"), 1);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), 1);
+  EXPECT_EQ(_cluster.num_cells("a"), 2u);
+  EXPECT_EQ(_cluster.num_cells("kermit"), 1u);
+}
+
+// Trims update the change token in the same batch as the deletes, and
+// conditional reads of an unchanged call list only read the token.
+TEST_F(CqlBackendTest, ChangeTokens)
+{
+  _store.configure_change_tokens(3600);
+
+  _store.write_call_fragment_sync("kermit", make_fragment("1", CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+  _store.write_call_fragment_sync("kermit", make_fragment("2", CallFragment::BEGIN), 1001, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_cluster.num_cells("kermit"), 3u);
+
+  std::vector<CallFragment> fragments;
+  std::string token;
+  bool modified;
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit", "", fragments, token, modified, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_TRUE(modified);
+  EXPECT_EQ(token, "1001");
+  EXPECT_EQ(fragments.size(), 2u);
+
+  int requests = _cluster.requests("10.0.0.2");
+  fragments.clear();
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit", token, fragments, token, modified, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_FALSE(modified);
+  EXPECT_TRUE(fragments.empty());
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), requests + 1);
+
+  // The delete and the token update are sent as one batch.
+  std::vector<CallFragment> to_delete(1, make_fragment("1", CallFragment::BEGIN));
+  EXPECT_EQ(_store.delete_old_call_fragments_sync("kermit", to_delete, 1002, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), requests + 2);
+  EXPECT_EQ(_cluster.num_cells("kermit"), 2u);
+
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit", token, fragments, token, modified, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_TRUE(modified);
+  EXPECT_EQ(token, "1002");
+  ASSERT_EQ(fragments.size(), 1u);
+  EXPECT_EQ(fragments[0].id, "2");
+
+  // A trim with an older timestamp deletes nothing, but still changes the
+  // token.
+  fragments.clear();
+  EXPECT_EQ(_store.delete_old_call_fragments_sync("kermit", to_delete, 1000, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_store.get_call_fragments_if_changed_sync("kermit", token, fragments, token, modified, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_TRUE(modified);
+  EXPECT_EQ(token, "1003");
+}
+
+struct ReaderThread
+{
+  CallListStore::Store* store;
+  std::string impu;
+  CassandraStore::ResultCode rc;
+  std::vector<CallFragment> fragments;
+  pthread_t thread;
+};
+
+static void* read_call_list(void* arg)
+{
+  ReaderThread* reader = (ReaderThread*)arg;
+  reader->rc = reader->store->get_call_fragments_sync(reader->impu,
+                                                      reader->fragments,
+                                                      FAKE_TRAIL);
+  return NULL;
+}
+
+// Requests from many threads are pipelined on a connection, and responses
+// arriving out of order are matched to the right requests.
+TEST_F(CqlBackendTest, Pipelining)
+{
+  const int NUM_THREADS = 8;
+  ReaderThread readers[NUM_THREADS];
+
+  // Find some IMPUs owned by node 2.
+  for (int ii = 0, jj = 0; ii < NUM_THREADS; ++jj)
+  {
+    std::string impu = "sip:" + std::to_string(jj) + "@example.com";
+
+    if (Cql::murmur3_token(impu) > 0)
+    {
+      _store.write_call_fragment_sync(impu, make_fragment(impu, CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+      readers[ii].store = &_store;
+      readers[ii].impu = impu;
+      ii++;
+    }
+  }
+
+  // The node doesn't respond until all the reads have arrived, then responds
+  // to the last first.
+  _cluster.hold_responses("10.0.0.2", NUM_THREADS);
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_create(&readers[ii].thread, NULL, read_call_list, &readers[ii]);
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(readers[ii].thread, NULL);
+    EXPECT_EQ(readers[ii].rc, CassandraStore::OK);
+    ASSERT_EQ(readers[ii].fragments.size(), 1u);
+    EXPECT_EQ(readers[ii].fragments[0].contents, "<" + readers[ii].impu + ">");
+  }
+}
+
+// Reads fall back to the lower consistency level if the cluster reports that
+// too few replicas are available.
+TEST_F(CqlBackendTest, ReadFallback)
+{
+  std::vector<CallFragment> fragments;
+  _store.write_call_fragment_sync("kermit", make_fragment("1", CallFragment::BEGIN), 1000, 3600, FAKE_TRAIL);
+
+  _cluster.fail_next("10.0.0.2", Cql::ERROR_UNAVAILABLE);
+  CassandraStore::ResultCode rc = _store.get_call_fragments_sync("kermit", fragments, FAKE_TRAIL);
+  EXPECT_EQ(rc, CassandraStore::OK);
+  EXPECT_EQ(fragments.size(), 1u);
+  EXPECT_EQ(_cluster.last_consistency("10.0.0.2"), 0x0001);
+}
+
+// Other errors are reported in the same way as for the thrift client.
+TEST_F(CqlBackendTest, Errors)
+{
+  CallFragment fragment = make_fragment("1", CallFragment::BEGIN);
+
+  _cluster.fail_next("10.0.0.2", Cql::ERROR_INVALID);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::INVALID_REQUEST);
+
+  _cluster.fail_next("10.0.0.2", Cql::ERROR_WRITE_TIMEOUT);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::UNKNOWN_ERROR);
+}
+
+// If a node forgets the prepared statements, they are prepared again.
+TEST_F(CqlBackendTest, Reprepare)
+{
+  _cluster.forget_prepared("10.0.0.2");
+
+  CallFragment fragment = make_fragment("1", CallFragment::BEGIN);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), 2);
+  EXPECT_EQ(_cluster.num_cells("kermit"), 1u);
+
+  // The new statements are used from then on.
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1001, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_cluster.requests("10.0.0.2"), 3);
+}
+
+// If the owning node is down, another node coordinates the request.  If no
+// nodes are up the request fails with a connection error.
+TEST_F(CqlBackendTest, NodeFailure)
+{
+  CallFragment fragment = make_fragment("1", CallFragment::BEGIN);
+
+  _cluster.set_up("10.0.0.2", false);
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::CONNECTION_ERROR);
+
+  // The failed connection has been noticed, so the next request goes to the
+  // other node.
+  EXPECT_EQ(_store.write_call_fragment_sync("kermit", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::OK);
+  EXPECT_EQ(_cluster.requests("10.0.0.1"), 1);
+
+  _cluster.set_up("10.0.0.1", false);
+  _store.write_call_fragment_sync("a", fragment, 1000, 3600, FAKE_TRAIL);
+  EXPECT_EQ(_store.write_call_fragment_sync("a", fragment, 1000, 3600, FAKE_TRAIL),
+            CassandraStore::CONNECTION_ERROR);
+}
+
+// The connection limits the requests in flight to the number of streams.
+TEST(CqlConnectionTest, StreamLimit)
+{
+  FakeCqlCluster cluster;
+  cluster.add_node("10.0.0.1", std::vector<int64_t>(1, 0));
+  CqlConnection connection(new FakeCqlTransport(&cluster, "10.0.0.1"), 2);
+  ASSERT_TRUE(connection.start());
+
+  Cql::Writer prepare;
+  prepare.long_string("SELECT column1 FROM memento.call_lists");
+
+  uint8_t opcode;
+  std::string body;
+  int stream1 = connection.send_request(Cql::OP_PREPARE, prepare);
+  int stream2 = connection.send_request(Cql::OP_PREPARE, prepare);
+  EXPECT_NE(stream1, stream2);
+  EXPECT_TRUE(connection.wait_response(stream2, 1000, opcode, body));
+  EXPECT_EQ(opcode, Cql::OP_RESULT);
+  EXPECT_TRUE(connection.wait_response(stream1, 1000, opcode, body));
+  EXPECT_EQ(connection.peak_in_flight(), 2u);
+
+  connection.stop();
+  EXPECT_FALSE(connection.is_connected());
+  EXPECT_EQ(connection.send_request(Cql::OP_PREPARE, prepare), -1);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file heavy_hitters_test.cpp Heavy hitters sketch unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "heavy_hitters.h"
+
+// If there are no more keys than counters, the counts are exact.
+TEST(HeavyHittersTest, ExactWhenUnderCapacity)
+{
+  HeavyHitters sketch(10);
+
+  sketch.add("kermit", 5);
+  sketch.add("gonzo");
+  sketch.add("gonzo");
+  sketch.add("animal", 3);
+
+  std::vector<HeavyHitters::Item> items;
+  sketch.top(2, items);
+
+  ASSERT_EQ(items.size(), 2u);
+  EXPECT_EQ(items[0].key, "kermit");
+  EXPECT_EQ(items[0].count, 5u);
+  EXPECT_EQ(items[0].error, 0u);
+  EXPECT_EQ(items[1].key, "animal");
+  EXPECT_EQ(items[1].count, 3u);
+
+  sketch.clear();
+  sketch.top(2, items);
+  EXPECT_TRUE(items.empty());
+}
+
+// A key with a large share of a stream of many distinct keys is found, and its
+// count is within the reported error.
+TEST(HeavyHittersTest, FindsHeavyKeyInLongTail)
+{
+  HeavyHitters sketch(20);
+  uint64_t kermit_count = 0;
+
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    if (ii % 10 == 0)
+    {
+      sketch.add("kermit");
+      kermit_count++;
+    }
+    else
+    {
+      sketch.add("impu" + std::to_string(ii));
+    }
+  }
+
+  std::vector<HeavyHitters::Item> items;
+  sketch.top(1, items);
+
+  ASSERT_EQ(items.size(), 1u);
+  EXPECT_EQ(items[0].key, "kermit");
+  EXPECT_GE(items[0].count, kermit_count);
+  EXPECT_LE(items[0].count - items[0].error, kermit_count);
+}
+
+TEST(HeavyHittersTest, TrackerRanksByOpsAndBytes)
+{
+  HotImpuTracker tracker(10, 5, NULL);
+
+  tracker.record("kermit", 10);
+  tracker.record("kermit", 10);
+  tracker.record("gonzo", 1000);
+
+  std::vector<HeavyHitters::Item> impus;
+  tracker.top_by_ops(1, impus);
+  ASSERT_EQ(impus.size(), 1u);
+  EXPECT_EQ(impus[0].key, "kermit");
+  EXPECT_EQ(impus[0].count, 2u);
+
+  tracker.top_by_bytes(1, impus);
+  ASSERT_EQ(impus.size(), 1u);
+  EXPECT_EQ(impus[0].key, "gonzo");
+  EXPECT_EQ(impus[0].count, 1000u);
+}
@@ -0,0 +1,166 @@
+/**
+ * @file mementosaslogger_test.cpp Memento SAS logger unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "mockhttpstack.h"
+#include "mock_sas.h"
+
+#include "mementosaslogger.h"
+#include "mementosasevent.h"
+#include "fnv_hash.h"
+
+const SAS::TrailId FAKE_TRAIL = 0x123456;
+
+class MementoSasLoggerTest : public ::testing::Test
+{
+public:
+  MementoSasLoggerTest()
+  {
+    mock_sas_collect_messages(true);
+  }
+
+  virtual ~MementoSasLoggerTest()
+  {
+    mock_sas_collect_messages(false);
+  }
+
+  MockHttpStack _stack;
+  MementoSasLogger _logger;
+};
+
+// Small request bodies are logged in full, and large ones as a digest.
+TEST_F(MementoSasLoggerTest, RequestBodies)
+{
+  _logger.set_body_digests(true);
+
+  MockHttpStack::Request small(&_stack, "/org.projectclearwater.call-list/users/", "kermit", "", "<small/>");
+  _logger.sas_log_rx_http_req(FAKE_TRAIL, small);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_RX_BODY_DIGEST);
+
+  MockHttpStack::Request large(&_stack, "/org.projectclearwater.call-list/users/", "kermit", "", std::string(10000, 'x'));
+  _logger.sas_log_rx_http_req(FAKE_TRAIL, large);
+  EXPECT_SAS_EVENT(SASEvent::HTTP_RX_BODY_DIGEST);
+}
+
+// Response bodies are only logged as a digest by default.
+TEST_F(MementoSasLoggerTest, ResponseBodies)
+{
+  _logger.set_body_digests(true);
+  MockHttpStack::Request req(&_stack, "/org.projectclearwater.call-list/users/", "kermit");
+  req.add_content("<call-list/>");
+
+  _logger.sas_log_tx_http_rsp(FAKE_TRAIL, req, 200);
+  EXPECT_SAS_EVENT(SASEvent::HTTP_TX_BODY_DIGEST);
+  mock_sas_discard_messages();
+
+  _logger.set_max_body_bytes(MementoSasLogger::DEFAULT_MAX_RX_BODY_BYTES, 4096);
+  _logger.sas_log_tx_http_rsp(FAKE_TRAIL, req, 200);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_TX_BODY_DIGEST);
+}
+
+// Digests of large bodies aren't logged unless they are turned on.
+TEST_F(MementoSasLoggerTest, DigestsOff)
+{
+  MockHttpStack::Request req(&_stack, "/org.projectclearwater.call-list/users/", "kermit", "", std::string(10000, 'x'));
+  req.add_content("<call-list/>");
+
+  _logger.sas_log_rx_http_req(FAKE_TRAIL, req);
+  _logger.sas_log_tx_http_rsp(FAKE_TRAIL, req, 200);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_RX_BODY_DIGEST);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_TX_BODY_DIGEST);
+}
+
+// Nothing is logged without a trail, or when the level is filtered out.
+TEST_F(MementoSasLoggerTest, Filtered)
+{
+  _logger.set_body_digests(true);
+  MockHttpStack::Request req(&_stack, "/org.projectclearwater.call-list/users/", "kermit", "", std::string(10000, 'x'));
+
+  _logger.sas_log_rx_http_req(0, req);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_RX_BODY_DIGEST);
+
+  _logger.set_min_level((SASEvent::HttpLogLevel)((int)SASEvent::HttpLogLevel::PROTOCOL + 1));
+  _logger.sas_log_rx_http_req(FAKE_TRAIL, req);
+  EXPECT_NO_SAS_EVENT(SASEvent::HTTP_RX_BODY_DIGEST);
+}
+
+TEST_F(MementoSasLoggerTest, BodyHash)
+{
+  std::string body(1001, 'x');
+  uint64_t hash = MementoSasLogger::body_hash((const unsigned char*)body.data(), body.length());
+
+  // The hash covers every byte, including the tail that isn't a whole word.
+  body[1000] = 'y';
+  EXPECT_NE(MementoSasLogger::body_hash((const unsigned char*)body.data(), body.length()), hash);
+  body[1000] = 'x';
+  body[0] = 'y';
+  EXPECT_NE(MementoSasLogger::body_hash((const unsigned char*)body.data(), body.length()), hash);
+  body[0] = 'x';
+  EXPECT_EQ(MementoSasLogger::body_hash((const unsigned char*)body.data(), body.length()), hash);
+
+  // The hash doesn't depend on how the body is split into chunks.
+  size_t splits[] = {1, 7, 31, 32, 33, 500};
+
+  for (size_t ii = 0; ii < sizeof(splits) / sizeof(splits[0]); ++ii)
+  {
+    FnvHash::WideHash hasher;
+    hasher.update(body.data(), splits[ii]);
+    hasher.update(body.data() + splits[ii], 1);
+    hasher.update(body.data() + splits[ii] + 1, body.length() - splits[ii] - 1);
+    EXPECT_EQ(hasher.value(), hash);
+  }
+}
+
+// Return the mean time taken (in ns) to log a request and response.
+static double time_logging(HttpStack::SasLogger* logger,
+                           MockHttpStack::Request& req,
+                           int iterations)
+{
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    logger->sas_log_rx_http_req(FAKE_TRAIL, req);
+    logger->sas_log_tx_http_rsp(FAKE_TRAIL, req, 200);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed_ns = ((end.tv_sec - start.tv_sec) * 1e9) + (end.tv_nsec - start.tv_nsec);
+  return elapsed_ns / iterations;
+}
+
+// Benchmark the cost of logging a request and response with bodies from 1KB
+// to 1MB, against the default logger that copies the whole of both bodies.
+TEST_F(MementoSasLoggerTest, Benchmark)
+{
+  mock_sas_collect_messages(false);
+  HttpStack::DefaultSasLogger default_logger;
+  _logger.set_body_digests(true);
+
+  for (size_t body_size = 1024; body_size <= 1024 * 1024; body_size *= 4)
+  {
+    MockHttpStack::Request req(&_stack, "/org.projectclearwater.call-list/users/", "kermit", "", std::string(body_size, 'x'));
+    req.add_content(std::string(body_size, 'y'));
+    int iterations = std::max(10, (int)((64 * 1024 * 1024) / body_size));
+
+    double default_ns = time_logging(&default_logger, req, iterations);
+    double bounded_ns = time_logging(&_logger, req, iterations);
+
+    RecordProperty("default_ns_" + std::to_string(body_size), (int)default_ns);
+    RecordProperty("bounded_ns_" + std::to_string(body_size), (int)bounded_ns);
+  }
+}
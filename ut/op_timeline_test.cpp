@@ -0,0 +1,152 @@
+/**
+ * @file op_timeline_test.cpp Operation timeline unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+
+#include "gtest/gtest.h"
+
+#include "op_timeline.h"
+
+// Build a timeline that starts at a time and takes a given duration.
+static OpTimeline make_timeline(const char* name,
+                                uint64_t start_ns,
+                                uint64_t duration_ns)
+{
+  OpTimeline timeline;
+  timeline.name = name;
+  timeline.trail = start_ns;
+  timeline.times_ns[OpTimeline::DEQUEUE] = start_ns;
+  timeline.times_ns[OpTimeline::SEND] = start_ns + (duration_ns / 4);
+  timeline.times_ns[OpTimeline::RECEIVE] = start_ns + (duration_ns / 2);
+  timeline.times_ns[OpTimeline::HANDOFF] = start_ns + duration_ns;
+  return timeline;
+}
+
+TEST(OpTimelineTest, Durations)
+{
+  OpTimeline timeline;
+  EXPECT_EQ(timeline.start_ns(), 0u);
+  EXPECT_EQ(timeline.duration_ns(), 0u);
+
+  timeline.mark(OpTimeline::DEQUEUE);
+  timeline.mark_first(OpTimeline::SEND);
+  uint64_t send_ns = timeline.times_ns[OpTimeline::SEND];
+  timeline.mark_first(OpTimeline::SEND);
+  timeline.mark(OpTimeline::HANDOFF);
+
+  EXPECT_EQ(timeline.times_ns[OpTimeline::SEND], send_ns);
+  EXPECT_EQ(timeline.start_ns(), timeline.times_ns[OpTimeline::DEQUEUE]);
+  EXPECT_EQ(timeline.duration_ns(),
+            timeline.times_ns[OpTimeline::HANDOFF] - timeline.times_ns[OpTimeline::DEQUEUE]);
+  EXPECT_STREQ(OpTimeline::event_name(OpTimeline::CONNECTION_CHECKOUT), "connection_checkout");
+}
+
+// The recorder returns the slowest operations, slowest first, and forgets
+// operations once the ring wraps.
+TEST(OpTimelineTest, Slowest)
+{
+  OpTimelineRecorder recorder(4);
+
+  recorder.record(make_timeline("very_slow", 1000, 1000000));
+
+  for (uint64_t ii = 1; ii <= 4; ++ii)
+  {
+    recorder.record(make_timeline("op", ii * 1000, ii * 100));
+  }
+
+  std::vector<OpTimeline> timelines;
+  recorder.slowest(2, timelines);
+  ASSERT_EQ(timelines.size(), 2u);
+  EXPECT_EQ(timelines[0].duration_ns(), 400u);
+  EXPECT_EQ(timelines[1].duration_ns(), 300u);
+
+  recorder.slowest(10, timelines);
+  EXPECT_EQ(timelines.size(), 4u);
+}
+
+TEST(OpTimelineTest, ChromeTrace)
+{
+  OpTimelineRecorder recorder(4);
+
+  std::string json;
+  recorder.dump_slowest(10, json);
+  EXPECT_EQ(json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}");
+
+  OpTimeline timeline = make_timeline("GetCallFragments", 2000, 4000);
+  timeline.times_ns[OpTimeline::ENQUEUE] = 1000;
+  recorder.record(timeline);
+  recorder.dump_slowest(10, json);
+
+  EXPECT_EQ(json,
+            "{\"displayTimeUnit\":\"ns\",\"traceEvents\":["
+            "{\"name\":\"GetCallFragments\",\"cat\":\"call_list\",\"ph\":\"X\",\"ts\":1.000,\"dur\":5.000,\"pid\":1,\"tid\":0,\"args\":{\"trail\":2000}},"
+            "{\"name\":\"queued\",\"cat\":\"call_list\",\"ph\":\"X\",\"ts\":1.000,\"dur\":1.000,\"pid\":1,\"tid\":0,\"args\":{\"trail\":2000}},"
+            "{\"name\":\"cassandra\",\"cat\":\"call_list\",\"ph\":\"X\",\"ts\":3.000,\"dur\":1.000,\"pid\":1,\"tid\":0,\"args\":{\"trail\":2000}},"
+            "{\"name\":\"hand-off\",\"cat\":\"call_list\",\"ph\":\"X\",\"ts\":4.000,\"dur\":2.000,\"pid\":1,\"tid\":0,\"args\":{\"trail\":2000}}"
+            "]}");
+}
+
+struct RecorderThread
+{
+  OpTimelineRecorder* recorder;
+  uint64_t id;
+  pthread_t thread;
+};
+
+static void* record_timelines(void* arg)
+{
+  RecorderThread* thread = (RecorderThread*)arg;
+
+  for (uint64_t ii = 1; ii <= 10000; ++ii)
+  {
+    thread->recorder->record(make_timeline("op", thread->id * 1000000000, ii));
+  }
+
+  return NULL;
+}
+
+// Many threads can record at once while the slowest are read, and each
+// thread keeps its own ring.
+TEST(OpTimelineTest, Concurrent)
+{
+  const int NUM_THREADS = 4;
+  OpTimelineRecorder recorder(64);
+  RecorderThread threads[NUM_THREADS];
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads[ii].recorder = &recorder;
+    threads[ii].id = ii + 1;
+    pthread_create(&threads[ii].thread, NULL, record_timelines, &threads[ii]);
+  }
+
+  std::vector<OpTimeline> timelines;
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    recorder.slowest(10, timelines);
+
+    // Every timeline read must be internally consistent.
+    for (size_t jj = 0; jj < timelines.size(); ++jj)
+    {
+      EXPECT_EQ(timelines[jj].start_ns(), timelines[jj].trail);
+    }
+  }
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+  }
+
+  recorder.slowest(1000, timelines);
+  EXPECT_EQ(timelines.size(), (size_t)(NUM_THREADS * 64));
+  EXPECT_EQ(timelines[0].duration_ns(), 10000u);
+}
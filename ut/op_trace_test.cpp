@@ -0,0 +1,180 @@
+/**
+ * @file op_trace_test.cpp Operation trace unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "op_trace.h"
+#include "memory_backend.h"
+#include "call_list_store.h"
+
+using namespace CallListStore;
+
+class OpTraceTest : public ::testing::Test
+{
+public:
+  OpTraceTest() :
+    _path("/tmp/op_trace_test_" + std::to_string(getpid()))
+  {}
+
+  virtual ~OpTraceTest()
+  {
+    unlink(_path.c_str());
+  }
+
+  static OpTraceRecord make_record(OpTraceRecord::Type type,
+                                   uint64_t start_us,
+                                   uint64_t num_bytes)
+  {
+    OpTraceRecord record;
+    record.type = type;
+    record.success = (type != OpTraceRecord::TRIM);
+    record.impu_hash = OpTraceRecord::hash_impu("sip:kermit@example.com");
+    record.start_us = start_us;
+    record.latency_us = 250;
+    record.num_fragments = 3;
+    record.num_bytes = num_bytes;
+    return record;
+  }
+
+  std::string _path;
+};
+
+// Records are read back as they were written, including start times that go
+// backwards.
+TEST_F(OpTraceTest, RoundTrip)
+{
+  std::vector<OpTraceRecord> records;
+  records.push_back(make_record(OpTraceRecord::WRITE, 1000, 1500));
+  records.push_back(make_record(OpTraceRecord::READ, 900, 0));
+  records.push_back(make_record(OpTraceRecord::TRIM, 5000000000ULL, 100000));
+
+  OpTraceWriter writer;
+  ASSERT_TRUE(writer.open(_path, 3));
+
+  for (size_t ii = 0; ii < records.size(); ++ii)
+  {
+    writer.write(records[ii]);
+  }
+
+  // The trace is full, so this is dropped.
+  writer.write(records[0]);
+  EXPECT_EQ(writer.num_records(), 3u);
+  EXPECT_EQ(writer.num_dropped(), 1u);
+  EXPECT_TRUE(writer.close());
+
+  OpTraceReader reader;
+  ASSERT_TRUE(reader.open(_path));
+  OpTraceRecord record;
+
+  for (size_t ii = 0; ii < records.size(); ++ii)
+  {
+    ASSERT_TRUE(reader.read(record)) << "Record " << ii;
+    EXPECT_EQ(record.type, records[ii].type);
+    EXPECT_EQ(record.success, records[ii].success);
+    EXPECT_EQ(record.impu_hash, records[ii].impu_hash);
+    EXPECT_EQ(record.start_us, records[ii].start_us);
+    EXPECT_EQ(record.latency_us, records[ii].latency_us);
+    EXPECT_EQ(record.num_fragments, records[ii].num_fragments);
+    EXPECT_EQ(record.num_bytes, records[ii].num_bytes);
+  }
+
+  EXPECT_FALSE(reader.read(record));
+  EXPECT_FALSE(reader.error());
+}
+
+TEST_F(OpTraceTest, BadFiles)
+{
+  OpTraceReader reader;
+  EXPECT_FALSE(reader.open("/tmp/no_such_op_trace"));
+
+  FILE* f = fopen(_path.c_str(), "wb");
+  fputs("CLARxxxx", f);
+  fclose(f);
+  EXPECT_FALSE(reader.open(_path));
+
+  // A trace that ends part way through a record is corrupt.
+  OpTraceWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  writer.write(make_record(OpTraceRecord::WRITE, 1000, 1500));
+  writer.close();
+  ASSERT_EQ(truncate(_path.c_str(), 12), 0);
+
+  OpTraceRecord record;
+  ASSERT_TRUE(reader.open(_path));
+  EXPECT_FALSE(reader.read(record));
+  EXPECT_TRUE(reader.error());
+}
+
+// The store traces the shape of each operation.
+TEST_F(OpTraceTest, StoreCapture)
+{
+  Store store;
+  store.configure_backend(new MemoryBackend());
+
+  OpTraceWriter writer;
+  ASSERT_TRUE(writer.open(_path));
+  store.configure_op_trace(&writer);
+
+  CallFragment fragment;
+  fragment.timestamp = "20140101130100";
+  fragment.id = "0000000000000001";
+  fragment.type = CallFragment::BEGIN;
+  fragment.contents = "<begin-record>";
+  std::vector<CallFragment> fragments;
+
+  EXPECT_EQ(store.write_call_fragment_sync("kermit", fragment, 1000, 3600, 0),
+            CassandraStore::OK);
+  EXPECT_EQ(store.get_call_fragments_sync("kermit", fragments, 0),
+            CassandraStore::OK);
+  EXPECT_EQ(store.get_call_fragments_sync("gonzo", fragments, 0),
+            CassandraStore::NOT_FOUND);
+  EXPECT_EQ(store.delete_old_call_fragments_sync("kermit", fragments, 2000, 0),
+            CassandraStore::OK);
+
+  // Operations after tracing stops aren't traced.
+  store.configure_op_trace(NULL);
+  EXPECT_EQ(store.get_call_fragments_sync("kermit", fragments, 0),
+            CassandraStore::NOT_FOUND);
+  EXPECT_TRUE(writer.close());
+
+  OpTraceReader reader;
+  ASSERT_TRUE(reader.open(_path));
+  std::vector<OpTraceRecord> records;
+  OpTraceRecord record;
+
+  while (reader.read(record))
+  {
+    records.push_back(record);
+  }
+
+  ASSERT_EQ(records.size(), 4u);
+  EXPECT_EQ(records[0].type, OpTraceRecord::WRITE);
+  EXPECT_TRUE(records[0].success);
+  EXPECT_EQ(records[0].impu_hash, OpTraceRecord::hash_impu("kermit"));
+  EXPECT_EQ(records[0].num_fragments, 1u);
+  EXPECT_EQ(records[0].num_bytes, 44u);
+
+  EXPECT_EQ(records[1].type, OpTraceRecord::READ);
+  EXPECT_EQ(records[1].num_fragments, 1u);
+  EXPECT_EQ(records[1].num_bytes, 51u);
+  EXPECT_GE(records[1].start_us, records[0].start_us);
+
+  EXPECT_EQ(records[2].type, OpTraceRecord::READ);
+  EXPECT_FALSE(records[2].success);
+  EXPECT_EQ(records[2].impu_hash, OpTraceRecord::hash_impu("gonzo"));
+
+  EXPECT_EQ(records[3].type, OpTraceRecord::TRIM);
+  EXPECT_EQ(records[3].num_fragments, 1u);
+  EXPECT_EQ(records[3].num_bytes, 42u);
+}
@@ -0,0 +1,199 @@
+/**
+ * @file read_memory_budget_test.cpp Read memory budget unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "mock_sas.h"
+
+#include "read_memory_budget.h"
+#include "call_list_store.h"
+#include "memory_backend.h"
+#include "mementosasevent.h"
+
+using namespace CallListStore;
+
+static ReadMemoryBudget::Config make_config(uint64_t max_bytes,
+                                            uint64_t large_read_bytes,
+                                            uint64_t max_wait_ms,
+                                            uint64_t reserved_bytes = 0)
+{
+  ReadMemoryBudget::Config config;
+  config.max_bytes = max_bytes;
+  config.large_read_bytes = large_read_bytes;
+  config.max_wait_ms = max_wait_ms;
+  config.reserved_bytes = reserved_bytes;
+  return config;
+}
+
+static uint64_t monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Releases memory from a budget after a short delay.
+static void* delayed_release(void* budget)
+{
+  usleep(10000);
+  ((ReadMemoryBudget*)budget)->release(600);
+  return NULL;
+}
+
+// Small results are always charged, but large ones can't take the memory
+// held over the budget.
+TEST(ReadMemoryBudgetTest, Charge)
+{
+  ReadMemoryBudget budget(make_config(1000, 500, 0), NULL);
+
+  EXPECT_TRUE(budget.charge(600));
+  EXPECT_FALSE(budget.charge(500));
+  EXPECT_TRUE(budget.charge(400));
+  EXPECT_TRUE(budget.charge(100));
+  EXPECT_EQ(budget.bytes_held(), 1100u);
+  EXPECT_EQ(budget.num_rejected(), 1u);
+
+  budget.release(1100);
+  EXPECT_EQ(budget.bytes_held(), 0u);
+  EXPECT_TRUE(budget.charge(1000));
+}
+
+// Reads wait for memory to be released while the budget is used up, and are
+// rejected if none is.
+TEST(ReadMemoryBudgetTest, Admit)
+{
+  ReadMemoryBudget budget(make_config(1000, 500, 20), NULL);
+  uint64_t reserved_bytes;
+  EXPECT_TRUE(budget.admit(reserved_bytes));
+
+  budget.charge(1000);
+  uint64_t start_ms = monotonic_ms();
+  EXPECT_FALSE(budget.admit(reserved_bytes));
+  EXPECT_GE(monotonic_ms() - start_ms, 20u);
+  EXPECT_EQ(budget.num_rejected(), 1u);
+
+  // A release while a read is waiting lets it start.
+  ReadMemoryBudget long_wait_budget(make_config(1000, 500, 5000), NULL);
+  long_wait_budget.charge(1000);
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, NULL, delayed_release, &long_wait_budget), 0);
+  EXPECT_TRUE(long_wait_budget.admit(reserved_bytes));
+  pthread_join(thread, NULL);
+}
+
+// Reads reserve memory before they start, so that reads can't all start
+// while the budget is nearly used up, and the reservation is exchanged for
+// the actual size.
+TEST(ReadMemoryBudgetTest, Reserve)
+{
+  ReadMemoryBudget budget(make_config(1000, 500, 0, 300), NULL);
+
+  uint64_t reserved_bytes[4];
+  EXPECT_TRUE(budget.admit(reserved_bytes[0]));
+  EXPECT_EQ(reserved_bytes[0], 300u);
+  EXPECT_TRUE(budget.admit(reserved_bytes[1]));
+  EXPECT_TRUE(budget.admit(reserved_bytes[2]));
+  EXPECT_EQ(budget.bytes_held(), 900u);
+
+  // There's no room for another reservation.
+  EXPECT_FALSE(budget.admit(reserved_bytes[3]));
+  EXPECT_EQ(reserved_bytes[3], 0u);
+  EXPECT_EQ(budget.bytes_held(), 900u);
+
+  // Charging a read's results releases its reservation.
+  EXPECT_TRUE(budget.charge(50, reserved_bytes[0]));
+  EXPECT_EQ(budget.bytes_held(), 650u);
+  EXPECT_TRUE(budget.admit(reserved_bytes[3]));
+
+  // So does rejecting it.
+  EXPECT_FALSE(budget.charge(600, reserved_bytes[1]));
+  EXPECT_EQ(budget.bytes_held(), 650u);
+
+  // A reservation larger than the budget is allowed when nothing is held.
+  ReadMemoryBudget small_budget(make_config(100, 50, 0, 300), NULL);
+  EXPECT_TRUE(small_budget.admit(reserved_bytes[0]));
+  EXPECT_FALSE(small_budget.admit(reserved_bytes[1]));
+}
+
+class ReadMemoryBudgetStoreTest : public ::testing::Test
+{
+public:
+  ReadMemoryBudgetStoreTest()
+  {
+    _store.configure_backend(new MemoryBackend());
+    _store.configure_read_memory_budget(make_config(1000, 500, 0), NULL);
+  }
+
+  void write_fragment(const std::string& impu, size_t contents_length)
+  {
+    CallFragment fragment;
+    fragment.timestamp = "20140101130100";
+    fragment.id = "0000000000000001";
+    fragment.type = CallFragment::BEGIN;
+    fragment.contents = std::string(contents_length, 'x');
+    EXPECT_EQ(_store.write_call_fragment_sync(impu, fragment, 1000, 3600, 0),
+              CassandraStore::OK);
+  }
+
+  Store _store;
+};
+
+// Read results are charged to the budget until they are consumed.
+TEST_F(ReadMemoryBudgetStoreTest, HeldUntilConsumed)
+{
+  write_fragment("kermit", 100);
+
+  GetCallFragments* op = _store.new_get_call_fragments_op("kermit");
+  EXPECT_TRUE(_store.do_sync(op, 0));
+  std::vector<CallFragment> fragments;
+  op->get_result(fragments);
+  ASSERT_EQ(fragments.size(), 1u);
+
+  // The row is the column name ("<timestamp>_<id>_begin") and the contents.
+  EXPECT_EQ(_store.get_read_memory_budget()->bytes_held(), 137u);
+  delete op;
+  EXPECT_EQ(_store.get_read_memory_budget()->bytes_held(), 0u);
+
+  // Results moved into an arena belong to the caller.
+  op = _store.new_get_call_fragments_op("kermit", true);
+  EXPECT_TRUE(_store.do_sync(op, 0));
+  EXPECT_EQ(_store.get_read_memory_budget()->bytes_held(), 137u);
+  CallFragmentArena arena;
+  op->get_result(arena);
+  EXPECT_EQ(_store.get_read_memory_budget()->bytes_held(), 0u);
+  delete op;
+}
+
+// Large reads that would exceed the budget are rejected.
+TEST_F(ReadMemoryBudgetStoreTest, LargeReadRejected)
+{
+  write_fragment("kermit", 100);
+  write_fragment("gonzo", 600);
+
+  mock_sas_collect_messages(true);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(_store.get_call_fragments_sync("kermit", fragments, 0),
+            CassandraStore::OK);
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_OVERLOAD);
+
+  EXPECT_EQ(_store.get_call_fragments_sync("gonzo", fragments, 0),
+            CassandraStore::RESOURCE_ERROR);
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_OVERLOAD);
+  EXPECT_EQ(_store.get_read_memory_budget()->num_rejected(), 1u);
+  EXPECT_EQ(_store.get_read_memory_budget()->bytes_held(), 0u);
+
+  mock_sas_collect_messages(false);
+}
@@ -0,0 +1,107 @@
+/**
+ * @file recent_writes_filter_test.cpp Recent writes filter unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <stdio.h>
+
+#include "gtest/gtest.h"
+
+#include "recent_writes_filter.h"
+
+static RecentWritesFilter::Key make_key(int ii)
+{
+  RecentWritesFilter::Key key;
+  key.add("sip:" + std::to_string(ii) + "@example.com").add("call_20140101130100_1_begin");
+  return key;
+}
+
+TEST(RecentWritesFilterTest, RemembersForWindow)
+{
+  RecentWritesFilter filter(1000, 100, 0.01);
+
+  filter.add(make_key(1), 5000);
+  EXPECT_TRUE(filter.contains(make_key(1), 5000));
+  EXPECT_FALSE(filter.contains(make_key(2), 5000));
+
+  // The key is remembered for at least one window...
+  EXPECT_TRUE(filter.contains(make_key(1), 5999));
+  EXPECT_TRUE(filter.contains(make_key(1), 6500));
+
+  // ... and at most two.
+  EXPECT_FALSE(filter.contains(make_key(1), 7000));
+}
+
+TEST(RecentWritesFilterTest, ForgetsAfterLongGap)
+{
+  RecentWritesFilter filter(1000, 100, 0.01);
+
+  filter.add(make_key(1), 5000);
+  EXPECT_FALSE(filter.contains(make_key(1), 60000));
+}
+
+TEST(RecentWritesFilterTest, KeyPartsAreDelimited)
+{
+  RecentWritesFilter filter(1000, 100, 0.01);
+
+  RecentWritesFilter::Key key1;
+  key1.add("ab").add("c");
+  RecentWritesFilter::Key key2;
+  key2.add("a").add("bc");
+
+  filter.add(key1, 0);
+  EXPECT_TRUE(filter.contains(key1, 0));
+  EXPECT_FALSE(filter.contains(key2, 0));
+}
+
+// Measure the false positive rate when both windows are full, and check it is
+// close to the configured rate.
+TEST(RecentWritesFilterTest, FalsePositiveRate)
+{
+  const size_t EXPECTED_ENTRIES = 10000;
+  const double TARGET_RATE = 0.01;
+  RecentWritesFilter filter(1000, EXPECTED_ENTRIES, TARGET_RATE);
+
+  // Fill the previous window, then the current one.
+  for (size_t ii = 0; ii < EXPECTED_ENTRIES; ++ii)
+  {
+    filter.add(make_key(ii), 0);
+  }
+
+  for (size_t ii = EXPECTED_ENTRIES; ii < 2 * EXPECTED_ENTRIES; ++ii)
+  {
+    filter.add(make_key(ii), 1000);
+  }
+
+  // Nothing that was added is forgotten.
+  for (size_t ii = 0; ii < 2 * EXPECTED_ENTRIES; ++ii)
+  {
+    ASSERT_TRUE(filter.contains(make_key(ii), 1000));
+  }
+
+  const size_t NUM_PROBES = 100000;
+  size_t false_positives = 0;
+
+  for (size_t ii = 0; ii < NUM_PROBES; ++ii)
+  {
+    if (filter.contains(make_key(1000000 + ii), 1000))
+    {
+      false_positives++;
+    }
+  }
+
+  double rate = (double)false_positives / NUM_PROBES;
+  char value[32];
+  snprintf(value, sizeof(value), "%f", rate);
+  RecordProperty("false_positive_rate", value);
+  RecordProperty("num_bits", filter.num_bits());
+  RecordProperty("num_hashes", filter.num_hashes());
+
+  EXPECT_LT(rate, TARGET_RATE * 1.5);
+}
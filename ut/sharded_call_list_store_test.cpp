@@ -0,0 +1,198 @@
+/**
+ * @file sharded_call_list_store_test.cpp Sharded call list store unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "sharded_call_list_store.h"
+#include "call_list_store_fixture.h"
+
+const SAS::TrailId FAKE_TRAIL = 0x123456;
+const size_t NUM_SHARDS = 3;
+
+// Matches a batch_mutate that changes a particular row.
+MATCHER_P(MutatesRow, key, "")
+{
+  return (arg.find(key) != arg.end());
+}
+
+class ShardedStoreTest : public ::testing::Test
+{
+public:
+  ShardedStoreTest()
+  {
+    _iter = new FakeBaseAddrIterator(CallListStoreFixture::create_target("10.0.0.1"));
+
+    EXPECT_CALL(_resolver, resolve_iter(_,_,_)).WillRepeatedly(Return(_iter));
+    EXPECT_CALL(_resolver, success(_)).Times(testing::AnyNumber());
+
+    // Each shard has its own client, as if it were a separate cluster.
+    for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      TestCallListStore* store = new TestCallListStore();
+      MockCassandraConnectionPool* pool = new MockCassandraConnectionPool();
+      store->set_conn_pool(pool);
+      store->configure_connection("localhost", 1234, NULL, &_resolver);
+
+      EXPECT_CALL(*pool, get_client()).Times(testing::AnyNumber()).WillRepeatedly(Return(&_clients[ii]));
+      EXPECT_CALL(_clients[ii], set_keyspace(_)).Times(testing::AnyNumber());
+      EXPECT_CALL(_clients[ii], connect()).Times(testing::AnyNumber());
+      EXPECT_CALL(_clients[ii], is_connected()).Times(testing::AnyNumber()).WillRepeatedly(Return(false));
+
+      _store.add_shard("shard" + std::to_string(ii), store);
+    }
+
+    EXPECT_EQ(_store.start(), CassandraStore::OK);
+  }
+
+  virtual ~ShardedStoreTest()
+  {
+    _store.stop();
+    _store.wait_stopped();
+    delete _iter; _iter = NULL;
+  }
+
+  // Find an IMPU that belongs to a particular shard.
+  std::string impu_on_shard(size_t shard)
+  {
+    std::string name = "shard" + std::to_string(shard);
+
+    for (int ii = 0; ; ++ii)
+    {
+      std::string impu = "sip:kermit" + std::to_string(ii) + "@example.com";
+
+      if (_store.get_shard_name(impu) == name)
+      {
+        return impu;
+      }
+    }
+  }
+
+  MockCassandraClient _clients[NUM_SHARDS];
+  MockCassandraResolver _resolver;
+  FakeBaseAddrIterator* _iter;
+  CallListStore::ShardedStore _store;
+};
+
+// Each operation goes to the IMPU's shard, and no other.
+TEST_F(ShardedStoreTest, Routing)
+{
+  CallListStore::CallFragment frag;
+  frag.timestamp = "20140101130101";
+  frag.id = "0123456789ABCDEF";
+  frag.type = CallListStore::CallFragment::BEGIN;
+  frag.contents = "<xml>";
+  std::vector<CallListStore::CallFragment> fragments(1, frag);
+
+  std::map<std::string, std::string> columns;
+  columns["call_20140101130101_0123456789ABCDEF_begin"] = "<xml>";
+  slice_t slice;
+  make_slice(slice, columns);
+
+  for (size_t shard = 0; shard < NUM_SHARDS; ++shard)
+  {
+    std::string impu = impu_on_shard(shard);
+
+    for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      if (ii == shard)
+      {
+        EXPECT_CALL(_clients[ii], batch_mutate(MutatesRow(impu), _)).Times(2);
+        EXPECT_CALL(_clients[ii], get_slice(_, impu, _, _, _)).WillOnce(SetArgReferee<0>(slice));
+      }
+      else
+      {
+        EXPECT_CALL(_clients[ii], batch_mutate(MutatesRow(impu), _)).Times(0);
+        EXPECT_CALL(_clients[ii], get_slice(_, impu, _, _, _)).Times(0);
+      }
+    }
+
+    EXPECT_EQ(_store.write_call_fragment_sync(impu, frag, 1000, 3600, FAKE_TRAIL),
+              CassandraStore::OK);
+
+    std::vector<CallListStore::CallFragment> fetched_fragments;
+    EXPECT_EQ(_store.get_call_fragments_sync(impu, fetched_fragments, FAKE_TRAIL),
+              CassandraStore::OK);
+    EXPECT_EQ(fetched_fragments.size(), 1u);
+
+    EXPECT_EQ(_store.delete_old_call_fragments_sync(impu, fragments, 2000, FAKE_TRAIL),
+              CassandraStore::OK);
+  }
+}
+
+TEST_F(ShardedStoreTest, DuplicateShard)
+{
+  TestCallListStore* store = new TestCallListStore();
+  EXPECT_FALSE(_store.add_shard("shard0", store));
+  EXPECT_EQ(_store.num_shards(), NUM_SHARDS);
+  delete store;
+}
+
+TEST(ShardedStoreRingTest, NoShards)
+{
+  CallListStore::ShardedStore store;
+  std::vector<CallListStore::CallFragment> fragments;
+
+  EXPECT_EQ(store.get_store("kermit"), (CallListStore::Store*)NULL);
+  EXPECT_EQ(store.get_shard_name("kermit"), "");
+  EXPECT_EQ(store.get_call_fragments_sync("kermit", fragments, FAKE_TRAIL),
+            CassandraStore::CONNECTION_ERROR);
+}
+
+// IMPUs are spread evenly, and adding a shard only moves IMPUs to the new
+// shard, and only about its fair share of them.
+TEST(ShardedStoreRingTest, Rebalancing)
+{
+  const int NUM_IMPUS = 20000;
+  CallListStore::ShardedStore store;
+
+  for (int ii = 0; ii < 4; ++ii)
+  {
+    store.add_shard("shard" + std::to_string(ii), new CallListStore::Store());
+  }
+
+  std::map<std::string, int> counts;
+  std::vector<std::string> before;
+
+  for (int ii = 0; ii < NUM_IMPUS; ++ii)
+  {
+    std::string shard = store.get_shard_name("sip:" + std::to_string(ii) + "@example.com");
+    before.push_back(shard);
+    counts[shard]++;
+  }
+
+  for (std::map<std::string, int>::iterator it = counts.begin();
+       it != counts.end();
+       ++it)
+  {
+    EXPECT_GT(it->second, (NUM_IMPUS / 4) * 0.8) << it->first;
+    EXPECT_LT(it->second, (NUM_IMPUS / 4) * 1.2) << it->first;
+  }
+
+  store.add_shard("shard4", new CallListStore::Store());
+  int moved = 0;
+
+  for (int ii = 0; ii < NUM_IMPUS; ++ii)
+  {
+    std::string shard = store.get_shard_name("sip:" + std::to_string(ii) + "@example.com");
+
+    if (shard != before[ii])
+    {
+      EXPECT_EQ(shard, "shard4");
+      moved++;
+    }
+  }
+
+  EXPECT_GT(moved, (NUM_IMPUS / 5) * 0.8);
+  EXPECT_LT(moved, (NUM_IMPUS / 5) * 1.2);
+}
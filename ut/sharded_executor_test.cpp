@@ -0,0 +1,314 @@
+/**
+ * @file sharded_executor_test.cpp Sharded executor unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+
+#include "gtest/gtest.h"
+
+#include "sharded_executor.h"
+#include "call_list_store.h"
+#include "memory_backend.h"
+
+using namespace CallListStore;
+
+// Records the order tasks run in for each key, and whether any two tasks for
+// the same key ever ran at once.
+class Recorder
+{
+public:
+  Recorder() : _runs(), _in_progress(), _overlaps(0), _completed(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~Recorder()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  void begin(uint64_t key)
+  {
+    pthread_mutex_lock(&_lock);
+
+    if (_in_progress[key])
+    {
+      _overlaps++;
+    }
+
+    _in_progress[key] = true;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void end(uint64_t key, int seq)
+  {
+    pthread_mutex_lock(&_lock);
+    _in_progress[key] = false;
+    _runs[key].push_back(seq);
+    pthread_mutex_unlock(&_lock);
+    _completed++;
+  }
+
+  std::map<uint64_t, std::vector<int> > _runs;
+  std::map<uint64_t, bool> _in_progress;
+  int _overlaps;
+  std::atomic<int> _completed;
+  pthread_mutex_t _lock;
+};
+
+class RecordingTask : public ShardedExecutor::Task
+{
+public:
+  RecordingTask(Recorder* recorder, uint64_t key, int seq) :
+    _recorder(recorder), _key(key), _seq(seq)
+  {}
+
+  void run()
+  {
+    _recorder->begin(_key);
+    usleep(10);
+    _recorder->end(_key, _seq);
+  }
+
+private:
+  Recorder* _recorder;
+  uint64_t _key;
+  int _seq;
+};
+
+// Task that doesn't finish until it is released.
+class BlockingTask : public ShardedExecutor::Task
+{
+public:
+  BlockingTask(std::atomic<bool>* started, std::atomic<bool>* release) :
+    _started(started), _release(release)
+  {}
+
+  void run()
+  {
+    *_started = true;
+
+    while (!*_release)
+    {
+      usleep(100);
+    }
+  }
+
+private:
+  std::atomic<bool>* _started;
+  std::atomic<bool>* _release;
+};
+
+// Wait (for up to 5s) until a number of tasks have completed.
+static bool wait_for_completed(Recorder& recorder, int count)
+{
+  for (int ii = 0; (ii < 5000) && (recorder._completed < count); ++ii)
+  {
+    usleep(1000);
+  }
+
+  return (recorder._completed >= count);
+}
+
+// Find a number of keys that are handled by a shard.
+static std::vector<uint64_t> keys_for_shard(size_t shard,
+                                            size_t num_shards,
+                                            size_t count)
+{
+  std::vector<uint64_t> keys;
+
+  for (uint64_t key = 0; keys.size() < count; ++key)
+  {
+    if (ShardedExecutor::shard_for(key, num_shards) == shard)
+    {
+      keys.push_back(key);
+    }
+  }
+
+  return keys;
+}
+
+static ShardedExecutor::Config make_config(size_t num_shards)
+{
+  ShardedExecutor::Config config;
+  config.num_shards = num_shards;
+  config.pin_threads = false;
+  return config;
+}
+
+// Tasks for each key run one at a time and in order, even with stealing.
+TEST(ShardedExecutorTest, KeyOrdering)
+{
+  Recorder recorder;
+  ShardedExecutor executor(make_config(4), NULL);
+  executor.start();
+  EXPECT_EQ(executor.num_shards(), 4u);
+
+  for (int seq = 0; seq < 200; ++seq)
+  {
+    for (uint64_t key = 0; key < 8; ++key)
+    {
+      EXPECT_TRUE(executor.submit(key, new RecordingTask(&recorder, key, seq)));
+    }
+  }
+
+  // Stopping runs the tasks that are already queued.
+  executor.stop();
+  executor.wait_stopped();
+  EXPECT_EQ(recorder._completed, 1600);
+  EXPECT_EQ(recorder._overlaps, 0);
+
+  for (uint64_t key = 0; key < 8; ++key)
+  {
+    const std::vector<int>& runs = recorder._runs[key];
+    ASSERT_EQ(runs.size(), 200u);
+
+    for (int seq = 0; seq < 200; ++seq)
+    {
+      EXPECT_EQ(runs[seq], seq) << "Key " << key;
+    }
+  }
+}
+
+// An idle shard runs the tasks queued behind a slow task on another shard.
+TEST(ShardedExecutorTest, Stealing)
+{
+  Recorder recorder;
+  std::atomic<bool> started(false);
+  std::atomic<bool> release(false);
+  ShardedExecutor executor(make_config(2), NULL);
+  executor.start();
+
+  std::vector<uint64_t> keys = keys_for_shard(0, 2, 11);
+  EXPECT_TRUE(executor.submit(keys[0], new BlockingTask(&started, &release)));
+
+  while (!started)
+  {
+    usleep(100);
+  }
+
+  for (size_t ii = 1; ii < keys.size(); ++ii)
+  {
+    EXPECT_TRUE(executor.submit(keys[ii], new RecordingTask(&recorder, keys[ii], 0)));
+  }
+
+  // A task for the blocked key can't be stolen, as it would run out of
+  // order.
+  EXPECT_TRUE(executor.submit(keys[0], new RecordingTask(&recorder, keys[0], 1)));
+
+  EXPECT_TRUE(wait_for_completed(recorder, 10));
+  EXPECT_GE(executor.num_steals(), 10u);
+  EXPECT_EQ(executor.queue_length(0), 1u);
+  EXPECT_EQ(recorder._runs[keys[0]].size(), 0u);
+
+  release = true;
+  EXPECT_TRUE(wait_for_completed(recorder, 11));
+  executor.stop();
+  executor.wait_stopped();
+}
+
+TEST(ShardedExecutorTest, NotRunning)
+{
+  Recorder recorder;
+  ShardedExecutor executor(make_config(2), NULL);
+  RecordingTask task(&recorder, 1, 0);
+
+  EXPECT_FALSE(executor.submit(1, &task));
+  executor.start();
+  executor.stop();
+  executor.wait_stopped();
+  EXPECT_FALSE(executor.submit(1, &task));
+  EXPECT_EQ(recorder._completed, 0);
+}
+
+// Transaction that counts the operations that complete.
+class CountingTransaction : public CassandraStore::Transaction
+{
+public:
+  CountingTransaction(std::atomic<int>* successes) :
+    CassandraStore::Transaction(0),
+    _successes(successes)
+  {}
+
+  void on_success(CassandraStore::Operation* op) { (*_successes)++; }
+  void on_failure(CassandraStore::Operation* op) {}
+
+private:
+  std::atomic<int>* _successes;
+};
+
+// The store runs asynchronous operations on the sharded workers.
+TEST(ShardedExecutorTest, StoreAsync)
+{
+  Store store;
+  store.configure_backend(new MemoryBackend());
+  store.configure_sharded_workers(make_config(2), NULL);
+  ASSERT_EQ(store.start(), CassandraStore::OK);
+
+  std::atomic<int> successes(0);
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    CallFragment fragment;
+    fragment.timestamp = "201401011301" + std::to_string(10 + ii);
+    fragment.id = "id" + std::to_string(ii);
+    fragment.type = CallFragment::BEGIN;
+    fragment.contents = "<xml>";
+
+    CassandraStore::Operation* op =
+      store.new_write_call_fragment_op("kermit", fragment, 1000 + ii, 3600);
+    CassandraStore::Transaction* trx = new CountingTransaction(&successes);
+    store.do_async(op, trx);
+    EXPECT_TRUE(op == NULL);
+    EXPECT_TRUE(trx == NULL);
+  }
+
+  for (int ii = 0; (ii < 5000) && (successes < 10); ++ii)
+  {
+    usleep(1000);
+  }
+
+  EXPECT_EQ(successes, 10);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(store.get_call_fragments_sync("kermit", fragments, 0),
+            CassandraStore::OK);
+  EXPECT_EQ(fragments.size(), 10u);
+
+  store.stop();
+  store.wait_stopped();
+}
+
+// The sharded workers are created when the store starts, with one shard for
+// each of the store's worker threads unless configured otherwise.
+TEST(ShardedExecutorTest, StoreShardsFollowWorkers)
+{
+  Store store;
+  store.configure_backend(new MemoryBackend());
+  store.configure_workers(NULL, 3, 0);
+  store.configure_sharded_workers(make_config(0), NULL);
+  EXPECT_TRUE(store.get_sharded_executor() == NULL);
+
+  ASSERT_EQ(store.start(), CassandraStore::OK);
+  ASSERT_TRUE(store.get_sharded_executor() != NULL);
+  EXPECT_EQ(store.get_sharded_executor()->num_shards(), 3u);
+
+  store.stop();
+  store.wait_stopped();
+
+  // The store can be restarted.
+  ASSERT_EQ(store.start(), CassandraStore::OK);
+  EXPECT_EQ(store.get_sharded_executor()->num_shards(), 3u);
+  store.stop();
+  store.wait_stopped();
+}
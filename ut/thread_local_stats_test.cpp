@@ -0,0 +1,275 @@
+/**
+ * @file thread_local_stats_test.cpp Thread-local statistics unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits>
+
+#include "gtest/gtest.h"
+
+#include "thread_local_stats.h"
+
+// Expose the merged values of the statistics under test.
+class TestCounter : public ThreadLocalCounter
+{
+public:
+  TestCounter() : ThreadLocalCounter("test_counter", NULL, 1000000) {}
+  using ThreadLocalCounter::merge;
+};
+
+class TestAccumulator : public ThreadLocalAccumulator
+{
+public:
+  TestAccumulator() : ThreadLocalAccumulator("test_accumulator", NULL, 1000000) {}
+  using ThreadLocalAccumulator::merge;
+};
+
+class TestHistogram : public ThreadLocalHistogram
+{
+public:
+  TestHistogram() : ThreadLocalHistogram("test_histogram", NULL, 1000000) {}
+  using ThreadLocalHistogram::merge;
+};
+
+TEST(ThreadLocalStatsTest, Counter)
+{
+  TestCounter counter;
+  counter.increment();
+  counter.increment(4);
+
+  std::vector<std::string> values;
+  counter.merge(values);
+  ASSERT_EQ(values.size(), 1u);
+  EXPECT_EQ(values[0], "5");
+
+  // Each merge starts a new period, but the total is kept.
+  counter.increment();
+  values.clear();
+  counter.merge(values);
+  EXPECT_EQ(values[0], "1");
+  EXPECT_EQ(counter.total(), 6u);
+}
+
+TEST(ThreadLocalStatsTest, Accumulator)
+{
+  TestAccumulator accumulator;
+
+  std::vector<std::string> values;
+  accumulator.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"0", "0", "0", "0", "0"}));
+
+  accumulator.accumulate(10);
+  accumulator.accumulate(20);
+  accumulator.accumulate(30);
+
+  // Mean, variance, low and high water marks, and count.
+  values.clear();
+  accumulator.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"20", "66", "10", "30", "3"}));
+
+  accumulator.accumulate(5);
+  values.clear();
+  accumulator.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"5", "0", "5", "5", "1"}));
+}
+
+TEST(ThreadLocalStatsTest, HistogramBuckets)
+{
+  // Every sample falls in a bucket whose upper bound is at least the sample
+  // and at most 25% more.
+  for (uint64_t sample = 0; sample < 100000; sample += 1 + (sample / 64))
+  {
+    size_t index = ThreadLocalHistogram::bucket_index(sample);
+    EXPECT_GE(ThreadLocalHistogram::bucket_upper_bound(index), sample);
+    EXPECT_LE(ThreadLocalHistogram::bucket_upper_bound(index), sample + (sample / 4));
+
+    if (index > 0)
+    {
+      EXPECT_LT(ThreadLocalHistogram::bucket_upper_bound(index - 1), sample);
+    }
+  }
+
+  EXPECT_EQ(ThreadLocalHistogram::bucket_index(UINT64_MAX),
+            ThreadLocalHistogram::NUM_BUCKETS - 1);
+}
+
+TEST(ThreadLocalStatsTest, Histogram)
+{
+  TestHistogram histogram;
+
+  std::vector<std::string> values;
+  histogram.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"0", "0", "0", "0", "0", "0"}));
+
+  // 1000 small samples and a long tail.
+  for (int ii = 0; ii < 989; ++ii)
+  {
+    histogram.record(100);
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    histogram.record(10000);
+  }
+  histogram.record(1000000);
+
+  // 50th, 90th, 99th and 99.9th percentiles, maximum and count.
+  values.clear();
+  histogram.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"111", "111", "10239", "10239", "1000000", "1000"}));
+
+  // Percentiles are capped at the maximum.
+  histogram.record(100);
+  values.clear();
+  histogram.merge(values);
+  EXPECT_EQ(values, std::vector<std::string>({"100", "100", "100", "100", "100", "1"}));
+}
+
+// The same updates as the thread-local statistics make, but on a single set
+// of shared atomics, as a baseline for the benchmark.
+struct SharedCounter
+{
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> samples;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> sum_squares;
+  std::atomic<uint64_t> lwm;
+  std::atomic<uint64_t> hwm;
+};
+
+struct BenchmarkThread
+{
+  TestCounter* counter;
+  TestAccumulator* accumulator;
+  SharedCounter* shared;
+  uint64_t num_updates;
+  pthread_t thread;
+};
+
+static void* update_thread_local(void* arg)
+{
+  BenchmarkThread* thread = (BenchmarkThread*)arg;
+
+  for (uint64_t ii = 0; ii < thread->num_updates; ++ii)
+  {
+    thread->counter->increment();
+    thread->accumulator->accumulate(ii & 0xff);
+  }
+
+  return NULL;
+}
+
+static void* update_shared(void* arg)
+{
+  BenchmarkThread* thread = (BenchmarkThread*)arg;
+
+  for (uint64_t ii = 0; ii < thread->num_updates; ++ii)
+  {
+    SharedCounter* shared = thread->shared;
+    uint64_t sample = ii & 0xff;
+    shared->count.fetch_add(1, std::memory_order_relaxed);
+    shared->total.fetch_add(1, std::memory_order_relaxed);
+    shared->samples.fetch_add(1, std::memory_order_relaxed);
+    shared->sum.fetch_add(sample, std::memory_order_relaxed);
+    shared->sum_squares.fetch_add(sample * sample, std::memory_order_relaxed);
+
+    uint64_t lwm = shared->lwm.load(std::memory_order_relaxed);
+    while ((sample < lwm) &&
+           (!shared->lwm.compare_exchange_weak(lwm, sample, std::memory_order_relaxed)))
+    {
+    }
+
+    uint64_t hwm = shared->hwm.load(std::memory_order_relaxed);
+    while ((sample > hwm) &&
+           (!shared->hwm.compare_exchange_weak(hwm, sample, std::memory_order_relaxed)))
+    {
+    }
+  }
+
+  return NULL;
+}
+
+// Run a number of threads doing updates, and return the elapsed time divided
+// by the number of updates each thread made.  If the updates scale perfectly
+// (and there are enough cores) this is the same for any number of threads.
+static double run_threads(int num_threads,
+                          void* (*fn)(void*),
+                          TestCounter* counter,
+                          TestAccumulator* accumulator,
+                          SharedCounter* shared,
+                          uint64_t num_updates)
+{
+  std::vector<BenchmarkThread> threads(num_threads);
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads[ii].counter = counter;
+    threads[ii].accumulator = accumulator;
+    threads[ii].shared = shared;
+    threads[ii].num_updates = num_updates;
+    pthread_create(&threads[ii].thread, NULL, fn, &threads[ii]);
+  }
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pthread_join(threads[ii].thread, NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed_ns = ((end.tv_sec - start.tv_sec) * 1e9) + (end.tv_nsec - start.tv_nsec);
+  return elapsed_ns / num_updates;
+}
+
+// Benchmark updates from increasing numbers of threads.  The thread-local and
+// shared updates are the same atomic operations, on a per-thread slot or on
+// a single shared one.  Updating the thread-local statistics should cost
+// about the same however many threads there are (up to the number of cores),
+// whereas updates to a shared counter get slower as the threads contend for
+// its cache line.  The timings are recorded as test properties (see
+// --gtest_output), as they depend on the machine.
+TEST(ThreadLocalStatsTest, Benchmark)
+{
+  const uint64_t NUM_UPDATES = 200000;
+
+  for (int num_threads = 1; num_threads <= 16; num_threads *= 2)
+  {
+    TestCounter counter;
+    TestAccumulator accumulator;
+    SharedCounter shared = {};
+    shared.lwm = std::numeric_limits<uint64_t>::max();
+
+    double local_ns = run_threads(num_threads, update_thread_local,
+                                  &counter, &accumulator, &shared, NUM_UPDATES);
+    double shared_ns = run_threads(num_threads, update_shared,
+                                   &counter, &accumulator, &shared, NUM_UPDATES);
+
+    char value[32];
+    snprintf(value, sizeof(value), "%.1f", local_ns);
+    RecordProperty("thread_local_ns_" + std::to_string(num_threads), value);
+    snprintf(value, sizeof(value), "%.1f", shared_ns);
+    RecordProperty("shared_ns_" + std::to_string(num_threads), value);
+
+    // No updates are lost.
+    std::vector<std::string> values;
+    counter.merge(values);
+    EXPECT_EQ(values[0], std::to_string(num_threads * NUM_UPDATES));
+
+    values.clear();
+    accumulator.merge(values);
+    EXPECT_EQ(values[4], std::to_string(num_threads * NUM_UPDATES));
+    EXPECT_EQ(values[2], "0");
+    EXPECT_EQ(values[3], "255");
+  }
+}
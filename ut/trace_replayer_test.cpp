@@ -0,0 +1,141 @@
+/**
+ * @file trace_replayer_test.cpp Trace replayer unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "trace_replayer.h"
+#include "memory_backend.h"
+
+using namespace CallListStore;
+
+class TraceReplayerTest : public ::testing::Test
+{
+public:
+  TraceReplayerTest() :
+    _backend(new MemoryBackend())
+  {
+    _store.configure_backend(_backend);
+  }
+
+  static OpTraceRecord make_record(OpTraceRecord::Type type,
+                                   uint64_t impu_hash,
+                                   uint64_t start_us,
+                                   uint64_t num_fragments)
+  {
+    OpTraceRecord record;
+    record.type = type;
+    record.success = true;
+    record.impu_hash = impu_hash;
+    record.start_us = start_us;
+    record.latency_us = 100;
+    record.num_fragments = num_fragments;
+    record.num_bytes = 200;
+    return record;
+  }
+
+  Store _store;
+  MemoryBackend* _backend;
+};
+
+TEST_F(TraceReplayerTest, Summarize)
+{
+  std::vector<uint64_t> latencies;
+
+  for (uint64_t ii = 1000; ii > 0; --ii)
+  {
+    latencies.push_back(ii);
+  }
+
+  TraceReplayer::LatencySummary summary;
+  TraceReplayer::summarize(latencies, summary);
+  EXPECT_EQ(summary.count, 1000u);
+  EXPECT_EQ(summary.p50_us, 500u);
+  EXPECT_EQ(summary.p90_us, 900u);
+  EXPECT_EQ(summary.p99_us, 990u);
+  EXPECT_EQ(summary.p999_us, 999u);
+  EXPECT_EQ(summary.max_us, 1000u);
+
+  latencies.clear();
+  TraceReplayer::summarize(latencies, summary);
+  EXPECT_EQ(summary.count, 0u);
+  EXPECT_EQ(summary.max_us, 0u);
+}
+
+// Writes, reads and trims are replayed per IMPU in the order they started,
+// at maximum speed.
+TEST_F(TraceReplayerTest, MaxSpeed)
+{
+  TraceReplayer::Config config;
+  config.speed = 0;
+  config.num_threads = 2;
+  TraceReplayer replayer(&_store, config);
+
+  for (uint64_t impu = 0; impu < 4; ++impu)
+  {
+    // The records are in the order the operations finished.
+    replayer.add(make_record(OpTraceRecord::WRITE, impu, 100, 1));
+    replayer.add(make_record(OpTraceRecord::WRITE, impu, 200, 1));
+    replayer.add(make_record(OpTraceRecord::TRIM, impu, 400, 2));
+    replayer.add(make_record(OpTraceRecord::WRITE, impu, 50, 1));
+    replayer.add(make_record(OpTraceRecord::READ, impu, 300, 0));
+  }
+
+  // A read of an IMPU that was never written to isn't an error.
+  replayer.add(make_record(OpTraceRecord::READ, 99, 0, 0));
+  EXPECT_EQ(replayer.num_records(), 21u);
+
+  TraceReplayer::Results results;
+  replayer.run(results);
+
+  EXPECT_EQ(results.num_ops, 21u);
+  EXPECT_EQ(results.num_errors, 0u);
+  EXPECT_EQ(results.latency[OpTraceRecord::WRITE].count, 12u);
+  EXPECT_EQ(results.latency[OpTraceRecord::READ].count, 5u);
+  EXPECT_EQ(results.latency[OpTraceRecord::TRIM].count, 4u);
+  EXPECT_GT(results.ops_per_sec, 0.0);
+
+  // Each IMPU is left with the newest of its three fragments.
+  EXPECT_EQ(_backend->num_rows(), 4u);
+  EXPECT_EQ(_backend->num_columns(), 4u);
+
+  std::vector<CallFragment> fragments;
+  EXPECT_EQ(_store.get_call_fragments_sync("sip:0000000000000002@replay.invalid",
+                                           fragments,
+                                           0),
+            CassandraStore::OK);
+  ASSERT_EQ(fragments.size(), 1u);
+  EXPECT_EQ(fragments[0].timestamp.length() +
+            fragments[0].id.length() +
+            fragments[0].contents.length(), 200u);
+
+  std::string report = results.to_string();
+  EXPECT_NE(report.find("21 ops (0 errors)"), std::string::npos);
+  EXPECT_NE(report.find("trim: 4 ops"), std::string::npos);
+}
+
+// At a fixed speed, operations are spaced out as they were in the trace.
+TEST_F(TraceReplayerTest, Paced)
+{
+  TraceReplayer::Config config;
+  config.speed = 10.0;
+  config.num_threads = 1;
+  TraceReplayer replayer(&_store, config);
+
+  replayer.add(make_record(OpTraceRecord::WRITE, 1, 1000000, 1));
+  replayer.add(make_record(OpTraceRecord::READ, 1, 1300000, 0));
+
+  TraceReplayer::Results results;
+  replayer.run(results);
+
+  EXPECT_EQ(results.num_ops, 2u);
+  EXPECT_GE(results.elapsed_us, 30000u);
+  EXPECT_LT(results.elapsed_us, 1000000u);
+}
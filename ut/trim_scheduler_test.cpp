@@ -0,0 +1,280 @@
+/**
+ * @file trim_scheduler_test.cpp Background trim scheduler unit tests
+ *
+ * Copyright (C) Metaswitch Networks 2016
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <unistd.h>
+#include <map>
+
+#include "gtest/gtest.h"
+
+#include "mock_sas.h"
+
+#include "trim_scheduler.h"
+#include "call_list_store.h"
+#include "mementosasevent.h"
+
+using namespace CallListStore;
+
+// Trimmer that serves call lists from memory and records what it deletes.
+class FakeTrimmer : public TrimScheduler::Trimmer
+{
+public:
+  FakeTrimmer(std::map<std::string, std::vector<CallFragment> >* call_lists,
+              std::vector<std::string>* trimmed) :
+    _call_lists(call_lists),
+    _trimmed(trimmed)
+  {}
+
+  CassandraStore::ResultCode get_fragments(const std::string& impu,
+                                           std::vector<CallFragment>& fragments,
+                                           SAS::TrailId trail)
+  {
+    if (_call_lists->find(impu) == _call_lists->end())
+    {
+      return CassandraStore::NOT_FOUND;
+    }
+
+    fragments = (*_call_lists)[impu];
+    return CassandraStore::OK;
+  }
+
+  CassandraStore::ResultCode delete_fragments(const std::string& impu,
+                                              const std::vector<CallFragment>& fragments,
+                                              SAS::TrailId trail)
+  {
+    std::vector<CallFragment>& call_list = (*_call_lists)[impu];
+    call_list.erase(call_list.begin(), call_list.begin() + fragments.size());
+    _trimmed->push_back(impu);
+    return CassandraStore::OK;
+  }
+
+private:
+  std::map<std::string, std::vector<CallFragment> >* _call_lists;
+  std::vector<std::string>* _trimmed;
+};
+
+// Build a call list with a begin and end fragment for each call.
+static std::vector<CallFragment> make_call_list(int num_calls)
+{
+  std::vector<CallFragment> fragments;
+
+  for (int ii = 0; ii < num_calls; ++ii)
+  {
+    CallFragment fragment;
+    fragment.timestamp = "201401011301" + std::to_string(10 + ii);
+    fragment.id = "id" + std::to_string(ii);
+    fragment.contents = "<xml>";
+    fragment.type = CallFragment::BEGIN;
+    fragments.push_back(fragment);
+    fragment.type = CallFragment::END;
+    fragments.push_back(fragment);
+  }
+
+  return fragments;
+}
+
+class TrimSchedulerTest : public ::testing::Test
+{
+public:
+  TrimSchedulerTest()
+  {
+    _config.max_calls = 2;
+    _config.delay_ms = 1000;
+    _config.trims_per_sec = 10.0;
+    _config.burst = 2.0;
+    _config.target_latency_us = 10000;
+    _config.max_backlog = 3;
+  }
+
+  TrimScheduler* create_scheduler()
+  {
+    return new TrimScheduler(_config, new FakeTrimmer(&_call_lists, &_trimmed), NULL);
+  }
+
+  TrimScheduler::Config _config;
+  std::map<std::string, std::vector<CallFragment> > _call_lists;
+  std::vector<std::string> _trimmed;
+};
+
+TEST_F(TrimSchedulerTest, SelectOldFragments)
+{
+  std::vector<CallFragment> fragments = make_call_list(4);
+  std::vector<CallFragment> old_fragments;
+
+  TrimScheduler::select_old_fragments(fragments, 2, old_fragments);
+  ASSERT_EQ(old_fragments.size(), 4u);
+  EXPECT_EQ(old_fragments[3].id, "id1");
+
+  TrimScheduler::select_old_fragments(fragments, 4, old_fragments);
+  EXPECT_TRUE(old_fragments.empty());
+
+  TrimScheduler::select_old_fragments(fragments, 0, old_fragments);
+  EXPECT_EQ(old_fragments.size(), 8u);
+
+  // A call with only one fragment counts as a call.
+  fragments.pop_back();
+  TrimScheduler::select_old_fragments(fragments, 1, old_fragments);
+  EXPECT_EQ(old_fragments.size(), 6u);
+}
+
+// IMPUs are trimmed after the delay, in the order they became due, at the
+// configured rate.
+TEST_F(TrimSchedulerTest, Pacing)
+{
+  TrimScheduler* scheduler = create_scheduler();
+  uint64_t wait_ms;
+
+  _call_lists["kermit"] = make_call_list(3);
+  _call_lists["gonzo"] = make_call_list(3);
+  _call_lists["piggy"] = make_call_list(3);
+
+  scheduler->record_write("gonzo", 100);
+  scheduler->record_write("kermit", 200);
+  scheduler->record_write("gonzo", 300);
+  scheduler->record_write("piggy", 300);
+  EXPECT_EQ(scheduler->backlog(), 3u);
+
+  EXPECT_FALSE(scheduler->trim_next(500, wait_ms));
+  EXPECT_EQ(wait_ms, 600u);
+
+  // The second write to gonzo didn't delay its trim.
+  EXPECT_TRUE(scheduler->trim_next(1300, wait_ms));
+  EXPECT_TRUE(scheduler->trim_next(1300, wait_ms));
+  EXPECT_EQ(_trimmed, std::vector<std::string>({"gonzo", "kermit"}));
+  EXPECT_EQ(_call_lists["gonzo"].size(), 4u);
+
+  // The burst is used up, so the next trim waits for a token.
+  EXPECT_FALSE(scheduler->trim_next(1300, wait_ms));
+  EXPECT_EQ(wait_ms, 101u);
+  EXPECT_TRUE(scheduler->trim_next(1400, wait_ms));
+  EXPECT_EQ(scheduler->backlog(), 0u);
+
+  EXPECT_FALSE(scheduler->trim_next(5000, wait_ms));
+  EXPECT_EQ(wait_ms, 0u);
+
+  delete scheduler;
+}
+
+// Call lists that are short enough, or have expired, are left alone.
+TEST_F(TrimSchedulerTest, NothingToTrim)
+{
+  TrimScheduler* scheduler = create_scheduler();
+  uint64_t wait_ms;
+  mock_sas_collect_messages(true);
+
+  _call_lists["kermit"] = make_call_list(2);
+  scheduler->record_write("kermit", 0);
+  scheduler->record_write("gonzo", 0);
+
+  EXPECT_TRUE(scheduler->trim_next(1000, wait_ms));
+  EXPECT_TRUE(scheduler->trim_next(1000, wait_ms));
+  EXPECT_TRUE(_trimmed.empty());
+  EXPECT_NO_SAS_EVENT(SASEvent::CALL_LIST_TRIM_NEEDED);
+
+  // Writing again schedules another trim.
+  _call_lists["kermit"] = make_call_list(3);
+  scheduler->record_write("kermit", 1000);
+  EXPECT_TRUE(scheduler->trim_next(2000, wait_ms));
+  EXPECT_EQ(_trimmed.size(), 1u);
+  EXPECT_SAS_EVENT(SASEvent::CALL_LIST_TRIM_NEEDED);
+
+  mock_sas_collect_messages(false);
+  delete scheduler;
+}
+
+TEST_F(TrimSchedulerTest, BacklogLimit)
+{
+  TrimScheduler* scheduler = create_scheduler();
+
+  scheduler->record_write("kermit", 0);
+  scheduler->record_write("gonzo", 0);
+  scheduler->record_write("piggy", 0);
+  scheduler->record_write("animal", 0);
+  EXPECT_EQ(scheduler->backlog(), 3u);
+
+  delete scheduler;
+}
+
+// The rate backs off in proportion to cassandra latency above the target,
+// down to a minimum.
+TEST_F(TrimSchedulerTest, LatencyBackoff)
+{
+  TrimScheduler* scheduler = create_scheduler();
+  EXPECT_DOUBLE_EQ(scheduler->current_rate(), 10.0);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    scheduler->record_latency(20000);
+  }
+  EXPECT_NEAR(scheduler->current_rate(), 5.0, 0.1);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    scheduler->record_latency(10000000);
+  }
+  EXPECT_NEAR(scheduler->current_rate(), 0.5, 0.01);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    scheduler->record_latency(1000);
+  }
+  EXPECT_DOUBLE_EQ(scheduler->current_rate(), 10.0);
+
+  delete scheduler;
+}
+
+// The background thread trims due IMPUs.
+TEST_F(TrimSchedulerTest, Thread)
+{
+  _config.delay_ms = 0;
+  TrimScheduler* scheduler = create_scheduler();
+  _call_lists["kermit"] = make_call_list(3);
+  scheduler->start();
+  scheduler->record_write("kermit");
+
+  for (int ii = 0; (ii < 1000) && (scheduler->backlog() > 0); ++ii)
+  {
+    usleep(1000);
+  }
+
+  // Deleting the scheduler waits for the trim in progress.
+  delete scheduler;
+  EXPECT_EQ(_trimmed, std::vector<std::string>({"kermit"}));
+}
+
+// IMPUs written while the scheduler is stopped are trimmed once it is
+// started again.
+TEST_F(TrimSchedulerTest, StopAndRestart)
+{
+  _config.delay_ms = 0;
+  TrimScheduler* scheduler = create_scheduler();
+  _call_lists["kermit"] = make_call_list(3);
+  scheduler->start();
+  scheduler->stop();
+  scheduler->wait_stopped();
+
+  scheduler->record_write("kermit");
+  usleep(10000);
+  EXPECT_EQ(scheduler->backlog(), 1u);
+  EXPECT_TRUE(_trimmed.empty());
+
+  scheduler->start();
+
+  for (int ii = 0; (ii < 1000) && (scheduler->backlog() > 0); ++ii)
+  {
+    usleep(1000);
+  }
+
+  scheduler->stop();
+  scheduler->wait_stopped();
+  EXPECT_EQ(_trimmed, std::vector<std::string>({"kermit"}));
+
+  delete scheduler;
+}